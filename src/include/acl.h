@@ -0,0 +1,103 @@
+/*
+ * \file acl.h
+ * \brief Address based access control
+ *
+ */
+#ifndef __ACL_H__
+#define __ACL_H__
+
+#include "network.h"
+
+//! \brief ACL_DENY refuses a connection
+#define ACL_DENY 0
+
+//! \brief ACL_ALLOW accepts a connection
+#define ACL_ALLOW 1
+
+/*! \class ACL
+ *  \brief Access list of IPv4 networks
+ *
+ *  ACL holds allow and deny rules for IPv4 networks in CIDR notation. The rules
+ *  are kept in a binary radix trie, so a lookup costs at most 32 steps no
+ *  matter how many rules there are. The most specific matching rule wins; if
+ *  no rule matches, the default action is used.
+ */
+class ACL {
+public:
+	//! \brief Constructs an empty access list, which allows everyone
+	ACL();
+
+	//! \brief Destroys the access list
+	~ACL();
+
+	/*! \brief Adds a rule to the list
+	 *  \return Zero on failure or non-zero on success
+	 *  \param cidr The network, such as 192.168.0.0/16 or 10.1.2.3
+	 *  \param action ACL_ALLOW or ACL_DENY
+	 *
+	 *  Adding a network which is already listed replaces its action.
+	 */
+	int add (char* cidr, int action);
+
+	/*! \brief Adds a rule to the list
+	 *  \return Zero on failure or non-zero on success
+	 *  \param key The network address
+	 *  \param prefix The prefix length of the network
+	 *  \param action ACL_ALLOW or ACL_DENY
+	 */
+	int add (IPV4KEY key, int prefix, int action);
+
+	/*! \brief Allows a network
+	 *  \return Zero on failure or non-zero on success
+	 *  \param cidr The network to allow
+	 */
+	inline int allow (char* cidr) { return add (cidr, ACL_ALLOW); };
+
+	/*! \brief Denies a network
+	 *  \return Zero on failure or non-zero on success
+	 *  \param cidr The network to deny
+	 */
+	inline int deny (char* cidr) { return add (cidr, ACL_DENY); };
+
+	/*! \brief Sets the action used if no rule matches
+	 *  \param action ACL_ALLOW or ACL_DENY
+	 */
+	void setDefault (int action);
+
+	//! \brief Removes all rules
+	void clear ();
+
+	/*! \brief Looks up an address
+	 *  \return ACL_ALLOW or ACL_DENY
+	 *  \param key The address to look up
+	 */
+	int check (IPV4KEY key);
+
+	/*! \brief Looks up an address
+	 *  \return ACL_ALLOW or ACL_DENY
+	 *  \param addr The address to look up
+	 */
+	inline int check (IPV4ADDRESS* addr) { return check (addr->getKey()); };
+
+private:
+	/*! \brief Allocates a fresh trie node
+	 *  \return The index of the node, or -1 on failure
+	 */
+	int newNode ();
+
+	//! \brief The trie nodes; node 0 is the root
+	struct ACLNODE* nodes;
+
+	//! \brief The number of nodes in use
+	int numNodes;
+
+	//! \brief The number of nodes allocated
+	int maxNodes;
+
+	//! \brief The action to use if no rule matches
+	int defaultAction;
+};
+
+#endif // __ACL_H__
+
+/* vim:set ts=2 sw=2: */
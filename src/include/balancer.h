@@ -0,0 +1,141 @@
+/*
+ * \file balancer.h
+ * \brief Spreading of requests over a number of servers
+ *
+ */
+#ifndef __BALANCER_H__
+#define __BALANCER_H__
+
+#include "network.h"
+
+class NETPOOL;
+class POOLCLIENT;
+
+/* NETBALANCER_xxx identify how servers are compared */
+#define NETBALANCER_LEAST_LOADED  0   /* fewest requests in flight */
+#define NETBALANCER_LATENCY       1   /* lowest latency, times requests in flight */
+
+//! \brief NETBALANCER_FAILURES is the default number of failures in a row before ejecting
+#define NETBALANCER_FAILURES 5
+
+//! \brief NETBALANCER_EJECT is the default number of milliseconds a server is ejected
+#define NETBALANCER_EJECT 10000
+
+//! \brief NETBALANCER_MAX_BACKOFF is the maximum factor the ejection time grows by
+#define NETBALANCER_MAX_BACKOFF 32
+
+// NETBACKEND lives in balancer.cc
+struct NETBACKEND;
+
+/*! \class NETBALANCER
+ *  \brief Picks the server to send a request to
+ *
+ *  A NETBALANCER spreads requests over a number of equivalent servers. For
+ *  every request, two servers are picked at random and the one with the
+ *  lower cost is used; this keeps away from slow or busy servers without
+ *  having to look at all of them, and without sending everything to the same
+ *  one. The cost is either the number of requests in flight, or the latency
+ *  of the server times the number of requests in flight plus one.
+ *
+ *  Latency is tracked as a moving average which follows increases right away
+ *  and decreases slowly, so a server which slows down is avoided at once.
+ *
+ *  A server which fails a number of requests in a row is ejected for a while;
+ *  each time it is ejected again without a success in between, it stays out
+ *  twice as long. If all servers are ejected, they are used anyway.
+ *
+ *  The caller reports the outcome of every request with done(). Like the rest
+ *  of the network code, this is meant to be used from a single thread.
+ */
+class NETBALANCER {
+public:
+	/*! \brief The constructor of the class
+	 *  \param mode How servers are compared, one of NETBALANCER_xxx
+	 */
+	NETBALANCER(int mode = NETBALANCER_LATENCY);
+
+	//! \brief The destructor of the class
+	~NETBALANCER();
+
+	/*! \brief Adds a server
+	 *  \return The number of the server, or -1 on failure
+	 *  \param addr The address of the server, which is copied
+	 */
+	int add (IPV4ADDRESS* addr);
+
+	//! \brief Returns the number of servers
+	int getCount ();
+
+	/*! \brief Returns the address of a server
+	 *  \param i The number of the server
+	 */
+	IPV4ADDRESS* getAddress (int i);
+
+	/*! \brief Sets when servers are ejected
+	 *  \param failures The number of failures in a row, or 0 to never eject
+	 *  \param msec The number of milliseconds they stay out the first time
+	 */
+	void setEjection (int failures, int msec);
+
+	/*! \brief Picks a server for a request
+	 *  \return The number of the server, or -1 if there are none
+	 *
+	 *  The request is counted as in flight until done() is called.
+	 */
+	int pick ();
+
+	/*! \brief Picks a server and obtains a connection to it from a pool
+	 *  \return The connection, or NULL if no server could be reached
+	 *  \param pool The pool to obtain the connection from
+	 *  \param backend Receives the number of the server
+	 *
+	 *  A server which cannot be connected to counts as a failure, and another
+	 *  one is tried.
+	 */
+	POOLCLIENT* get (NETPOOL* pool, int* backend);
+
+	/*! \brief Reports the outcome of a request
+	 *  \param i The number of the server, as returned by pick()
+	 *  \param ok Non-zero if the request succeeded
+	 *  \param usec The number of microseconds the request took
+	 */
+	void done (int i, int ok, long long usec);
+
+	//! \brief Returns the number of requests in flight to a server
+	int getInFlight (int i);
+
+	//! \brief Returns the latency average of a server, in microseconds
+	long long getLatency (int i);
+
+	//! \brief Returns non-zero if a server is ejected
+	int isEjected (int i);
+
+private:
+	//! \brief Returns the cost of sending a request to a server
+	double cost (struct NETBACKEND* b, struct NETBACKEND* other);
+
+	//! \brief Returns a random number
+	unsigned int random ();
+
+	//! \brief How servers are compared, one of NETBALANCER_xxx
+	int mode;
+
+	//! \brief The servers
+	struct NETBACKEND** backends;
+
+	//! \brief The number of servers
+	int numBackends;
+
+	//! \brief The number of failures in a row which eject a server
+	int maxFailures;
+
+	//! \brief The number of milliseconds a server is ejected the first time
+	int ejectTime;
+
+	//! \brief State of the random number generator
+	unsigned int seed;
+};
+
+#endif // __BALANCER_H__
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,253 @@
+/*
+ * \file buffer.h
+ * \brief Byte buffers
+ *
+ */
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+//! \brief NETBUFFER_SCAN_BATCH is the number of delimiters looked for at once
+#define NETBUFFER_SCAN_BATCH 64
+
+/*! \brief NETLINE is a line found by NETBUFFER::getLines()
+ *
+ *  The line is not terminated; [len] excludes the delimiter, and a carriage
+ *  return before a newline.
+ */
+struct NETLINE {
+	char* data;
+	int   len;
+};
+
+/*! \class NETBUFFER
+ *  \brief Growable byte buffer
+ *
+ *  NETBUFFER is a FIFO of bytes: data is appended at the end and consumed from
+ *  the front. It is used for the input and output queues of network services.
+ */
+class NETBUFFER {
+public:
+	//! \brief Constructs an empty buffer
+	NETBUFFER();
+
+	//! \brief Destroys the buffer
+	~NETBUFFER();
+
+	/*! \brief Appends data to the buffer
+	 *  \return Zero on failure or non-zero on success
+	 *  \param buf The data to append
+	 *  \param len The number of bytes to append
+	 */
+	int append (char* buf, int len);
+
+	/*! \brief Reserves space at the end of the buffer
+	 *  \return Pointer to at least len writable bytes, or NULL on failure
+	 *  \param len The number of bytes needed
+	 *
+	 *  The data written must be made part of the buffer using commit().
+	 */
+	char* reserve (int len);
+
+	/*! \brief Adds reserved bytes to the buffer
+	 *  \param len The number of bytes written after reserve()
+	 */
+	void commit (int len);
+
+	/*! \brief Copies data out of the buffer and removes it
+	 *  \return The number of bytes copied
+	 *  \param buf Buffer to store the data in
+	 *  \param len Size of the buffer
+	 */
+	int read (char* buf, int len);
+
+	/*! \brief Removes data from the front of the buffer
+	 *  \param len The number of bytes to remove
+	 */
+	void consume (int len);
+
+	//! \brief Removes all data from the buffer
+	void clear ();
+
+	/*! \brief Removes complete lines from the front of the buffer
+	 *  \return The number of lines found
+	 *  \param lines Receives the lines
+	 *  \param max The maximum number of lines to find
+	 *  \param delim The byte ending a line
+	 *
+	 *  The lines point into the buffer, and remain valid until data is added
+	 *  to it. A partial line is left in place; as long as the delimiter stays
+	 *  the same, the next call does not look at its bytes again.
+	 */
+	int getLines (struct NETLINE* lines, int max, char delim = '\n');
+
+	//! \brief Returns a pointer to the data in the buffer
+	inline char* getData () { return data + start; };
+
+	//! \brief Returns the number of bytes in the buffer
+	inline int getLength () { return end - start; };
+
+private:
+	//! \brief The memory holding the data
+	char* data;
+
+	//! \brief The number of bytes allocated
+	int size;
+
+	//! \brief Offset of the first byte in use
+	int start;
+
+	//! \brief Offset just beyond the last byte in use
+	int end;
+
+	//! \brief The number of bytes from the front known not to hold a delimiter
+	int scanned;
+};
+
+/*! \class NETBLOCK
+ *  \brief Reference counted block of data
+ *
+ *  A NETBLOCK can be queued for sending on any number of connections at the
+ *  same time without being copied. It is freed once the last reference to it
+ *  is dropped. The header and the data share a single allocation.
+ */
+class NETBLOCK {
+public:
+	/*! \brief Allocates an empty block
+	 *  \return The new block, with a single reference, or NULL on failure
+	 *  \param size The number of bytes the block can hold
+	 */
+	static NETBLOCK* create (int size);
+
+	/*! \brief Allocates a block holding a copy of some data
+	 *  \return The new block, with a single reference, or NULL on failure
+	 *  \param buf The data to copy
+	 *  \param len The number of bytes to copy
+	 */
+	static NETBLOCK* create (char* buf, int len);
+
+	//! \brief Adds a reference to the block, which may be shared between threads
+	inline void ref () { __atomic_add_fetch (&refs, 1, __ATOMIC_RELAXED); };
+
+	//! \brief Drops a reference to the block, freeing it if it was the last
+	void unref ();
+
+	//! \brief Returns the number of references to the block
+	inline int getRefs () { return __atomic_load_n (&refs, __ATOMIC_RELAXED); };
+
+	//! \brief Returns a pointer to the data
+	inline char* getData () { return data; };
+
+	//! \brief Returns the number of bytes in use
+	inline int getLength () { return length; };
+
+	//! \brief Returns the number of bytes which can still be appended
+	inline int getSpace () { return size - length; };
+
+	/*! \brief Appends data to the block
+	 *  \return The number of bytes appended, which is limited by the space left
+	 *  \param buf The data to append
+	 *  \param len The number of bytes to append
+	 *
+	 *  Blocks must not be changed once they are shared.
+	 */
+	int append (char* buf, int len);
+
+private:
+	//! \brief Blocks can only be made by create()
+	NETBLOCK() { };
+
+	//! \brief The number of references
+	int refs;
+
+	//! \brief The number of bytes in use
+	int length;
+
+	//! \brief The number of bytes allocated
+	int size;
+
+	//! \brief The data, which directly follows the header
+	char* data;
+};
+
+/*! \class NETQUEUE
+ *  \brief Queue of data to be sent
+ *
+ *  A NETQUEUE holds references to NETBLOCKs. Data which is private to the
+ *  queue is copied into blocks owned by the queue; shared blocks are queued
+ *  by reference. The queue entries live in a ring which only grows, so queueing
+ *  a shared block does not allocate any memory once the queue has warmed up.
+ */
+class NETQUEUE {
+public:
+	//! \brief Constructs an empty queue
+	NETQUEUE();
+
+	//! \brief Destroys the queue, dropping all references it holds
+	~NETQUEUE();
+
+	/*! \brief Appends a copy of some data
+	 *  \return Zero on failure or non-zero on success
+	 *  \param buf The data to append
+	 *  \param len The number of bytes to append
+	 */
+	int append (char* buf, int len);
+
+	/*! \brief Appends a shared block
+	 *  \return Zero on failure or non-zero on success
+	 *  \param b The block to append; a reference is added
+	 *  \param offset Offset of the first byte to send
+	 */
+	int append (NETBLOCK* b, int offset = 0);
+
+	//! \brief Returns the number of bytes queued
+	inline int getLength () { return length; };
+
+	//! \brief Returns a pointer to the first queued byte
+	char* getData ();
+
+	//! \brief Returns the number of bytes which directly follow getData()
+	int getChunkLength ();
+
+	/*! \brief Describes the queued data as an I/O vector
+	 *  \return The number of entries filled
+	 *  \param iov The vector to fill
+	 *  \param n The number of entries available in iov
+	 */
+	int getVector (struct iovec* iov, int n);
+
+	/*! \brief Removes data from the front of the queue
+	 *  \param len The number of bytes to remove
+	 */
+	void consume (int len);
+
+	//! \brief Removes all data from the queue
+	void clear ();
+
+private:
+	/*! \brief Makes room for another entry
+	 *  \return Zero on failure or non-zero on success
+	 */
+	int grow ();
+
+	//! \brief The ring of entries
+	struct NETQUEUEENTRY* entries;
+
+	//! \brief Index of the first entry in use
+	int first;
+
+	//! \brief Number of entries in use
+	int count;
+
+	//! \brief Number of entries allocated
+	int max;
+
+	//! \brief Number of bytes queued
+	int length;
+};
+
+#endif // __BUFFER_H__
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,169 @@
+/*
+ * \file fileio.h
+ * \brief Asynchronous file I/O
+ *
+ */
+#ifndef __FILEIO_H__
+#define __FILEIO_H__
+
+#include <sys/types.h>
+#include "network.h"
+
+//! \brief FILEIO_DEPTH is the default maximum number of requests in progress
+#define FILEIO_DEPTH 256
+
+//! \brief FILEIO_THREADS is the default number of threads, if threads are used
+#define FILEIO_THREADS 4
+
+//! \brief FILEIO_RETRY is the number of milliseconds before requests the kernel had no room for are handed to it again
+#define FILEIO_RETRY 10
+
+/* FILEIO_xxx identify how a FILEIO performs its requests */
+#define FILEIO_NONE           0       /* not set up */
+#define FILEIO_URING          1       /* io_uring, Linux only */
+#define FILEIO_POOL           2       /* a pool of threads */
+#define FILEIO_SYNC           3       /* right away, blocking the loop */
+
+// FILEREQUEST, FILEURING and FILEPOOL live in fileio.cc
+struct FILEREQUEST;
+struct FILEURING;
+struct FILEPOOL;
+
+/*! \class FILEHANDLER
+ *  \brief Receives the outcome of asynchronous file I/O
+ */
+class FILEHANDLER {
+public:
+	//! \brief The destructor of the class
+	virtual ~FILEHANDLER() { };
+
+	/*! \brief Called once a request is done
+	 *  \param result The number of bytes read or written, or minus the error
+	 *  \param buf The buffer of the request
+	 *  \param arg The argument given with the request
+	 */
+	virtual void fileDone (int result, char* buf, void* arg) = 0;
+};
+
+/*! \class FILEIO
+ *  \brief Asynchronous reading and writing of files
+ *
+ *  A FILEIO reads and writes files without blocking the network it is added
+ *  to. Requests are handed to the kernel using io_uring where available, or
+ *  to a pool of threads otherwise. Either way, the FILEHANDLER of a request is
+ *  called from NETWORK::run(), just like any other callback, so it needs no
+ *  locking.
+ *
+ *  If neither io_uring nor threads can be used, requests are performed right
+ *  away, but the handler is still called from the loop. The buffer and the
+ *  handler of a request must stay around until the handler is called. If the
+ *  kernel refuses a request, its handler gets the error like any other.
+ */
+class FILEIO : public NETSERVICE, public NETTIMER {
+public:
+	//! \brief The constructor of the class
+	FILEIO();
+
+	/*! \brief The destructor of the class
+	 *
+	 *  Requests in progress are waited for, but their handlers are not called.
+	 */
+	virtual ~FILEIO();
+
+	/*! \brief Sets asynchronous I/O up
+	 *  \return Zero on failure or non-zero on success
+	 *  \param depth The maximum number of requests in progress
+	 *  \param threads The number of threads, if io_uring cannot be used
+	 *
+	 *  This must be called before adding the FILEIO to a network.
+	 */
+	int create (int depth = FILEIO_DEPTH, int threads = FILEIO_THREADS);
+
+	/*! \brief Starts reading from a file
+	 *  \return Zero on failure or non-zero on success
+	 *  \param filefd The file descriptor of the file
+	 *  \param buf The buffer to read into
+	 *  \param len The number of bytes to read
+	 *  \param offset The offset in the file to read from
+	 *  \param h The handler to call once done
+	 *  \param arg Argument passed to the handler
+	 */
+	int read (int filefd, char* buf, int len, off_t offset, FILEHANDLER* h, void* arg = NULL);
+
+	/*! \brief Starts writing to a file
+	 *  \return Zero on failure or non-zero on success
+	 *  \param filefd The file descriptor of the file
+	 *  \param buf The buffer to write from
+	 *  \param len The number of bytes to write
+	 *  \param offset The offset in the file to write to
+	 *  \param h The handler to call once done
+	 *  \param arg Argument passed to the handler
+	 */
+	int write (int filefd, char* buf, int len, off_t offset, FILEHANDLER* h, void* arg = NULL);
+
+	//! \brief Returns the number of requests in progress
+	int getPending ();
+
+	//! \brief Returns how requests are performed, one of FILEIO_xxx
+	int getMethod ();
+
+	// FILEIO reads its descriptor by itself
+	inline int getType () { return NETSERVICE_EVENT; };
+
+protected:
+	//! \brief Calls the handlers of the requests which are done
+	void incoming ();
+
+	//! \brief Hands requests the kernel had no room for to it again
+	void expired ();
+
+private:
+	/*! \brief Queues a request
+	 *  \return Zero on failure or non-zero on success
+	 */
+	int submit (int op, int filefd, char* buf, int len, off_t offset, FILEHANDLER* h, void* arg);
+
+	//! \brief Hands the requests queued in the io_uring to the kernel
+	void enter ();
+
+	/*! \brief Sets io_uring up
+	 *  \return Zero on failure or non-zero on success
+	 */
+	int setupRing (int depth);
+
+	/*! \brief Sets the thread pool up
+	 *  \return Zero on failure or non-zero on success
+	 */
+	int setupPool (int threads);
+
+	//! \brief Calls the handler of a request, and frees it
+	void complete (struct FILEREQUEST* r);
+
+	//! \brief How requests are performed, one of FILEIO_xxx
+	int method;
+
+	//! \brief The descriptor written to to wake the loop up
+	int wakefd;
+
+	//! \brief The maximum number of requests in progress
+	int depth;
+
+	//! \brief The number of requests in progress
+	int pending;
+
+	//! \brief Requests which are done, or refused by the kernel if using io_uring
+	struct FILEREQUEST* done;
+
+	//! \brief Requests which can be reused
+	struct FILEREQUEST* spare;
+
+	//! \brief The io_uring, if used
+	struct FILEURING* ring;
+
+	//! \brief The thread pool, if used
+	struct FILEPOOL* pool;
+};
+
+#endif // __FILEIO_H__
+
+/* vim:set ts=2 sw=2: */
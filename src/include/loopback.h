@@ -0,0 +1,158 @@
+/*
+ * \file loopback.h
+ * \brief In-process connections without descriptors
+ *
+ */
+#ifndef __LOOPBACK_H__
+#define __LOOPBACK_H__
+
+#include "network.h"
+
+//! \brief LOOPBACK_WINDOW is the default number of bytes in flight per direction
+#define LOOPBACK_WINDOW 262144
+
+// LOOPDIR lives in loopback.cc
+struct LOOPDIR;
+
+/*! \class LOOPBACK
+ *  \brief In-process connection between two services
+ *
+ *  A LOOPBACK connects two services within the same process without sockets
+ *  or any other descriptor. Data is copied from one side to the other in
+ *  memory, and NETWORK::run() handles both sides like any other connection,
+ *  without making system calls for them. The services themselves are
+ *  ordinary services, so protocol code can be tested and profiled without
+ *  the kernel getting in the way, and many connections can be simulated at
+ *  little cost.
+ *
+ *  Data written can be held back for a fixed latency. It can also be handed
+ *  out in chunks of limited size, as a real network would, to exercise the
+ *  handling of partial input. Chunk sizes follow a seeded sequence, so a run
+ *  can be repeated exactly. No more than a window of bytes is in flight in
+ *  either direction; beyond that, output is queued as with a full socket
+ *  buffer.
+ *
+ *  Both sides must be part of the network the LOOPBACK was created for, and
+ *  the LOOPBACK must outlive them or be deleted after both were closed.
+ *  Closing either side gives the other end of file. TLS and sendfile() do
+ *  not apply; files are copied.
+ */
+class LOOPBACK : public NETTIMER {
+	friend class NETSERVICE;
+	friend class NETWORK;
+
+public:
+	/*! \brief The constructor of the class
+	 *  \param n The network handling the services
+	 */
+	LOOPBACK(NETWORK* n);
+
+	//! \brief The destructor of the class; sides still connected are cut off
+	virtual ~LOOPBACK();
+
+	/*! \brief Connects two services
+	 *  \return Zero on failure or non-zero on success
+	 *  \param a The one side, which must not be connected yet
+	 *  \param b The other side, which must not be connected yet
+	 *
+	 *  Both services are added to the network by the caller.
+	 */
+	int connect (NETSERVICE* a, NETSERVICE* b);
+
+	/*! \brief Connects a service to a server
+	 *  \return The client the server constructed for the connection, or NULL
+	 *          on failure
+	 *  \param server The server, which constructs its side using createClient()
+	 *  \param client The service connecting, which must not be connected yet
+	 *
+	 *  This acts as if [client] connected to the server over the network, but
+	 *  without the access checks, as there is no address to check.
+	 */
+	SERVICECLIENT* connect (NETSERVER* server, NETSERVICE* client);
+
+	/*! \brief Sets the latency
+	 *  \param usec The number of microseconds data takes to arrive
+	 */
+	void setLatency (int usec);
+
+	/*! \brief Sets the size of the chunks data is handed out in
+	 *  \param max The largest chunk, or zero to hand out everything at once
+	 *  \param seed Zero to always use [max], or the start of the sequence of
+	 *              chunk sizes between 1 and [max]
+	 */
+	void setChunk (int max, unsigned int seed = 0);
+
+	/*! \brief Sets the window
+	 *  \param bytes The number of bytes which may be in flight per direction
+	 */
+	void setWindow (int bytes);
+
+	//! \brief Called once data held back for latency may have arrived
+	void expired ();
+
+private:
+	/*! \brief Reads data for a side
+	 *  \return Like ::recv()
+	 *  \param s The side
+	 *  \param buf Buffer to store the data in
+	 *  \param len Size of the buffer
+	 *  \param flags MSG_PEEK to leave the data where it is
+	 */
+	int read (NETSERVICE* s, char* buf, int len, int flags);
+
+	/*! \brief Writes data from a side
+	 *  \return Like ::send()
+	 *  \param s The side
+	 *  \param iov The buffers
+	 *  \param n The number of buffers
+	 */
+	int write (NETSERVICE* s, struct iovec* iov, int n);
+
+	//! \brief Returns non-zero if a side has data or end of file to read
+	int hasInput (NETSERVICE* s);
+
+	//! \brief Returns non-zero if a side can write without being refused
+	int hasRoom (NETSERVICE* s);
+
+	//! \brief Disconnects a side; the other side gets end of file
+	void detach (NETSERVICE* s);
+
+	/*! \brief Moves data whose latency passed to where it can be read
+	 *  \param d The direction
+	 */
+	void arrive (struct LOOPDIR* d);
+
+	//! \brief Arms the timer for the first data held back
+	void schedule ();
+
+	//! \brief Returns a number from the chunk size sequence
+	unsigned int random ();
+
+	//! \brief The network handling the services
+	NETWORK* net;
+
+	//! \brief The two sides
+	NETSERVICE* side[2];
+
+	//! \brief The data written by either side
+	struct LOOPDIR* dir[2];
+
+	//! \brief The latency in microseconds
+	int latency;
+
+	//! \brief The largest chunk, or zero for no limit
+	int chunk;
+
+	//! \brief The number of bytes which may be in flight per direction
+	int window;
+
+	//! \brief State of the chunk size sequence, or zero for fixed chunks
+	unsigned int seed;
+
+	//! \brief When the timer is set to go off, or zero if it isn't
+	long long armed;
+};
+
+#endif // __LOOPBACK_H__
+
+/* vim:set ts=2 sw=2: */
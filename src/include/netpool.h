@@ -0,0 +1,211 @@
+/*
+ * \file netpool.h
+ * \brief Pooling of outgoing connections
+ *
+ */
+#ifndef __NETPOOL_H__
+#define __NETPOOL_H__
+
+#include "network.h"
+
+//! \brief NETPOOL_BUCKETS is the number of hash buckets for the hosts
+#define NETPOOL_BUCKETS 64
+
+//! \brief NETPOOL_CHECK is the number of milliseconds between health checks
+#define NETPOOL_CHECK 1000
+
+/* NETPOOL_COUNT_xxx identify the counters of a NETPOOL */
+#define NETPOOL_COUNT_CONNECTED       0       /* new connections made */
+#define NETPOOL_COUNT_REUSED          1       /* idle connections handed out */
+#define NETPOOL_COUNT_STALE           2       /* idle connections found broken */
+#define NETPOOL_COUNT_EXPIRED         3       /* idle connections timed out */
+#define NETPOOL_COUNT_DENIED          4       /* refused, too many per host */
+#define NETPOOL_COUNT_MAX             5
+
+class NETPOOL;
+
+// NETPOOLHOST lives in netpool.cc
+struct NETPOOLHOST;
+
+/*! \class POOLCLIENT
+ *  \brief Connection which can be kept in a NETPOOL
+ *
+ *  This is a NETCLIENT which knows the pool it belongs to. It is used just
+ *  like any other NETCLIENT, except that it is obtained from NETPOOL::get()
+ *  and handed back with release() rather than deleted.
+ */
+class POOLCLIENT : public NETCLIENT {
+	friend class NETPOOL;
+public:
+	//! \brief The constructor of the class
+	POOLCLIENT();
+
+	//! \brief The destructor of the class; the pool forgets about us
+	virtual ~POOLCLIENT();
+
+	/*! \brief Hands the connection back to its pool
+	 *
+	 *  This may be called from the incoming() handler of the connection. The
+	 *  connection must not be used afterwards.
+	 */
+	void release ();
+
+private:
+	//! \brief The pool we belong to
+	NETPOOL* pool;
+
+	//! \brief The host we are connected to
+	struct NETPOOLHOST* host;
+
+	//! \brief Whether we are handed out, idle or waiting to be deleted
+	int state;
+
+	//! \brief When we were handed back
+	long long since;
+
+	//! \brief Previous connection in the same list
+	POOLCLIENT* prev;
+
+	//! \brief Next connection in the same list
+	POOLCLIENT* next;
+};
+
+/*! \class NETPOOL
+ *  \brief Pool of warm connections to other servers
+ *
+ *  A NETPOOL keeps connections to the servers we talk to open, so a request
+ *  can reuse one rather than waiting for a new connection to be made. It is
+ *  meant to be used from the network loop only, and takes no locks.
+ *
+ *  Connections handed out by get() are part of the network; the ones handed
+ *  back are taken out and kept idle, the most recently used first. Before an
+ *  idle connection is handed out, and every NETPOOL_CHECK milliseconds, it is
+ *  checked without blocking; connections which the server closed, or which
+ *  have unexpected data waiting, are closed. So are connections idle for too
+ *  long.
+ *
+ *  Connections are created by createClient(), which must be provided by a
+ *  derived class.
+ */
+class NETPOOL : public NETTIMER {
+	friend class POOLCLIENT;
+public:
+	/*! \brief The constructor of the class
+	 *  \param n The network connections are added to
+	 */
+	NETPOOL(NETWORK* n);
+
+	/*! \brief The destructor of the class
+	 *
+	 *  Idle connections are closed. Connections handed out are left alone,
+	 *  but no longer belong to the pool.
+	 */
+	virtual ~NETPOOL();
+
+	/*! \brief Sets the number of idle connections kept per server
+	 *  \param n The number of connections
+	 */
+	void setMaxIdle (int n);
+
+	/*! \brief Sets the number of connections per server
+	 *  \param n The number of connections, both handed out and idle, or 0 for
+	 *           no limit
+	 */
+	void setMaxPerHost (int n);
+
+	/*! \brief Sets how long idle connections are kept
+	 *  \param msec The number of milliseconds
+	 */
+	void setIdleTimeout (int msec);
+
+	/*! \brief Obtains a connection to a server
+	 *  \return The connection, or NULL on failure
+	 *  \param addr The address of the server
+	 *
+	 *  An idle connection is used if there is a healthy one. Otherwise, a new
+	 *  connection is made in the background, unless the server already has
+	 *  as many as allowed; data sent is queued until it is up. If it cannot be
+	 *  made, the connection is dropped. The connection is added to the
+	 *  network.
+	 */
+	POOLCLIENT* get (IPV4ADDRESS* addr);
+
+	/*! \brief Hands a connection back
+	 *  \param c The connection, which came from get()
+	 *
+	 *  The connection is kept if it is healthy, nothing is queued in either
+	 *  direction and there is room for it; otherwise, it is closed.
+	 */
+	void put (POOLCLIENT* c);
+
+	//! \brief Returns the number of idle connections
+	int getIdle ();
+
+	//! \brief Returns the number of connections handed out
+	int getBusy ();
+
+	/*! \brief Returns a counter of the pool
+	 *  \param which One of the NETPOOL_COUNT_xxx values
+	 */
+	unsigned long getCounter (int which);
+
+	//! \brief Closes idle connections which are broken or expired
+	void expired ();
+
+protected:
+	/*! \brief Creates a connection object
+	 *  \return The new object, which is not connected yet
+	 */
+	virtual POOLCLIENT* createClient () = 0;
+
+private:
+	/*! \brief Looks up a server
+	 *  \return The server, or NULL if it is not known and [create] is zero
+	 */
+	struct NETPOOLHOST* lookup (IPV4ADDRESS* addr, int create);
+
+	/*! \brief Checks an idle connection
+	 *  \return Non-zero if the connection can be used
+	 */
+	int healthy (POOLCLIENT* c);
+
+	//! \brief Adds a connection to the front of a list
+	void link (POOLCLIENT** list, POOLCLIENT* c);
+
+	//! \brief Removes a connection from a list
+	void unlink (POOLCLIENT** list, POOLCLIENT* c);
+
+	//! \brief Forgets about a connection which is being deleted
+	void forget (POOLCLIENT* c);
+
+	//! \brief The network connections are added to
+	NETWORK* net;
+
+	//! \brief The servers, hashed by address and port
+	struct NETPOOLHOST* hosts[NETPOOL_BUCKETS];
+
+	//! \brief Connections waiting to be deleted
+	POOLCLIENT* dead;
+
+	//! \brief The number of idle connections kept per server
+	int maxIdle;
+
+	//! \brief The number of connections per server, or 0 for no limit
+	int maxPerHost;
+
+	//! \brief The number of milliseconds idle connections are kept
+	int idleTimeout;
+
+	//! \brief The number of idle connections
+	int numIdle;
+
+	//! \brief The number of connections handed out
+	int numBusy;
+
+	//! \brief The counters
+	unsigned long counters[NETPOOL_COUNT_MAX];
+};
+
+#endif // __NETPOOL_H__
+
+/* vim:set ts=2 sw=2: */
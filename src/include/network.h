@@ -8,22 +8,105 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #ifdef OS_FREEBSD
 #include <netipx/ipx.h>
 #endif /* OS_FREEBSD */
 #include "vector.h"
+#include "buffer.h"
 
 // NETSERVICE is yet to come
 class NETSERVICE;
 
+// ACL lives in acl.h
+class ACL;
+
+// RATELIMIT lives in ratelimit.h
+class RATELIMIT;
+
+// TLSCONTEXT and TLSSESSION live in tls.h
+class TLSCONTEXT;
+class TLSSESSION;
+
+// PUBSUB lives in pubsub.h
+class PUBSUB;
+struct PUBSUBLINK;
+
+// LOOPBACK lives in loopback.h
+class LOOPBACK;
+
+// NETWORK is defined below
+class NETWORK;
+
 //! \brief NETSERVICE_SERVER identifies a server class
 #define NETSERVICE_SERVER 0
 
 //! \brief NETSERVICE_CLIENT identifies a client class
 #define NETSERVICE_CLIENT 1
 
+//! \brief NETSERVICE_EVENT identifies a class which reads its descriptor itself
+#define NETSERVICE_EVENT 2
+
+//! \brief NETSERVICE_NOFD is the descriptor of a service connected without one
+#define NETSERVICE_NOFD -2
+
+/* NETSERVICE_PRIORITY_xxx identify the order in which services are handled */
+#define NETSERVICE_PRIORITY_HIGH      0       /* control traffic, handled first */
+#define NETSERVICE_PRIORITY_NORMAL    1       /* the default */
+#define NETSERVICE_PRIORITY_LOW       2       /* bulk traffic, handled last */
+#define NETSERVICE_PRIORITY_MAX       3
+
+//! \brief NETSERVICE_QUEUE_LIMIT is the most output queued without watermarks
+#define NETSERVICE_QUEUE_LIMIT 1048576
+
+/* NETSERVICE_BURIED_xxx identify what becomes of a service after the round */
+#define NETSERVICE_BURIED_DETACH      1       /* removed from its network or parent */
+#define NETSERVICE_BURIED_DELETE      2       /* removed and deleted */
+
+/*! \brief NETHANDLE refers to a service without keeping it alive
+ *
+ *  A handle consists of a slot number and the generation of the slot, which
+ *  changes whenever the service in it is deleted.
+ */
+typedef unsigned long long NETHANDLE;
+
+//! \brief NETHANDLE_NONE never refers to a service
+#define NETHANDLE_NONE 0
+
+//! \brief NETHANDLE_CHUNK is the number of handle slots allocated at once
+#define NETHANDLE_CHUNK 1024
+
+//! \brief NETHANDLE_CHUNKS is the maximum number of chunks of handle slots
+#define NETHANDLE_CHUNKS 4096
+
+//! \brief NETSERVER_HANDOFF_TIMEOUT is the number of milliseconds handOff() waits for the other process
+#define NETSERVER_HANDOFF_TIMEOUT 1000
+
+/* NETSERVER_COUNT_xxx identify the connection counters of a NETSERVER */
+#define NETSERVER_COUNT_ACCEPTED      0       /* connections accepted */
+#define NETSERVER_COUNT_DENIED_ACL    1       /* refused by access list */
+#define NETSERVER_COUNT_DENIED_RATE   2       /* refused by rate limiter */
+#define NETSERVER_COUNT_DENIED_LIMIT  3       /* refused, too many clients */
+#define NETSERVER_COUNT_MAX           4
+
+/* NETSERVICE_STAT_xxx identify the per connection counters of a NETSERVICE */
+#define NETSERVICE_STAT_BYTES_IN      0       /* bytes read */
+#define NETSERVICE_STAT_BYTES_OUT     1       /* bytes written */
+#define NETSERVICE_STAT_READS         2       /* reads from the connection, not peeks */
+#define NETSERVICE_STAT_WRITES        3       /* writes to the connection */
+#define NETSERVICE_STAT_OUTPUT_PEAK   4       /* most bytes queued for output */
+#define NETSERVICE_STAT_MAX           5
+
+/* NETWORK_COUNT_xxx identify the polling counters of a NETWORK */
+#define NETWORK_COUNT_SPINS           0       /* non-blocking polls while spinning */
+#define NETWORK_COUNT_SPIN_HITS       1       /* events found while spinning */
+#define NETWORK_COUNT_SLEEPS          2       /* blocking waits */
+#define NETWORK_COUNT_BUDGET_HITS     3       /* dispatches which used up their input budget */
+#define NETWORK_COUNT_SLICED          4       /* rounds cut short by the time slice */
+#define NETWORK_COUNT_MAX             5
+
 /*! \class NETADDRESS
  *  \brief Holder of a protocol independant network address
  *
@@ -69,6 +152,79 @@ protected:
 	struct sockaddr saddr;
 };
 
+/*! \class IPV4KEY
+ *  \brief Compact binary IPv4 address
+ *
+ *  IPV4KEY is a plain value holding an IPv4 address in host byte order. It is
+ *  cheap to copy, compare and hash, which makes it suitable as a key for
+ *  lookups done on every accepted connection.
+ */
+class IPV4KEY {
+public:
+	//! \brief Constructs the 0.0.0.0 address
+	IPV4KEY() { value = 0; };
+
+	/*! \brief Constructs an address from a host byte order value
+	 *  \param v The address to use
+	 */
+	IPV4KEY(uint32_t v) { value = v; };
+
+	/*! \brief Parses a dotted IPv4 address
+	 *  \return Zero on failure or non-zero on success
+	 *  \param addr The address to parse
+	 */
+	int parse (char* addr);
+
+	/*! \brief Parses an address in CIDR notation, such as 10.0.0.0/8
+	 *  \return Zero on failure or non-zero on success
+	 *  \param addr The address to parse
+	 *  \param prefix Will receive the prefix length (32 if none was given)
+	 */
+	int parseCIDR (char* addr, int* prefix);
+
+	/*! \brief Formats the address as dotted text
+	 *  \return buf
+	 *  \param buf Buffer to store the text in
+	 *  \param len Size of the buffer, should be at least 16 bytes
+	 *
+	 *  Unlike inet_ntoa(), this does not use a shared static buffer.
+	 */
+	char* format (char* buf, int len);
+
+	//! \brief Returns the address in host byte order
+	inline uint32_t getValue () const { return value; };
+
+	/*! \brief Returns the address with only the first bits retained
+	 *  \param prefix The number of bits to keep
+	 */
+	inline IPV4KEY mask (int prefix) const {
+		return IPV4KEY ((prefix <= 0) ? 0 : (prefix >= 32) ? value : (value & ~(0xffffffffU >> prefix)));
+	};
+
+	/*! \brief Returns a hash value of the address
+	 *
+	 *  Every bit of the hash depends on every bit of the address, so taking
+	 *  the low bits for a table slot works even if the low bits of the
+	 *  address were masked off.
+	 */
+	inline unsigned int hash () const {
+		unsigned int h = value;
+		h ^= h >> 16; h *= 0x85ebca6bU;
+		h ^= h >> 13; h *= 0xc2b2ae35U;
+		return h ^ (h >> 16);
+	};
+
+	//! \brief Compares two addresses
+	inline int operator== (const IPV4KEY& k) const { return value == k.value; };
+
+	//! \brief Compares two addresses
+	inline int operator!= (const IPV4KEY& k) const { return value != k.value; };
+
+private:
+	//! \brief The address, in host byte order
+	uint32_t value;
+};
+
 /*! \class IPV4ADDRESS
  *  \brief Holder of an IPv4 network address
  */
@@ -88,6 +244,23 @@ public:
 	//! \brief This will return the IPv4 address stored as human-readable text
 	char* getAddr();
 
+	/*! \brief This will store the IPv4 address as human-readable text in buf
+	 *  \return buf
+	 *  \param buf Buffer to store the text in
+	 *  \param len Size of the buffer, should be at least 16 bytes
+	 *
+	 *  This is the thread-safe version of getAddr().
+	 */
+	char* getAddr(char* buf, int len);
+
+	//! \brief Returns the address stored as a compact binary value
+	IPV4KEY getKey ();
+
+	/*! \brief Sets the address from a compact binary value
+	 *  \param key The address to use
+	 */
+	void setKey (IPV4KEY key);
+
 	/*! \brief This will set the port number
 	 *  \arg port The port number to use
 	 */
@@ -107,6 +280,12 @@ public:
 	 */
 	int compareAddr (char* addr);
 
+	/*! \brief Compares the supplied binary IPv4 address with the address stored
+	 *  \return Non-zero on a match, zero if no match
+	 *  \param key The adress to match
+	 */
+	int compareAddr (IPV4KEY key);
+
 private:
 	// This is just the cast we need to correctly access the internal address
 	struct sockaddr_in* sin;
@@ -145,6 +324,40 @@ private:
 	struct sockaddr_ipx* sipx;
 };
 
+/*! \class NETTIMER
+ *  \brief Callback called by NETWORK::run() once a given time has passed
+ *
+ *  Timers are kept in a heap, so adding, removing and firing one takes time
+ *  logarithmic in the number of timers. A timer fires once; it may add itself
+ *  again from expired().
+ */
+class NETTIMER {
+	friend class NETWORK;
+
+public:
+	//! \brief The constructor of the class
+	NETTIMER();
+
+	//! \brief The destructor of the class; the timer is removed if pending
+	virtual ~NETTIMER();
+
+	//! \brief Returns non-zero if the timer is waiting to fire
+	int isPending ();
+
+	//! \brief Called from NETWORK::run() once the timer fires
+	virtual void expired () = 0;
+
+private:
+	//! \brief The network the timer is added to, if any
+	NETWORK* network;
+
+	//! \brief When the timer fires, in microseconds
+	long long when;
+
+	//! \brief Position in the heap of the network, or -1 if not pending
+	int slot;
+};
+
 /*!	\class NETWORK
 		\brief The core network class
 
@@ -152,6 +365,8 @@ private:
 		are called when needed.
  */
 class NETWORK {
+	friend class NETSERVICE;
+
 public:
 	//! \brief The constructor of the class.
 	NETWORK();
@@ -163,6 +378,8 @@ public:
 
 	/*! \brief Removes a service from the network.
 	 *  \param service The service to be removed.
+	 *
+	 *  Within run(), the service is removed once all services were handled.
 	 */
 	void removeService (NETSERVICE* service);
 
@@ -172,9 +389,270 @@ public:
 	 */
 	void run ();
 
+	/*! \brief Sets the busy polling budget
+	 *  \param usec Number of microseconds to keep polling without blocking
+	 *               before waiting for events, or zero to always block
+	 *
+	 *  Spinning trades CPU time for latency. The NETWORK_COUNT_xxx counters
+	 *  show how often it pays off: the hit rate is the number of spin hits
+	 *  divided by the sum of spin hits and sleeps.
+	 */
+	void setBusyPoll (int usec);
+
+	/*! \brief Sets the input budget of a connection per dispatch
+	 *  \param bytes The number of bytes a connection may read each time it is
+	 *                dispatched, or zero for no limit
+	 *
+	 *  This keeps a busy connection whose handler reads until it runs dry from
+	 *  starving the others. The budget covers input read into the buffer, and
+	 *  whatever the handler reads from the socket itself where that does not
+	 *  block; once it is used up, recv() returns -1 with errno set to EAGAIN,
+	 *  rather than zero as on end of file. Whatever is left is read the next
+	 *  time round, after every other connection had its turn.
+	 */
+	void setBudget (int bytes);
+
+	/*! \brief Reserves time for services of high priority
+	 *  \param usec The number of microseconds services of lower priority may
+	 *               be handled per call to run(), or zero for no limit
+	 *
+	 *  Services are always handled in order of priority. Under heavy load,
+	 *  handling all services of normal and low priority may take long enough
+	 *  for those of high priority to time out; the time slice makes run()
+	 *  return once it is used up, so they are checked again. The slice starts
+	 *  once services of high priority are handled, and every lower priority
+	 *  has at least one service handled, so none of them starves. Services
+	 *  which were not handled go first the next time round.
+	 */
+	void setSlice (int usec);
+
+	/*! \brief Returns a polling counter
+	 *  \param which One of the NETWORK_COUNT_xxx values
+	 */
+	unsigned long getCounter (int which);
+
+	//! \brief Resets all polling counters to zero
+	void resetCounters ();
+
+	/*! \brief Binds the network to a CPU
+	 *  \return Zero on failure or non-zero on success
+	 *  \param cpu The CPU number
+	 *
+	 *  This must be called from the thread which calls run(). The thread is
+	 *  pinned to the CPU, and memory it allocates from then on, including that
+	 *  of new connections and their buffers, preferably comes from the NUMA
+	 *  node of the CPU. Servers which are part of the network have their
+	 *  listening socket set to the CPU using NETSERVICE::setIncomingCPU(); if
+	 *  every CPU runs its own network with its own server, all sharing a port
+	 *  using NETSERVER::setReusePort(), connections stay on the CPU which
+	 *  handled their packets. This is only supported on Linux.
+	 */
+	int setCPU (int cpu);
+
+	//! \brief Returns the CPU the network is bound to, or -1 if none
+	int getCPU ();
+
+	//! \brief Returns the NUMA node the network is bound to, or -1 if unknown
+	int getNode ();
+
+	/*! \brief Forks worker processes which share the servers of the network
+	 *  \return The worker number, from 1 up, in a worker; -1 in the parent
+	 *           once all workers are gone, or if no worker could be started
+	 *  \param workers The number of workers
+	 *
+	 *  This must be called once all servers are created and added. Every
+	 *  worker has its own copy of the network, its services and all other
+	 *  state, and is expected to call run() until it is done, so handlers need
+	 *  not be thread safe.
+	 *
+	 *  The parent does not return until the workers are gone. It restarts
+	 *  workers which crash or exit with a non-zero status, and passes SIGHUP,
+	 *  SIGINT and SIGTERM on to all workers; after SIGINT or SIGTERM, workers
+	 *  are no longer restarted.
+	 */
+	int prefork (int workers);
+
+	/*! \brief Has a timer fire after a while
+	 *  \return Zero on failure or non-zero on success
+	 *  \param t The timer, which is rescheduled if it is already pending
+	 *  \param msec The number of milliseconds to wait
+	 */
+	int addTimer (NETTIMER* t, int msec);
+
+	/*! \brief Cancels a timer
+	 *  \param t The timer
+	 */
+	void removeTimer (NETTIMER* t);
+
+	//! \brief Returns a monotonic timestamp in microseconds
+	static long long getTime ();
+
 private:
+	/*! \brief Adds the descriptor of a service to the sets to be monitored
+	 *  \return Non-zero if the service has buffered input awaiting dispatch
+	 *  \param s The service to add
+	 *  \param rfds The set of descriptors monitored for reading
+	 *  \param wfds The set of descriptors monitored for writing
+	 *  \param fdmax Pointer to the highest descriptor in use
+	 */
+	int collect (NETSERVICE* s, fd_set* rfds, fd_set* wfds, int* fdmax);
+
+	/*! \brief Handles the events of all services of a priority
+	 *  \return Zero if the time slice ran out, non-zero otherwise
+	 *  \param prio The priority, one of NETSERVICE_PRIORITY_xxx
+	 *  \param rfds The set of descriptors ready for reading
+	 *  \param wfds The set of descriptors ready for writing
+	 *  \param start When handling services started
+	 */
+	int dispatchAll (int prio, fd_set* rfds, fd_set* wfds, long long start);
+
+	/*! \brief Handles the events of a service
+	 *  \return Zero if the service must be dropped, non-zero otherwise
+	 *  \param s The service to handle
+	 *  \param rfds The set of descriptors ready for reading
+	 *  \param wfds The set of descriptors ready for writing
+	 */
+	int dispatch (NETSERVICE* s, fd_set* rfds, fd_set* wfds);
+
+	/*! \brief Moves a timer up the heap until its parent fires earlier
+	 *  \param i The position of the timer
+	 */
+	void siftUp (int i);
+
+	/*! \brief Moves a timer down the heap until its children fire later
+	 *  \param i The position of the timer
+	 */
+	void siftDown (int i);
+
+	//! \brief Fires all timers which are due
+	void runTimers ();
+
+	/*! \brief Has a service removed once all services were handled
+	 *  \param s The service
+	 *  \param how One of NETSERVICE_BURIED_xxx
+	 */
+	void bury (NETSERVICE* s, int how);
+
+	//! \brief Takes a service off the list of services to be removed
+	void unbury (NETSERVICE* s);
+
+	//! \brief Removes, and deletes if asked to, the services on the list
+	void reap ();
+
 	// \brief The internal list of services to be monitored
 	VECTOR* services;
+
+	//! \brief Busy polling budget in microseconds, zero if disabled
+	int busyPoll;
+
+	//! \brief Bytes a connection may read per dispatch, zero if unlimited
+	int budget;
+
+	//! \brief Microseconds services of lower priority may take, zero if unlimited
+	int slice;
+
+	//! \brief Per priority, the service which goes first in the next round
+	int resume[NETSERVICE_PRIORITY_MAX];
+
+	//! \brief Services to be removed once all services were handled
+	NETSERVICE* graveyard;
+
+	//! \brief Non-zero while services are being handled
+	int running;
+
+	//! \brief Polling counters
+	unsigned long counters[NETWORK_COUNT_MAX];
+
+	//! \brief The CPU we are bound to, or -1
+	int cpu;
+
+	//! \brief The NUMA node of the CPU, or -1
+	int node;
+
+	//! \brief Heap of pending timers, the first one fires first
+	NETTIMER** timers;
+
+	//! \brief The number of pending timers
+	int numTimers;
+
+	//! \brief The number of timers the heap has room for
+	int maxTimers;
+};
+
+/*! \struct NETTCPINFO
+ *  \brief What the kernel knows about a TCP connection
+ *
+ *  Fields the kernel does not provide are zero.
+ */
+struct NETTCPINFO {
+	//! \brief Smoothed round trip time, in microseconds
+	unsigned int rtt;
+
+	//! \brief Variation of the round trip time, in microseconds
+	unsigned int rttVar;
+
+	//! \brief Congestion window, in segments
+	unsigned int cwnd;
+
+	//! \brief Slow start threshold, in segments
+	unsigned int ssthresh;
+
+	//! \brief Maximum segment size for sending
+	unsigned int mss;
+
+	//! \brief Segments sent but not acknowledged yet
+	unsigned int unacked;
+
+	//! \brief Segments presumed lost
+	unsigned int lost;
+
+	//! \brief Segments retransmitted over the life of the connection
+	unsigned int retransmits;
+
+	//! \brief Bytes in the socket buffer which were not sent yet
+	unsigned int notSent;
+
+	//! \brief Bytes acknowledged by the peer
+	unsigned long long bytesAcked;
+
+	//! \brief Bytes received from the peer
+	unsigned long long bytesReceived;
+};
+
+/*! \struct NETSUMMARY
+ *  \brief Summary of the connections of a server
+ */
+struct NETSUMMARY {
+	//! \brief The number of connections
+	int clients;
+
+	/*! \brief The NETSERVICE_STAT_xxx counters, added up
+	 *
+	 *  Connections which are gone still count. The output peak is the highest
+	 *  of any connection.
+	 */
+	unsigned long long stats[NETSERVICE_STAT_MAX];
+
+	//! \brief Bytes queued for output right now
+	unsigned long long outputQueued;
+
+	//! \brief Bytes of buffered input right now
+	unsigned long long inputBuffered;
+
+	//! \brief Connections whose output is above the high watermark
+	int outputFull;
+
+	//! \brief Connections which are not read from
+	int readPaused;
+
+	//! \brief Average round trip time, in microseconds, if asked for
+	unsigned int rttAvg;
+
+	//! \brief Highest round trip time, in microseconds, if asked for
+	unsigned int rttMax;
+
+	//! \brief Retransmitted segments of the current connections, if asked for
+	unsigned long long retransmits;
 };
 
 /*! \class NETSERVICE
@@ -186,6 +664,9 @@ private:
 class NETSERVICE {
 	// everybody loves somebody ... ;-)
 	friend class NETWORK;
+	friend class NETSERVER;
+	friend class PUBSUB;
+	friend class LOOPBACK;
 
 public:
 	//! \brief The constructor of the class.
@@ -207,18 +688,58 @@ public:
 	 */
 	void setParent (NETSERVICE* p);
 
+	/*! \brief Returns the network the service is part of
+	 *  \return The network, or NULL if the service was not added to one
+	 *
+	 *  Clients are part of the network of their parent.
+	 */
+	NETWORK* getNetwork ();
+
 	/*! \brief Set the address of the client
 	 *  \param addr The new client address
 	 */
 	void setClientAddress (NETADDRESS* addr);
 
 	/*! \brief Sends data to the socket
-	 *	\return The number of bytes sent
+	 *	\return The number of bytes sent or queued
 	 *  \param buf Buffer of data to send
 	 *  \param len Size of the buffer
+	 *
+	 *  Whatever the socket does not take right away is queued and sent by
+	 *  NETWORK::run(). This never blocks. Once watermarks are set, everything
+	 *  is queued; the producer is expected to watch them. Otherwise, no more
+	 *  than NETSERVICE_QUEUE_LIMIT bytes are queued, and if the peer falls that
+	 *  far behind, a short count is returned with errno set to EAGAIN.
    */
 	int	send (char* buf, int len);
 
+	/*! \brief Queues a shared block of data for sending
+	 *  \return The number of bytes sent or queued
+	 *  \param b The block to send
+	 *
+	 *  The block is not copied; a reference to it is kept until it is sent. It
+	 *  must not be changed afterwards. Like send(), this refuses what does not
+	 *  fit if no watermarks are set, but the block is queued as a whole.
+	 */
+	int sendBlock (NETBLOCK* b);
+
+	/*! \brief Sends data to all clients
+	 *  \return The number of clients the data was sent or queued to
+	 *  \param buf Buffer of data to send
+	 *  \param len Size of the buffer
+	 *
+	 *  The data is copied once into a shared block, which is queued on every
+	 *  client. This never waits; clients which are above their high watermark
+	 *  or out of room miss the data.
+	 */
+	int broadcast (char* buf, int len);
+
+	/*! \brief Sends a shared block to all clients
+	 *  \return The number of clients the block was sent or queued to
+	 *  \param b The block to send
+	 */
+	int broadcast (NETBLOCK* b);
+
 	/*! \brief Sends printf()-formatted data to the socket
 	 *  \return The number of bytes sent
 	 *  \param fmt Format specifier for printf()
@@ -229,9 +750,9 @@ public:
 	/*! \brief Determines the service type
 	 *  \return The service type
 	 *
-	 * This must return NETSERVICE_SERVER or NETSERVICE_CLIENT. The difference
-	 * between the two is that a NETSERVICE_CLIENT will always be checked to
-	 * have data available when it is executed, and the other will not.
+	 * This must return NETSERVICE_SERVER, NETSERVICE_CLIENT or NETSERVICE_EVENT.
+	 * The difference is that a NETSERVICE_CLIENT will always be checked to
+	 * have data available when it is executed, and the others will not.
 	 */
 	virtual int getType () = 0;
 
@@ -246,7 +767,271 @@ public:
 	//! \brief Retrieves the client address
 	NETADDRESS* getClientAddress ();
 
+	/*! \brief Sets the output watermarks
+	 *  \param high Output size at which outputHigh() is called, zero to disable
+	 *  \param low Output size at which outputLow() is called afterwards
+	 *
+	 *  Data which cannot be sent right away is queued and sent by NETWORK::run()
+	 *  once the socket is writable. The watermarks allow a producer to notice
+	 *  that the peer cannot keep up.
+	 */
+	void setWatermarks (int high, int low);
+
+	/*! \brief Enables buffering of input
+	 *  \param limit The maximum number of bytes to buffer, zero to disable
+	 *
+	 *  With buffering enabled, NETWORK::run() reads the incoming data into a
+	 *  buffer and recv() hands it out from there. Once the buffer holds limit
+	 *  bytes, the socket is no longer polled for reading until the handler has
+	 *  consumed some of it.
+	 */
+	void setInputLimit (int limit);
+
+	/*! \brief Pairs the input of another service to our output
+	 *  \param s The service to be paused while our output is above the high
+	 *            watermark, or NULL for none
+	 *
+	 *  This is intended for proxies: data read from s is written to us, so s
+	 *  should not be read faster than our peer accepts it. The paired service
+	 *  must outlive the pairing.
+	 */
+	void setPairedInput (NETSERVICE* s);
+
+	//! \brief Stops NETWORK::run() from reading from the service
+	void pauseReading ();
+
+	//! \brief Allows NETWORK::run() to read from the service again
+	void resumeReading ();
+
+	//! \brief Returns non-zero if reading is paused
+	int isReadPaused ();
+
+	//! \brief Returns non-zero if the output is above the high watermark
+	int isOutputFull ();
+
+	/*! \brief Starts draining the service
+	 *
+	 *  A draining server closes its listening socket, so it stops accepting
+	 *  connections. Clients which have nothing queued in either direction are
+	 *  dropped right away; the others are served until they are, so replies
+	 *  being written still go out.
+	 */
+	void drain ();
+
+	//! \brief Returns non-zero if the service is draining
+	int isDraining ();
+
+	//! \brief Returns non-zero once a draining service has no clients left
+	int isDrained ();
+
+	//! \brief Returns non-zero if nothing is queued for input or output
+	int isIdle ();
+
+	//! \brief Returns the number of bytes queued for sending
+	virtual int getOutputLength ();
+
+	//! \brief Returns the number of bytes of buffered input
+	int getInputLength ();
+
+	/*! \brief Takes complete lines from the buffered input
+	 *  \return The number of lines found
+	 *  \param lines Receives the lines
+	 *  \param max The maximum number of lines to find
+	 *  \param delim The byte ending a line
+	 *
+	 *  This requires input buffering, see setInputLimit(). The lines are only
+	 *  valid during incoming(). If [max] lines are returned, more may follow;
+	 *  if none are, and the buffer is at its limit, the line is too long.
+	 */
+	int getLines (struct NETLINE* lines, int max, char delim = '\n');
+
+	/*! \brief Starts TLS on the connection
+	 *  \return Zero on failure or non-zero on success
+	 *  \param ctx The TLS context to use
+	 *  \param server Non-zero to act as the server, zero to act as the client
+	 *  \param host The name or address of the server, if acting as the client
+	 *
+	 *  The handshake is done by NETWORK::run() without blocking; incoming() is
+	 *  only called once it has completed. Data sent in the meantime is queued.
+	 *  A client sends [host] to the server, and, if the context verifies the
+	 *  server, fails the handshake unless the certificate matches it; starting
+	 *  without [host] then fails. This always fails if the library was built
+	 *  without TLS support.
+	 */
+	int startTLS (TLSCONTEXT* ctx, int server, char* host = NULL);
+
+	//! \brief Returns the TLS state of the connection, or NULL if not using TLS
+	TLSSESSION* getTLS ();
+
+	/*! \brief Sends part of a file
+	 *  \return The number of bytes sent, which is zero if the socket is full,
+	 *          or -1 on failure
+	 *  \param filefd The file descriptor of the file
+	 *  \param offset Offset to send from, which is advanced by the amount sent
+	 *  \param len The maximum number of bytes to send
+	 *
+	 *  This never blocks. sendfile() is used if possible, which is also the case
+	 *  for TLS connections if the kernel does the encryption. Nothing is sent
+	 *  while output is queued, to keep the data in order.
+	 */
+	int sendFile (int filefd, off_t* offset, int len);
+
+	/*! \brief Tries to send queued output
+	 *  \return Zero if the connection failed, non-zero otherwise
+	 *
+	 *  This will never block. It is called by NETWORK::run() whenever the
+	 *  socket is writable. Services which send data by other means than the
+	 *  output queue override this along with getOutputLength().
+	 */
+	virtual int flush ();
+
+	/*! \brief Drops the connection
+	 *
+	 *  Queued output is discarded and nothing more is sent; the connection is
+	 *  closed and destroyed by the next NETWORK::run(). This is safe to call
+	 *  from within any callback.
+	 */
+	void drop ();
+
+	//! \brief Returns non-zero if the connection was dropped
+	int isDropped ();
+
+	/*! \brief Deletes the service once it is safe to do so
+	 *
+	 *  Within NETWORK::run(), the service is closed right away but only
+	 *  deleted once all services were handled, so nothing refers to it
+	 *  anymore. This makes it safe to destroy any service, including the one
+	 *  being handled, from within a callback. Elsewhere, the service is deleted
+	 *  at once.
+	 */
+	void destroy ();
+
+	/*! \brief Returns a handle to the service
+	 *
+	 *  Unlike a pointer, a handle can be kept after the service is deleted;
+	 *  lookup() tells whether it still refers to it.
+	 */
+	NETHANDLE getHandle ();
+
+	/*! \brief Finds the service a handle refers to
+	 *  \return The service, or NULL if it was deleted or is about to be
+	 *  \param h The handle, as returned by getHandle()
+	 */
+	static NETSERVICE* lookup (NETHANDLE h);
+
+	/*! \brief Enables or disables Nagle's algorithm
+	 *  \return Zero on failure or non-zero on success
+	 *  \param on Non-zero to send small segments right away
+	 *
+	 *  When set on a server, the setting is inherited by accepted connections.
+	 */
+	int setNoDelay (int on);
+
+	/*! \brief Corks or uncorks the connection
+	 *  \return Zero on failure or non-zero on success
+	 *  \param on Non-zero to hold back partial segments, zero to push them out
+	 *
+	 *  This uses TCP_CORK on Linux and TCP_NOPUSH on BSD, and fails elsewhere.
+	 */
+	int setCork (int on);
+
+	/*! \brief Enables or disables automatic corking
+	 *  \param on Non-zero to enable automatic corking
+	 *
+	 *  Data sent from within incoming() is then held back until incoming()
+	 *  returns, and written in a single call. Clients accepted by a server
+	 *  inherit its setting.
+	 */
+	void setAutoCork (int on);
+
+	//! \brief Returns non-zero if automatic corking is enabled
+	int isAutoCork ();
+
+	/*! \brief Enables busy polling of the socket by the kernel
+	 *  \return Zero on failure or non-zero on success
+	 *  \param usec Number of microseconds the kernel may poll the device for
+	 *               data on a blocking receive, or zero to disable this
+	 *  \param prefer Non-zero to prefer busy polling over interrupts
+	 *
+	 *  This uses SO_BUSY_POLL and SO_PREFER_BUSY_POLL, and fails where these
+	 *  are not available. Raising the value may require privileges.
+	 */
+	int setBusyPoll (int usec, int prefer = 0);
+
+	/*! \brief Sets the CPU whose connections a listening socket prefers
+	 *  \return Zero on failure or non-zero on success
+	 *  \param cpu The CPU number
+	 *
+	 *  Among listening sockets sharing a port using SO_REUSEPORT, the kernel
+	 *  hands new connections to the one set to the CPU which handled the
+	 *  packet. This uses SO_INCOMING_CPU, and fails where it is not available.
+	 */
+	int setIncomingCPU (int cpu);
+
+	/*! \brief Sets the priority of the service
+	 *  \param prio One of NETSERVICE_PRIORITY_xxx
+	 *
+	 *  Ready services of higher priority are handled before the others. The
+	 *  clients a server accepts start out with the priority of the server.
+	 */
+	void setPriority (int prio);
+
+	//! \brief Returns the priority of the service
+	int getPriority ();
+
+	/*! \brief Asks the kernel about the connection
+	 *  \return Zero on failure or non-zero on success
+	 *  \param info Receives what the kernel knows
+	 *
+	 *  This uses TCP_INFO, and fails where it is not available or the service
+	 *  is not a TCP connection.
+	 */
+	int getTCPInfo (struct NETTCPINFO* info);
+
+	/*! \brief Returns a counter of the connection
+	 *  \param which One of the NETSERVICE_STAT_xxx values
+	 *
+	 *  The counters are kept for every connection, and cost nothing more than
+	 *  an addition per read or write.
+	 */
+	unsigned long getStat (int which);
+
+	//! \brief Resets the counters of the connection to zero
+	void resetStats ();
+
 protected:
+	/*! \brief Counts a read from the connection
+	 *  \param n The number of bytes read, or a negative value if none
+	 *
+	 *  Services which bypass the raw I/O functions call this themselves.
+	 */
+	inline void countRead (int n) {
+		stats[NETSERVICE_STAT_READS]++;
+		if (n > 0)
+			stats[NETSERVICE_STAT_BYTES_IN] += n;
+	};
+
+	/*! \brief Counts a write to the connection
+	 *  \param n The number of bytes written, or a negative value if none
+	 */
+	inline void countWrite (int n) {
+		stats[NETSERVICE_STAT_WRITES]++;
+		if (n > 0)
+			stats[NETSERVICE_STAT_BYTES_OUT] += n;
+	};
+
+	/*! \brief Called when the output rises to the high watermark
+	 *
+	 *  By default, this pauses reading from the paired input, if any.
+	 */
+	virtual void outputHigh ();
+
+	/*! \brief Called when the output drains to the low watermark
+	 *
+	 *  By default, this resumes reading from the paired input, if any.
+	 */
+	virtual void outputLow ();
+
 	/*! \brief Callback function to handle events
 	 *
 	 *  This will be called whenever NETWORK::run() notices an event for the file
@@ -274,7 +1059,8 @@ protected:
 	FILE* filp;
 
 	/*! \brief Reads data from the socket
-	 *  \return The number of bytes retrieved
+	 *  \return The number of bytes retrieved, or -1 with errno set to EAGAIN
+	 *           if the input budget is used up
 	 *  \param buf Buffer to handle the data
 	 *  \param len Size of the buffer
 	 */
@@ -288,6 +1074,73 @@ protected:
 	//! \brief Closes the connection
 	void close ();
 
+	/*! \brief Reads from the connection, decrypting if needed
+	 *  \return Like ::recv()
+	 *  \param buf Buffer to store the data in
+	 *  \param len Size of the buffer
+	 *  \param flags Flags for ::recv(); only MSG_PEEK and MSG_DONTWAIT are used
+	 *
+	 *  This and the other raw I/O functions may be overridden by services
+	 *  which don't use a socket to transfer data.
+	 */
+	virtual int readRaw (char* buf, int len, int flags);
+
+	/*! \brief Writes to the connection, encrypting if needed
+	 *  \return Like ::send()
+	 *  \param buf Buffer holding the data
+	 *  \param len Size of the buffer
+	 *  \param flags Flags for ::send()
+	 */
+	virtual int writeRaw (char* buf, int len, int flags);
+
+	/*! \brief Writes a number of buffers to the connection
+	 *  \return Like ::send()
+	 *  \param iov The buffers
+	 *  \param n The number of buffers
+	 *  \param flags Flags for ::send()
+	 */
+	virtual int writeVector (struct iovec* iov, int n, int flags);
+
+	/*! \brief Writes part of a file to the connection without blocking
+	 *  \return Like ::send()
+	 *  \param filefd The file descriptor of the file
+	 *  \param offset Offset to send from, which is advanced by the amount sent
+	 *  \param len The maximum number of bytes to send
+	 */
+	virtual int writeFile (int filefd, off_t* offset, int len);
+
+	/*! \brief Returns non-zero if the descriptor merely signals events
+	 *
+	 *  Such a descriptor is only monitored for reading. Whenever it becomes
+	 *  readable, wakeup() is called, after which queued output is flushed and
+	 *  input is read as if the connection were both readable and writable.
+	 */
+	virtual int usesEventFD () { return 0; };
+
+	//! \brief Called when a descriptor which merely signals events is readable
+	virtual void wakeup () { };
+
+	/*! \brief Returns non-zero if input is available without being signalled
+	 *
+	 *  This is asked before waiting on a descriptor which merely signals
+	 *  events, so a service which is not told about input it left behind can
+	 *  have it handled without waiting.
+	 */
+	virtual int hasInput () { return 0; };
+
+	/*! \brief Tells the other side that no more data follows
+	 *
+	 *  This is called by closeAll() once queued output is sent, before the
+	 *  descriptor is closed. Transports for which closing the descriptor does
+	 *  not suffice override it.
+	 */
+	virtual void closeRaw () { };
+
+	/*! \brief Switches the socket to non-blocking mode
+	 *  \return Zero on failure or non-zero on success
+	 */
+	int setNonBlocking ();
+
 private:
 	//! \brief Holds all attached clients
 	VECTOR*	clients;
@@ -297,6 +1150,127 @@ private:
 
 	//! \brief Holds the address of whoever connected to us
 	NETADDRESS* clientAddress;
+
+	/*! \brief Writes queued output to the connection
+	 *  \return Like ::send()
+	 *  \param flags Flags for ::send()
+	 *
+	 *  Plain connections write several queued chunks at once.
+	 */
+	int writeQueue (int flags);
+
+	//! \brief Calls outputHigh() if the output just crossed the high watermark
+	void checkHigh ();
+
+	/*! \brief Checks for room in the output queue, unless watermarks are set
+	 *  \return The number of bytes which may be queued, zero if there is no
+	 *          room, or -1 if the connection failed
+	 *  \param len The number of bytes to be queued
+	 *
+	 *  This never waits for the peer.
+	 */
+	int makeRoom (int len);
+
+	/*! \brief Reads available data into the input buffer
+	 *  \return The number of bytes read, zero on end of file or failure, or -1
+	 *           if there was nothing to read
+	 */
+	int fill ();
+
+	/*! \brief Limits a read to what is left of the input budget
+	 *  \return The number of bytes which may be read, zero if none
+	 *  \param len The number of bytes wanted
+	 */
+	int allowance (int len);
+
+	/*! \brief Reports that the input budget stopped a read
+	 *  \return -1, with errno set to EAGAIN
+	 */
+	int spent ();
+
+	//! \brief Queued output
+	NETQUEUE* outqueue;
+
+	//! \brief Buffered input
+	NETBUFFER* inbuf;
+
+	//! \brief The NETSERVICE_STAT_xxx counters
+	unsigned long stats[NETSERVICE_STAT_MAX];
+
+	//! \brief Maximum size of the input buffer, zero if input is not buffered
+	int inputLimit;
+
+	//! \brief High output watermark, zero if disabled
+	int highWatermark;
+
+	//! \brief Low output watermark
+	int lowWatermark;
+
+	//! \brief Service whose input is paused when we are above the high watermark
+	NETSERVICE* pairedInput;
+
+	//! \brief Non-zero if reading is paused
+	int readPaused;
+
+	//! \brief Non-zero if the output is above the high watermark
+	int outputFull;
+
+	//! \brief Non-zero if buffered input must be dispatched without new data
+	int inputPending;
+
+	//! \brief Non-zero if the socket was switched to non-blocking mode
+	int nonBlocking;
+
+	//! \brief Bytes which may still be read in this dispatch, or -1 if unlimited
+	int budget;
+
+	//! \brief The priority, one of NETSERVICE_PRIORITY_xxx
+	int priority;
+
+	//! \brief TLS state, or NULL if not using TLS
+	TLSSESSION* tls;
+
+	//! \brief The in-process connection, or NULL if not connected that way
+	LOOPBACK* loop;
+
+	//! \brief Non-zero if the connection is to be dropped
+	int dropped;
+
+	//! \brief Non-zero if the service is draining
+	int draining;
+
+	//! \brief Non-zero if automatic corking is enabled
+	int autoCork;
+
+	//! \brief Non-zero while output is held back by automatic corking
+	int corked;
+
+	//! \brief Topics the service is subscribed to
+	struct PUBSUBLINK* subscriptions;
+
+	//! \brief The network the service was added to, if any
+	NETWORK* network;
+
+	/*! \brief Closes the connection and those of all clients
+	 *  \param defer Non-zero to leave removing and deleting services to the
+	 *                network, which may be going through them
+	 */
+	void closeAll (int defer);
+
+	//! \brief What becomes of the service after the round, if anything
+	int buried;
+
+	//! \brief The network which is to do that
+	NETWORK* buriedIn;
+
+	//! \brief The next service to be removed after the round
+	NETSERVICE* graveNext;
+
+	//! \brief The handle slot of the service, or -1 if it has none
+	int handleSlot;
+
+	//! \brief Non-zero if the service counts towards NETSERVER::getTotalClients()
+	int counted;
 };
 
 /*! \class SERVICECLIENT
@@ -324,22 +1298,191 @@ public:
  */
 class NETSERVER : public NETSERVICE {
 public:
+	//! \brief The constructor of the class
+	NETSERVER();
+
 	/*! \brief Creates a server TCP socket
 	 *  \return Zero on failure and non-zero on failure
 	 *  \param no The port number to open
 	 */
 	int create (int no);
 
+	/*! \brief Allows several sockets to listen on the same port
+	 *  \param on Non-zero to set SO_REUSEPORT on the socket
+	 *
+	 *  This must be called before create(). The kernel spreads connections over
+	 *  all sockets listening on the port, which is useful when every thread or
+	 *  process runs its own server.
+	 */
+	void setReusePort (int on);
+
+	/*! \brief Hands the listening socket over to another process
+	 *  \return Zero on failure or non-zero on success
+	 *  \param path The Unix socket the other process waits on in takeOver()
+	 *
+	 *  The socket is passed using SCM_RIGHTS, and keeps accepting connections
+	 *  throughout. Our copy is closed afterwards and the server starts to
+	 *  drain. Servers are handed over in the order the other process takes
+	 *  them over. If the other process does not respond within
+	 *  NETSERVER_HANDOFF_TIMEOUT milliseconds, this fails and we keep serving.
+	 */
+	int handOff (char* path);
+
+	/*! \brief Takes a listening socket over from another process
+	 *  \return Zero on failure or non-zero on success
+	 *  \param path The Unix socket to wait on; it is created and removed
+	 *  \param timeout Number of seconds to wait for handOff(), or zero to wait
+	 *                  forever
+	 *
+	 *  This is used instead of create().
+	 */
+	int takeOver (char* path, int timeout = 0);
+
+	/*! \brief Sets the access list consulted for new connections
+	 *  \param a The access list to use, or NULL to accept everyone
+	 *
+	 *  The access list is not owned by the server; it may be shared by several
+	 *  servers and must remain valid while it is in use.
+	 */
+	void setACL (ACL* a);
+
+	//! \brief Returns the access list in use
+	ACL* getACL ();
+
+	/*! \brief Enables TLS for new connections
+	 *  \param ctx The server context to use, or NULL to disable TLS
+	 */
+	void setTLS (TLSCONTEXT* ctx);
+
+	/*! \brief Sets the rate limiter consulted for new connections
+	 *  \param r The rate limiter to use, or NULL to disable rate limiting
+	 *
+	 *  Like the access list, the rate limiter is not owned by the server.
+	 */
+	void setRateLimit (RATELIMIT* r);
+
+	/*! \brief Sets the maximum number of concurrent clients of this server
+	 *  \param max The maximum, or zero for no limit
+	 *
+	 *  This only counts the clients of this server; see setTotalMaxClients()
+	 *  for a limit on all servers together.
+	 */
+	void setMaxClients (int max);
+
+	/*! \brief Sets the maximum number of concurrent clients of all servers
+	 *  \param max The maximum, or zero for no limit
+	 *
+	 *  This counts the clients accepted by any server in the process. With
+	 *  NETWORK::prefork(), every worker process has a limit of its own.
+	 */
+	static void setTotalMaxClients (int max);
+
+	//! \brief Returns the number of clients accepted by all servers together
+	static int getTotalClients ();
+
+	/*! \brief Retrieves a connection counter
+	 *  \return The value of the counter
+	 *  \param which NETSERVER_COUNT_xxx
+	 */
+	unsigned long getCounter (int which);
+
+	//! \brief Resets all connection counters to zero
+	void resetCounters ();
+
+	/*! \brief Summarizes the connections of the server
+	 *  \param s Receives the summary
+	 *  \param tcp Non-zero to ask the kernel about every connection as well
+	 *
+	 *  This only walks the clients, unless [tcp] is set, which costs a system
+	 *  call per client.
+	 */
+	void getSummary (struct NETSUMMARY* s, int tcp = 0);
+
 	// NETSERVER is a server networking service
 	inline int getType () { return NETSERVICE_SERVER; };
 
 protected:
+	/*! \brief Callback handler for an event
+	 *
+	 *  The default implementation calls accept(), which relies on createClient()
+	 *  to construct the client objects.
+	 */
+	virtual void incoming();
+
+	/*! \brief Constructs a client for a newly accepted connection
+	 *  \return The new client, or NULL to refuse the connection
+	 *
+	 *  This is called by accept() only after the connection has passed all
+	 *  access checks.
+	 */
+	virtual SERVICECLIENT* createClient ();
+
 	/*! \brief Accepts a new connection
 	 *  \returns Non-zero on success and non-zero on failure
 	 *
 	 *  If anything fails, client will automatically be deleted.
 	 */
 	int accept (SERVICECLIENT* client);
+
+	/*! \brief Accepts a new connection using createClient()
+	 *  \returns Non-zero on success and zero on failure
+	 *
+	 *  Connections refused by the access list are closed before a client is
+	 *  constructed.
+	 */
+	int accept ();
+
+private:
+	/*! \brief Accepts the pending connection and performs access checks
+	 *  \return The new file descriptor, or -1 if it failed or was refused
+	 *
+	 *  The access list is checked first, then the client limit and finally the
+	 *  rate limiter, so refused peers do not use up tokens.
+	 *  \param sin Will receive the address of the peer
+	 */
+	int acceptFD (struct sockaddr_in* sin);
+
+	/*! \brief Hooks an accepted connection up to a client object
+	 *  \return Non-zero on success and zero on failure
+	 *  \param client The client to use
+	 *  \param client_fd The accepted file descriptor
+	 *  \param sin The address of the peer
+	 */
+	int attach (SERVICECLIENT* client, int client_fd, struct sockaddr_in* sin);
+
+	//! \brief The access list, if any
+	ACL* acl;
+
+	//! \brief The rate limiter, if any
+	RATELIMIT* ratelimit;
+
+	//! \brief The TLS context for new connections, if any
+	TLSCONTEXT* tlsContext;
+
+	//! \brief The maximum number of concurrent clients, or zero for no limit
+	int maxClients;
+
+	//! \brief The maximum number of clients of all servers, or zero for no limit
+	static int totalMaxClients;
+
+	//! \brief The number of clients of all servers
+	static int totalClients;
+
+	//! \brief The connection counters
+	unsigned long counters[NETSERVER_COUNT_MAX];
+
+	//! \brief Non-zero if SO_REUSEPORT is to be set
+	int reusePort;
+
+	//! \brief Adds the counters of a client which is going away
+	void retire (NETSERVICE* client);
+
+	//! \brief The NETSERVICE_STAT_xxx counters of clients which are gone
+	unsigned long long retired[NETSERVICE_STAT_MAX];
+
+	friend class NETWORK;
+	friend class NETSERVICE;
+	friend class LOOPBACK;
 };
 
 /*! \class NETCLIENT
@@ -352,8 +1495,13 @@ public:
 	/*! \brief Creates a new connection to a server
 	 *  \returns Non-zero on success and non-zero on failure
 	 *  \param addr The address to connect to.
+	 *  \param wait Zero to make the connection in the background
+	 *
+	 *  A connection made in the background can be used right away; data sent
+	 *  is queued until it is up. If it cannot be made, the connection is
+	 *  dropped once NETWORK::run() notices.
 	 */
-	int connect (NETADDRESS* addr);
+	int connect (NETADDRESS* addr, int wait = 1);
 
 	// NETCLIENT is a client networking service
 	inline int getType () { return NETSERVICE_CLIENT; };
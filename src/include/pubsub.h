@@ -0,0 +1,170 @@
+/*
+ * \file pubsub.h
+ * \brief Publish/subscribe channels
+ *
+ */
+#ifndef __PUBSUB_H__
+#define __PUBSUB_H__
+
+#include <inttypes.h>
+#include "network.h"
+#include "buffer.h"
+
+/* PUBSUB_SLOW_xxx are the policies for subscribers which cannot keep up */
+#define PUBSUB_SLOW_IGNORE      0       /* queue the message anyway */
+#define PUBSUB_SLOW_SKIP        1       /* skip the message */
+#define PUBSUB_SLOW_DROP        2       /* drop the subscriber */
+
+/* PUBSUB_COUNT_xxx identify the counters of a PUBSUB */
+#define PUBSUB_COUNT_PUBLISHED  0       /* messages published */
+#define PUBSUB_COUNT_DELIVERED  1       /* messages sent or queued */
+#define PUBSUB_COUNT_SKIPPED    2       /* messages skipped, subscriber slow */
+#define PUBSUB_COUNT_DROPPED    3       /* subscribers dropped */
+#define PUBSUB_COUNT_MAX        4
+
+// PUBSUBTOPIC and PUBSUBLINK are private to pubsub.cc
+struct PUBSUBTOPIC;
+struct PUBSUBLINK;
+
+/*! \class PUBSUB
+ *  \brief Named channels of subscribed services
+ *
+ *  A PUBSUB maps topic names to the services subscribed to them. Subscribing
+ *  and unsubscribing take constant time with respect to the number of
+ *  subscribers. A published message is copied once into a NETBLOCK which is
+ *  shared by all subscribers. Services are unsubscribed from everything when
+ *  they are closed.
+ */
+class PUBSUB {
+public:
+	/*! \brief Constructs an empty set of topics
+	 *  \param size The initial number of hash buckets, which is a power of two
+	 */
+	PUBSUB(int size = 64);
+
+	//! \brief Destroys the topics, unsubscribing all services
+	~PUBSUB();
+
+	/*! \brief Subscribes a service to a topic
+	 *  \return Zero on failure or non-zero on success
+	 *  \param s The service
+	 *  \param topic The name of the topic
+	 *
+	 *  Subscribing to a topic twice has no effect.
+	 */
+	int subscribe (NETSERVICE* s, char* topic);
+
+	/*! \brief Unsubscribes a service from a topic
+	 *  \return Zero if the service was not subscribed, non-zero otherwise
+	 *  \param s The service
+	 *  \param topic The name of the topic
+	 */
+	int unsubscribe (NETSERVICE* s, char* topic);
+
+	/*! \brief Unsubscribes a service from all topics of all PUBSUBs
+	 *  \param s The service
+	 *
+	 *  This is called by NETSERVICE when the service is closed.
+	 */
+	static void unsubscribeAll (NETSERVICE* s);
+
+	/*! \brief Sends a message to all subscribers of a topic
+	 *  \return The number of subscribers the message was sent or queued to
+	 *  \param topic The name of the topic
+	 *  \param buf The message
+	 *  \param len The size of the message
+	 *
+	 *  This never waits for a subscriber. One whose output queue has no room
+	 *  left misses the message, or is dropped under PUBSUB_SLOW_DROP.
+	 */
+	int publish (char* topic, char* buf, int len);
+
+	/*! \brief Sends a shared block to all subscribers of a topic
+	 *  \return The number of subscribers the block was sent or queued to
+	 *  \param topic The name of the topic
+	 *  \param b The block to send
+	 */
+	int publish (char* topic, NETBLOCK* b);
+
+	/*! \brief Returns the number of subscribers of a topic
+	 *  \param topic The name of the topic
+	 */
+	int getSubscribers (char* topic);
+
+	/*! \brief Sets how subscribers which cannot keep up are handled
+	 *  \param policy One of the PUBSUB_SLOW_xxx values
+	 *  \param limit Number of bytes of queued output at which a subscriber is
+	 *               considered slow. If zero, a subscriber is slow once its
+	 *               output is above its high watermark.
+	 */
+	void setSlowPolicy (int policy, int limit = 0);
+
+	/*! \brief Returns a counter
+	 *  \param which One of the PUBSUB_COUNT_xxx values
+	 */
+	int getCounter (int which);
+
+	//! \brief Resets all counters to zero
+	void resetCounters ();
+
+private:
+	/*! \brief Looks a topic up
+	 *  \return The topic, or NULL if it does not exist
+	 *  \param name The name of the topic
+	 *  \param hash The hash of the name
+	 */
+	struct PUBSUBTOPIC* find (char* name, uint32_t hash);
+
+	/*! \brief Doubles the number of hash buckets
+	 *  \return Zero on failure or non-zero on success
+	 */
+	int grow ();
+
+	/*! \brief Removes a subscription from the list of its service
+	 *  \param l The subscription
+	 */
+	static void detach (struct PUBSUBLINK* l);
+
+	/*! \brief Removes a subscription
+	 *  \param l The subscription
+	 */
+	static void unlink (struct PUBSUBLINK* l);
+
+	/*! \brief Frees a topic, which must have no subscribers
+	 *  \param t The topic
+	 */
+	void removeTopic (struct PUBSUBTOPIC* t);
+
+	/*! \brief Decides whether a subscriber gets a message
+	 *  \return Non-zero if the message must be sent
+	 *  \param s The subscriber
+	 */
+	int admit (NETSERVICE* s);
+
+	/*! \brief Skips a message for a slow subscriber, or drops it
+	 *  \param s The subscriber
+	 */
+	void refuse (NETSERVICE* s);
+
+	//! \brief The hash buckets
+	struct PUBSUBTOPIC** buckets;
+
+	//! \brief The number of hash buckets
+	int numBuckets;
+
+	//! \brief The number of topics
+	int numTopics;
+
+	//! \brief The slow subscriber policy
+	int slowPolicy;
+
+	//! \brief The slow subscriber limit
+	int slowLimit;
+
+	//! \brief The counters
+	int counters[PUBSUB_COUNT_MAX];
+};
+
+#endif // __PUBSUB_H__
+
+/* vim:set ts=2 sw=2: */
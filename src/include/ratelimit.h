@@ -0,0 +1,70 @@
+/*
+ * \file ratelimit.h
+ * \brief Per-address rate limiting
+ *
+ */
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include "network.h"
+
+/*! \class RATELIMIT
+ *  \brief Token bucket rate limiter keyed by client address
+ *
+ *  Every address (or network, if a prefix is set) gets its own token bucket,
+ *  which refills at a fixed rate up to a burst size. The buckets are kept in
+ *  a hash table of fixed size; when it is full, the bucket used least recently
+ *  is recycled, so memory use stays bounded no matter how many peers show up.
+ */
+class RATELIMIT {
+public:
+	/*! \brief Constructs a rate limiter
+	 *  \param size The number of buckets to keep
+	 */
+	RATELIMIT(int size = 4096);
+
+	//! \brief Destroys the rate limiter
+	~RATELIMIT();
+
+	/*! \brief Sets the rate
+	 *  \param r The number of events allowed per second
+	 *  \param b The number of events allowed in a single burst
+	 */
+	void setRate (double r, double b);
+
+	/*! \brief Sets the prefix length used to group addresses
+	 *  \param p The number of bits to use, 32 for a bucket per address
+	 */
+	void setPrefix (int p);
+
+	/*! \brief Checks whether an event is allowed
+	 *  \return Non-zero if the event is allowed, zero if it must be dropped
+	 *  \param key The address responsible for the event
+	 *
+	 *  If the event is allowed, a token is taken from the bucket.
+	 */
+	int check (IPV4KEY key);
+
+	//! \brief Forgets all buckets
+	void clear ();
+
+private:
+	//! \brief The buckets
+	struct RATEBUCKET* buckets;
+
+	//! \brief The number of buckets
+	int numBuckets;
+
+	//! \brief The refill rate, in tokens per second
+	double rate;
+
+	//! \brief The size of each bucket
+	double burst;
+
+	//! \brief The prefix length used to group addresses
+	int prefix;
+};
+
+#endif // __RATELIMIT_H__
+
+/* vim:set ts=2 sw=2: */
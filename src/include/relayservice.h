@@ -0,0 +1,121 @@
+/*
+ * \file relayservice.h
+ * \brief Relaying of connections
+ *
+ */
+#ifndef __RELAYSERVICE_H__
+#define __RELAYSERVICE_H__
+
+#include "network.h"
+
+//! \brief RELAYSERVICE_CHUNK is the maximum number of bytes moved at once
+#define RELAYSERVICE_CHUNK 65536
+
+/*! \class RELAYSERVICE
+ *  \brief One end of a relayed connection
+ *
+ *  Two paired RELAYSERVICEs pass everything read from one on to the other.
+ *  On Linux, data is moved with splice() through a pipe per direction and
+ *  never copied to user space. Elsewhere, it is copied through the output
+ *  queue.
+ *
+ *  Reading from one end is paused while the other end cannot keep up. If one
+ *  end reaches end of file, the other end is shut down for writing once all
+ *  data is delivered; both ends are dropped once both directions are done,
+ *  or as soon as either connection fails. TLS cannot be used on a relay.
+ */
+class RELAYSERVICE : public SERVICECLIENT {
+public:
+	//! \brief The constructor of the class
+	RELAYSERVICE();
+
+	//! \brief The destructor of the class; the peer is dropped as well
+	virtual ~RELAYSERVICE();
+
+	/*! \brief Pairs this end with another one
+	 *  \return Zero on failure or non-zero on success
+	 *  \param p The other end
+	 */
+	int pair (RELAYSERVICE* p);
+
+	/*! \brief Connects to a server without waiting for the connection
+	 *  \return Zero on failure or non-zero on success
+	 *  \param addr The address to connect to
+	 *
+	 *  Data for the server is kept until the connection is made.
+	 */
+	int connect (NETADDRESS* addr);
+
+	//! \brief Returns the other end, if any
+	RELAYSERVICE* getPeer ();
+
+	//! \brief Returns the number of bytes relayed to the other end
+	unsigned long getRelayed ();
+
+	//! \brief Returns the number of bytes on their way to us
+	int getOutputLength ();
+
+	//! \brief Sends what the other end has for us
+	int flush ();
+
+	// RELAYSERVICE reads by itself
+	inline int getType () { return NETSERVICE_EVENT; };
+
+protected:
+	//! \brief Moves what can be read on to the other end
+	void incoming ();
+
+private:
+	//! \brief Drops both ends if both directions are done
+	void checkDone ();
+
+	//! \brief The other end
+	RELAYSERVICE* peer;
+
+	//! \brief The pipe data read from us goes through
+	int pipefd[2];
+
+	//! \brief The number of bytes in the pipe
+	int queued;
+
+	//! \brief Non-zero once we reached end of file
+	int eof;
+
+	//! \brief Non-zero once we were shut down for writing
+	int shut;
+
+	//! \brief The number of bytes relayed to the other end
+	unsigned long relayed;
+};
+
+/*! \class RELAYSERVER
+ *  \brief Server which relays all its connections to another server
+ *
+ *  For every connection accepted, a connection to the target is made and
+ *  the two are relayed to each other.
+ */
+class RELAYSERVER : public NETSERVER {
+public:
+	//! \brief The constructor of the class
+	RELAYSERVER();
+
+	/*! \brief Sets the server to relay to
+	 *  \param addr The address of the server, which is copied
+	 */
+	void setTarget (IPV4ADDRESS* addr);
+
+protected:
+	//! \brief Accepts a connection and relays it
+	void incoming ();
+
+private:
+	//! \brief The server to relay to
+	IPV4ADDRESS target;
+
+	//! \brief Non-zero once the target is set
+	int hasTarget;
+};
+
+#endif // __RELAYSERVICE_H__
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,177 @@
+/*
+ * \file rpcclient.h
+ * \brief Pipelined requests over a single connection
+ *
+ */
+#ifndef __RPCCLIENT_H__
+#define __RPCCLIENT_H__
+
+#include "network.h"
+
+//! \brief RPCCLIENT_DEPTH is the default maximum number of requests in flight
+#define RPCCLIENT_DEPTH 64
+
+//! \brief RPCCLIENT_CHUNK is the number of bytes read at once
+#define RPCCLIENT_CHUNK 16384
+
+/* RPCCLIENT_xxx identify how responses are matched to requests */
+#define RPCCLIENT_ORDERED     0       /* responses come in the order sent */
+#define RPCCLIENT_TAGGED      1       /* responses carry the ID of the request */
+
+/* RPCCLIENT_xxx identify the outcome of a request */
+#define RPCCLIENT_OK          0       /* a response arrived */
+#define RPCCLIENT_TIMEOUT     1       /* no response before the deadline */
+#define RPCCLIENT_FAILED      2       /* the connection failed or was closed */
+
+// RPCCALL lives in rpcclient.cc
+struct RPCCALL;
+
+/*! \class RPCHANDLER
+ *  \brief Receives the outcome of a request
+ */
+class RPCHANDLER {
+public:
+	//! \brief The destructor of the class
+	virtual ~RPCHANDLER() { };
+
+	/*! \brief Called once a request is done
+	 *  \param status One of the RPCCLIENT_xxx outcomes
+	 *  \param data The response, if status is RPCCLIENT_OK
+	 *  \param len The length of the response
+	 *  \param arg The argument given with the request
+	 *
+	 *  The response is only valid during the call.
+	 */
+	virtual void rpcDone (int status, char* data, int len, void* arg) = 0;
+};
+
+/*! \class RPCCLIENT
+ *  \brief Connection carrying many requests at once
+ *
+ *  An RPCCLIENT sends requests without waiting for the responses to earlier
+ *  ones, so the number of requests per second is not bound by the round trip
+ *  time. Responses are matched to the requests either by order, for protocols
+ *  which answer in the order asked, or by an ID which the protocol carries in
+ *  both. Each request has its own handler and, optionally, deadline.
+ *
+ *  No more than a fixed number of requests are in flight; call() refuses
+ *  more. If the connection fails or is closed, all requests in flight fail.
+ *  An ordered request which timed out keeps its place until its response
+ *  arrives, as the responses after it could not be matched otherwise.
+ *
+ *  The protocol is provided by a derived class, which implements parse() to
+ *  find where a response ends.
+ */
+class RPCCLIENT : public NETCLIENT, public NETTIMER {
+public:
+	/*! \brief The constructor of the class
+	 *  \param matching RPCCLIENT_ORDERED or RPCCLIENT_TAGGED
+	 *  \param depth The maximum number of requests in flight
+	 */
+	RPCCLIENT(int matching = RPCCLIENT_ORDERED, int depth = RPCCLIENT_DEPTH);
+
+	//! \brief The destructor of the class; requests in flight fail
+	virtual ~RPCCLIENT();
+
+	/*! \brief Sends a request
+	 *  \return Zero on failure or non-zero on success
+	 *  \param req The request, which is sent as is
+	 *  \param len The length of the request
+	 *  \param h The handler to call once done
+	 *  \param arg Argument passed to the handler
+	 *  \param timeout The number of milliseconds to wait for the response, or 0
+	 *                 to wait as long as the connection lasts
+	 *  \param id The ID of the request, if the responses are tagged
+	 *
+	 *  This fails with errno set to EAGAIN if too many requests are in flight,
+	 *  and to EEXIST if a tagged request with the same ID is in flight.
+	 */
+	int call (char* req, int len, RPCHANDLER* h, void* arg = NULL, int timeout = 0, unsigned int id = 0);
+
+	//! \brief Returns the number of requests in flight
+	int getInFlight ();
+
+	//! \brief Returns the maximum number of requests in flight
+	int getDepth ();
+
+	/*! \brief Fails all requests in flight
+	 *  \param status The outcome passed to the handlers
+	 */
+	void cancel (int status = RPCCLIENT_FAILED);
+
+	//! \brief Fails the requests which are past their deadline
+	void expired ();
+
+	// RPCCLIENT reads by itself
+	inline int getType () { return NETSERVICE_EVENT; };
+
+protected:
+	/*! \brief Finds the end of a response
+	 *  \return The length of the response, 0 if it is not complete yet, or -1
+	 *          if the input makes no sense
+	 *  \param buf The input received so far
+	 *  \param len The length of the input
+	 *  \param id Receives the ID of the response, if the responses are tagged
+	 */
+	virtual int parse (char* buf, int len, unsigned int* id) = 0;
+
+	//! \brief Reads and handles responses
+	void incoming ();
+
+private:
+	/*! \brief Finds a tagged request
+	 *  \return The position in the hash table, or -1 if not found
+	 */
+	int find (unsigned int id);
+
+	//! \brief Removes the entry at position [i] from the hash table
+	void unhash (int i);
+
+	//! \brief Frees slot [slot]
+	void freeCall (int slot);
+
+	//! \brief Arms the timer for the earliest deadline
+	void schedule ();
+
+	/*! \brief Hands a response to the handler of its request
+	 *  \return Zero if there is no request for it, non-zero otherwise
+	 */
+	int handle (char* data, int len, unsigned int id);
+
+	//! \brief How responses are matched, one of RPCCLIENT_xxx
+	int matching;
+
+	//! \brief The maximum number of requests in flight
+	int depth;
+
+	//! \brief The number of requests in flight
+	int inFlight;
+
+	//! \brief The requests, one per slot
+	struct RPCCALL* calls;
+
+	//! \brief The first free slot, or -1 if none
+	int freeSlot;
+
+	//! \brief Slots of the ordered requests, oldest first, in a ring
+	int* order;
+
+	//! \brief The position of the oldest ordered request
+	int orderHead;
+
+	//! \brief Slots of the tagged requests plus one, hashed by ID
+	int* table;
+
+	//! \brief The size of the hash table, a power of two
+	int tableSize;
+
+	//! \brief The earliest deadline the timer is set for, or 0
+	long long nextDeadline;
+
+	//! \brief Input not handled yet
+	NETBUFFER* input;
+};
+
+#endif // __RPCCLIENT_H__
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,133 @@
+/*
+ * \file shmservice.h
+ * \brief Shared memory transport between processes
+ *
+ */
+#ifndef __SHMSERVICE_H__
+#define __SHMSERVICE_H__
+
+#include <inttypes.h>
+#include "network.h"
+
+// SHMRING lives in shmservice.cc
+struct SHMRING;
+
+/*! \class SHMSERVICE
+ *  \brief Connection to another process through shared memory
+ *
+ *  A SHMSERVICE exchanges data with a SHMSERVICE in another process using a
+ *  pair of single producer, single consumer rings in shared memory, one for
+ *  each direction. It is used just like any other connection: recv(), send()
+ *  and incoming() work unchanged.
+ *
+ *  The other side is only woken up, using an eventfd, if it found the ring
+ *  empty or full and is waiting for data or room; as long as the rings keep
+ *  busy, moving data makes no system calls. Input is always buffered.
+ *
+ *  One side calls create() and the other attach(), both on either end of a
+ *  connected Unix socket, which is only used to pass the shared memory and
+ *  eventfd descriptors. This is only supported on Linux.
+ *
+ *  Closing the connection never waits for the other side; output which does
+ *  not fit in the ring by then is lost.
+ */
+class SHMSERVICE : public NETSERVICE {
+public:
+	//! \brief The constructor of the class
+	SHMSERVICE();
+
+	//! \brief The destructor of the class
+	virtual ~SHMSERVICE();
+
+	/*! \brief Sets up the rings and passes them to the other process
+	 *  \return Zero on failure or non-zero on success
+	 *  \param sock Connected Unix socket to pass the rings over
+	 *  \param size The size of each ring, rounded up to a power of two
+	 */
+	int create (int sock, int size = 262144);
+
+	/*! \brief Attaches to rings set up by create() in the other process
+	 *  \return Zero on failure or non-zero on success
+	 *  \param sock Connected Unix socket the rings are passed over
+	 */
+	int attach (int sock);
+
+	// SHMSERVICE is a client networking service
+	inline int getType () { return NETSERVICE_CLIENT; };
+
+	/*! \brief Callback handler for an event
+	 *
+	 * This will be called whenever there is data in the incoming ring. */
+	virtual void incoming() = 0;
+
+protected:
+	//! \brief Reads from the incoming ring
+	int readRaw (char* buf, int len, int flags);
+
+	//! \brief Writes to the outgoing ring
+	int writeRaw (char* buf, int len, int flags);
+
+	//! \brief Writes a number of buffers to the outgoing ring
+	int writeVector (struct iovec* iov, int n, int flags);
+
+	//! \brief Reads part of a file straight into the outgoing ring
+	int writeFile (int filefd, off_t* offset, int len);
+
+	//! \brief Our eventfd merely signals events
+	inline int usesEventFD () { return 1; };
+
+	//! \brief Resets our eventfd
+	void wakeup ();
+
+	//! \brief Returns non-zero if there is data in the incoming ring
+	int hasInput ();
+
+	/*! \brief Marks the outgoing ring as closed
+	 *
+	 *  The other side gets end of file once it has read everything.
+	 */
+	void closeRaw ();
+
+private:
+	/*! \brief Maps the rings
+	 *  \return Zero on failure or non-zero on success
+	 *  \param memfd Descriptor of the shared memory
+	 *  \param creator Non-zero if we created the rings
+	 */
+	int map (int memfd, int creator);
+
+	/*! \brief Reserves room in the outgoing ring
+	 *  \return Pointer to the room, or NULL if the ring is full or closed, with
+	 *          errno set
+	 *  \param len The number of bytes wanted, which is lowered to what fits
+	 *             without wrapping around
+	 */
+	char* reserve (int* len);
+
+	/*! \brief Makes bytes written to reserved room available to the other side
+	 *  \param len The number of bytes
+	 */
+	void commit (int len);
+
+	//! \brief Wakes the other side up
+	void notify ();
+
+	//! \brief The shared memory
+	char* mem;
+
+	//! \brief The size of the shared memory
+	int memSize;
+
+	//! \brief The ring we write to
+	struct SHMRING* tx;
+
+	//! \brief The ring we read from
+	struct SHMRING* rx;
+
+	//! \brief The eventfd of the other side
+	int peerEvent;
+};
+
+#endif // __SHMSERVICE_H__
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,100 @@
+/*
+ * \file sigservice.h
+ * \brief Signal delivery through the network loop
+ *
+ */
+#ifndef __SIGSERVICE_H__
+#define __SIGSERVICE_H__
+
+#include <signal.h>
+#include "network.h"
+
+/*! \class SIGNALHANDLER
+ *  \brief Receiver of signals
+ *
+ *  Classes which want to be told about signals derive from this class.
+ */
+class SIGNALHANDLER {
+public:
+	//! \brief The destructor of the class
+	virtual ~SIGNALHANDLER() { };
+
+	/*! \brief Called when a signal was received
+	 *  \param signo The signal number
+	 *
+	 *  This is called from within NETWORK::run(), like any other incoming()
+	 *  callback, so there are no restrictions on what it may do.
+	 */
+	virtual void handleSignal (int signo) = 0;
+};
+
+/*! \class SIGNALSERVICE
+ *  \brief Service which turns signals into events
+ *
+ *  Signals added to a SIGNALSERVICE are no longer delivered asynchronously.
+ *  Instead, NETWORK::run() wakes up for them and calls their handlers between
+ *  the other callbacks, so handlers don't race with the rest of the program.
+ *  On Linux, this uses signalfd(); elsewhere, a signal handler writes to a
+ *  pipe. Only a single SIGNALSERVICE should exist.
+ *
+ *  Signals are blocked for the calling thread only, and threads inherit the
+ *  mask of the thread starting them. All signals must therefore be added
+ *  before any other thread is started, or those threads may still have them
+ *  delivered asynchronously.
+ */
+class SIGNALSERVICE : public NETSERVICE {
+public:
+	//! \brief The constructor of the class
+	SIGNALSERVICE();
+
+	//! \brief The destructor of the class
+	~SIGNALSERVICE();
+
+	/*! \brief Handles a signal in the network loop
+	 *  \return Zero on failure or non-zero on success
+	 *  \param signo The signal number
+	 *  \param h The handler to call, or NULL to only call handleSignal()
+	 *
+	 *  This must be called before any other thread is started.
+	 */
+	int add (int signo, SIGNALHANDLER* h = NULL);
+
+	/*! \brief Restores the default behaviour of a signal
+	 *  \return Zero on failure or non-zero on success
+	 *  \param signo The signal number
+	 */
+	int remove (int signo);
+
+	// SIGNALSERVICE is not a socket
+	inline int getType () { return NETSERVICE_EVENT; };
+
+protected:
+	/*! \brief Called for every signal received
+	 *  \param signo The signal number
+	 *
+	 *  By default, this calls the handler added for the signal.
+	 */
+	virtual void handleSignal (int signo);
+
+	//! \brief Reads the pending signals and handles them
+	void incoming ();
+
+private:
+	/*! \brief Sets up the descriptor to wait on
+	 *  \return Zero on failure or non-zero on success
+	 */
+	int setup ();
+
+	//! \brief The handlers, by signal number
+	SIGNALHANDLER* handlers[NSIG];
+
+	//! \brief The signals we handle
+	sigset_t mask;
+
+	//! \brief Write end of the pipe, if signalfd() is not used
+	int pipefd;
+};
+
+#endif // __SIGSERVICE_H__
+
+/* vim:set ts=2 sw=2: */
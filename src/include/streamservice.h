@@ -0,0 +1,94 @@
+/*
+ * \file streamservice.h
+ * \brief Streaming of files at a constant rate
+ *
+ */
+#ifndef __STREAMSERVICE_H__
+#define __STREAMSERVICE_H__
+
+#include <sys/types.h>
+#include "network.h"
+
+//! \brief STREAMSERVICE_TICK is the number of milliseconds between sends
+#define STREAMSERVICE_TICK 50
+
+//! \brief STREAMSERVICE_READAHEAD is the number of seconds read ahead
+#define STREAMSERVICE_READAHEAD 4
+
+//! \brief STREAMSERVICE_MIN_BUFFER is the smallest socket buffer used
+#define STREAMSERVICE_MIN_BUFFER 16384
+
+/*! \class STREAMSERVICE
+ *  \brief Connection which streams a file at a constant rate
+ *
+ *  A STREAMSERVICE sends (part of) a file at a given number of bytes per
+ *  second, using a timer of its network to hand the socket a tick's worth at
+ *  a time. On Linux, the kernel is asked to pace the packets at the same rate
+ *  as well. The socket buffer is kept small, so a listener that falls behind
+ *  does not pile up data, and the file is read ahead a few seconds at a time.
+ *
+ *  Data goes straight from the file to the socket using sendFile(), so a
+ *  stream takes no memory beyond the service itself. The file is not closed,
+ *  and a single descriptor may be shared by any number of streams.
+ */
+class STREAMSERVICE : public SERVICECLIENT, public NETTIMER {
+public:
+	//! \brief The constructor of the class
+	STREAMSERVICE();
+
+	/*! \brief Starts streaming a file
+	 *  \return Zero on failure or non-zero on success
+	 *  \param filefd The file descriptor of the file
+	 *  \param rate The number of bytes per second
+	 *  \param offset Offset to start from
+	 *  \param len The number of bytes to send, or -1 for the rest of the file
+	 *
+	 *  The service must be part of a network, either directly or through its
+	 *  parent. Anything already streaming is stopped.
+	 */
+	int play (int filefd, int rate, off_t offset = 0, off_t len = -1);
+
+	//! \brief Stops streaming
+	void stop ();
+
+	//! \brief Returns non-zero while streaming
+	int isPlaying ();
+
+	//! \brief Returns the offset in the file of the next byte to send
+	off_t getPosition ();
+
+	/*! \brief Called once the whole file is sent
+	 *
+	 *  By default, this does nothing.
+	 */
+	virtual void finished ();
+
+	//! \brief Sends what is due, called by the timer
+	void expired ();
+
+private:
+	//! \brief The file descriptor of the file, or -1 if not streaming
+	int file;
+
+	//! \brief The offset of the next byte to send
+	off_t pos;
+
+	//! \brief The offset at which to stop
+	off_t end;
+
+	//! \brief The offset up to which the file is read ahead
+	off_t advised;
+
+	//! \brief The number of bytes per second
+	int rate;
+
+	//! \brief The number of bytes we may send, in millionths
+	long long credit;
+
+	//! \brief When credit was last earned
+	long long last;
+};
+
+#endif // __STREAMSERVICE_H__
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,195 @@
+/*
+ * \file tls.h
+ * \brief TLS support
+ *
+ */
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#ifdef NET_TLS
+
+#include <openssl/ssl.h>
+#include "network.h"
+
+//! \brief TLSCONTEXT_SESSIONS is the number of servers a client context keeps a session for
+#define TLSCONTEXT_SESSIONS 64
+
+// TLSCACHED lives in tls.cc
+struct TLSCACHED;
+
+/*! \class TLSCONTEXT
+ *  \brief Shared TLS configuration
+ *
+ *  A TLSCONTEXT holds the certificates and settings used by a number of TLS
+ *  connections. A server context keeps a session cache, so returning clients
+ *  can skip the full handshake; a client context remembers the last session
+ *  it got from each server, and offers it on the next connection to the same
+ *  server.
+ */
+class TLSCONTEXT {
+public:
+	//! \brief Constructs an uninitialized context
+	TLSCONTEXT();
+
+	//! \brief Destroys the context
+	~TLSCONTEXT();
+
+	/*! \brief Initializes the context for use by a server
+	 *  \return Zero on failure or non-zero on success
+	 *  \param cert File containing the PEM encoded certificate chain
+	 *  \param key File containing the PEM encoded private key
+	 */
+	int createServer (char* cert, char* key);
+
+	/*! \brief Initializes the context for use by a client
+	 *  \return Zero on failure or non-zero on success
+	 *  \param ca File containing the PEM encoded certificates to trust, or NULL
+	 *            to skip verification of the server
+	 *
+	 *  If the server is verified, connections must name the server they expect
+	 *  to NETSERVICE::startTLS(); its certificate must be issued to that name.
+	 */
+	int createClient (char* ca);
+
+	//! \brief Returns non-zero if servers are verified
+	int isVerifying ();
+
+	/*! \brief Enables or disables kernel TLS offload
+	 *  \param on Non-zero to hand encryption over to the kernel when possible
+	 *
+	 *  This is enabled by default. It only has an effect if both OpenSSL and the
+	 *  kernel support it; otherwise, encryption is done by OpenSSL.
+	 */
+	void setKernelTLS (int on);
+
+	//! \brief Returns the OpenSSL context
+	SSL_CTX* getContext ();
+
+	/*! \brief Returns the session to offer when connecting, if any
+	 *  \param host The name of the server, or NULL if it has none
+	 */
+	SSL_SESSION* getSession (char* host);
+
+	/*! \brief Stores the session to offer when connecting
+	 *  \param host The name of the server, or NULL if it has none
+	 *  \param s The session, or NULL to forget it
+	 */
+	void setSession (char* host, SSL_SESSION* s);
+
+private:
+	/*! \brief Applies the settings shared by clients and servers
+	 *  \return Zero on failure or non-zero on success
+	 */
+	int setup ();
+
+	//! \brief The OpenSSL context
+	SSL_CTX* ctx;
+
+	//! \brief The last client session of each server
+	struct TLSCACHED* sessions;
+
+	//! \brief The entry of [sessions] to be replaced next
+	int nextSession;
+
+	//! \brief Non-zero if kernel TLS should be used
+	int ktls;
+};
+
+/*! \class TLSSESSION
+ *  \brief TLS state of a single connection
+ *
+ *  This is used by NETSERVICE; applications should not need it.
+ */
+class TLSSESSION {
+public:
+	/*! \brief Sets up TLS on a connection
+	 *  \param c The context to use
+	 *  \param fd The file descriptor of the connection
+	 *  \param server Non-zero to act as server, zero to act as client
+	 *  \param host The name or address of the server, if we are the client
+	 */
+	TLSSESSION(TLSCONTEXT* c, int fd, int server, char* host = NULL);
+
+	//! \brief Destroys the TLS state
+	~TLSSESSION();
+
+	//! \brief Returns non-zero if the session could be set up
+	int isValid ();
+
+	/*! \brief Continues the handshake
+	 *  \return 1 if the handshake is done, 0 if it failed or -1 if it must be
+	 *          continued once the socket is ready
+	 */
+	int handshake ();
+
+	//! \brief Returns non-zero once the handshake is done
+	int isEstablished ();
+
+	//! \brief Returns non-zero if the handshake waits for the socket to be writable
+	int wantsWrite ();
+
+	/*! \brief Returns non-zero if the kernel encrypts outgoing data
+	 *
+	 *  In that case, data may be written to the socket directly, and sendfile()
+	 *  works as usual.
+	 */
+	int isKernelSend ();
+
+	/*! \brief Reads decrypted data
+	 *  \return Like recv(): the number of bytes read, zero on end of file or -1
+	 *          with errno set on failure
+	 *  \param buf Buffer to store the data in
+	 *  \param len Size of the buffer
+	 */
+	int read (char* buf, int len);
+
+	/*! \brief Writes data to be encrypted
+	 *  \return Like send(): the number of bytes written or -1 with errno set
+	 *  \param buf Buffer holding the data
+	 *  \param len Size of the buffer
+	 */
+	int write (char* buf, int len);
+
+	//! \brief Returns the number of decrypted bytes available without reading
+	int pending ();
+
+	//! \brief Returns non-zero if the session was resumed
+	int isResumed ();
+
+	//! \brief Sends a close notification, without waiting for the peer
+	void shutdown ();
+
+private:
+	/*! \brief Translates an OpenSSL result to recv()/send() conventions
+	 *  \return The value to return
+	 *  \param ret The OpenSSL return value
+	 */
+	int result (int ret);
+
+	//! \brief The context used
+	TLSCONTEXT* ctx;
+
+	//! \brief The OpenSSL connection
+	SSL* ssl;
+
+	//! \brief Non-zero if we are the server
+	int server;
+
+	//! \brief Non-zero once the handshake is done
+	int established;
+
+	//! \brief Non-zero if the handshake waits for writability
+	int wantWrite;
+
+	//! \brief Non-zero if the kernel encrypts outgoing data
+	int kernelSend;
+
+	//! \brief The name or address of the server, if we are the client
+	char* host;
+};
+
+#endif // NET_TLS
+
+#endif // __TLS_H__
+
+/* vim:set ts=2 sw=2: */
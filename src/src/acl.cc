@@ -0,0 +1,203 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file acl.cc
+ * \brief Address based access control, implements the ACL class
+ *
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <network.h>
+#include <acl.h>
+
+//! \brief ACL_NONE marks a trie node without a rule of its own
+#define ACL_NONE (-1)
+
+/*
+ * ACLNODE is a single node in the trie. Children are referenced by index, so
+ * the entire trie lives in a single block of memory.
+ */
+struct ACLNODE {
+	int child[2];
+	int action;
+};
+
+/*
+ * ACL::ACL()
+ *
+ * This is the constructor.
+ *
+ */
+ACL::ACL() {
+	// start out with just the root node. if there's no memory for it, add()
+	// tries again
+	maxNodes = 64; numNodes = 0; defaultAction = ACL_ALLOW;
+	nodes = (struct ACLNODE*)malloc (maxNodes * sizeof (struct ACLNODE));
+	if (nodes == NULL)
+		maxNodes = 0;
+	newNode();
+}
+
+/*
+ * ACL::~ACL()
+ *
+ * This is the destructor.
+ *
+ */
+ACL::~ACL() {
+	free (nodes);
+}
+
+/*
+ * ACL::newNode()
+ *
+ * This will allocate an empty node and return its index, or -1 if we are out
+ * of memory.
+ *
+ */
+int
+ACL::newNode() {
+	struct ACLNODE* n;
+
+	// do we have to grow the pool ?
+	if (numNodes >= maxNodes) {
+		// yes. double it
+		n = (struct ACLNODE*)realloc (nodes, (maxNodes ? maxNodes * 2 : 64) * sizeof (struct ACLNODE));
+		if (n == NULL)
+			return -1;
+		nodes = n; maxNodes = maxNodes ? maxNodes * 2 : 64;
+	}
+
+	// initialize the node
+	n = &nodes[numNodes];
+	n->child[0] = -1; n->child[1] = -1; n->action = ACL_NONE;
+	return numNodes++;
+}
+
+/*
+ * ACL::add (char* cidr, int action)
+ *
+ * This will add network [cidr] with [action] to the list. It will return zero
+ * on failure or non-zero on success.
+ *
+ */
+int
+ACL::add (char* cidr, int action) {
+	IPV4KEY key;
+	int prefix;
+
+	// parse the network
+	if (!key.parseCIDR (cidr, &prefix))
+		return 0;
+
+	return add (key, prefix, action);
+}
+
+/*
+ * ACL::add (IPV4KEY key, int prefix, int action)
+ *
+ * This will add the network [key]/[prefix] with [action] to the list. It will
+ * return zero on failure or non-zero on success.
+ *
+ */
+int
+ACL::add (IPV4KEY key, int prefix, int action) {
+	uint32_t value = key.getValue();
+	int node = 0, next, bit;
+
+	// sensible values ?
+	if (prefix < 0 || prefix > 32 || (action != ACL_ALLOW && action != ACL_DENY))
+		// no. complain
+		return 0;
+
+	// do we have a root ?
+	if (numNodes == 0 && newNode() == -1)
+		// no, and no memory for one either
+		return 0;
+
+	// walk down the trie, creating nodes as we go
+	for (int i = 0; i < prefix; i++) {
+		bit = (value >> (31 - i)) & 1;
+		next = nodes[node].child[bit];
+		if (next == -1) {
+			// no such node yet. create it. note that this may move the pool
+			next = newNode();
+			if (next == -1)
+				return 0;
+			nodes[node].child[bit] = next;
+		}
+		node = next;
+	}
+
+	// the final node holds the rule
+	nodes[node].action = action;
+	return 1;
+}
+
+/*
+ * ACL::setDefault (int action)
+ *
+ * This will set the action for addresses without a matching rule to [action].
+ *
+ */
+void
+ACL::setDefault (int action) {
+	defaultAction = action;
+}
+
+/*
+ * ACL::clear()
+ *
+ * This will remove all rules.
+ *
+ */
+void
+ACL::clear() {
+	// just drop everything but a fresh root
+	numNodes = 0;
+	newNode();
+}
+
+/*
+ * ACL::check (IPV4KEY key)
+ *
+ * This will look up [key] and return ACL_ALLOW or ACL_DENY. The rule with the
+ * longest matching prefix is used.
+ *
+ */
+int
+ACL::check (IPV4KEY key) {
+	uint32_t value = key.getValue();
+	int action = defaultAction;
+	int node = (numNodes > 0) ? 0 : -1;
+
+	// walk down the trie as long as it matches, remembering the last rule seen
+	for (int i = 0; node != -1; i++) {
+		if (nodes[node].action != ACL_NONE)
+			action = nodes[node].action;
+		if (i == 32)
+			break;
+		node = nodes[node].child[(value >> (31 - i)) & 1];
+	}
+
+	return action;
+}
+
+/* vim:set ts=2 sw=2: */
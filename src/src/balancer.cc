@@ -0,0 +1,324 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file balancer.cc
+ * \brief Spreading of requests over a number of servers, implements the
+ *        NETBALANCER class
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <network.h>
+#include <netpool.h>
+#include <balancer.h>
+
+/*
+ * NETBACKEND is a server. [latency] is only meaningful once [samples] is
+ * set. [ejectedUntil] is the time it may be used again, and [backoff] the
+ * factor its next ejection lasts longer by.
+ */
+struct NETBACKEND {
+	IPV4ADDRESS  addr;
+	int          inFlight;
+	long long    latency;
+	int          samples;
+	int          failures;
+	long long    ejectedUntil;
+	int          backoff;
+};
+
+/*
+ * NETBALANCER::NETBALANCER (int m)
+ *
+ * This is the constructor. Servers will be compared according to [m].
+ *
+ */
+NETBALANCER::NETBALANCER (int m) {
+	mode = m; backends = NULL; numBackends = 0;
+	maxFailures = NETBALANCER_FAILURES; ejectTime = NETBALANCER_EJECT;
+
+	// every balancer gets its own sequence, so they don't all pick alike
+	seed = (unsigned int)NETWORK::getTime() ^ (unsigned int)(uintptr_t)this;
+	if (seed == 0)
+		seed = 1;
+}
+
+/*
+ * NETBALANCER::~NETBALANCER()
+ *
+ * This is the destructor.
+ *
+ */
+NETBALANCER::~NETBALANCER() {
+	for (int i = 0; i < numBackends; i++)
+		delete backends[i];
+	if (backends != NULL)
+		free (backends);
+}
+
+/*
+ * NETBALANCER::add (IPV4ADDRESS* addr)
+ *
+ * This will add the server at [addr]. It will return the number of the
+ * server, or -1 on failure.
+ *
+ */
+int
+NETBALANCER::add (IPV4ADDRESS* addr) {
+	NETBACKEND** n;
+	NETBACKEND* b;
+
+	n = (NETBACKEND**)realloc (backends, (numBackends + 1) * sizeof (NETBACKEND*));
+	if (n == NULL)
+		return -1;
+	backends = n;
+
+	b = new NETBACKEND;
+	memcpy (b->addr.getInternalAddress(), addr->getInternalAddress(), sizeof (struct sockaddr_in));
+	b->inFlight = 0; b->latency = 0; b->samples = 0;
+	b->failures = 0; b->ejectedUntil = 0; b->backoff = 1;
+	backends[numBackends] = b;
+	return numBackends++;
+}
+
+/*
+ * NETBALANCER::getCount()
+ *
+ * This will return the number of servers.
+ *
+ */
+int
+NETBALANCER::getCount() {
+	return numBackends;
+}
+
+/*
+ * NETBALANCER::getAddress (int i)
+ *
+ * This will return the address of server [i], or NULL if there is no such
+ * server.
+ *
+ */
+IPV4ADDRESS*
+NETBALANCER::getAddress (int i) {
+	return (i >= 0 && i < numBackends) ? &backends[i]->addr : NULL;
+}
+
+/*
+ * NETBALANCER::setEjection (int failures, int msec)
+ *
+ * This will eject servers which fail [failures] requests in a row, for
+ * [msec] milliseconds. If [failures] is zero, servers are never ejected.
+ *
+ */
+void
+NETBALANCER::setEjection (int failures, int msec) {
+	maxFailures = failures; ejectTime = msec;
+}
+
+/*
+ * NETBALANCER::random()
+ *
+ * This will return a random number. It need not be a good one, just cheap.
+ *
+ */
+unsigned int
+NETBALANCER::random() {
+	seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+	return seed;
+}
+
+/*
+ * NETBALANCER::cost (NETBACKEND* b, NETBACKEND* other)
+ *
+ * This will return the cost of sending a request to server [b], to be
+ * compared to that of server [other].
+ *
+ */
+double
+NETBALANCER::cost (struct NETBACKEND* b, struct NETBACKEND* other) {
+	// if we don't know how fast either of them is, go by the load alone
+	if (mode == NETBALANCER_LEAST_LOADED || !b->samples || !other->samples)
+		return (double)b->inFlight;
+
+	// every request in flight will be waited for
+	return (double)(b->latency + 1) * (double)(b->inFlight + 1);
+}
+
+/*
+ * NETBALANCER::pick()
+ *
+ * This will pick the server to send a request to. It will return the number
+ * of the server, or -1 if there are none.
+ *
+ */
+int
+NETBALANCER::pick() {
+	long long t = NETWORK::getTime();
+	int avail = 0, panic = 0;
+	int first = 0, second = 0;
+	int a, b, i, n;
+
+	if (numBackends == 0)
+		return -1;
+
+	// how many can we use ?
+	for (i = 0; i < numBackends; i++)
+		if (backends[i]->ejectedUntil <= t)
+			avail++;
+	if (avail == 0) {
+		// none. better to try them all than to fail for sure
+		avail = numBackends; panic = 1;
+	}
+
+	// choose two of them at random
+	a = random() % avail; b = a;
+	if (avail > 1) {
+		b = random() % (avail - 1);
+		if (b >= a)
+			b++;
+	}
+	for (i = 0, n = 0; i < numBackends; i++) {
+		if (!panic && backends[i]->ejectedUntil > t)
+			continue;
+		if (n == a)
+			first = i;
+		if (n == b)
+			second = i;
+		n++;
+	}
+
+	// and take the cheaper one
+	if (cost (backends[second], backends[first]) < cost (backends[first], backends[second]))
+		first = second;
+	backends[first]->inFlight++;
+	return first;
+}
+
+/*
+ * NETBALANCER::get (NETPOOL* pool, int* backend)
+ *
+ * This will pick a server and obtain a connection to it from [pool]. The
+ * number of the server is stored in [backend]. It will return the
+ * connection, or NULL if no server could be reached.
+ *
+ */
+POOLCLIENT*
+NETBALANCER::get (NETPOOL* pool, int* backend) {
+	POOLCLIENT* c;
+	int i;
+
+	for (int tries = 0; tries < numBackends; tries++) {
+		i = pick();
+		if (i < 0)
+			break;
+		c = pool->get (&backends[i]->addr);
+		if (c != NULL) {
+			*backend = i;
+			return c;
+		}
+
+		// it is not the fault of the server if the pool has no room for it
+		if (errno == EAGAIN)
+			backends[i]->inFlight--;
+		else
+			done (i, 0, 0);
+	}
+	return NULL;
+}
+
+/*
+ * NETBALANCER::done (int i, int ok, long long usec)
+ *
+ * This will note that a request to server [i] took [usec] microseconds, and
+ * succeeded if [ok] is non-zero.
+ *
+ */
+void
+NETBALANCER::done (int i, int ok, long long usec) {
+	NETBACKEND* b;
+
+	if (i < 0 || i >= numBackends)
+		return;
+	b = backends[i];
+	if (b->inFlight > 0)
+		b->inFlight--;
+
+	if (ok) {
+		// follow a slowdown at once, but a speedup only gradually
+		if (!b->samples || usec > b->latency)
+			b->latency = usec;
+		else
+			b->latency += (usec - b->latency) / 8;
+		b->samples = 1;
+		b->failures = 0; b->backoff = 1;
+		return;
+	}
+
+	// did it fail too often ?
+	if (maxFailures <= 0 || ++b->failures < maxFailures)
+		// no. give it another chance
+		return;
+
+	// yes. leave it alone for a while. when it comes back, a single failure is
+	// enough to eject it again, for longer
+	b->ejectedUntil = NETWORK::getTime() + (long long)ejectTime * 1000 * b->backoff;
+	if (b->backoff < NETBALANCER_MAX_BACKOFF)
+		b->backoff *= 2;
+	b->failures = maxFailures - 1;
+}
+
+/*
+ * NETBALANCER::getInFlight (int i)
+ *
+ * This will return the number of requests in flight to server [i].
+ *
+ */
+int
+NETBALANCER::getInFlight (int i) {
+	return (i >= 0 && i < numBackends) ? backends[i]->inFlight : 0;
+}
+
+/*
+ * NETBALANCER::getLatency (int i)
+ *
+ * This will return the latency average of server [i], in microseconds.
+ *
+ */
+long long
+NETBALANCER::getLatency (int i) {
+	return (i >= 0 && i < numBackends) ? backends[i]->latency : 0;
+}
+
+/*
+ * NETBALANCER::isEjected (int i)
+ *
+ * This will return non-zero if server [i] is ejected.
+ *
+ */
+int
+NETBALANCER::isEjected (int i) {
+	return (i >= 0 && i < numBackends && backends[i]->ejectedUntil > NETWORK::getTime()) ? 1 : 0;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,551 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file buffer.cc
+ * \brief Byte buffers, implements the NETBUFFER, NETBLOCK and NETQUEUE classes
+ *
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <buffer.h>
+
+//! \brief NETQUEUE_BLOCKSIZE is the minimum size of a private queue block
+#define NETQUEUE_BLOCKSIZE 4096
+
+/*
+ * NETQUEUEENTRY is a single queue entry. [priv] is non-zero if the block is
+ * owned by the queue, in which case more data may be appended to it.
+ */
+struct NETQUEUEENTRY {
+	NETBLOCK* block;
+	int       offset;
+	int       priv;
+};
+
+/*
+ * netbuffer_scan (char* p, int len, char c, int* found, int max)
+ *
+ * This will look for bytes [c] in the [len] bytes at [p], and store the
+ * offsets of up to [max] of them in [found]. It will return the number of
+ * offsets stored; if that is less than [max], all bytes were looked at.
+ *
+ */
+static int
+netbuffer_scan (char* p, int len, char c, int* found, int max) {
+	unsigned int mask;
+	int i = 0, n = 0;
+
+	// compare a vector at a time, and pick all matches out of the mask
+	#if defined(__AVX2__)
+	__m256i wide = _mm256_set1_epi8 (c);
+	for (; i + 32 <= len; i += 32) {
+		mask = (unsigned int)_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((__m256i*)(p + i)), wide));
+		while (mask != 0) {
+			found[n++] = i + __builtin_ctz (mask);
+			if (n == max)
+				return n;
+			mask &= mask - 1;
+		}
+	}
+	#endif // __AVX2__
+	#if defined(__SSE2__)
+	__m128i narrow = _mm_set1_epi8 (c);
+	for (; i + 16 <= len; i += 16) {
+		mask = (unsigned int)_mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((__m128i*)(p + i)), narrow));
+		while (mask != 0) {
+			found[n++] = i + __builtin_ctz (mask);
+			if (n == max)
+				return n;
+			mask &= mask - 1;
+		}
+	}
+	#endif // __SSE2__
+
+	// whatever is left, or everything without vectors, a byte at a time
+	for (; i < len; i++) {
+		if (p[i] != c)
+			continue;
+		found[n++] = i;
+		if (n == max)
+			return n;
+	}
+	return n;
+}
+
+/*
+ * NETBUFFER::NETBUFFER()
+ *
+ * This will construct an empty buffer. No memory is allocated until data is
+ * appended.
+ *
+ */
+NETBUFFER::NETBUFFER() {
+	data = NULL; size = 0; start = 0; end = 0; scanned = 0;
+}
+
+/*
+ * NETBUFFER::~NETBUFFER()
+ *
+ * This is the destructor.
+ *
+ */
+NETBUFFER::~NETBUFFER() {
+	if (data)
+		free (data);
+}
+
+/*
+ * NETBUFFER::reserve (int len)
+ *
+ * This will ensure there are [len] bytes of free space at the end of the
+ * buffer. It will return a pointer to the space, or NULL if we are out of
+ * memory.
+ *
+ */
+char*
+NETBUFFER::reserve (int len) {
+	int newsize;
+	char* p;
+
+	// is there enough space at the end ?
+	if (end + len <= size)
+		// yes. use it
+		return data + end;
+
+	// would moving the data to the front be enough ?
+	if (start > 0 && (end - start) + len <= size) {
+		// yes. do so
+		memmove (data, data + start, end - start);
+		end -= start; start = 0;
+		return data + end;
+	}
+
+	// no. we have to grow the buffer
+	newsize = (size == 0) ? 256 : size;
+	while (newsize < (end - start) + len)
+		newsize *= 2;
+	p = (char*)malloc (newsize);
+	if (p == NULL)
+		return NULL;
+	if (data) {
+		memcpy (p, data + start, end - start);
+		free (data);
+	}
+	data = p; size = newsize; end -= start; start = 0;
+	return data + end;
+}
+
+/*
+ * NETBUFFER::commit (int len)
+ *
+ * This will add [len] bytes written to the space returned by reserve() to
+ * the buffer.
+ *
+ */
+void
+NETBUFFER::commit (int len) {
+	end += len;
+}
+
+/*
+ * NETBUFFER::append (char* buf, int len)
+ *
+ * This will append [len] bytes from [buf] to the buffer. It will return zero
+ * on failure or non-zero on success.
+ *
+ */
+int
+NETBUFFER::append (char* buf, int len) {
+	char* p = reserve (len);
+
+	if (p == NULL)
+		return 0;
+	memcpy (p, buf, len);
+	commit (len);
+	return 1;
+}
+
+/*
+ * NETBUFFER::read (char* buf, int len)
+ *
+ * This will copy up to [len] bytes to [buf] and remove them from the buffer.
+ * It will return the number of bytes copied.
+ *
+ */
+int
+NETBUFFER::read (char* buf, int len) {
+	if (len > end - start)
+		len = end - start;
+	memcpy (buf, data + start, len);
+	consume (len);
+	return len;
+}
+
+/*
+ * NETBUFFER::consume (int len)
+ *
+ * This will remove [len] bytes from the front of the buffer.
+ *
+ */
+void
+NETBUFFER::consume (int len) {
+	start += len;
+	scanned = (scanned > len) ? scanned - len : 0;
+
+	// if we are empty, start over at the front
+	if (start >= end)
+		start = end = scanned = 0;
+}
+
+/*
+ * NETBUFFER::clear()
+ *
+ * This will remove all data from the buffer.
+ *
+ */
+void
+NETBUFFER::clear() {
+	start = end = scanned = 0;
+}
+
+/*
+ * NETBUFFER::getLines (NETLINE* lines, int max, char delim)
+ *
+ * This will store up to [max] complete lines, ended by [delim], in [lines]
+ * and remove them from the buffer. It will return the number of lines
+ * stored.
+ *
+ */
+int
+NETBUFFER::getLines (struct NETLINE* lines, int max, char delim) {
+	int found[NETBUFFER_SCAN_BATCH];
+	char* p = data + start;
+	int len = end - start;
+	int pos = 0, n = 0, k, want, e;
+
+	// pick up where we left off; the partial line up to there has no delimiter
+	while (n < max) {
+		want = (max - n < NETBUFFER_SCAN_BATCH) ? max - n : NETBUFFER_SCAN_BATCH;
+		k = netbuffer_scan (p + scanned, len - scanned, delim, found, want);
+		for (int i = 0; i < k; i++) {
+			e = scanned + found[i];
+			lines[n].data = p + pos; lines[n].len = e - pos;
+			if (delim == '\n' && e > pos && p[e - 1] == '\r')
+				lines[n].len--;
+			n++; pos = e + 1;
+		}
+
+		// did we look at everything ?
+		if (k < want) {
+			// yes. none of it needs to be looked at again
+			scanned = len;
+			break;
+		}
+		scanned = pos;
+	}
+
+	// the lines stay where they are until more data is added
+	consume (pos);
+	return n;
+}
+
+/*
+ * NETBLOCK::create (int size)
+ *
+ * This will allocate an empty block which can hold [size] bytes. It will
+ * return the block, or NULL if we are out of memory.
+ *
+ */
+NETBLOCK*
+NETBLOCK::create (int size) {
+	void* p = malloc (sizeof (NETBLOCK) + size);
+	NETBLOCK* b;
+
+	if (p == NULL)
+		return NULL;
+
+	// the data directly follows the header
+	b = new (p) NETBLOCK();
+	b->refs = 1; b->length = 0; b->size = size;
+	b->data = (char*)p + sizeof (NETBLOCK);
+	return b;
+}
+
+/*
+ * NETBLOCK::create (char* buf, int len)
+ *
+ * This will allocate a block holding a copy of the [len] bytes at [buf]. It
+ * will return the block, or NULL if we are out of memory.
+ *
+ */
+NETBLOCK*
+NETBLOCK::create (char* buf, int len) {
+	NETBLOCK* b = create (len);
+
+	if (b != NULL)
+		b->append (buf, len);
+	return b;
+}
+
+/*
+ * NETBLOCK::unref()
+ *
+ * This will drop a reference to the block. The block is freed once the last
+ * reference is gone.
+ *
+ */
+void
+NETBLOCK::unref() {
+	// the last one out must see everything the others did to the block
+	if (__atomic_sub_fetch (&refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		this->~NETBLOCK();
+		free (this);
+	}
+}
+
+/*
+ * NETBLOCK::append (char* buf, int len)
+ *
+ * This will append up to [len] bytes from [buf] to the block. It will return
+ * the number of bytes appended.
+ *
+ */
+int
+NETBLOCK::append (char* buf, int len) {
+	if (len > size - length)
+		len = size - length;
+	memcpy (data + length, buf, len);
+	length += len;
+	return len;
+}
+
+/*
+ * NETQUEUE::NETQUEUE()
+ *
+ * This will construct an empty queue.
+ *
+ */
+NETQUEUE::NETQUEUE() {
+	entries = NULL; first = 0; count = 0; max = 0; length = 0;
+}
+
+/*
+ * NETQUEUE::~NETQUEUE()
+ *
+ * This is the destructor.
+ *
+ */
+NETQUEUE::~NETQUEUE() {
+	clear();
+	if (entries)
+		free (entries);
+}
+
+/*
+ * NETQUEUE::grow()
+ *
+ * This will make sure there is room for another entry. It will return zero
+ * on failure or non-zero on success.
+ *
+ */
+int
+NETQUEUE::grow() {
+	struct NETQUEUEENTRY* e;
+	int newmax;
+
+	// still room left ?
+	if (count < max)
+		// yes. nothing to do
+		return 1;
+
+	// double the ring, and straighten it out while we are at it
+	newmax = (max == 0) ? 8 : max * 2;
+	e = (struct NETQUEUEENTRY*)malloc (newmax * sizeof (struct NETQUEUEENTRY));
+	if (e == NULL)
+		return 0;
+	for (int i = 0; i < count; i++)
+		e[i] = entries[(first + i) % max];
+	if (entries)
+		free (entries);
+	entries = e; max = newmax; first = 0;
+	return 1;
+}
+
+/*
+ * NETQUEUE::append (char* buf, int len)
+ *
+ * This will append a copy of the [len] bytes at [buf] to the queue. It will
+ * return zero on failure or non-zero on success.
+ *
+ */
+int
+NETQUEUE::append (char* buf, int len) {
+	struct NETQUEUEENTRY* e;
+	NETBLOCK* b;
+	int i;
+
+	// if the last block is ours, fill it up first
+	if (count > 0) {
+		e = &entries[(first + count - 1) % max];
+		if (e->priv) {
+			i = e->block->append (buf, len);
+			buf += i; len -= i; length += i;
+		}
+	}
+
+	// anything left ?
+	if (len == 0)
+		// no. we're done
+		return 1;
+
+	// put the rest in a fresh block, with some room to spare
+	if (!grow())
+		return 0;
+	b = NETBLOCK::create ((len > NETQUEUE_BLOCKSIZE) ? len : NETQUEUE_BLOCKSIZE);
+	if (b == NULL)
+		return 0;
+	b->append (buf, len);
+	e = &entries[(first + count) % max];
+	e->block = b; e->offset = 0; e->priv = 1;
+	count++; length += len;
+	return 1;
+}
+
+/*
+ * NETQUEUE::append (NETBLOCK* b, int offset)
+ *
+ * This will append shared block [b] from [offset] onwards to the queue. It
+ * will return zero on failure or non-zero on success.
+ *
+ */
+int
+NETQUEUE::append (NETBLOCK* b, int offset) {
+	struct NETQUEUEENTRY* e;
+
+	// anything to queue ?
+	if (offset >= b->getLength())
+		// no. we're done
+		return 1;
+
+	if (!grow())
+		return 0;
+	b->ref();
+	e = &entries[(first + count) % max];
+	e->block = b; e->offset = offset; e->priv = 0;
+	count++; length += b->getLength() - offset;
+	return 1;
+}
+
+/*
+ * NETQUEUE::getData()
+ *
+ * This will return a pointer to the first queued byte.
+ *
+ */
+char*
+NETQUEUE::getData() {
+	if (count == 0)
+		return NULL;
+	return entries[first].block->getData() + entries[first].offset;
+}
+
+/*
+ * NETQUEUE::getChunkLength()
+ *
+ * This will return the number of bytes which are stored contiguously from
+ * getData() onwards.
+ *
+ */
+int
+NETQUEUE::getChunkLength() {
+	if (count == 0)
+		return 0;
+	return entries[first].block->getLength() - entries[first].offset;
+}
+
+/*
+ * NETQUEUE::getVector (struct iovec* iov, int n)
+ *
+ * This will describe up to [n] chunks of queued data in [iov]. It will
+ * return the number of entries filled.
+ *
+ */
+int
+NETQUEUE::getVector (struct iovec* iov, int n) {
+	struct NETQUEUEENTRY* e;
+	int i;
+
+	for (i = 0; i < n && i < count; i++) {
+		e = &entries[(first + i) % max];
+		iov[i].iov_base = e->block->getData() + e->offset;
+		iov[i].iov_len = e->block->getLength() - e->offset;
+	}
+	return i;
+}
+
+/*
+ * NETQUEUE::consume (int len)
+ *
+ * This will remove [len] bytes from the front of the queue.
+ *
+ */
+void
+NETQUEUE::consume (int len) {
+	struct NETQUEUEENTRY* e;
+	int i;
+
+	while (len > 0 && count > 0) {
+		e = &entries[first];
+		i = e->block->getLength() - e->offset;
+		if (len < i) {
+			// only part of this entry goes
+			e->offset += len; length -= len;
+			return;
+		}
+
+		// the entire entry goes
+		e->block->unref();
+		first = (first + 1) % max; count--;
+		len -= i; length -= i;
+	}
+}
+
+/*
+ * NETQUEUE::clear()
+ *
+ * This will remove all data from the queue.
+ *
+ */
+void
+NETQUEUE::clear() {
+	while (count > 0) {
+		entries[first].block->unref();
+		first = (first + 1) % max; count--;
+	}
+	first = 0; length = 0;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,743 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file fileio.cc
+ * \brief Asynchronous file I/O, implements the FILEIO class
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef NET_THREADS
+#include <pthread.h>
+#endif // NET_THREADS
+#ifdef OS_LINUX
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define FILEIO_HAVE_URING
+#endif
+#endif
+#endif // OS_LINUX
+#include <network.h>
+#include <fileio.h>
+
+/* FILEIO_OP_xxx identify what a request does */
+#define FILEIO_OP_READ  0
+#define FILEIO_OP_WRITE 1
+
+/*
+ * FILEREQUEST is a single read or write. [next] links it into whatever list
+ * it is on: the spare requests, the queue of the thread pool or the requests
+ * which are done.
+ */
+struct FILEREQUEST {
+	int           op;
+	int           filefd;
+	char*         buf;
+	int           len;
+	off_t         offset;
+	FILEHANDLER*  handler;
+	void*         arg;
+	int           result;
+	struct iovec  iov;
+	FILEREQUEST*  next;
+};
+
+#ifdef FILEIO_HAVE_URING
+/*
+ * FILEURING is an io_uring: the submission and completion rings shared with
+ * the kernel, and pointers to their fields. [queued] is the number of
+ * submissions the kernel has not taken yet.
+ */
+struct FILEURING {
+	int                   fd;
+	char*                 sq;
+	size_t                sqSize;
+	char*                 cq;
+	size_t                cqSize;
+	struct io_uring_sqe*  sqes;
+	size_t                sqesSize;
+	unsigned*             sqHead;
+	unsigned*             sqTail;
+	unsigned*             sqMask;
+	unsigned*             sqArray;
+	unsigned              sqEntries;
+	unsigned*             cqHead;
+	unsigned*             cqTail;
+	unsigned*             cqMask;
+	struct io_uring_cqe*  cqes;
+	int                   queued;
+};
+#endif // FILEIO_HAVE_URING
+
+#ifdef NET_THREADS
+/*
+ * FILEPOOL is a pool of threads performing requests. [todo] is the queue of
+ * requests, oldest first, and [done] the requests performed, newest first.
+ * Both are protected by [lock].
+ */
+struct FILEPOOL {
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+	pthread_t*       threads;
+	int              numThreads;
+	FILEREQUEST*     todo;
+	FILEREQUEST*     todoTail;
+	FILEREQUEST*     done;
+	int              stop;
+	int              wakefd;
+};
+#endif // NET_THREADS
+
+/*
+ * fileio_wake (int wakefd)
+ *
+ * This will wake up the loop waiting for [wakefd].
+ *
+ */
+static void
+fileio_wake (int wakefd) {
+	#ifdef OS_LINUX
+	uint64_t one = 1;
+	#else
+	char one = 0;
+	#endif // OS_LINUX
+
+	while (::write (wakefd, &one, sizeof (one)) < 0 && errno == EINTR);
+}
+
+/*
+ * fileio_perform (FILEREQUEST* r)
+ *
+ * This will perform request [r] right away.
+ *
+ */
+static void
+fileio_perform (FILEREQUEST* r) {
+	do {
+		if (r->op == FILEIO_OP_READ)
+			r->result = pread (r->filefd, r->buf, r->len, r->offset);
+		else
+			r->result = pwrite (r->filefd, r->buf, r->len, r->offset);
+	} while (r->result < 0 && errno == EINTR);
+	if (r->result < 0)
+		r->result = -errno;
+}
+
+#ifdef NET_THREADS
+/*
+ * fileio_worker (void* arg)
+ *
+ * This is a thread of the pool [arg]. It performs requests until told to
+ * stop.
+ *
+ */
+static void*
+fileio_worker (void* arg) {
+	FILEPOOL* p = (FILEPOOL*)arg;
+	FILEREQUEST* r;
+
+	pthread_mutex_lock (&p->lock);
+	while (1) {
+		// wait for something to do
+		while (p->todo == NULL && !p->stop)
+			pthread_cond_wait (&p->cond, &p->lock);
+		if (p->stop)
+			break;
+		r = p->todo; p->todo = r->next;
+		if (p->todo == NULL)
+			p->todoTail = NULL;
+		pthread_mutex_unlock (&p->lock);
+
+		fileio_perform (r);
+
+		// hand it back. the loop only needs waking if it had nothing yet
+		pthread_mutex_lock (&p->lock);
+		r->next = p->done; p->done = r;
+		if (r->next == NULL)
+			fileio_wake (p->wakefd);
+	}
+	pthread_mutex_unlock (&p->lock);
+	return NULL;
+}
+#endif // NET_THREADS
+
+/*
+ * FILEIO::FILEIO()
+ *
+ * This is the constructor.
+ *
+ */
+FILEIO::FILEIO() {
+	method = FILEIO_NONE; wakefd = -1; depth = 0; pending = 0;
+	done = NULL; spare = NULL; ring = NULL; pool = NULL;
+}
+
+/*
+ * FILEIO::~FILEIO()
+ *
+ * This is the destructor. Requests in progress are waited for, but their
+ * handlers are not called.
+ *
+ */
+FILEIO::~FILEIO() {
+	FILEREQUEST* r;
+
+	#ifdef FILEIO_HAVE_URING
+	if (ring != NULL) {
+		// requests the kernel refused are done with already
+		while ((r = done) != NULL) {
+			done = r->next; free (r); pending--;
+		}
+
+		// the kernel may still use the buffers. wait until it is done with them
+		while (pending > 0) {
+			while (*ring->cqHead != __atomic_load_n (ring->cqTail, __ATOMIC_ACQUIRE)) {
+				r = (FILEREQUEST*)(uintptr_t)ring->cqes[*ring->cqHead & *ring->cqMask].user_data;
+				__atomic_store_n (ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+				free (r); pending--;
+			}
+			if (pending > 0 && syscall (__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+				break;
+			ring->queued = 0;
+		}
+		munmap (ring->sqes, ring->sqesSize);
+		if (ring->cq != ring->sq)
+			munmap (ring->cq, ring->cqSize);
+		munmap (ring->sq, ring->sqSize);
+		::close (ring->fd);
+		delete ring;
+	}
+	#endif // FILEIO_HAVE_URING
+
+	#ifdef NET_THREADS
+	if (pool != NULL) {
+		// have the threads finish what they are doing, and stop
+		pthread_mutex_lock (&pool->lock);
+		pool->stop = 1;
+		pthread_cond_broadcast (&pool->cond);
+		pthread_mutex_unlock (&pool->lock);
+		for (int i = 0; i < pool->numThreads; i++)
+			pthread_join (pool->threads[i], NULL);
+
+		while ((r = pool->todo) != NULL) {
+			pool->todo = r->next; free (r);
+		}
+		while ((r = pool->done) != NULL) {
+			pool->done = r->next; free (r);
+		}
+		pthread_mutex_destroy (&pool->lock);
+		pthread_cond_destroy (&pool->cond);
+		free (pool->threads);
+		delete pool;
+	}
+	#endif // NET_THREADS
+
+	while ((r = done) != NULL) {
+		done = r->next; free (r);
+	}
+	while ((r = spare) != NULL) {
+		spare = r->next; free (r);
+	}
+	if (wakefd != -1 && wakefd != fd)
+		::close (wakefd);
+}
+
+/*
+ * FILEIO::create (int d, int threads)
+ *
+ * This will set asynchronous I/O up, allowing [d] requests in progress. If
+ * io_uring cannot be used, [threads] threads perform the requests. It will
+ * return zero on failure or non-zero on success.
+ *
+ */
+int
+FILEIO::create (int d, int threads) {
+	// already set up ?
+	if (method != FILEIO_NONE || d <= 0)
+		// yes. complain
+		return 0;
+
+	// create the descriptor the loop waits on
+	#ifdef OS_LINUX
+	wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakefd < 0) {
+		wakefd = -1;
+		return 0;
+	}
+	setFD (wakefd);
+	#else
+	int sv[2];
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return 0;
+	fcntl (sv[0], F_SETFL, fcntl (sv[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl (sv[1], F_SETFL, fcntl (sv[1], F_GETFL, 0) | O_NONBLOCK);
+	fcntl (sv[0], F_SETFD, FD_CLOEXEC);
+	fcntl (sv[1], F_SETFD, FD_CLOEXEC);
+	wakefd = sv[1];
+	setFD (sv[0]);
+	#endif // OS_LINUX
+	depth = d;
+
+	// pick the best way to get the requests done
+	if (setupRing (d))
+		method = FILEIO_URING;
+	else if (threads > 0 && setupPool (threads))
+		method = FILEIO_POOL;
+	else
+		method = FILEIO_SYNC;
+	return 1;
+}
+
+/*
+ * FILEIO::setupRing (int d)
+ *
+ * This will set up an io_uring for [d] requests. It will return zero on
+ * failure or non-zero on success.
+ *
+ */
+int
+FILEIO::setupRing (int d) {
+	#ifdef FILEIO_HAVE_URING
+	struct io_uring_params p;
+	FILEURING* r;
+	int rfd;
+
+	memset (&p, 0, sizeof (p));
+	rfd = syscall (__NR_io_uring_setup, d, &p);
+	if (rfd < 0)
+		// no io_uring here, or it is not allowed
+		return 0;
+
+	r = new FILEURING;
+	memset (r, 0, sizeof (FILEURING));
+	r->fd = rfd;
+	r->sqSize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	r->cqSize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	r->sqesSize = p.sq_entries * sizeof (struct io_uring_sqe);
+
+	// newer kernels map both rings at once
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cqSize > r->sqSize)
+			r->sqSize = r->cqSize;
+		r->cqSize = r->sqSize;
+	}
+	r->sq = (char*)mmap (NULL, r->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+	if (r->sq == (char*)MAP_FAILED)
+		goto fail;
+	r->cq = r->sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		r->cq = (char*)mmap (NULL, r->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+		if (r->cq == (char*)MAP_FAILED) {
+			munmap (r->sq, r->sqSize);
+			goto fail;
+		}
+	}
+	r->sqes = (struct io_uring_sqe*)mmap (NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+	if (r->sqes == (struct io_uring_sqe*)MAP_FAILED) {
+		if (r->cq != r->sq)
+			munmap (r->cq, r->cqSize);
+		munmap (r->sq, r->sqSize);
+		goto fail;
+	}
+
+	r->sqHead = (unsigned*)(r->sq + p.sq_off.head);
+	r->sqTail = (unsigned*)(r->sq + p.sq_off.tail);
+	r->sqMask = (unsigned*)(r->sq + p.sq_off.ring_mask);
+	r->sqArray = (unsigned*)(r->sq + p.sq_off.array);
+	r->sqEntries = p.sq_entries;
+	r->cqHead = (unsigned*)(r->cq + p.cq_off.head);
+	r->cqTail = (unsigned*)(r->cq + p.cq_off.tail);
+	r->cqMask = (unsigned*)(r->cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(r->cq + p.cq_off.cqes);
+
+	// have the kernel poke our eventfd for every completion
+	if (syscall (__NR_io_uring_register, rfd, IORING_REGISTER_EVENTFD, &wakefd, 1) < 0) {
+		munmap (r->sqes, r->sqesSize);
+		if (r->cq != r->sq)
+			munmap (r->cq, r->cqSize);
+		munmap (r->sq, r->sqSize);
+		goto fail;
+	}
+
+	// never allow more in progress than the rings can hold
+	if ((unsigned)depth > r->sqEntries)
+		depth = r->sqEntries;
+	ring = r;
+	return 1;
+
+fail:
+	::close (rfd);
+	delete r;
+	#endif // FILEIO_HAVE_URING
+	return 0;
+}
+
+/*
+ * FILEIO::setupPool (int threads)
+ *
+ * This will start [threads] threads to perform requests. It will return zero
+ * on failure or non-zero on success.
+ *
+ */
+int
+FILEIO::setupPool (int threads) {
+	#ifdef NET_THREADS
+	sigset_t all, old;
+	FILEPOOL* p;
+
+	p = new FILEPOOL;
+	pthread_mutex_init (&p->lock, NULL);
+	pthread_cond_init (&p->cond, NULL);
+	p->threads = (pthread_t*)malloc (threads * sizeof (pthread_t));
+	p->numThreads = 0;
+	p->todo = NULL; p->todoTail = NULL; p->done = NULL;
+	p->stop = 0; p->wakefd = wakefd;
+	pool = p;
+
+	// the threads don't take any signals; those are for the loop
+	sigfillset (&all);
+	pthread_sigmask (SIG_BLOCK, &all, &old);
+	while (p->numThreads < threads) {
+		if (pthread_create (&p->threads[p->numThreads], NULL, fileio_worker, p) != 0)
+			break;
+		p->numThreads++;
+	}
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+	// did we get any threads at all ?
+	if (p->numThreads > 0)
+		// yes. good enough
+		return 1;
+
+	pool = NULL;
+	pthread_mutex_destroy (&p->lock);
+	pthread_cond_destroy (&p->cond);
+	free (p->threads);
+	delete p;
+	#endif // NET_THREADS
+	return 0;
+}
+
+/*
+ * FILEIO::read (int filefd, char* buf, int len, off_t offset, FILEHANDLER* h,
+ *               void* arg)
+ *
+ * This will start reading [len] bytes at [offset] from file [filefd] into
+ * [buf]. Once done, [h] is called with [arg]. It will return zero on failure
+ * or non-zero on success.
+ *
+ */
+int
+FILEIO::read (int filefd, char* buf, int len, off_t offset, FILEHANDLER* h, void* arg) {
+	return submit (FILEIO_OP_READ, filefd, buf, len, offset, h, arg);
+}
+
+/*
+ * FILEIO::write (int filefd, char* buf, int len, off_t offset, FILEHANDLER* h,
+ *                void* arg)
+ *
+ * This will start writing [len] bytes from [buf] to file [filefd] at
+ * [offset]. Once done, [h] is called with [arg]. It will return zero on
+ * failure or non-zero on success.
+ *
+ */
+int
+FILEIO::write (int filefd, char* buf, int len, off_t offset, FILEHANDLER* h, void* arg) {
+	return submit (FILEIO_OP_WRITE, filefd, buf, len, offset, h, arg);
+}
+
+/*
+ * FILEIO::submit (int op, int filefd, char* buf, int len, off_t offset,
+ *                 FILEHANDLER* h, void* arg)
+ *
+ * This will queue request [op]. It will return zero on failure or non-zero on
+ * success, with errno set to EAGAIN if too many requests are in progress.
+ *
+ */
+int
+FILEIO::submit (int op, int filefd, char* buf, int len, off_t offset, FILEHANDLER* h, void* arg) {
+	FILEREQUEST* r;
+
+	// can we take it ?
+	if (method == FILEIO_NONE || h == NULL || len < 0)
+		// no. complain
+		return 0;
+	if (pending >= depth) {
+		errno = EAGAIN;
+		return 0;
+	}
+
+	// reuse a request if we can
+	if (spare != NULL) {
+		r = spare; spare = r->next;
+	} else {
+		r = (FILEREQUEST*)malloc (sizeof (FILEREQUEST));
+		if (r == NULL)
+			return 0;
+	}
+	r->op = op; r->filefd = filefd; r->buf = buf; r->len = len;
+	r->offset = offset; r->handler = h; r->arg = arg; r->result = 0;
+	r->iov.iov_base = buf; r->iov.iov_len = len; r->next = NULL;
+	pending++;
+
+	#ifdef FILEIO_HAVE_URING
+	if (method == FILEIO_URING) {
+		struct io_uring_sqe* sqe;
+		unsigned tail = *ring->sqTail;
+		unsigned idx = tail & *ring->sqMask;
+
+		// fill in the next submission. there is always room, as no more than
+		// the ring holds is ever in progress
+		sqe = &ring->sqes[idx];
+		memset (sqe, 0, sizeof (struct io_uring_sqe));
+		sqe->opcode = (op == FILEIO_OP_READ) ? IORING_OP_READV : IORING_OP_WRITEV;
+		sqe->fd = filefd;
+		sqe->addr = (uintptr_t)&r->iov;
+		sqe->len = 1;
+		sqe->off = offset;
+		sqe->user_data = (uintptr_t)r;
+		ring->sqArray[idx] = idx;
+		__atomic_store_n (ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+		ring->queued++;
+
+		// hand it to the kernel
+		enter();
+		return 1;
+	}
+	#endif // FILEIO_HAVE_URING
+
+	#ifdef NET_THREADS
+	if (method == FILEIO_POOL) {
+		// queue it for the threads
+		pthread_mutex_lock (&pool->lock);
+		if (pool->todoTail != NULL)
+			pool->todoTail->next = r;
+		else
+			pool->todo = r;
+		pool->todoTail = r;
+		pthread_cond_signal (&pool->cond);
+		pthread_mutex_unlock (&pool->lock);
+		return 1;
+	}
+	#endif // NET_THREADS
+
+	// no way to do it in the background. do it now, but call the handler from
+	// the loop, like always
+	fileio_perform (r);
+	r->next = done; done = r;
+	if (r->next == NULL)
+		fileio_wake (wakefd);
+	return 1;
+}
+
+/*
+ * FILEIO::enter()
+ *
+ * This will hand the submissions queued in the ring to the kernel. If it
+ * takes only some or none for lack of resources, the rest is tried again
+ * after FILEIO_RETRY milliseconds. If it refuses them, their handlers are
+ * called with the error from the loop.
+ *
+ */
+void
+FILEIO::enter() {
+	#ifdef FILEIO_HAVE_URING
+	FILEREQUEST* r;
+	unsigned first, tail;
+	int i, err;
+
+	if (ring->queued == 0)
+		return;
+	i = syscall (__NR_io_uring_enter, ring->fd, ring->queued, 0, 0, NULL, 0);
+	if (i > 0)
+		ring->queued -= i;
+	if (ring->queued == 0)
+		return;
+
+	// the kernel didn't take everything. is it merely busy ?
+	if (i >= 0 || errno == EAGAIN || errno == EBUSY || errno == EINTR) {
+		// yes. try again in a while, unless completions wake us up first
+		if (!isPending() && getNetwork() != NULL)
+			getNetwork()->addTimer (this, FILEIO_RETRY);
+		return;
+	}
+
+	// no. take the submissions back and fail them, oldest first, so the list
+	// ends up newest first
+	err = errno;
+	first = *ring->sqTail - ring->queued;
+	for (tail = first; tail != *ring->sqTail; tail++) {
+		r = (FILEREQUEST*)(uintptr_t)ring->sqes[ring->sqArray[tail & *ring->sqMask]].user_data;
+		r->result = -err;
+		r->next = done; done = r;
+	}
+	__atomic_store_n (ring->sqTail, first, __ATOMIC_RELEASE);
+	ring->queued = 0;
+	fileio_wake (wakefd);
+	#endif // FILEIO_HAVE_URING
+}
+
+/*
+ * FILEIO::expired()
+ *
+ * This will try again to hand the submissions the kernel didn't take to it.
+ *
+ */
+void
+FILEIO::expired() {
+	enter();
+}
+
+/*
+ * FILEIO::getPending()
+ *
+ * This will return the number of requests in progress.
+ *
+ */
+int
+FILEIO::getPending() {
+	return pending;
+}
+
+/*
+ * FILEIO::getMethod()
+ *
+ * This will return how requests are performed, one of FILEIO_xxx.
+ *
+ */
+int
+FILEIO::getMethod() {
+	return method;
+}
+
+/*
+ * FILEIO::complete (FILEREQUEST* r)
+ *
+ * This will call the handler of request [r], and keep the request for reuse.
+ *
+ */
+void
+FILEIO::complete (FILEREQUEST* r) {
+	pending--;
+	r->handler->fileDone (r->result, r->buf, r->arg);
+	r->next = spare; spare = r;
+}
+
+/*
+ * FILEIO::incoming()
+ *
+ * This will call the handlers of all requests which are done.
+ *
+ */
+void
+FILEIO::incoming() {
+	FILEREQUEST* list = NULL;
+	FILEREQUEST* r;
+	#ifdef OS_LINUX
+	uint64_t count;
+	#else
+	char tmp[64];
+	#endif // OS_LINUX
+
+	// reset the descriptor first, so nothing done after this is missed
+	#ifdef OS_LINUX
+	if (::read (fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+		return;
+	#else
+	while (::read (fd, tmp, sizeof (tmp)) > 0);
+	#endif // OS_LINUX
+
+	#ifdef FILEIO_HAVE_URING
+	if (method == FILEIO_URING) {
+		FILEREQUEST* last = NULL;
+		FILEREQUEST* refused = NULL;
+		unsigned head = *ring->cqHead;
+		unsigned tail = __atomic_load_n (ring->cqTail, __ATOMIC_ACQUIRE);
+
+		// take all completions, oldest first, before calling anyone, as the
+		// handlers may submit more
+		while (head != tail) {
+			struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+			r = (FILEREQUEST*)(uintptr_t)cqe->user_data;
+			r->result = cqe->res; r->next = NULL;
+			if (last != NULL)
+				last->next = r;
+			else
+				list = r;
+			last = r; head++;
+		}
+		__atomic_store_n (ring->cqHead, head, __ATOMIC_RELEASE);
+
+		// anything the kernel didn't take yet ? it may have room now
+		enter();
+
+		// requests it refused go after those it completed. they are newest
+		// first; turn them around
+		while ((r = done) != NULL) {
+			done = r->next; r->next = refused; refused = r;
+		}
+		if (last != NULL)
+			last->next = refused;
+		else
+			list = refused;
+
+		while ((r = list) != NULL) {
+			list = r->next;
+			complete (r);
+		}
+		return;
+	}
+	#endif // FILEIO_HAVE_URING
+
+	#ifdef NET_THREADS
+	if (method == FILEIO_POOL) {
+		pthread_mutex_lock (&pool->lock);
+		r = pool->done; pool->done = NULL;
+		pthread_mutex_unlock (&pool->lock);
+	} else
+	#endif // NET_THREADS
+	{
+		r = done; done = NULL;
+	}
+
+	// the list is newest first. turn it around
+	while (r != NULL) {
+		FILEREQUEST* next = r->next;
+		r->next = list; list = r; r = next;
+	}
+	while ((r = list) != NULL) {
+		list = r->next;
+		complete (r);
+	}
+}
+
+/* vim:set ts=2 sw=2: */
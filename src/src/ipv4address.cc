@@ -87,6 +87,40 @@ IPV4ADDRESS::getAddr() {
 	return inet_ntoa (sin->sin_addr);
 }
 
+/*
+ * IPV4ADDRESS::getAddr (char* buf, int len)
+ *
+ * This will store the human-readable IPv4 address in [buf], which is [len]
+ * bytes long. It will return [buf].
+ *
+ */
+char*
+IPV4ADDRESS::getAddr (char* buf, int len) {
+	return getKey().format (buf, len);
+}
+
+/*
+ * IPV4ADDRESS::getKey()
+ *
+ * This will return the address as a compact binary value.
+ *
+ */
+IPV4KEY
+IPV4ADDRESS::getKey() {
+	return IPV4KEY (ntohl (sin->sin_addr.s_addr));
+}
+
+/*
+ * IPV4ADDRESS::setKey (IPV4KEY key)
+ *
+ * This will set the address to [key].
+ *
+ */
+void
+IPV4ADDRESS::setKey (IPV4KEY key) {
+	sin->sin_addr.s_addr = htonl (key.getValue());
+}
+
 /*
  * IPV4ADDRESS::setPort (int port)
  *
@@ -129,4 +163,93 @@ IPV4ADDRESS::compareAddr (char* addr) {
 	return (!memcmp (&stmp.sin_addr, &sin->sin_addr, sizeof (sin->sin_addr))) ? 1 : 0;
 }
 
+/*
+ * IPV4ADDRESS::compareAddr (IPV4KEY key)
+ *
+ * This will check whether the address stored matches [key]. It will return zero
+ * if not an non-zero if it does.
+ *
+ */
+int
+IPV4ADDRESS::compareAddr (IPV4KEY key) {
+	return (getKey() == key) ? 1 : 0;
+}
+
+/*
+ * IPV4KEY::parse (char* addr)
+ *
+ * This will parse dotted IPv4 address [addr]. It will return zero on failure
+ * or non-zero on success.
+ *
+ */
+int
+IPV4KEY::parse (char* addr) {
+	struct in_addr in;
+
+	// convert the address
+	if (!inet_aton (addr, &in))
+		// this did not work. bail out
+		return 0;
+
+	value = ntohl (in.s_addr);
+	return 1;
+}
+
+/*
+ * IPV4KEY::parseCIDR (char* addr, int* prefix)
+ *
+ * This will parse [addr], which is either a dotted IPv4 address or an
+ * address/prefix pair. The prefix length is stored in [prefix]; it will be
+ * 32 if [addr] holds no prefix. Any bits beyond the prefix are cleared. This
+ * will return zero on failure or non-zero on success.
+ *
+ */
+int
+IPV4KEY::parseCIDR (char* addr, int* prefix) {
+	char tmp[32];
+	char* ptr;
+	char* end;
+	long l;
+
+	// make a copy, since we have to cut the prefix off
+	if (strlen (addr) >= sizeof (tmp))
+		return 0;
+	strcpy (tmp, addr);
+
+	// got a prefix ?
+	*prefix = 32;
+	ptr = strchr (tmp, '/');
+	if (ptr != NULL) {
+		// yes. parse it
+		*ptr++ = 0;
+		l = strtol (ptr, &end, 10);
+		if (*ptr == 0 || *end != 0 || l < 0 || l > 32)
+			// this is not a sensible prefix. bail out
+			return 0;
+		*prefix = (int)l;
+	}
+
+	// parse the address
+	if (!parse (tmp))
+		return 0;
+
+	// get rid of any host bits
+	value = mask (*prefix).getValue();
+	return 1;
+}
+
+/*
+ * IPV4KEY::format (char* buf, int len)
+ *
+ * This will store the address as dotted text in [buf], which is [len] bytes
+ * long. It will return [buf].
+ *
+ */
+char*
+IPV4KEY::format (char* buf, int len) {
+	snprintf (buf, len, "%u.%u.%u.%u", (value >> 24) & 0xff,
+	          (value >> 16) & 0xff, (value >> 8) & 0xff, value & 0xff);
+	return buf;
+}
+
 /* vim:set ts=2 sw=2: */
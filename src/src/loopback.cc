@@ -0,0 +1,418 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file loopback.cc
+ * \brief In-process connections without descriptors, implements the LOOPBACK
+ *        class
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <network.h>
+#include <loopback.h>
+
+/*
+ * LOOPMARK says the bytes written up to [end] arrive at [when].
+ */
+struct LOOPMARK {
+	unsigned long long  end;
+	long long           when;
+};
+
+/*
+ * LOOPDIR is the data written by one side. [data] holds what was not read
+ * yet; of that, the bytes up to [ready] arrived. [marks] holds the arrival of
+ * the rest, from [firstMark] up to [numMarks]. [closed] is set once the
+ * writer is gone.
+ */
+struct LOOPDIR {
+	NETBUFFER           data;
+	unsigned long long  written;
+	unsigned long long  taken;
+	unsigned long long  ready;
+	LOOPMARK*           marks;
+	int                 firstMark;
+	int                 numMarks;
+	int                 maxMarks;
+	int                 closed;
+};
+
+/*
+ * LOOPBACK::LOOPBACK (NETWORK* n)
+ *
+ * This is the constructor. The services will be handled by network [n].
+ *
+ */
+LOOPBACK::LOOPBACK (NETWORK* n) {
+	net = n; latency = 0; chunk = 0; window = LOOPBACK_WINDOW; seed = 0; armed = 0;
+	for (int i = 0; i < 2; i++) {
+		side[i] = NULL;
+		dir[i] = new LOOPDIR;
+		dir[i]->written = 0; dir[i]->taken = 0; dir[i]->ready = 0;
+		dir[i]->marks = NULL; dir[i]->firstMark = 0; dir[i]->numMarks = 0; dir[i]->maxMarks = 0;
+		dir[i]->closed = 0;
+	}
+}
+
+/*
+ * LOOPBACK::~LOOPBACK()
+ *
+ * This is the destructor. Sides still connected are cut off; they are not
+ * told about it.
+ *
+ */
+LOOPBACK::~LOOPBACK() {
+	for (int i = 0; i < 2; i++)
+		if (side[i] != NULL)
+			detach (side[i]);
+	net->removeTimer (this);
+	for (int i = 0; i < 2; i++) {
+		if (dir[i]->marks != NULL)
+			free (dir[i]->marks);
+		delete dir[i];
+	}
+}
+
+/*
+ * LOOPBACK::connect (NETSERVICE* a, NETSERVICE* b)
+ *
+ * This will connect services [a] and [b]. It will return zero on failure or
+ * non-zero on success.
+ *
+ */
+int
+LOOPBACK::connect (NETSERVICE* a, NETSERVICE* b) {
+	// can we ?
+	if (side[0] != NULL || side[1] != NULL || a == b || a->getFD() != -1 || b->getFD() != -1)
+		// no. complain
+		return 0;
+
+	side[0] = a; side[1] = b;
+	for (int i = 0; i < 2; i++) {
+		// nothing ever blocks, and there is no descriptor to wait on
+		side[i]->loop = this;
+		side[i]->fd = NETSERVICE_NOFD;
+		side[i]->nonBlocking = 1;
+	}
+	return 1;
+}
+
+/*
+ * LOOPBACK::connect (NETSERVER* server, NETSERVICE* client)
+ *
+ * This will connect [client] to [server], which constructs its side of the
+ * connection. It will return that side, or NULL on failure.
+ *
+ */
+SERVICECLIENT*
+LOOPBACK::connect (NETSERVER* server, NETSERVICE* client) {
+	SERVICECLIENT* c;
+
+	// is the server still taking connections ?
+	if (server->isDraining() || client->getFD() != -1)
+		// no. complain
+		return NULL;
+	c = server->createClient();
+	if (c == NULL)
+		return NULL;
+
+	// hook it up as the server would
+	c->setParent (server);
+	c->setAutoCork (server->isAutoCork());
+	if (!connect (client, c)) {
+		delete c;
+		return NULL;
+	}
+	server->addClient (c);
+	server->counters[NETSERVER_COUNT_ACCEPTED]++;
+	return c;
+}
+
+/*
+ * LOOPBACK::setLatency (int usec)
+ *
+ * This will hold data written from now on back for [usec] microseconds.
+ *
+ */
+void
+LOOPBACK::setLatency (int usec) {
+	latency = (usec > 0) ? usec : 0;
+}
+
+/*
+ * LOOPBACK::setChunk (int max, unsigned int s)
+ *
+ * This will hand data out in chunks of at most [max] bytes. If [s] is
+ * non-zero, the size of every chunk is picked from a sequence starting at
+ * [s], otherwise all chunks are [max] bytes.
+ *
+ */
+void
+LOOPBACK::setChunk (int max, unsigned int s) {
+	chunk = (max > 0) ? max : 0; seed = s;
+}
+
+/*
+ * LOOPBACK::setWindow (int bytes)
+ *
+ * This will allow [bytes] bytes to be in flight in either direction.
+ *
+ */
+void
+LOOPBACK::setWindow (int bytes) {
+	window = (bytes > 0) ? bytes : 1;
+}
+
+/*
+ * LOOPBACK::random()
+ *
+ * This will return the next number of the chunk size sequence.
+ *
+ */
+unsigned int
+LOOPBACK::random() {
+	seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+	return seed;
+}
+
+/*
+ * LOOPBACK::arrive (struct LOOPDIR* d)
+ *
+ * This will make the data of direction [d] whose latency passed available
+ * to read.
+ *
+ */
+void
+LOOPBACK::arrive (struct LOOPDIR* d) {
+	long long t;
+
+	if (d->firstMark == d->numMarks)
+		return;
+	t = NETWORK::getTime();
+	while (d->firstMark < d->numMarks && d->marks[d->firstMark].when <= t) {
+		d->ready = d->marks[d->firstMark].end;
+		d->firstMark++;
+	}
+	if (d->firstMark == d->numMarks) {
+		d->firstMark = 0; d->numMarks = 0;
+	}
+}
+
+/*
+ * LOOPBACK::schedule()
+ *
+ * This will arm the timer for the first data held back, unless it already
+ * is.
+ *
+ */
+void
+LOOPBACK::schedule() {
+	long long when = 0, t;
+
+	for (int i = 0; i < 2; i++) {
+		LOOPDIR* d = dir[i];
+		if (d->firstMark < d->numMarks && (when == 0 || d->marks[d->firstMark].when < when))
+			when = d->marks[d->firstMark].when;
+	}
+	if (when == 0 || (armed != 0 && armed <= when))
+		return;
+
+	// round up, so we don't wake up just before it
+	t = when - NETWORK::getTime();
+	net->addTimer (this, (t > 0) ? (int)((t + 999) / 1000) : 0);
+	armed = when;
+}
+
+/*
+ * LOOPBACK::expired()
+ *
+ * This will wait for the next data held back. Whatever arrived is picked up
+ * by the network by itself.
+ *
+ */
+void
+LOOPBACK::expired() {
+	armed = 0;
+	for (int i = 0; i < 2; i++)
+		arrive (dir[i]);
+	schedule();
+}
+
+/*
+ * LOOPBACK::read (NETSERVICE* s, char* buf, int len, int flags)
+ *
+ * This will copy up to [len] bytes written by the other side of [s] to
+ * [buf]. If [flags] contains MSG_PEEK, the data is left where it is. It will
+ * return what ::recv() would.
+ *
+ */
+int
+LOOPBACK::read (NETSERVICE* s, char* buf, int len, int flags) {
+	LOOPDIR* d = (s == side[0]) ? dir[1] : dir[0];
+	int n;
+
+	arrive (d);
+	n = (int)(d->ready - d->taken);
+	if (n == 0) {
+		// nothing there. if the other side is gone and nothing is on its way
+		// anymore, this is the end
+		if (d->closed && d->ready == d->written)
+			return 0;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	// hand out no more than a chunk. peeking says nothing about the size
+	if (chunk > 0 && !(flags & MSG_PEEK)) {
+		int c = (seed != 0) ? (int)(random() % chunk) + 1 : chunk;
+		if (n > c)
+			n = c;
+	}
+	if (n > len)
+		n = len;
+	memcpy (buf, d->data.getData(), n);
+	if (!(flags & MSG_PEEK)) {
+		d->data.consume (n);
+		d->taken += n;
+	}
+	return n;
+}
+
+/*
+ * LOOPBACK::write (NETSERVICE* s, struct iovec* iov, int n)
+ *
+ * This will pass as much of the [n] buffers in [iov] to the other side of
+ * [s] as the window allows. It will return what ::send() would.
+ *
+ */
+int
+LOOPBACK::write (NETSERVICE* s, struct iovec* iov, int n) {
+	int i = (s == side[0]) ? 0 : 1;
+	LOOPDIR* d = dir[i];
+	int room, len, total = 0;
+	LOOPMARK* m;
+
+	// is anyone listening ?
+	if (side[1 - i] == NULL) {
+		// no. complain
+		errno = EPIPE;
+		return -1;
+	}
+	room = window - d->data.getLength();
+	if (room <= 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	for (int j = 0; j < n && room > 0; j++) {
+		len = ((int)iov[j].iov_len < room) ? (int)iov[j].iov_len : room;
+		if (!d->data.append ((char*)iov[j].iov_base, len))
+			break;
+		total += len; room -= len;
+	}
+	if (total == 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	d->written += total;
+
+	// can it be read right away ?
+	if (latency == 0 && d->firstMark == d->numMarks) {
+		// yes. that's it
+		d->ready = d->written;
+		return total;
+	}
+
+	// no. note when it arrives; data never overtakes what was written before
+	if (d->numMarks == d->maxMarks) {
+		d->maxMarks = (d->maxMarks == 0) ? 16 : d->maxMarks * 2;
+		m = (LOOPMARK*)realloc (d->marks, d->maxMarks * sizeof (LOOPMARK));
+		if (m == NULL) {
+			// we can't hold it back. better early than never
+			d->maxMarks = d->numMarks;
+			d->ready = d->written;
+			return total;
+		}
+		d->marks = m;
+	}
+	d->marks[d->numMarks].end = d->written;
+	d->marks[d->numMarks].when = NETWORK::getTime() + latency;
+	d->numMarks++;
+	schedule();
+	return total;
+}
+
+/*
+ * LOOPBACK::hasInput (NETSERVICE* s)
+ *
+ * This will return non-zero if [s] has data or end of file to read.
+ *
+ */
+int
+LOOPBACK::hasInput (NETSERVICE* s) {
+	LOOPDIR* d = (s == side[0]) ? dir[1] : dir[0];
+
+	arrive (d);
+	return (d->ready > d->taken || (d->closed && d->ready == d->written)) ? 1 : 0;
+}
+
+/*
+ * LOOPBACK::hasRoom (NETSERVICE* s)
+ *
+ * This will return non-zero if [s] can write without being refused. Writing
+ * once the other side is gone fails, which counts.
+ *
+ */
+int
+LOOPBACK::hasRoom (NETSERVICE* s) {
+	int i = (s == side[0]) ? 0 : 1;
+
+	return (side[1 - i] == NULL || dir[i]->data.getLength() < window) ? 1 : 0;
+}
+
+/*
+ * LOOPBACK::detach (NETSERVICE* s)
+ *
+ * This will disconnect [s]. The other side gets end of file once it read
+ * what [s] wrote.
+ *
+ */
+void
+LOOPBACK::detach (NETSERVICE* s) {
+	int i = (s == side[0]) ? 0 : 1;
+
+	if (side[i] != s)
+		return;
+
+	// whatever was on its way to us is lost
+	dir[i]->closed = 1;
+	dir[1 - i]->data.clear();
+	dir[1 - i]->taken = dir[1 - i]->written;
+	dir[1 - i]->ready = dir[1 - i]->written;
+	dir[1 - i]->firstMark = 0; dir[1 - i]->numMarks = 0;
+
+	side[i] = NULL;
+	s->loop = NULL; s->fd = -1; s->nonBlocking = 0;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -23,6 +23,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -34,14 +35,15 @@
 #include <network.h>
 
 /*
- * NETCLIENT::connect (NETADDRESS* addr)
+ * NETCLIENT::connect (NETADDRESS* addr, int wait)
  *
- * This will try to make a connection to address [addr]. It will return zero on
- * failure or non-zero on success.
+ * This will try to make a connection to address [addr]. If [wait] is zero,
+ * the connection is made in the background. It will return zero on failure
+ * or non-zero on success.
  *
  */
 int
-NETCLIENT::connect (NETADDRESS* addr) {
+NETCLIENT::connect (NETADDRESS* addr, int wait) {
 	int lfd;
 
 	// create a socket
@@ -49,8 +51,11 @@ NETCLIENT::connect (NETADDRESS* addr) {
 	if (lfd < 0)
 		return 0;
 
-	// connect to the host
-	if (::connect (lfd, addr->getInternalAddress(), addr->getInternalLength()) < 0) {
+	// connect to the host. if we don't wait for it and this fails later on,
+	// we find out once we use the connection
+	if (!wait)
+		fcntl (lfd, F_SETFL, fcntl (lfd, F_GETFL, 0) | O_NONBLOCK);
+	if (::connect (lfd, addr->getInternalAddress(), addr->getInternalLength()) < 0 && (wait || errno != EINPROGRESS)) {
 		// this failed. complain
 		#ifdef _DEBUG_NETWORK
 		perror ("NETCLIENT::connect(): connect() failed");
@@ -65,6 +70,10 @@ NETCLIENT::connect (NETADDRESS* addr) {
 
 	// victory
 	setFD (lfd);
+	if (!wait && !setNonBlocking()) {
+		close();
+		return 0;
+	}
 	return 1;
 }
 
@@ -0,0 +1,451 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file netpool.cc
+ * \brief Pooling of outgoing connections, implements the POOLCLIENT and
+ *        NETPOOL classes
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <network.h>
+#include <netpool.h>
+
+/* POOLCLIENT_xxx are the states of a pooled connection */
+#define POOLCLIENT_BUSY       0       /* handed out */
+#define POOLCLIENT_IDLE       1       /* kept for reuse */
+#define POOLCLIENT_DEAD       2       /* waiting to be deleted */
+
+/*
+ * NETPOOLHOST is a server we have connections to. [idle] lists the idle
+ * connections, the most recently used first, and [busy] the ones handed
+ * out. [next] is the next server in the same hash bucket.
+ */
+struct NETPOOLHOST {
+	IPV4KEY       key;
+	int           port;
+	POOLCLIENT*   idle;
+	POOLCLIENT*   busy;
+	int           numIdle;
+	int           numBusy;
+	NETPOOLHOST*  next;
+};
+
+/*
+ * POOLCLIENT::POOLCLIENT()
+ *
+ * This is the constructor.
+ *
+ */
+POOLCLIENT::POOLCLIENT() {
+	pool = NULL; host = NULL; state = POOLCLIENT_BUSY; since = 0;
+	prev = NULL; next = NULL;
+}
+
+/*
+ * POOLCLIENT::~POOLCLIENT()
+ *
+ * This is the destructor. If we belong to a pool, it forgets about us.
+ *
+ */
+POOLCLIENT::~POOLCLIENT() {
+	if (pool != NULL)
+		pool->forget (this);
+}
+
+/*
+ * POOLCLIENT::release()
+ *
+ * This will hand us back to our pool. If the pool is gone, nothing happens.
+ *
+ */
+void
+POOLCLIENT::release() {
+	if (pool != NULL)
+		pool->put (this);
+}
+
+/*
+ * NETPOOL::NETPOOL (NETWORK* n)
+ *
+ * This is the constructor. Connections will be added to network [n].
+ *
+ */
+NETPOOL::NETPOOL (NETWORK* n) {
+	net = n; dead = NULL;
+	maxIdle = 8; maxPerHost = 0; idleTimeout = 30000;
+	numIdle = 0; numBusy = 0;
+	for (int i = 0; i < NETPOOL_BUCKETS; i++)
+		hosts[i] = NULL;
+	for (int i = 0; i < NETPOOL_COUNT_MAX; i++)
+		counters[i] = 0;
+}
+
+/*
+ * NETPOOL::~NETPOOL()
+ *
+ * This is the destructor. Idle connections are closed; connections handed
+ * out no longer belong to us.
+ *
+ */
+NETPOOL::~NETPOOL() {
+	NETPOOLHOST* h;
+	POOLCLIENT* c;
+
+	for (int i = 0; i < NETPOOL_BUCKETS; i++) {
+		while ((h = hosts[i]) != NULL) {
+			hosts[i] = h->next;
+			while ((c = h->idle) != NULL) {
+				h->idle = c->next; c->pool = NULL;
+				delete c;
+			}
+			for (c = h->busy; c != NULL; c = c->next)
+				c->pool = NULL;
+			free (h);
+		}
+	}
+	while ((c = dead) != NULL) {
+		dead = c->next; c->pool = NULL;
+		delete c;
+	}
+}
+
+/*
+ * NETPOOL::setMaxIdle (int n)
+ *
+ * This will keep at most [n] idle connections per server.
+ *
+ */
+void
+NETPOOL::setMaxIdle (int n) {
+	maxIdle = n;
+}
+
+/*
+ * NETPOOL::setMaxPerHost (int n)
+ *
+ * This will allow at most [n] connections per server, or any number if [n]
+ * is zero.
+ *
+ */
+void
+NETPOOL::setMaxPerHost (int n) {
+	maxPerHost = n;
+}
+
+/*
+ * NETPOOL::setIdleTimeout (int msec)
+ *
+ * This will close connections which are idle for [msec] milliseconds.
+ *
+ */
+void
+NETPOOL::setIdleTimeout (int msec) {
+	idleTimeout = msec;
+}
+
+/*
+ * NETPOOL::lookup (IPV4ADDRESS* addr, int create)
+ *
+ * This will look up the server at [addr]. If it is not known and [create] is
+ * non-zero, it is added. It will return the server, or NULL if it is not
+ * known.
+ *
+ */
+struct NETPOOLHOST*
+NETPOOL::lookup (IPV4ADDRESS* addr, int create) {
+	IPV4KEY key = addr->getKey();
+	int port = addr->getPort();
+	int i = (key.hash() ^ (unsigned int)port) % NETPOOL_BUCKETS;
+	NETPOOLHOST* h;
+
+	for (h = hosts[i]; h != NULL; h = h->next)
+		if (h->key == key && h->port == port)
+			return h;
+	if (!create)
+		return NULL;
+
+	// a new one. add it
+	h = (NETPOOLHOST*)malloc (sizeof (NETPOOLHOST));
+	if (h == NULL)
+		return NULL;
+	h->key = key; h->port = port; h->idle = NULL; h->busy = NULL;
+	h->numIdle = 0; h->numBusy = 0;
+	h->next = hosts[i]; hosts[i] = h;
+	return h;
+}
+
+/*
+ * NETPOOL::link (POOLCLIENT** list, POOLCLIENT* c)
+ *
+ * This will add connection [c] to the front of [list].
+ *
+ */
+void
+NETPOOL::link (POOLCLIENT** list, POOLCLIENT* c) {
+	c->prev = NULL; c->next = *list;
+	if (*list != NULL)
+		(*list)->prev = c;
+	*list = c;
+}
+
+/*
+ * NETPOOL::unlink (POOLCLIENT** list, POOLCLIENT* c)
+ *
+ * This will remove connection [c] from [list].
+ *
+ */
+void
+NETPOOL::unlink (POOLCLIENT** list, POOLCLIENT* c) {
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		*list = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	c->prev = NULL; c->next = NULL;
+}
+
+/*
+ * NETPOOL::healthy (POOLCLIENT* c)
+ *
+ * This will check whether connection [c] can be used for a new request. It
+ * will return zero if it can't, or non-zero if it can.
+ *
+ */
+int
+NETPOOL::healthy (POOLCLIENT* c) {
+	char ch;
+
+	// anything left over from before ?
+	if (c->getFD() == -1 || c->isDropped() || c->getOutputLength() > 0 || c->getInputLength() > 0)
+		// yes. we can't tell where the next reply starts
+		return 0;
+
+	// there should be nothing to read: not even end of file
+	if (::recv (c->getFD(), &ch, 1, MSG_PEEK | MSG_DONTWAIT) >= 0)
+		return 0;
+	return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : 0;
+}
+
+/*
+ * NETPOOL::get (IPV4ADDRESS* addr)
+ *
+ * This will hand out a connection to [addr], either an idle one or a new
+ * one. It will return the connection, or NULL on failure.
+ *
+ */
+POOLCLIENT*
+NETPOOL::get (IPV4ADDRESS* addr) {
+	NETPOOLHOST* h;
+	POOLCLIENT* c;
+
+	h = lookup (addr, 1);
+	if (h == NULL)
+		return NULL;
+
+	// use the warmest idle connection which still works
+	while ((c = h->idle) != NULL) {
+		unlink (&h->idle, c);
+		h->numIdle--; numIdle--;
+		if (healthy (c)) {
+			c->state = POOLCLIENT_BUSY;
+			link (&h->busy, c);
+			h->numBusy++; numBusy++;
+			counters[NETPOOL_COUNT_REUSED]++;
+			net->addService (c);
+			return c;
+		}
+		counters[NETPOOL_COUNT_STALE]++;
+		c->pool = NULL;
+		delete c;
+	}
+
+	// may we make another one ?
+	if (maxPerHost > 0 && h->numBusy >= maxPerHost) {
+		// no. complain
+		counters[NETPOOL_COUNT_DENIED]++;
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	// connect without waiting for it; requests are queued until it is up
+	c = createClient();
+	if (c == NULL)
+		return NULL;
+	if (!c->connect (addr, 0)) {
+		delete c;
+		return NULL;
+	}
+	c->pool = this; c->host = h; c->state = POOLCLIENT_BUSY;
+	link (&h->busy, c);
+	h->numBusy++; numBusy++;
+	counters[NETPOOL_COUNT_CONNECTED]++;
+	net->addService (c);
+	return c;
+}
+
+/*
+ * NETPOOL::put (POOLCLIENT* c)
+ *
+ * This will take connection [c] back. It is kept for reuse if it is fit for
+ * it, or closed otherwise.
+ *
+ */
+void
+NETPOOL::put (POOLCLIENT* c) {
+	NETPOOLHOST* h = c->host;
+
+	// is it ours, and handed out ?
+	if (c->pool != this || c->state != POOLCLIENT_BUSY)
+		// no. leave it alone
+		return;
+	unlink (&h->busy, c);
+	h->numBusy--; numBusy--;
+
+	// the network doesn't look after idle connections
+	if (c->getNetwork() == net)
+		net->removeService (c);
+
+	// can we keep it ?
+	if (healthy (c) && h->numIdle < maxIdle) {
+		// yes. do so, and have it checked every now and then
+		c->state = POOLCLIENT_IDLE;
+		c->since = NETWORK::getTime();
+		link (&h->idle, c);
+		h->numIdle++; numIdle++;
+		if (!isPending())
+			net->addTimer (this, NETPOOL_CHECK);
+		return;
+	}
+
+	// no. we may be called from its handler, so get rid of it once the network
+	// is done with it
+	c->drop();
+	c->state = POOLCLIENT_DEAD;
+	link (&dead, c);
+	net->addTimer (this, 0);
+}
+
+/*
+ * NETPOOL::forget (POOLCLIENT* c)
+ *
+ * This will forget about connection [c], which is being deleted.
+ *
+ */
+void
+NETPOOL::forget (POOLCLIENT* c) {
+	NETPOOLHOST* h = c->host;
+
+	switch (c->state) {
+		case POOLCLIENT_BUSY: unlink (&h->busy, c);
+		                      h->numBusy--; numBusy--;
+		                      break;
+		case POOLCLIENT_IDLE: unlink (&h->idle, c);
+		                      h->numIdle--; numIdle--;
+		                      break;
+		case POOLCLIENT_DEAD: unlink (&dead, c);
+		                      break;
+	}
+	if (c->getNetwork() == net)
+		net->removeService (c);
+	c->pool = NULL;
+}
+
+/*
+ * NETPOOL::getIdle()
+ *
+ * This will return the number of idle connections.
+ *
+ */
+int
+NETPOOL::getIdle() {
+	return numIdle;
+}
+
+/*
+ * NETPOOL::getBusy()
+ *
+ * This will return the number of connections handed out.
+ *
+ */
+int
+NETPOOL::getBusy() {
+	return numBusy;
+}
+
+/*
+ * NETPOOL::getCounter (int which)
+ *
+ * This will return the value of counter [which].
+ *
+ */
+unsigned long
+NETPOOL::getCounter (int which) {
+	return (which >= 0 && which < NETPOOL_COUNT_MAX) ? counters[which] : 0;
+}
+
+/*
+ * NETPOOL::expired()
+ *
+ * This will delete the connections which were closed, and close the idle
+ * connections which are broken or were idle for too long.
+ *
+ */
+void
+NETPOOL::expired() {
+	long long t = NETWORK::getTime();
+	NETPOOLHOST* h;
+	POOLCLIENT* c;
+	POOLCLIENT* next;
+
+	while ((c = dead) != NULL) {
+		unlink (&dead, c);
+		c->pool = NULL;
+		delete c;
+	}
+
+	for (int i = 0; i < NETPOOL_BUCKETS; i++) {
+		for (h = hosts[i]; h != NULL; h = h->next) {
+			for (c = h->idle; c != NULL; c = next) {
+				next = c->next;
+
+				// is this one still fine ?
+				if (t - c->since < (long long)idleTimeout * 1000 && healthy (c))
+					// yes. keep it
+					continue;
+				counters[(t - c->since < (long long)idleTimeout * 1000) ? NETPOOL_COUNT_STALE : NETPOOL_COUNT_EXPIRED]++;
+				unlink (&h->idle, c);
+				h->numIdle--; numIdle--;
+				c->pool = NULL;
+				delete c;
+			}
+		}
+	}
+
+	// keep an eye on whatever is left
+	if (numIdle > 0)
+		net->addTimer (this, NETPOOL_CHECK);
+}
+
+/* vim:set ts=2 sw=2: */
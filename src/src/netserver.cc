@@ -22,6 +22,8 @@
  */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <fcntl.h>
@@ -32,6 +34,24 @@
 #include <string.h>
 #include <unistd.h>
 #include <network.h>
+#include <acl.h>
+#include <ratelimit.h>
+
+int NETSERVER::totalMaxClients = 0;
+int NETSERVER::totalClients = 0;
+
+/*
+ * NETSERVER::NETSERVER()
+ *
+ * This is the constructor.
+ *
+ */
+NETSERVER::NETSERVER() {
+	// everyone is welcome
+	acl = NULL; ratelimit = NULL; maxClients = 0; tlsContext = NULL;
+	reusePort = 0;
+	resetCounters();
+}
 
 /*
  * NETSERVER::create (int no)
@@ -54,6 +74,15 @@ NETSERVER::create (int no) {
 	// ensure we can bind to the socket
 	setsockopt (lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
 
+	// share the port with other sockets if needed
+	#ifdef SO_REUSEPORT
+	if (reusePort && setsockopt (lfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) < 0)
+		goto fail;
+	#else
+	if (reusePort)
+		goto fail;
+	#endif // SO_REUSEPORT
+
 	// set the bind structure up
 	memset (&sin, 0, sizeof (struct sockaddr_in));
 	#ifdef OS_BSD
@@ -88,37 +117,429 @@ fail:
 }
 
 /*
- * NETSERVER::accept (SERVICECLIENT* client)
+ * NETSERVER::setReusePort (int on)
  *
- * This will assign the pending connection to [client]. It will return zero on
- * failure and non-zero on success.
+ * This will have create() set SO_REUSEPORT if [on] is non-zero.
+ *
+ */
+void
+NETSERVER::setReusePort (int on) {
+	reusePort = on;
+}
+
+/*
+ * NETSERVER::handOff (char* path)
+ *
+ * This will pass the listening socket to the process waiting on Unix socket
+ * [path], close our copy and start draining. It will return zero on failure
+ * or non-zero on success.
  *
  */
 int
-NETSERVER::accept (SERVICECLIENT* client) {
-	IPV4ADDRESS* addr = new IPV4ADDRESS();
-	socklen_t slen = addr->getInternalLength();
-	int client_fd;
+NETSERVER::handOff (char* path) {
+	struct sockaddr_un sun;
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	struct iovec iov;
+	struct timeval tv;
+	char cbuf[CMSG_SPACE (sizeof (int))];
+	char c = 0;
+	int s;
 
-	// accept the connection
-	client_fd = ::accept (fd, addr->getInternalAddress(), &slen);
-	if (client_fd < 0) {
-		// this failed. get rid of the client and leave
-		delete addr; delete client;
+	if (fd == -1 || strlen (path) >= sizeof (sun.sun_path))
+		return 0;
+
+	// contact the new process. we are still serving, so don't wait for it long
+	s = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0)
+		return 0;
+	tv.tv_sec = NETSERVER_HANDOFF_TIMEOUT / 1000;
+	tv.tv_usec = (NETSERVER_HANDOFF_TIMEOUT % 1000) * 1000;
+	if (setsockopt (s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv)) < 0 ||
+	    setsockopt (s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0) {
+		::close (s);
+		return 0;
+	}
+	memset (&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	strcpy (sun.sun_path, path);
+	if (connect (s, (struct sockaddr*)&sun, sizeof (sun)) < 0) {
+		::close (s);
+		return 0;
+	}
+
+	// pass the descriptor along with a single byte of data
+	memset (&msg, 0, sizeof (msg));
+	iov.iov_base = &c; iov.iov_len = 1;
+	msg.msg_iov = &iov; msg.msg_iovlen = 1;
+	msg.msg_control = cbuf; msg.msg_controllen = sizeof (cbuf);
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+	memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+	if (sendmsg (s, &msg, 0) != 1) {
+		::close (s);
+		return 0;
+	}
+
+	// wait for the other side to hang up, so we know it got the socket
+	if (::recv (s, &c, 1, 0) != 0) {
+		// it didn't. keep serving; the socket is shared at worst
+		::close (s);
+		return 0;
+	}
+	::close (s);
+
+	// stop accepting, which closes our copy
+	drain();
+	return 1;
+}
+
+/*
+ * NETSERVER::takeOver (char* path, int timeout)
+ *
+ * This will wait up to [timeout] seconds for another process to pass its
+ * listening socket through Unix socket [path], and use it. If [timeout] is
+ * zero, we wait forever. It will return zero on failure or non-zero on
+ * success.
+ *
+ */
+int
+NETSERVER::takeOver (char* path, int timeout) {
+	struct sockaddr_un sun;
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	struct iovec iov;
+	struct timeval tv;
+	fd_set fds;
+	char cbuf[CMSG_SPACE (sizeof (int))];
+	char c;
+	int s, conn, lfd = -1;
+
+	if (strlen (path) >= sizeof (sun.sun_path))
+		return 0;
+
+	// wait for the old process to contact us
+	s = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0)
+		return 0;
+	memset (&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	strcpy (sun.sun_path, path);
+	unlink (path);
+	if (bind (s, (struct sockaddr*)&sun, sizeof (sun)) < 0 || listen (s, 1) < 0) {
+		::close (s);
+		return 0;
+	}
+	FD_ZERO (&fds); FD_SET (s, &fds);
+	tv.tv_sec = timeout; tv.tv_usec = 0;
+	if (select (s + 1, &fds, NULL, NULL, timeout ? &tv : NULL) <= 0 ||
+	    (conn = ::accept (s, NULL, NULL)) < 0) {
+		::close (s); unlink (path);
 		return 0;
 	}
+	::close (s); unlink (path);
+
+	// fetch the descriptor
+	memset (&msg, 0, sizeof (msg));
+	iov.iov_base = &c; iov.iov_len = 1;
+	msg.msg_iov = &iov; msg.msg_iovlen = 1;
+	msg.msg_control = cbuf; msg.msg_controllen = sizeof (cbuf);
+	if (recvmsg (conn, &msg, 0) == 1) {
+		cmsg = CMSG_FIRSTHDR (&msg);
+		if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy (&lfd, CMSG_DATA (cmsg), sizeof (int));
+	}
+	::close (conn);
+	if (lfd == -1)
+		return 0;
+
+	// victory
+	setFD (lfd);
+	return 1;
+}
+
+/*
+ * NETSERVER::setACL (ACL* a)
+ *
+ * This will set the access list for new connections to [a].
+ *
+ */
+void
+NETSERVER::setACL (ACL* a) {
+	acl = a;
+}
+
+/*
+ * NETSERVER::getACL()
+ *
+ * This will return the access list for new connections.
+ *
+ */
+ACL*
+NETSERVER::getACL() {
+	return acl;
+}
+
+/*
+ * NETSERVER::setTLS (TLSCONTEXT* ctx)
+ *
+ * This will cause new connections to use TLS with context [ctx]. If [ctx] is
+ * NULL, TLS is not used.
+ *
+ */
+void
+NETSERVER::setTLS (TLSCONTEXT* ctx) {
+	tlsContext = ctx;
+}
+
+/*
+ * NETSERVER::setRateLimit (RATELIMIT* r)
+ *
+ * This will set the rate limiter for new connections to [r].
+ *
+ */
+void
+NETSERVER::setRateLimit (RATELIMIT* r) {
+	ratelimit = r;
+}
+
+/*
+ * NETSERVER::setMaxClients (int max)
+ *
+ * This will limit the number of concurrent clients to [max]. Zero means there
+ * is no limit.
+ *
+ */
+void
+NETSERVER::setMaxClients (int max) {
+	maxClients = max;
+}
+
+/*
+ * NETSERVER::setTotalMaxClients (int max)
+ *
+ * This will limit the number of concurrent clients of all servers together
+ * to [max]. Zero means there is no limit.
+ *
+ */
+void
+NETSERVER::setTotalMaxClients (int max) {
+	totalMaxClients = max;
+}
+
+/*
+ * NETSERVER::getTotalClients()
+ *
+ * This will return the number of clients of all servers together.
+ *
+ */
+int
+NETSERVER::getTotalClients() {
+	return totalClients;
+}
+
+/*
+ * NETSERVER::getCounter (int which)
+ *
+ * This will return the value of connection counter [which].
+ *
+ */
+unsigned long
+NETSERVER::getCounter (int which) {
+	return (which >= 0 && which < NETSERVER_COUNT_MAX) ? counters[which] : 0;
+}
+
+/*
+ * NETSERVER::resetCounters()
+ *
+ * This will reset all connection counters to zero.
+ *
+ */
+void
+NETSERVER::resetCounters() {
+	memset (counters, 0, sizeof (counters));
+	memset (retired, 0, sizeof (retired));
+}
+
+/*
+ * NETSERVER::retire (NETSERVICE* client)
+ *
+ * This will add the counters of [client], which is about to be deleted, to
+ * those of the clients which are gone.
+ *
+ */
+void
+NETSERVER::retire (NETSERVICE* client) {
+	for (int i = 0; i < NETSERVICE_STAT_MAX; i++) {
+		// the peak is the only one which doesn't add up
+		if (i == NETSERVICE_STAT_OUTPUT_PEAK) {
+			if (client->getStat (i) > retired[i])
+				retired[i] = client->getStat (i);
+		} else
+			retired[i] += client->getStat (i);
+	}
+}
+
+/*
+ * NETSERVER::getSummary (struct NETSUMMARY* s, int tcp)
+ *
+ * This will summarize the connections of the server in [s]. If [tcp] is
+ * non-zero, the kernel is asked about every connection as well.
+ *
+ */
+void
+NETSERVER::getSummary (struct NETSUMMARY* s, int tcp) {
+	struct NETTCPINFO info;
+	unsigned long long rttTotal = 0;
+	NETSERVICE* c;
+	int n, i, measured = 0;
+
+	memset (s, 0, sizeof (struct NETSUMMARY));
+	memcpy (s->stats, retired, sizeof (retired));
+	n = getClients()->count();
+	for (int j = 0; j < n; j++) {
+		c = (NETSERVICE*)getClients()->elementAt (j);
+		s->clients++;
+		for (i = 0; i < NETSERVICE_STAT_MAX; i++) {
+			if (i == NETSERVICE_STAT_OUTPUT_PEAK) {
+				if (c->getStat (i) > s->stats[i])
+					s->stats[i] = c->getStat (i);
+			} else
+				s->stats[i] += c->getStat (i);
+		}
+		s->outputQueued += c->getOutputLength();
+		s->inputBuffered += c->getInputLength();
+		if (c->isOutputFull())
+			s->outputFull++;
+		if (c->isReadPaused())
+			s->readPaused++;
+
+		// does the kernel have anything to add ?
+		if (!tcp || !c->getTCPInfo (&info))
+			// no. move on
+			continue;
+		rttTotal += info.rtt; measured++;
+		if (info.rtt > s->rttMax)
+			s->rttMax = info.rtt;
+		s->retransmits += info.retransmits;
+	}
+	if (measured > 0)
+		s->rttAvg = (unsigned int)(rttTotal / measured);
+}
+
+/*
+ * NETSERVER::incoming()
+ *
+ * This will handle a new connection by accepting it.
+ *
+ */
+void
+NETSERVER::incoming() {
+	accept();
+}
+
+/*
+ * NETSERVER::createClient()
+ *
+ * This will construct a client for a new connection. By default, there is
+ * none and the connection is refused.
+ *
+ */
+SERVICECLIENT*
+NETSERVER::createClient() {
+	return NULL;
+}
+
+/*
+ * NETSERVER::acceptFD (struct sockaddr_in* sin)
+ *
+ * This will accept the pending connection and store the peer's address in
+ * [sin]. The connection is checked against the access list, the client limit
+ * and the rate limiter and closed if it is refused. It will return the new
+ * file descriptor, or -1 on failure.
+ *
+ */
+int
+NETSERVER::acceptFD (struct sockaddr_in* sin) {
+	socklen_t slen = sizeof (struct sockaddr_in);
+	int client_fd, reason;
+	IPV4KEY key;
+
+	// accept the connection
+	client_fd = ::accept (fd, (struct sockaddr*)sin, &slen);
+	if (client_fd < 0)
+		return -1;
+
+	// is this peer allowed in ?
+	key = IPV4KEY (ntohl (sin->sin_addr.s_addr));
+	if (acl != NULL && acl->check (key) != ACL_ALLOW)
+		// no. get rid of it
+		reason = NETSERVER_COUNT_DENIED_ACL;
+	else if ((maxClients > 0 && getClients()->count() >= maxClients) ||
+	         (totalMaxClients > 0 && totalClients >= totalMaxClients))
+		// we, or all of us together, are full. get rid of it
+		reason = NETSERVER_COUNT_DENIED_LIMIT;
+	else if (ratelimit != NULL && !ratelimit->check (key))
+		// this peer is too eager. get rid of it
+		reason = NETSERVER_COUNT_DENIED_RATE;
+	else
+		reason = NETSERVER_COUNT_ACCEPTED;
+
+	counters[reason]++;
+	if (reason != NETSERVER_COUNT_ACCEPTED) {
+		#ifdef _DEBUG_NETWORK
+		printf ("NETSERVER::acceptFD(): connection refused (reason %u)\n", reason);
+		#endif // _DEBUG_NETWORK
+		::close (client_fd);
+		return -1;
+	}
 
 	// set the close-on-exec flag. this is required in case exec..() is used,
   // since clients can only exit if no processes occupy the sockets.
 	fcntl (client_fd, F_SETFD, FD_CLOEXEC);
-	
+
+	#ifdef OS_BSD
+	// the connection inherits non-blocking mode from the listening socket here
+	fcntl (client_fd, F_SETFL, fcntl (client_fd, F_GETFL, 0) & ~O_NONBLOCK);
+	#endif // OS_BSD
+	return client_fd;
+}
+
+/*
+ * NETSERVER::attach (SERVICECLIENT* client, int client_fd,
+ *                    struct sockaddr_in* sin)
+ *
+ * This will hook connection [client_fd] from [sin] up to [client]. It will
+ * return zero on failure and non-zero on success.
+ *
+ */
+int
+NETSERVER::attach (SERVICECLIENT* client, int client_fd, struct sockaddr_in* sin) {
+	IPV4ADDRESS* addr = new IPV4ADDRESS();
+
+	// copy the address over
+	memcpy (addr->getInternalAddress(), sin, sizeof (struct sockaddr_in));
+
 	// assign the client the correct file descriptor and parent
 	client->setFD (client_fd);
 	client->setParent (this);
 	client->setClientAddress (addr);
+	client->setAutoCork (isAutoCork());
 
-	// append the client to the pool of clients
+	// need to speak TLS ?
+	if (tlsContext != NULL && !client->startTLS (tlsContext, 1)) {
+		// yes, but this failed. get rid of the client
+		delete client;
+		return 0;
+	}
+
+	// append the client to the pool of clients. until it is closed, it counts
+	// towards the limit of all servers
 	addClient (client);
+	client->counted = 1;
+	__sync_add_and_fetch (&totalClients, 1);
 
 	#ifdef _DEBUG_NETWORK
 	printf ("NETSERVER::accept(): client 0x%x added\n", (unsigned int)client);
@@ -128,4 +549,57 @@ NETSERVER::accept (SERVICECLIENT* client) {
 	return 1;
 }
 
+/*
+ * NETSERVER::accept (SERVICECLIENT* client)
+ *
+ * This will assign the pending connection to [client]. It will return zero on
+ * failure and non-zero on success.
+ *
+ */
+int
+NETSERVER::accept (SERVICECLIENT* client) {
+	struct sockaddr_in sin;
+	int client_fd;
+
+	// accept the connection
+	client_fd = acceptFD (&sin);
+	if (client_fd < 0) {
+		// this failed. get rid of the client and leave
+		delete client;
+		return 0;
+	}
+
+	return attach (client, client_fd, &sin);
+}
+
+/*
+ * NETSERVER::accept()
+ *
+ * This will accept the pending connection and assign it to a client
+ * constructed by createClient(). It will return zero on failure and non-zero
+ * on success.
+ *
+ */
+int
+NETSERVER::accept() {
+	struct sockaddr_in sin;
+	SERVICECLIENT* client;
+	int client_fd;
+
+	// accept the connection; refused peers never get a client object
+	client_fd = acceptFD (&sin);
+	if (client_fd < 0)
+		return 0;
+
+	// construct a client
+	client = createClient();
+	if (client == NULL) {
+		// no client. drop the connection
+		::close (client_fd);
+		return 0;
+	}
+
+	return attach (client, client_fd, &sin);
+}
+
 /* vim:set ts=2 sw=2: */
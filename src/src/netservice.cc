@@ -24,14 +24,63 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef NET_THREADS
+#include <pthread.h>
+#endif // NET_THREADS
+#ifdef OS_LINUX
+#include <sys/sendfile.h>
+#endif // OS_LINUX
 #include <network.h>
+#include <tls.h>
+#include <pubsub.h>
+#include <loopback.h>
+
+//! \brief NETSERVICE_IOV_MAX is the number of chunks written at once
+#define NETSERVICE_IOV_MAX 16
+
+//! \brief NETSERVICE_CORK_LIMIT is the amount of corked output written early
+#define NETSERVICE_CORK_LIMIT 65536
+
+/*
+ * NETSLOT is a handle slot. [gen] changes whenever [service] is deleted, and
+ * [next] links the free slots together. Slots are allocated in chunks which
+ * never move, so lookups need no lock.
+ */
+struct NETSLOT {
+	NETSERVICE*   service;
+	unsigned int  gen;
+	int           next;
+};
+
+static NETSLOT* handle_chunks[NETHANDLE_CHUNKS];
+static int handle_used = 0;
+static int handle_free = -1;
+#ifdef NET_THREADS
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif // NET_THREADS
+
+/*
+ * handle_slot (int i)
+ *
+ * This will return handle slot [i].
+ *
+ */
+static inline NETSLOT*
+handle_slot (int i) {
+	return &handle_chunks[i / NETHANDLE_CHUNK][i % NETHANDLE_CHUNK];
+}
 
 /*
  * NETSERVICE::NETSERVICE()
@@ -43,6 +92,20 @@ NETSERVICE::NETSERVICE() {
 	// no file descriptors nor clients just yet
 	fd = -1; clients = new VECTOR(); parent = NULL; clientAddress = NULL;
 	filp = NULL;
+
+	// no queued data, and no flow control either
+	outqueue = new NETQUEUE(); inbuf = new NETBUFFER(); inputLimit = 0;
+	highWatermark = 0; lowWatermark = 0; pairedInput = NULL;
+	readPaused = 0; outputFull = 0; inputPending = 0;
+	nonBlocking = 0; tls = NULL; loop = NULL; budget = -1;
+	priority = NETSERVICE_PRIORITY_NORMAL;
+	dropped = 0; subscriptions = NULL; draining = 0;
+	autoCork = 0; corked = 0; network = NULL;
+	memset (stats, 0, sizeof (stats));
+
+	// nothing refers to us yet
+	buried = 0; buriedIn = NULL; graveNext = NULL; handleSlot = -1;
+	counted = 0;
 }
 
 /*
@@ -57,12 +120,41 @@ NETSERVICE::~NETSERVICE() {
 		// yes. get rid of it
 		delete clientAddress;
 
-	// close all connections
-	close();
+	// was the network to remove us ?
+	if (buried) {
+		// yes. it needn't bother anymore; do it ourselves
+		NETWORK* n = buriedIn;
+		n->unbury (this);
+		if (parent == NULL && network == n) {
+			n->services->removeElement (this);
+			network = NULL;
+		}
+	}
+
+	// close all connections. we are going away, so this can't wait
+	closeAll (0);
+
+	// handles to us are no longer valid
+	if (handleSlot != -1) {
+		#ifdef NET_THREADS
+		pthread_mutex_lock (&handle_lock);
+		#endif // NET_THREADS
+		NETSLOT* slot = handle_slot (handleSlot);
+		slot->service = NULL;
+		if (++slot->gen == 0)
+			slot->gen = 1;
+		slot->next = handle_free; handle_free = handleSlot;
+		#ifdef NET_THREADS
+		pthread_mutex_unlock (&handle_lock);
+		#endif // NET_THREADS
+	}
 
 	// get rid of the clients
 	if (clients)
 		delete clients;
+
+	// get rid of the buffers
+	delete outqueue; delete inbuf;
 }
 
 /*
@@ -84,6 +176,9 @@ NETSERVICE::getFD() {
  */
 void
 NETSERVICE::setFD(int no) {
+	// an in-process connection makes way, too
+	if (loop != NULL)
+		loop->detach (this);
 	fd = no;
 
 	if (fd != -1) {
@@ -137,6 +232,20 @@ NETSERVICE::setParent(NETSERVICE* p) {
 	parent = p;
 }
 
+/*
+ * NETSERVICE::getNetwork()
+ *
+ * This will return the network the service, or its parent, was added to, or
+ * NULL if there is none.
+ *
+ */
+NETWORK*
+NETSERVICE::getNetwork() {
+	if (network == NULL && parent != NULL)
+		return parent->getNetwork();
+	return network;
+}
+
 /*
  * NETSERVICE::setClientAddress (NETADDRESS* addr)
  *
@@ -152,7 +261,8 @@ NETSERVICE::setClientAddress (NETADDRESS* addr) {
  * NETSERVICE::recv (char* buf, int len)
  *
  * This will try to receive up to [len] bytes into [buf]. It will return the
- * number of bytes received.
+ * number of bytes received, or -1 with errno set to EAGAIN if the budget is
+ * used up.
  *
  */
 int
@@ -162,8 +272,37 @@ NETSERVICE::recv (char* buf, int len) {
 		// no. refuse to read anything
 		return 0;
 
+	// is input buffered ?
+	if (inputLimit > 0) {
+		// yes. hand out buffered data first
+		if (inbuf->getLength() > 0)
+			return inbuf->read (buf, len);
+
+		// nothing buffered; take whatever the socket has, without waiting, as
+		// far as the budget allows
+		len = allowance (len);
+		if (len == 0)
+			return spent();
+		int i = readRaw (buf, len, MSG_DONTWAIT);
+		countRead (i);
+		if (i > 0 && budget > 0)
+			budget -= i;
+		return (i == -1) ? 0 : i;
+	}
+
+	// if this can't block, the handler may keep reading until it runs dry.
+	// don't let it take more than its share
+	if (nonBlocking) {
+		len = allowance (len);
+		if (len == 0)
+			return spent();
+	}
+
 	// fetch the data
-	int i = ::recv (fd, buf, len, 0);
+	int i = readRaw (buf, len, 0);
+	countRead (i);
+	if (i > 0 && budget > 0)
+		budget -= i;
 
 	// return the size
 	return (i == -1) ? 0 : i;
@@ -172,22 +311,206 @@ NETSERVICE::recv (char* buf, int len) {
 /*
  * NETSERVICE::send (char* buf, int len)
  *
- * This will try to send up to [len] bytes from [buf]. It will return the
- * number of bytes sent.
+ * This will try to send up to [len] bytes from [buf]. Whatever cannot be sent
+ * right away is queued. It will return the number of bytes sent or queued.
  *
  */
 int
 NETSERVICE::send (char* buf, int len) {
+	int i = 0, n;
+
 	// got a file descriptor at hand ?
-	if (fd == -1)
+	if (fd == -1 || dropped)
 		// no. refuse to read anything
 		return 0;
 
-	// send the data
-	int i = ::send (fd, buf, len, 0);
+	// if nothing is queued or held back, try to send the data right away
+	if (outqueue->getLength() == 0 && !corked) {
+		i = writeRaw (buf, len, MSG_DONTWAIT);
+		countWrite (i);
+		if (i < 0) {
+			// did the connection fail ?
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				// yes. don't bother queueing
+				return 0;
+			i = 0;
+		}
+	}
 
-	// return the size
-	return (i == -1) ? 0 : i;
+	// queue whatever is left, as far as there is room for it
+	while (i < len) {
+		n = makeRoom (len - i);
+		if (n <= 0)
+			// no room, or the connection failed. report what we did manage
+			return i;
+		if (n > len - i)
+			n = len - i;
+		if (!outqueue->append (buf + i, n))
+			// out of memory. report what we did manage to send
+			return i;
+		i += n;
+		checkHigh();
+	}
+
+	// don't hold back too much
+	if (corked && outqueue->getLength() >= NETSERVICE_CORK_LIMIT)
+		flush();
+
+	// report success
+	return len;
+}
+
+/*
+ * NETSERVICE::sendBlock (NETBLOCK* b)
+ *
+ * This will try to send shared block [b]. Whatever cannot be sent right away
+ * is queued by reference. It will return the number of bytes sent or queued.
+ *
+ */
+int
+NETSERVICE::sendBlock (NETBLOCK* b) {
+	int i = 0;
+
+	// got a file descriptor at hand ?
+	if (fd == -1 || dropped)
+		// no. refuse to send anything
+		return 0;
+
+	// if nothing is queued or held back, try to send the data right away
+	if (outqueue->getLength() == 0 && !corked) {
+		i = writeRaw (b->getData(), b->getLength(), MSG_DONTWAIT);
+		countWrite (i);
+		if (i < 0) {
+			// did the connection fail ?
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				// yes. don't bother queueing
+				return 0;
+			i = 0;
+		}
+	}
+
+	// queue a reference to whatever is left, once there is room for it
+	if (i < b->getLength()) {
+		// the block goes as a whole, even if it is larger than the limit
+		int n = makeRoom (b->getLength() - i);
+		if (n < 0 || (n < b->getLength() - i && outqueue->getLength() > 0))
+			return i;
+		if (!outqueue->append (b, i))
+			return i;
+		checkHigh();
+	}
+
+	// don't hold back too much
+	if (corked && outqueue->getLength() >= NETSERVICE_CORK_LIMIT)
+		flush();
+
+	return b->getLength();
+}
+
+/*
+ * NETSERVICE::broadcast (char* buf, int len)
+ *
+ * This will send the [len] bytes at [buf] to all clients. It will return the
+ * number of clients the data was sent or queued to.
+ *
+ */
+int
+NETSERVICE::broadcast (char* buf, int len) {
+	NETBLOCK* b;
+	int n;
+
+	// copy the data once
+	b = NETBLOCK::create (buf, len);
+	if (b == NULL)
+		return 0;
+
+	// hand it to everyone; the queues keep their own references
+	n = broadcast (b);
+	b->unref();
+	return n;
+}
+
+/*
+ * NETSERVICE::broadcast (NETBLOCK* b)
+ *
+ * This will send shared block [b] to all clients. Clients which are above
+ * their high watermark, or have no room left in their output queue, miss it;
+ * nobody is waited for. It will return the number of clients the block was
+ * sent or queued to.
+ *
+ */
+int
+NETSERVICE::broadcast (NETBLOCK* b) {
+	NETSERVICE* c;
+	int n = 0;
+
+	for (int i = 0; i < clients->count(); i++) {
+		c = (NETSERVICE*)clients->elementAt (i);
+
+		// is this client keeping up ?
+		if (c->isOutputFull())
+			// no. don't pile up more for it
+			continue;
+		if (c->sendBlock (b) == b->getLength())
+			n++;
+	}
+	return n;
+}
+
+/*
+ * NETSERVICE::checkHigh()
+ *
+ * This will call outputHigh() if the output queue just rose to the high
+ * watermark.
+ *
+ */
+void
+NETSERVICE::checkHigh() {
+	// keep track of how far the output has ever backed up
+	if ((unsigned long)outqueue->getLength() > stats[NETSERVICE_STAT_OUTPUT_PEAK])
+		stats[NETSERVICE_STAT_OUTPUT_PEAK] = outqueue->getLength();
+
+	// did we just cross the high watermark ?
+	if (highWatermark > 0 && !outputFull && outqueue->getLength() >= highWatermark) {
+		// yes. tell whoever is interested
+		outputFull = 1;
+		outputHigh();
+	}
+}
+
+/*
+ * NETSERVICE::makeRoom (int len)
+ *
+ * This will see how many of [len] more bytes fit in the output queue, unless
+ * watermarks are set. If the queue is full, what the socket takes right away
+ * is sent first; the peer is never waited for. It will return the number of
+ * bytes which may be queued, zero with errno set to EAGAIN if there is no
+ * room, or -1 if the connection failed.
+ *
+ */
+int
+NETSERVICE::makeRoom (int len) {
+	int room, i;
+
+	// is the producer watching the queue itself ?
+	if (highWatermark > 0)
+		// yes. it may queue as much as it likes
+		return len;
+
+	// no. keep the queue bounded. waiting for the peer would stall the whole
+	// network, so push out what we can and settle for what is left
+	room = NETSERVICE_QUEUE_LIMIT - outqueue->getLength();
+	if (room < len && outqueue->getLength() > 0) {
+		i = writeQueue (MSG_DONTWAIT);
+		if (i < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			return -1;
+		room = NETSERVICE_QUEUE_LIMIT - outqueue->getLength();
+	}
+	if (room <= 0) {
+		errno = EAGAIN;
+		return 0;
+	}
+	return room;
 }
 
 /*
@@ -199,6 +522,8 @@ NETSERVICE::send (char* buf, int len) {
  */
 int
 NETSERVICE::sendf (char* fmt, ...) {
+	char tmp[1024];
+	char* buf = tmp;
 	va_list ap;
 	int ret;
 
@@ -209,101 +534,1072 @@ NETSERVICE::sendf (char* fmt, ...) {
 
 	// build the data to send
 	va_start (ap, fmt);
-	ret = vfprintf (filp, fmt, ap);
+	ret = vsnprintf (tmp, sizeof (tmp), fmt, ap);
 	va_end (ap);
+	if (ret < 0)
+		return 0;
+
+	// did it fit ?
+	if (ret >= (int)sizeof (tmp)) {
+		// no. allocate a buffer which is large enough and try again
+		buf = (char*)malloc (ret + 1);
+		if (buf == NULL)
+			return 0;
+		va_start (ap, fmt);
+		vsnprintf (buf, ret + 1, fmt, ap);
+		va_end (ap);
+	}
+
+	// send it
+	ret = send (buf, ret);
+	if (buf != tmp)
+		free (buf);
 	return ret;
 }
 
 /*
- * NETSERVICE::close ()
+ * NETSERVICE::flush()
  *
- * This will close the network connection.
+ * This will send as much of the queued data as the socket will take without
+ * blocking. It will return zero if the connection failed or non-zero if not.
  *
  */
-void
-NETSERVICE::close () {
-	NETSERVICE* c;
+int
+NETSERVICE::flush() {
+	int i;
 
-	// got a file descriptor ?
-	if (fd != -1) {
-		// yes. close it
-		#ifdef _DEBUG_NETWORK
-		printf ("NETSERVICE(): closed fd %u for 0x%x\n", fd, (unsigned int)this);
-		#endif // _DEBUG_NETWORK
-		if (filp != NULL) {
-			fflush (filp);
-			fclose (filp);
-		} else {
-			::shutdown (fd, SHUT_RDWR);
-			::close (fd);
-		}
-		fd = -1;
-	}
+	// anything to do ?
+	if (fd == -1 || outqueue->getLength() == 0)
+		// no. leave
+		return 1;
 
-	// do we have a parent object ?
-	if (parent) {
-		// yes. remove us as a client
-		parent->removeClient (this);
+	// send what we can
+	i = writeQueue (MSG_DONTWAIT);
+	if (i < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 1 : 0;
+
+	// did we just drain to the low watermark ?
+	if (outputFull && outqueue->getLength() <= lowWatermark) {
+		// yes. tell whoever is interested
+		outputFull = 0;
+		outputLow();
 	}
+	return 1;
+}
 
-	// scan all clients, too
-	for (int i = 0; i < clients->count(); i++) {
-		// fetch the client
-		c = (NETSERVICE*)clients->elementAt (i);
+/*
+ * NETSERVICE::writeQueue (int flags)
+ *
+ * This will write as much of the output queue as possible, passing [flags]
+ * to ::send(). Written data is removed from the queue. It will return what
+ * ::send() would.
+ *
+ */
+int
+NETSERVICE::writeQueue (int flags) {
+	struct iovec iov[NETSERVICE_IOV_MAX];
+	int i;
 
-		#ifdef _DEBUG_NETWORK
-		printf ("NETSERVICE(): close(): closing 0x%x for 0x%x\n", (unsigned int)c, (unsigned int)this);
-		#endif // _DEBUG_NETWORK
+	i = writeVector (iov, outqueue->getVector (iov, NETSERVICE_IOV_MAX), flags);
+	countWrite (i);
+	if (i > 0)
+		outqueue->consume (i);
+	return i;
+}
+
+/*
+ * NETSERVICE::writeVector (struct iovec* iov, int n, int flags)
+ *
+ * This will write as much of the [n] buffers in [iov] as possible, passing
+ * [flags] to ::send(). It will return what ::send() would.
+ *
+ */
+int
+NETSERVICE::writeVector (struct iovec* iov, int n, int flags) {
+	struct msghdr msg;
 
-		// close the connection of this client
-		c->close();
+	// connected in-process ?
+	if (loop != NULL)
+		// yes. copy it over
+		return loop->write (this, iov, n);
 
-		// get rid of the object, too
-		clients->removeElement (c);
-		delete c;
+	#ifdef NET_TLS
+	// TLS encrypts a chunk at a time, unless the kernel does it
+	if (tls != NULL && !(tls->isEstablished() && tls->isKernelSend()))
+		return writeRaw ((char*)iov[0].iov_base, iov[0].iov_len, flags);
+	#endif // NET_TLS
+
+	// hand as many chunks as we can to the kernel at once
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	return ::sendmsg (fd, &msg, flags);
+}
+
+/*
+ * NETSERVICE::fill()
+ *
+ * This will read as much data into the input buffer as the limit allows. It
+ * will return the number of bytes read, zero on end of file or failure, or -1
+ * if there was nothing to read.
+ *
+ */
+int
+NETSERVICE::fill() {
+	int len = inputLimit - inbuf->getLength();
+	char* p;
+	int i;
+
+	// is there room left, and may we fill it ?
+	len = allowance (len);
+	if (len <= 0)
+		// no. don't read anything
+		return -1;
+
+	// grab the space and read into it
+	p = inbuf->reserve (len);
+	if (p == NULL)
+		return -1;
+	i = readRaw (p, len, MSG_DONTWAIT);
+	countRead (i);
+	if (i < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -1 : 0;
+	inbuf->commit (i);
+	if (budget > 0)
+		budget -= i;
+
+	#ifdef NET_TLS
+	// TLS may have decrypted more than we took; make sure it gets handled
+	if (tls != NULL && tls->pending() > 0)
+		inputPending = 1;
+	#endif // NET_TLS
+	return i;
+}
+
+/*
+ * NETSERVICE::allowance (int len)
+ *
+ * This will return how many of [len] bytes may be read in this dispatch.
+ *
+ */
+int
+NETSERVICE::allowance (int len) {
+	// is there a budget at all ?
+	if (budget < 0)
+		// no. take everything
+		return len;
+	return (len < budget) ? len : budget;
+}
+
+/*
+ * NETSERVICE::spent()
+ *
+ * This is called when the budget stops a read. Input still buffered gets
+ * handled the next time round, even if the socket has nothing more. It will
+ * return -1 with errno set to EAGAIN, so the handler does not mistake this
+ * for end of file.
+ *
+ */
+int
+NETSERVICE::spent() {
+	if (inbuf->getLength() > 0)
+		inputPending = 1;
+	errno = EAGAIN;
+	return -1;
+}
+
+/*
+ * NETSERVICE::readRaw (char* buf, int len, int flags)
+ *
+ * This will read up to [len] bytes from the connection into [buf], passing
+ * [flags] to ::recv(). TLS connections are decrypted. It will return what
+ * ::recv() would.
+ *
+ */
+int
+NETSERVICE::readRaw (char* buf, int len, int flags) {
+	if (loop != NULL)
+		return loop->read (this, buf, len, flags);
+
+	#ifdef NET_TLS
+	if (tls != NULL)
+		return tls->read (buf, len);
+	#endif // NET_TLS
+
+	return ::recv (fd, buf, len, flags);
+}
+
+/*
+ * NETSERVICE::writeRaw (char* buf, int len, int flags)
+ *
+ * This will write up to [len] bytes from [buf] to the connection, passing
+ * [flags] to ::send(). TLS connections are encrypted, unless the kernel does
+ * it for us. It will return what ::send() would.
+ *
+ */
+int
+NETSERVICE::writeRaw (char* buf, int len, int flags) {
+	if (loop != NULL) {
+		struct iovec iov;
+		iov.iov_base = buf; iov.iov_len = len;
+		return loop->write (this, &iov, 1);
 	}
+
+	#ifdef NET_TLS
+	if (tls != NULL && !(tls->isEstablished() && tls->isKernelSend()))
+		return tls->write (buf, len);
+	#endif // NET_TLS
+
+	return ::send (fd, buf, len, flags);
 }
 
 /*
- * NETSERVICE::removeClient (NETSERVICE* client)
+ * NETSERVICE::setNonBlocking()
  *
- * This will remove [client] from the list of clients.
+ * This will switch the socket to non-blocking mode. It will return zero on
+ * failure or non-zero on success.
  *
  */
-void
-NETSERVICE::removeClient (NETSERVICE* client) {
-	clients->removeElement (client);
+int
+NETSERVICE::setNonBlocking() {
+	int flags;
+
+	// already done ?
+	if (nonBlocking)
+		// yes. nothing to do
+		return 1;
+
+	// stdio opened the socket for appending, which sendfile() and splice()
+	// refuse. it means nothing for a socket anyway
+	flags = fcntl (fd, F_GETFL, 0);
+	if (flags < 0 || fcntl (fd, F_SETFL, (flags | O_NONBLOCK) & ~O_APPEND) < 0)
+		return 0;
+	nonBlocking = 1;
+	return 1;
 }
 
 /*
- * NETSERVICE::addClient (NETSERVICE* client)
+ * NETSERVICE::startTLS (TLSCONTEXT* ctx, int server, char* host)
  *
- * This will add [client] to list of clients.
+ * This will start TLS using context [ctx]. If [server] is non-zero, we act as
+ * the server, otherwise as the client of server [host]. It will return zero on
+ * failure or non-zero on success.
  *
  */
-void
-NETSERVICE::addClient (NETSERVICE* client) {
-	clients->addElement (client);
+int
+NETSERVICE::startTLS (TLSCONTEXT* ctx, int server, char* host) {
+	#ifdef NET_TLS
+	// need a connection without TLS
+	if (fd == -1 || tls != NULL)
+		return 0;
+
+	// the handshake must not block the loop
+	if (!setNonBlocking())
+		return 0;
+
+	// set up the session
+	tls = new TLSSESSION (ctx, fd, server, host);
+	if (!tls->isValid()) {
+		delete tls; tls = NULL;
+		return 0;
+	}
+
+	// records are decrypted as a whole, so input must always be buffered
+	if (inputLimit == 0)
+		inputLimit = 16384;
+	return 1;
+	#else
+	return 0;
+	#endif // NET_TLS
 }
 
 /*
- * NETSERVICE::peek ()
+ * NETSERVICE::getTLS()
  *
- * This will peek whether we have data available. It will return zero if not
- * and non-zero if so.
+ * This will return the TLS state of the connection, or NULL if the connection
+ * does not use TLS.
+ *
+ */
+TLSSESSION*
+NETSERVICE::getTLS() {
+	return tls;
+}
+
+/*
+ * NETSERVICE::sendFile (int filefd, off_t* offset, int len)
+ *
+ * This will send up to [len] bytes of file [filefd], starting at [offset].
+ * [offset] is advanced by the amount sent. It will return the number of bytes
+ * sent or -1 on failure.
  *
  */
 int
-NETSERVICE::peek() {
-	char buf;
+NETSERVICE::sendFile (int filefd, off_t* offset, int len) {
+	int i;
 
 	// got a file descriptor at hand ?
+	if (fd == -1 || dropped)
+		// no. refuse to send anything
+		return -1;
+
+	// keep things in order; queued data must go first. if it was only held
+	// back by automatic corking, it may well fit right away
+	if (corked)
+		flush();
+	if (outqueue->getLength() > 0)
+		return 0;
+
+	// this must not block
+	if (!setNonBlocking())
+		return -1;
+
+	i = writeFile (filefd, offset, len);
+	countWrite (i);
+	if (i < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	return i;
+}
+
+/*
+ * NETSERVICE::writeFile (int filefd, off_t* offset, int len)
+ *
+ * This will write up to [len] bytes of file [filefd] from [offset] onwards to
+ * the connection without blocking, and advance [offset] by the amount sent.
+ * It will return what ::send() would.
+ *
+ */
+int
+NETSERVICE::writeFile (int filefd, off_t* offset, int len) {
+	char tmp[16384];
+	int i;
+
+	#ifdef OS_LINUX
+	// can the kernel send the file by itself ?
+	#ifdef NET_TLS
+	if (loop == NULL && (tls == NULL || (tls->isEstablished() && tls->isKernelSend())))
+	#else
+	if (loop == NULL)
+	#endif // NET_TLS
+	{
+		// yes. let it do so
+		return sendfile (fd, filefd, offset, len);
+	}
+	#endif // OS_LINUX
+
+	// read the file ourselves. whatever the socket does not take is read again
+	// next time
+	if (len > (int)sizeof (tmp))
+		len = sizeof (tmp);
+	i = pread (filefd, tmp, len, *offset);
+	if (i <= 0)
+		return i;
+	i = writeRaw (tmp, i, MSG_DONTWAIT);
+	if (i > 0)
+		*offset += i;
+	return i;
+}
+
+/*
+ * NETSERVICE::setNoDelay (int on)
+ *
+ * This will disable Nagle's algorithm if [on] is non-zero, or enable it if
+ * [on] is zero. It will return zero on failure or non-zero on success.
+ *
+ */
+int
+NETSERVICE::setNoDelay (int on) {
+	int i = on ? 1 : 0;
+
 	if (fd == -1)
-		// no. we can never have data ready
 		return 0;
+	return (setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof (i)) < 0) ? 0 : 1;
+}
 
-	// fetch the data
-	int i = ::recv (fd, &buf, 1, MSG_PEEK);
+/*
+ * NETSERVICE::setCork (int on)
+ *
+ * This will hold back partial segments if [on] is non-zero, or push them out
+ * if [on] is zero. It will return zero on failure or non-zero on success.
+ *
+ */
+int
+NETSERVICE::setCork (int on) {
+	if (fd == -1)
+		return 0;
+	#if defined(OS_LINUX) && defined(TCP_CORK)
+	int i = on ? 1 : 0;
+	return (setsockopt (fd, IPPROTO_TCP, TCP_CORK, &i, sizeof (i)) < 0) ? 0 : 1;
+	#elif defined(TCP_NOPUSH)
+	int i = on ? 1 : 0;
+	return (setsockopt (fd, IPPROTO_TCP, TCP_NOPUSH, &i, sizeof (i)) < 0) ? 0 : 1;
+	#else
+	// no way to do this here
+	return 0;
+	#endif
+}
+
+/*
+ * NETSERVICE::setAutoCork (int on)
+ *
+ * This will hold back data sent from within incoming() until it returns if
+ * [on] is non-zero.
+ *
+ */
+void
+NETSERVICE::setAutoCork (int on) {
+	autoCork = on;
+}
+
+/*
+ * NETSERVICE::isAutoCork()
+ *
+ * This will return non-zero if automatic corking is enabled.
+ *
+ */
+int
+NETSERVICE::isAutoCork() {
+	return autoCork;
+}
+
+/*
+ * NETSERVICE::setBusyPoll (int usec, int prefer)
+ *
+ * This will let the kernel busy poll for up to [usec] microseconds when
+ * receiving on the socket. If [prefer] is non-zero, busy polling is preferred
+ * over interrupts. It will return zero on failure or non-zero on success.
+ *
+ */
+int
+NETSERVICE::setBusyPoll (int usec, int prefer) {
+	if (fd == -1)
+		return 0;
+
+	#ifdef SO_BUSY_POLL
+	if (setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof (usec)) < 0)
+		return 0;
+	#ifdef SO_PREFER_BUSY_POLL
+	prefer = prefer ? 1 : 0;
+	if (setsockopt (fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof (prefer)) < 0 && prefer)
+		return 0;
+	#else
+	// can't prefer anything here
+	if (prefer)
+		return 0;
+	#endif // SO_PREFER_BUSY_POLL
+	return 1;
+	#else
+	// no busy polling here
+	return 0;
+	#endif // SO_BUSY_POLL
+}
+
+/*
+ * NETSERVICE::setIncomingCPU (int cpu)
+ *
+ * This will have the kernel prefer this socket for connections handled by
+ * CPU [cpu]. It will return zero on failure or non-zero on success.
+ *
+ */
+int
+NETSERVICE::setIncomingCPU (int cpu) {
+	if (fd == -1)
+		return 0;
+
+	#ifdef SO_INCOMING_CPU
+	return (setsockopt (fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof (cpu)) < 0) ? 0 : 1;
+	#else
+	// not supported here
+	return 0;
+	#endif // SO_INCOMING_CPU
+}
+
+/*
+ * NETSERVICE::setPriority (int prio)
+ *
+ * This will set the priority of the service to [prio].
+ *
+ */
+void
+NETSERVICE::setPriority (int prio) {
+	if (prio >= 0 && prio < NETSERVICE_PRIORITY_MAX)
+		priority = prio;
+}
+
+/*
+ * NETSERVICE::getPriority()
+ *
+ * This will return the priority of the service.
+ *
+ */
+int
+NETSERVICE::getPriority() {
+	return priority;
+}
+
+/*
+ * NETSERVICE::getTCPInfo (struct NETTCPINFO* info)
+ *
+ * This will ask the kernel about the connection and store what it knows in
+ * [info]. It will return zero on failure or non-zero on success.
+ *
+ */
+int
+NETSERVICE::getTCPInfo (struct NETTCPINFO* info) {
+	memset (info, 0, sizeof (struct NETTCPINFO));
+	if (fd == -1)
+		return 0;
+
+	#if defined(OS_LINUX) && defined(TCP_INFO)
+	// the C library may not know about the newer fields, so ask for them
+	// ourselves and only trust what the kernel filled in
+	struct tcp_info_ext {
+		struct tcp_info base;
+		uint64_t        pacingRate;
+		uint64_t        maxPacingRate;
+		uint64_t        bytesAcked;
+		uint64_t        bytesReceived;
+		uint32_t        segsOut;
+		uint32_t        segsIn;
+		uint32_t        notSentBytes;
+		uint32_t        minRtt;
+	} ti;
+	socklen_t len = sizeof (ti);
+
+	memset (&ti, 0, sizeof (ti));
+	if (getsockopt (fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+		return 0;
+	info->rtt = ti.base.tcpi_rtt; info->rttVar = ti.base.tcpi_rttvar;
+	info->cwnd = ti.base.tcpi_snd_cwnd; info->ssthresh = ti.base.tcpi_snd_ssthresh;
+	info->mss = ti.base.tcpi_snd_mss; info->unacked = ti.base.tcpi_unacked;
+	info->lost = ti.base.tcpi_lost; info->retransmits = ti.base.tcpi_total_retrans;
+
+	// while still in slow start, there is no threshold yet
+	if (info->ssthresh == 0x7fffffff)
+		info->ssthresh = 0;
+
+	// older kernels stop short of these
+	if (len >= offsetof (struct tcp_info_ext, segsOut)) {
+		info->bytesAcked = ti.bytesAcked; info->bytesReceived = ti.bytesReceived;
+	}
+	if (len >= offsetof (struct tcp_info_ext, minRtt))
+		info->notSent = ti.notSentBytes;
+	return 1;
+	#else
+	// not supported here
+	return 0;
+	#endif // OS_LINUX && TCP_INFO
+}
+
+/*
+ * NETSERVICE::getStat (int which)
+ *
+ * This will return the value of counter [which] of the connection.
+ *
+ */
+unsigned long
+NETSERVICE::getStat (int which) {
+	return (which >= 0 && which < NETSERVICE_STAT_MAX) ? stats[which] : 0;
+}
+
+/*
+ * NETSERVICE::resetStats()
+ *
+ * This will reset the counters of the connection to zero.
+ *
+ */
+void
+NETSERVICE::resetStats() {
+	memset (stats, 0, sizeof (stats));
+}
+
+/*
+ * NETSERVICE::setWatermarks (int high, int low)
+ *
+ * This will set the output high watermark to [high] and the low watermark to
+ * [low].
+ *
+ */
+void
+NETSERVICE::setWatermarks (int high, int low) {
+	highWatermark = high; lowWatermark = (low < high) ? low : high;
+}
+
+/*
+ * NETSERVICE::setInputLimit (int limit)
+ *
+ * This will buffer up to [limit] bytes of input. Zero disables buffering.
+ *
+ */
+void
+NETSERVICE::setInputLimit (int limit) {
+	inputLimit = limit;
+}
+
+/*
+ * NETSERVICE::setPairedInput (NETSERVICE* s)
+ *
+ * This will pair the input of [s] to our output.
+ *
+ */
+void
+NETSERVICE::setPairedInput (NETSERVICE* s) {
+	pairedInput = s;
+}
+
+/*
+ * NETSERVICE::drain()
+ *
+ * This will stop a server from accepting connections by closing its socket,
+ * drop all idle clients and have the others dropped as soon as they are
+ * idle.
+ *
+ */
+void
+NETSERVICE::drain() {
+	NETSERVICE* c;
+
+	draining = 1;
+
+	// no new connections please. the socket is closed rather than shut down,
+	// as another process may have taken it over
+	if (getType() == NETSERVICE_SERVER && fd != -1) {
+		if (filp != NULL)
+			fclose (filp);
+		else
+			::close (fd);
+		filp = NULL; fd = -1;
+	}
+
+	// get rid of whoever is idle; NETWORK::run() takes care of the rest
+	for (int i = 0; i < clients->count(); i++) {
+		c = (NETSERVICE*)clients->elementAt (i);
+		if (c->isIdle())
+			c->drop();
+	}
+}
+
+/*
+ * NETSERVICE::isDraining()
+ *
+ * This will return non-zero if the service is draining.
+ *
+ */
+int
+NETSERVICE::isDraining() {
+	return draining;
+}
+
+/*
+ * NETSERVICE::isDrained()
+ *
+ * This will return non-zero if the service is draining and has no clients
+ * left.
+ *
+ */
+int
+NETSERVICE::isDrained() {
+	return draining && clients->count() == 0;
+}
+
+/*
+ * NETSERVICE::isIdle()
+ *
+ * This will return non-zero if nothing is queued for input or output.
+ *
+ */
+int
+NETSERVICE::isIdle() {
+	return getOutputLength() == 0 && inbuf->getLength() == 0;
+}
+
+/*
+ * NETSERVICE::pauseReading()
+ *
+ * This will stop NETWORK::run() from reading from the service.
+ *
+ */
+void
+NETSERVICE::pauseReading() {
+	readPaused = 1;
+}
+
+/*
+ * NETSERVICE::resumeReading()
+ *
+ * This will allow NETWORK::run() to read from the service again. If input
+ * was left in the buffer, the handler will be called for it.
+ *
+ */
+void
+NETSERVICE::resumeReading() {
+	readPaused = 0;
+	if (inbuf->getLength() > 0)
+		inputPending = 1;
+}
+
+/*
+ * NETSERVICE::isReadPaused()
+ *
+ * This will return non-zero if reading from the service is paused.
+ *
+ */
+int
+NETSERVICE::isReadPaused() {
+	return readPaused;
+}
+
+/*
+ * NETSERVICE::isOutputFull()
+ *
+ * This will return non-zero if the output is above the high watermark.
+ *
+ */
+int
+NETSERVICE::isOutputFull() {
+	return outputFull;
+}
+
+/*
+ * NETSERVICE::getOutputLength()
+ *
+ * This will return the number of bytes queued for sending.
+ *
+ */
+int
+NETSERVICE::getOutputLength() {
+	return outqueue->getLength();
+}
+
+/*
+ * NETSERVICE::getInputLength()
+ *
+ * This will return the number of bytes of buffered input.
+ *
+ */
+int
+NETSERVICE::getInputLength() {
+	return inbuf->getLength();
+}
+
+/*
+ * NETSERVICE::getLines (NETLINE* lines, int max, char delim)
+ *
+ * This will store up to [max] complete lines of buffered input, ended by
+ * [delim], in [lines]. It will return the number of lines stored.
+ *
+ */
+int
+NETSERVICE::getLines (struct NETLINE* lines, int max, char delim) {
+	return inbuf->getLines (lines, max, delim);
+}
+
+/*
+ * NETSERVICE::outputHigh()
+ *
+ * This is called when the output rises to the high watermark. It will pause
+ * the paired input.
+ *
+ */
+void
+NETSERVICE::outputHigh() {
+	if (pairedInput)
+		pairedInput->pauseReading();
+}
+
+/*
+ * NETSERVICE::outputLow()
+ *
+ * This is called when the output drains to the low watermark. It will resume
+ * the paired input.
+ *
+ */
+void
+NETSERVICE::outputLow() {
+	if (pairedInput)
+		pairedInput->resumeReading();
+}
+
+/*
+ * NETSERVICE::drop()
+ *
+ * This will discard all queued output and have the next NETWORK::run() get
+ * rid of the connection.
+ *
+ */
+void
+NETSERVICE::drop() {
+	dropped = 1;
+	outqueue->clear();
+	PUBSUB::unsubscribeAll (this);
+}
+
+/*
+ * NETSERVICE::isDropped()
+ *
+ * This will return non-zero if the connection was dropped.
+ *
+ */
+int
+NETSERVICE::isDropped() {
+	return dropped;
+}
+
+/*
+ * NETSERVICE::close ()
+ *
+ * This will close the network connection, and those of all clients, which
+ * are deleted. Within NETWORK::run(), removing and deleting services waits
+ * until all services were handled.
+ *
+ */
+void
+NETSERVICE::close () {
+	NETWORK* n = getNetwork();
+
+	closeAll (n != NULL && n->running);
+}
+
+/*
+ * NETSERVICE::closeAll (int defer)
+ *
+ * This will close the network connection, and those of all clients. If
+ * [defer] is non-zero, removing us from our parent and deleting the clients
+ * is left to the network, which may be going through them.
+ *
+ */
+void
+NETSERVICE::closeAll (int defer) {
+	NETSERVICE* c;
+
+	// nobody can publish to us anymore
+	PUBSUB::unsubscribeAll (this);
+
+	// did a server count us ?
+	if (counted) {
+		// yes. we no longer take up a place
+		__sync_sub_and_fetch (&NETSERVER::totalClients, 1);
+		counted = 0;
+	}
+
+	// connected in-process ?
+	if (loop != NULL) {
+		// yes. pass on what the window takes; there is nobody to wait for
+		while (outqueue->getLength() > 0) {
+			if (writeQueue (0) <= 0)
+				break;
+		}
+		outqueue->clear(); inbuf->clear();
+		loop->detach (this);
+	}
+
+	// got a file descriptor ?
+	if (fd != -1) {
+		// yes. close it
+		#ifdef _DEBUG_NETWORK
+		printf ("NETSERVICE(): closed fd %u for 0x%x\n", fd, (unsigned int)this);
+		#endif // _DEBUG_NETWORK
+		// send whatever is still queued. this blocks, just like send() always did
+		if (outqueue->getLength() > 0 && nonBlocking)
+			fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) & ~O_NONBLOCK);
+		while (outqueue->getLength() > 0) {
+			if (writeQueue (0) <= 0)
+				break;
+		}
+		outqueue->clear(); inbuf->clear();
+		closeRaw();
+
+		#ifdef NET_TLS
+		// tell the peer we are done
+		if (tls != NULL) {
+			tls->shutdown();
+			delete tls; tls = NULL;
+		}
+		#endif // NET_TLS
+		nonBlocking = 0;
+
+		if (filp != NULL) {
+			fflush (filp);
+			fclose (filp);
+		} else {
+			::shutdown (fd, SHUT_RDWR);
+			::close (fd);
+		}
+		fd = -1;
+	}
+
+	// do we have a parent object ?
+	if (parent) {
+		// yes. remove us as a client
+		if (defer)
+			getNetwork()->bury (this, NETSERVICE_BURIED_DETACH);
+		else
+			parent->removeClient (this);
+	}
+
+	// scan all clients, too. they go as well
+	if (defer) {
+		for (int i = 0; i < clients->count(); i++) {
+			c = (NETSERVICE*)clients->elementAt (i);
+			c->closeAll (1);
+			getNetwork()->bury (c, NETSERVICE_BURIED_DELETE);
+		}
+		return;
+	}
+	while (clients->count() > 0) {
+		// fetch the client
+		c = (NETSERVICE*)clients->elementAt (0);
+
+		#ifdef _DEBUG_NETWORK
+		printf ("NETSERVICE(): close(): closing 0x%x for 0x%x\n", (unsigned int)c, (unsigned int)this);
+		#endif // _DEBUG_NETWORK
+
+		// close the connection of this client. this removes it from the list,
+		// unless someone else is its parent
+		c->closeAll (0);
+		clients->removeElement (c);
+
+		// get rid of the object, too
+		delete c;
+	}
+}
+
+/*
+ * NETSERVICE::destroy()
+ *
+ * This will delete the service. Within NETWORK::run(), it is closed at once
+ * but deleted once all services were handled.
+ *
+ */
+void
+NETSERVICE::destroy() {
+	NETWORK* n = getNetwork();
+
+	// is the network going through the services right now ?
+	if (n == NULL || !n->running) {
+		// no. nothing can refer to us then
+		if (network != NULL)
+			network->removeService (this);
+		delete this;
+		return;
+	}
+
+	// yes. leave the rest to the network
+	closeAll (1);
+	n->bury (this, NETSERVICE_BURIED_DELETE);
+}
+
+/*
+ * NETSERVICE::getHandle()
+ *
+ * This will return a handle to the service, or NETHANDLE_NONE if we are out
+ * of slots.
+ *
+ */
+NETHANDLE
+NETSERVICE::getHandle() {
+	NETSLOT* slot;
+
+	// do we have a slot yet ?
+	if (handleSlot == -1) {
+		// no. take a free one, or a new one
+		#ifdef NET_THREADS
+		pthread_mutex_lock (&handle_lock);
+		#endif // NET_THREADS
+		if (handle_free != -1) {
+			handleSlot = handle_free;
+			handle_free = handle_slot (handleSlot)->next;
+		} else if (handle_used < NETHANDLE_CHUNK * NETHANDLE_CHUNKS) {
+			if (handle_used % NETHANDLE_CHUNK == 0)
+				handle_chunks[handle_used / NETHANDLE_CHUNK] = (NETSLOT*)calloc (NETHANDLE_CHUNK, sizeof (NETSLOT));
+			if (handle_chunks[handle_used / NETHANDLE_CHUNK] != NULL) {
+				handleSlot = handle_used++;
+				handle_slot (handleSlot)->gen = 1;
+			}
+		}
+		if (handleSlot != -1)
+			handle_slot (handleSlot)->service = this;
+		#ifdef NET_THREADS
+		pthread_mutex_unlock (&handle_lock);
+		#endif // NET_THREADS
+		if (handleSlot == -1)
+			return NETHANDLE_NONE;
+	}
+
+	slot = handle_slot (handleSlot);
+	return ((NETHANDLE)slot->gen << 32) | (NETHANDLE)(handleSlot + 1);
+}
+
+/*
+ * NETSERVICE::lookup (NETHANDLE h)
+ *
+ * This will return the service handle [h] refers to, or NULL if it was
+ * deleted or is about to be.
+ *
+ */
+NETSERVICE*
+NETSERVICE::lookup (NETHANDLE h) {
+	int i = (int)(h & 0xffffffff) - 1;
+	NETSLOT* slot;
+
+	if (i < 0 || i >= handle_used)
+		return NULL;
+	slot = handle_slot (i);
+	if (slot->gen != (unsigned int)(h >> 32) || slot->service == NULL)
+		return NULL;
+	return (slot->service->buried == NETSERVICE_BURIED_DELETE) ? NULL : slot->service;
+}
+
+/*
+ * NETSERVICE::removeClient (NETSERVICE* client)
+ *
+ * This will remove [client] from the list of clients.
+ *
+ */
+void
+NETSERVICE::removeClient (NETSERVICE* client) {
+	clients->removeElement (client);
+}
+
+/*
+ * NETSERVICE::addClient (NETSERVICE* client)
+ *
+ * This will add [client] to list of clients.
+ *
+ */
+void
+NETSERVICE::addClient (NETSERVICE* client) {
+	client->priority = priority;
+	clients->addElement (client);
+}
+
+/*
+ * NETSERVICE::peek ()
+ *
+ * This will peek whether we have data available. It will return zero if not
+ * and non-zero if so.
+ *
+ */
+int
+NETSERVICE::peek() {
+	char buf;
+
+	// got a file descriptor at hand ?
+	if (fd == -1)
+		// no. we can never have data ready
+		return 0;
+
+	// buffered data counts, too
+	if (inbuf->getLength() > 0)
+		return 1;
+
+	#ifdef NET_TLS
+	// with TLS, only decrypted data counts
+	if (tls != NULL)
+		return (tls->pending() > 0) ? 1 : 0;
+	#endif // NET_TLS
+
+	// fetch the data. this does not count as a read; nothing is taken
+	int i = readRaw (&buf, 1, MSG_PEEK);
 
 	// return the size
 	return (i == -1) ? 0 : i;
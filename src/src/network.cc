@@ -23,15 +23,34 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#ifdef OS_LINUX
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#endif // OS_LINUX
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <network.h>
+#include <tls.h>
+#include <loopback.h>
+
+#ifdef OS_LINUX
+#ifndef MPOL_PREFERRED
+//! \brief MPOL_PREFERRED is the memory policy to prefer a node, see set_mempolicy(2)
+#define MPOL_PREFERRED 1
+#endif // MPOL_PREFERRED
+#endif // OS_LINUX
 
 /*
  * NETWORK::NETWORK()
@@ -42,6 +61,359 @@
 NETWORK::NETWORK() {
 	// no services just yet
 	services = new VECTOR();
+
+	// always block, unless told otherwise
+	busyPoll = 0; budget = 0; slice = 0;
+	for (int i = 0; i < NETSERVICE_PRIORITY_MAX; i++)
+		resume[i] = 0;
+	graveyard = NULL; running = 0;
+	resetCounters();
+
+	// run wherever the scheduler wants us to
+	cpu = -1; node = -1;
+
+	// no timers either
+	timers = NULL; numTimers = 0; maxTimers = 0;
+}
+
+/*
+ * now()
+ *
+ * This will return a monotonic timestamp in microseconds.
+ *
+ */
+static long long
+now() {
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * NETWORK::getTime()
+ *
+ * This will return a monotonic timestamp in microseconds.
+ *
+ */
+long long
+NETWORK::getTime() {
+	return now();
+}
+
+/*
+ * NETWORK::setBusyPoll (int usec)
+ *
+ * This will keep polling without blocking for [usec] microseconds before
+ * waiting for events. Zero disables this.
+ *
+ */
+void
+NETWORK::setBusyPoll (int usec) {
+	busyPoll = usec;
+}
+
+/*
+ * NETWORK::setCPU (int c)
+ *
+ * This will bind the calling thread, the memory it allocates and the servers
+ * of the network to CPU [c]. It will return zero on failure or non-zero on
+ * success.
+ *
+ */
+int
+NETWORK::setCPU (int c) {
+	#ifdef OS_LINUX
+	cpu_set_t set;
+	unsigned long mask[16];
+	unsigned int cur, n;
+	NETSERVICE* service;
+
+	// pin ourselves to the CPU
+	CPU_ZERO (&set);
+	CPU_SET (c, &set);
+	if (sched_setaffinity (0, sizeof (set), &set) < 0)
+		return 0;
+	cpu = c; node = -1;
+
+	// now that we run there, ask the kernel which node we are on, and prefer
+	// its memory from now on. this is merely an optimization, so don't fail if
+	// the machine doesn't do NUMA
+	if (syscall (SYS_getcpu, &cur, &n, NULL) == 0 && n < sizeof (mask) * 8) {
+		node = n;
+		memset (mask, 0, sizeof (mask));
+		mask[n / (sizeof (unsigned long) * 8)] |= 1UL << (n % (sizeof (unsigned long) * 8));
+		syscall (SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof (mask) * 8);
+	}
+
+	// have our servers prefer connections handled by this CPU
+	for (int i = 0; i < services->count(); i++) {
+		service = (NETSERVICE*)services->elementAt (i);
+		if (service->getType() == NETSERVICE_SERVER)
+			service->setIncomingCPU (cpu);
+	}
+
+	#ifdef _DEBUG_NETWORK
+	printf ("NETWORK::setCPU(): bound to cpu %d, node %d\n", cpu, node);
+	#endif // _DEBUG_NETWORK
+	return 1;
+	#else
+	// not supported here
+	return 0;
+	#endif // OS_LINUX
+}
+
+/*
+ * NETWORK::getCPU()
+ *
+ * This will return the CPU the network is bound to, or -1 if it is not.
+ *
+ */
+int
+NETWORK::getCPU() {
+	return cpu;
+}
+
+/*
+ * NETWORK::getNode()
+ *
+ * This will return the NUMA node the network is bound to, or -1 if this is
+ * unknown.
+ *
+ */
+int
+NETWORK::getNode() {
+	return node;
+}
+
+/*
+ * superSignal is the signal to pass on by the prefork supervisor, or zero if
+ * there is none.
+ */
+static volatile sig_atomic_t superSignal = 0;
+
+/*
+ * superHandler (int signo)
+ *
+ * This is the signal handler of the prefork supervisor. It will merely
+ * remember [signo], unless a signal which stops the workers is remembered
+ * already.
+ *
+ */
+static void
+superHandler (int signo) {
+	if (superSignal == 0 || superSignal == SIGHUP)
+		superSignal = signo;
+}
+
+/*
+ * childHandler (int signo)
+ *
+ * This is called when a worker of the prefork supervisor exits. It does
+ * nothing; it only needs to interrupt sigsuspend().
+ *
+ */
+static void
+childHandler (int) {
+}
+
+/*
+ * NETWORK::prefork (int workers)
+ *
+ * This will fork [workers] worker processes and supervise them. It will
+ * return the worker number in the workers, or -1 in the parent once all
+ * workers are gone.
+ *
+ */
+int
+NETWORK::prefork (int workers) {
+	struct sigaction sa, old[4];
+	static int sigs[4] = { SIGHUP, SIGINT, SIGTERM, SIGCHLD };
+	sigset_t set, oldset, waitset;
+	pid_t* pids;
+	time_t* started;
+	NETSERVICE* service;
+	int alive = 0, stopping = 0, status, i;
+	pid_t pid;
+
+	if (workers < 1)
+		return -1;
+
+	// all workers wait on the same listening sockets, and only one of them
+	// gets the connection. the others must not block in accept()
+	for (i = 0; i < services->count(); i++) {
+		service = (NETSERVICE*)services->elementAt (i);
+		if (service->getType() == NETSERVICE_SERVER && service->getFD() != -1)
+			fcntl (service->getFD(), F_SETFL, fcntl (service->getFD(), F_GETFL, 0) | O_NONBLOCK);
+	}
+
+	pids = (pid_t*)calloc (workers, sizeof (pid_t));
+	started = (time_t*)calloc (workers, sizeof (time_t));
+	if (pids == NULL || started == NULL) {
+		free (pids); free (started);
+		return -1;
+	}
+
+	// the signals are only let through while we wait for them, so none can
+	// arrive between looking for one and going to sleep
+	sigemptyset (&set);
+	for (i = 0; i < 4; i++)
+		sigaddset (&set, sigs[i]);
+	pthread_sigmask (SIG_BLOCK, &set, &oldset);
+	waitset = oldset;
+	for (i = 0; i < 4; i++)
+		sigdelset (&waitset, sigs[i]);
+
+	// catch the signals we pass on, and the exit of workers
+	memset (&sa, 0, sizeof (sa));
+	sigemptyset (&sa.sa_mask);
+	for (i = 0; i < 4; i++) {
+		sa.sa_handler = (sigs[i] == SIGCHLD) ? childHandler : superHandler;
+		sigaction (sigs[i], &sa, &old[i]);
+	}
+	superSignal = 0;
+
+	for (;;) {
+		// start whoever isn't running
+		for (i = 0; i < workers && !stopping; i++) {
+			if (pids[i] != 0)
+				continue;
+
+			// don't restart a worker in a tight loop if it dies right away
+			if (started[i] != 0 && time (NULL) - started[i] < 1)
+				sleep (1);
+			started[i] = time (NULL);
+
+			pid = fork();
+			if (pid == 0) {
+				// we are the worker. we don't supervise anything
+				for (int j = 0; j < 4; j++)
+					sigaction (sigs[j], &old[j], NULL);
+				pthread_sigmask (SIG_SETMASK, &oldset, NULL);
+				#ifdef OS_LINUX
+				// don't outlive the parent
+				prctl (PR_SET_PDEATHSIG, SIGTERM);
+				#endif // OS_LINUX
+				free (pids); free (started);
+				return i + 1;
+			}
+			if (pid < 0) {
+				// this failed. try again later, unless nothing runs at all
+				#ifdef _DEBUG_NETWORK
+				perror ("NETWORK::prefork(): fork() failed");
+				#endif // _DEBUG_NETWORK
+				if (alive == 0)
+					stopping = 1;
+				break;
+			}
+			pids[i] = pid; alive++;
+		}
+
+		// anyone left ?
+		if (alive == 0)
+			// no. we're done
+			break;
+
+		// got a signal ?
+		if (superSignal != 0) {
+			// yes. pass it on
+			if (superSignal != SIGHUP)
+				stopping = 1;
+			for (i = 0; i < workers; i++)
+				if (pids[i] > 0)
+					kill (pids[i], superSignal);
+			superSignal = 0;
+		}
+
+		// is a worker gone ?
+		pid = waitpid (-1, &status, WNOHANG);
+		if (pid == 0) {
+			// no. wait for that or a signal
+			sigsuspend (&waitset);
+			continue;
+		}
+		if (pid < 0) {
+			// if we have no children at all, we lost track of them
+			if (errno == ECHILD)
+				break;
+			continue;
+		}
+
+		// yes. find out which one
+		for (i = 0; i < workers; i++)
+			if (pids[i] == pid)
+				break;
+		if (i == workers)
+			continue;
+		alive--;
+
+		// did it finish on its own ?
+		if (WIFEXITED (status) && WEXITSTATUS (status) == 0) {
+			// yes. leave it be
+			pids[i] = -1;
+			continue;
+		}
+
+		// no. it will be restarted
+		#ifdef _DEBUG_NETWORK
+		printf ("NETWORK::prefork(): worker %d (pid %d) died, status 0x%x\n", i + 1, (int)pid, status);
+		#endif // _DEBUG_NETWORK
+		pids[i] = 0;
+	}
+
+	// restore the signals. whatever is pending is caught by us still
+	pthread_sigmask (SIG_SETMASK, &oldset, NULL);
+	for (i = 0; i < 4; i++)
+		sigaction (sigs[i], &old[i], NULL);
+	free (pids); free (started);
+	return -1;
+}
+
+/*
+ * NETWORK::setBudget (int bytes)
+ *
+ * This will allow every connection to read at most [bytes] bytes each time
+ * it is dispatched. If [bytes] is zero, there is no limit.
+ *
+ */
+void
+NETWORK::setBudget (int bytes) {
+	budget = (bytes > 0) ? bytes : 0;
+}
+
+/*
+ * NETWORK::setSlice (int usec)
+ *
+ * This will handle services of lower than high priority for at most [usec]
+ * microseconds per call to run(). If [usec] is zero, there is no limit.
+ *
+ */
+void
+NETWORK::setSlice (int usec) {
+	slice = (usec > 0) ? usec : 0;
+}
+
+/*
+ * NETWORK::getCounter (int which)
+ *
+ * This will return the value of polling counter [which].
+ *
+ */
+unsigned long
+NETWORK::getCounter (int which) {
+	return (which >= 0 && which < NETWORK_COUNT_MAX) ? counters[which] : 0;
+}
+
+/*
+ * NETWORK::resetCounters()
+ *
+ * This will reset all polling counters to zero.
+ *
+ */
+void
+NETWORK::resetCounters() {
+	for (int i = 0; i < NETWORK_COUNT_MAX; i++)
+		counters[i] = 0;
 }
 
 /*
@@ -52,8 +424,20 @@ NETWORK::NETWORK() {
  */
 void
 NETWORK::addService (NETSERVICE* service) {
+	// was it about to be removed ?
+	if (service->buried && service->buriedIn == this && service->parent == NULL) {
+		// yes. it can simply stay
+		unbury (service);
+		return;
+	}
+
 	// add the service to the vector
 	services->addElement (service);
+	service->network = this;
+
+	// if we are bound to a CPU, have servers prefer its connections
+	if (cpu != -1 && service->getType() == NETSERVICE_SERVER)
+		service->setIncomingCPU (cpu);
 
 	#ifdef _DEBUG_NETWORK
 	printf ("NETWORK::addService(): service 0x%p added\n", service);
@@ -68,8 +452,16 @@ NETWORK::addService (NETSERVICE* service) {
  */
 void
 NETWORK::removeService (NETSERVICE* service) {
+	// are we going through the services ?
+	if (running) {
+		// yes. don't pull the rug from under our feet
+		bury (service, NETSERVICE_BURIED_DETACH);
+		return;
+	}
+
 	// remove the service from the vector
 	services->removeElement (service);
+	service->network = NULL;
 
 	#ifdef _DEBUG_NETWORK
 	printf ("NETWORK::removeService(): service 0x%p removed\n", service);
@@ -77,155 +469,641 @@ NETWORK::removeService (NETSERVICE* service) {
 }
 
 /*
- * NETWORK::run()
+ * NETWORK::bury (NETSERVICE* s, int how)
  *
- * This will monitor the network.
+ * This will have service [s] removed, and deleted if [how] says so, once all
+ * services were handled.
  *
  */
 void
-NETWORK::run() {
-	fd_set fds;
-	int		 i, j, fd, fdmax;
-	NETSERVICE* service;
-	NETSERVICE* subservice;
+NETWORK::bury (NETSERVICE* s, int how) {
+	// already on the list ?
+	if (s->buried) {
+		// yes. it may have to go further now
+		if (how > s->buried)
+			s->buried = how;
+		return;
+	}
+	s->buried = how; s->buriedIn = this;
+	s->graveNext = graveyard; graveyard = s;
+}
 
-	// construct the set of file descriptors to monitor
-	FD_ZERO (&fds); fdmax = -1;
-	for (i = 0; i < services->count(); i++) {
-		// fetch the service
-		service = (NETSERVICE*)services->elementAt (i);
+/*
+ * NETWORK::unbury (NETSERVICE* s)
+ *
+ * This will take service [s] off the list of services to be removed.
+ *
+ */
+void
+NETWORK::unbury (NETSERVICE* s) {
+	NETSERVICE** p;
 
-		// fetch the file descriptor
-		fd = service->getFD();
+	for (p = &graveyard; *p != NULL; p = &(*p)->graveNext) {
+		if (*p == s) {
+			*p = s->graveNext;
+			break;
+		}
+	}
+	s->buried = 0; s->buriedIn = NULL; s->graveNext = NULL;
+}
 
-		// valid descriptor ?
-		if (fd != -1) {
-			// yes. append it to the list
-			FD_SET (fd, &fds);
+/*
+ * NETWORK::reap()
+ *
+ * This will remove the services on the list from their parent or from us,
+ * and delete those which are to be deleted.
+ *
+ */
+void
+NETWORK::reap() {
+	NETSERVICE* s;
+	int how;
 
-			#ifdef _DEBUG_NETWORK
-			printf ("NETWORK::run(): added fd %u for service 0x%p\n", fd, service);
-			#endif // _DEBUG_NETWORK
+	while (graveyard != NULL) {
+		// take it off the list first. deleting it may take others off, too
+		s = graveyard; graveyard = s->graveNext;
+		how = s->buried;
+		s->buried = 0; s->buriedIn = NULL; s->graveNext = NULL;
 
-			// if we have a new maximum, use it
-			if (fdmax < fd)
-				fdmax = fd;
+		// remove it from wherever it is
+		if (s->parent != NULL) {
+			if (s->parent->getType() == NETSERVICE_SERVER)
+				((NETSERVER*)s->parent)->retire (s);
+			s->parent->removeClient (s);
+			s->parent = NULL;
+		} else if (s->network == this) {
+			services->removeElement (s);
+			s->network = NULL;
 		}
 
-		// check for service's clients
-		for (j = 0; j < service->getClients()->count(); j++) {
-			// fetch the service
-			subservice = (NETSERVICE*)service->getClients()->elementAt (j);
+		#ifdef _DEBUG_NETWORK
+		printf ("NETWORK::reap(): %s service 0x%p\n", (how == NETSERVICE_BURIED_DELETE) ? "deleting" : "removing", s);
+		#endif // _DEBUG_NETWORK
+		if (how == NETSERVICE_BURIED_DELETE)
+			delete s;
+	}
+}
+
+/*
+ * NETTIMER::NETTIMER()
+ *
+ * This is the constructor.
+ *
+ */
+NETTIMER::NETTIMER() {
+	network = NULL; when = 0; slot = -1;
+}
 
-			// fetch the file descriptor
-			fd = subservice->getFD();
+/*
+ * NETTIMER::~NETTIMER()
+ *
+ * This is the destructor. If the timer is pending, it is removed.
+ *
+ */
+NETTIMER::~NETTIMER() {
+	if (network != NULL)
+		network->removeTimer (this);
+}
 
-			// valid descriptor ?
-			if (fd != -1) {
-				// yes. append it to the list
-				FD_SET (fd, &fds);
+/*
+ * NETTIMER::isPending()
+ *
+ * This will return non-zero if the timer is waiting to fire.
+ *
+ */
+int
+NETTIMER::isPending() {
+	return (slot != -1) ? 1 : 0;
+}
 
-				#ifdef _DEBUG_NETWORK
-				printf ("NETWORK::run(): added fd %u for client 0x%p for service 0x%p\n", fd, subservice, service);
-				#endif // _DEBUG_NETWORK
+/*
+ * NETWORK::siftUp (int i)
+ *
+ * This will move the timer at position [i] up the heap until its parent
+ * fires no later than it does.
+ *
+ */
+void
+NETWORK::siftUp (int i) {
+	NETTIMER* t = timers[i];
+	int p;
 
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (timers[p]->when <= t->when)
+			break;
+		timers[i] = timers[p]; timers[i]->slot = i;
+		i = p;
+	}
+	timers[i] = t; t->slot = i;
+}
 
-				// if we have a new maximum, use it
-				if (fdmax < fd)
-					fdmax = fd;
-			}
+/*
+ * NETWORK::siftDown (int i)
+ *
+ * This will move the timer at position [i] down the heap until its children
+ * fire no earlier than it does.
+ *
+ */
+void
+NETWORK::siftDown (int i) {
+	NETTIMER* t = timers[i];
+	int c;
+
+	while ((c = 2 * i + 1) < numTimers) {
+		// pick the child which fires first
+		if (c + 1 < numTimers && timers[c + 1]->when < timers[c]->when)
+			c++;
+		if (t->when <= timers[c]->when)
+			break;
+		timers[i] = timers[c]; timers[i]->slot = i;
+		i = c;
+	}
+	timers[i] = t; t->slot = i;
+}
+
+/*
+ * NETWORK::addTimer (NETTIMER* t, int msec)
+ *
+ * This will have timer [t] fire after [msec] milliseconds. If it is already
+ * pending, it is rescheduled. It will return zero on failure or non-zero on
+ * success.
+ *
+ */
+int
+NETWORK::addTimer (NETTIMER* t, int msec) {
+	NETTIMER** n;
+
+	// pending on another network ?
+	if (t->network != NULL && t->network != this)
+		// yes. take it off there first
+		t->network->removeTimer (t);
+
+	t->when = now() + (long long)msec * 1000;
+
+	// already pending ?
+	if (t->slot != -1) {
+		// yes. just move it to its new place
+		siftUp (t->slot);
+		siftDown (t->slot);
+		return 1;
+	}
+
+	// make room if needed
+	if (numTimers == maxTimers) {
+		n = (NETTIMER**)realloc (timers, (maxTimers ? maxTimers * 2 : 16) * sizeof (NETTIMER*));
+		if (n == NULL)
+			return 0;
+		timers = n; maxTimers = maxTimers ? maxTimers * 2 : 16;
+	}
+
+	t->network = this;
+	timers[numTimers] = t;
+	siftUp (numTimers++);
+	return 1;
+}
+
+/*
+ * NETWORK::removeTimer (NETTIMER* t)
+ *
+ * This will cancel timer [t].
+ *
+ */
+void
+NETWORK::removeTimer (NETTIMER* t) {
+	int i = t->slot;
+
+	// is it pending here ?
+	if (t->network != this || i == -1)
+		// no. nothing to do
+		return;
+	t->slot = -1; t->network = NULL;
+
+	// fill the hole with the last timer, and put that one in its place
+	if (i != --numTimers) {
+		t = timers[numTimers];
+		timers[i] = t;
+		siftUp (i);
+		siftDown (t->slot);
+	}
+}
+
+/*
+ * NETWORK::runTimers()
+ *
+ * This will fire all timers which are due. Timers added while doing so wait
+ * for the next round.
+ *
+ */
+void
+NETWORK::runTimers() {
+	long long t = now();
+	int n = numTimers;
+	NETTIMER* timer;
+
+	while (n-- > 0 && numTimers > 0 && timers[0]->when <= t) {
+		timer = timers[0];
+		removeTimer (timer);
+		timer->expired();
+	}
+}
+
+/*
+ * NETWORK::collect (NETSERVICE* s, fd_set* rfds, fd_set* wfds, int* fdmax)
+ *
+ * This will add the descriptor of service [s] to [rfds] if we should read
+ * from it, and to [wfds] if it has output queued. [fdmax] is updated to hold
+ * the highest descriptor. It will return non-zero if the service has buffered
+ * input which must be handled without waiting for new data.
+ *
+ */
+int
+NETWORK::collect (NETSERVICE* s, fd_set* rfds, fd_set* wfds, int* fdmax) {
+	int fd = s->getFD();
+
+	// valid descriptor, and still around ?
+	if (fd == -1 || s->buried)
+		// no. nothing to monitor
+		return 0;
+
+	// if the service was dropped, get rid of it without waiting
+	if (s->dropped)
+		return 1;
+
+	// connected in-process ?
+	if (s->loop != NULL) {
+		// yes. there is nothing to wait for; whatever can be done is done now
+		if ((s->inputLimit == 0 || s->inbuf->getLength() < s->inputLimit) && s->loop->hasInput (s))
+			s->inputPending = 1;
+		return (s->inputPending && !s->readPaused) || (s->getOutputLength() > 0 && s->loop->hasRoom (s));
+	}
+
+	#ifdef NET_TLS
+	// still shaking hands ?
+	if (s->tls != NULL && !s->tls->isEstablished()) {
+		// yes. wait for whatever the handshake needs
+		FD_SET (fd, s->tls->wantsWrite() ? wfds : rfds);
+		if (*fdmax < fd)
+			*fdmax = fd;
+		return 0;
+	}
+	#endif // NET_TLS
+
+	// does the descriptor merely signal events ?
+	if (s->usesEventFD()) {
+		// yes. any event, be it input or room for output, makes it readable
+		FD_SET (fd, rfds);
+		if (*fdmax < fd)
+			*fdmax = fd;
+
+		// input we won't be told about is handled without waiting, if there is
+		// room for it
+		if ((s->inputLimit == 0 || s->inbuf->getLength() < s->inputLimit) && s->hasInput())
+			s->inputPending = 1;
+		return s->inputPending && !s->readPaused;
+	}
+
+	// do we want to read ? not if we are paused or the input buffer is full
+	if (!s->readPaused && (s->inputLimit == 0 || s->inbuf->getLength() < s->inputLimit)) {
+		// yes. append it to the list
+		FD_SET (fd, rfds);
+
+		#ifdef _DEBUG_NETWORK
+		printf ("NETWORK::collect(): added fd %u for service 0x%p\n", fd, s);
+		#endif // _DEBUG_NETWORK
+	}
+
+	// do we have anything left to write ?
+	if (s->getOutputLength() > 0)
+		// yes. wait until we can
+		FD_SET (fd, wfds);
+
+	// if we have a new maximum, use it
+	if (*fdmax < fd)
+		*fdmax = fd;
+
+	return s->inputPending && !s->readPaused;
+}
+
+/*
+ * NETWORK::dispatch (NETSERVICE* s, fd_set* rfds, fd_set* wfds)
+ *
+ * This will handle the events of service [s], as flagged in [rfds] and
+ * [wfds]. It will return zero if the service must be dropped, or non-zero if
+ * it is fine.
+ *
+ */
+int
+NETWORK::dispatch (NETSERVICE* s, fd_set* rfds, fd_set* wfds) {
+	int fd = s->getFD();
+	int readable, writable, pending;
+
+	// do we have a valid file descriptor, and are we still around ?
+	if (fd == -1 || s->buried)
+		// no. nothing to do
+		return 1;
+
+	// was the service dropped ?
+	if (s->dropped)
+		// yes. get rid of it
+		return 0;
+
+	// what did the descriptor signal ? connected in-process, there is none to
+	// ask, and input is always pending rather than signalled
+	if (s->loop != NULL) {
+		readable = 0;
+		writable = s->loop->hasRoom (s);
+	} else {
+		readable = FD_ISSET (fd, rfds);
+		writable = FD_ISSET (fd, wfds);
+	}
+
+	#ifdef NET_TLS
+	// still shaking hands ?
+	if (s->tls != NULL && !s->tls->isEstablished()) {
+		// yes. carry on if the socket is ready
+		if (!readable && !writable)
+			return 1;
+		switch (s->tls->handshake()) {
+			case 0: // failed. drop the connection
+			        return 0;
+			case 1: // done. send what was queued in the meantime and see if the
+			        // peer already sent something
+			        s->inputPending = 1;
+			        return s->flush();
 		}
+		return 1;
 	}
+	#endif // NET_TLS
 
-	// await a connection
-	if (select (fdmax + 1, &fds, (fd_set*)NULL, (fd_set*)NULL, (struct timeval*)NULL) < 0) {
-		// this failed. return
+	// does the descriptor merely signal events ?
+	if (s->usesEventFD() && readable) {
+		// yes. we can't tell input from room for output, so try both
+		s->wakeup();
+		writable = 1;
+		if (s->readPaused)
+			readable = 0;
+	}
+
+	// can we write queued data ?
+	if (writable) {
+		// yes. do so
+		if (!s->flush())
+			// the connection failed. drop it
+			return 0;
+	}
+
+	// did this service generate a read event ?
+	pending = s->inputPending && !s->readPaused;
+	if (!readable && !pending)
+		// no. we are done
+		return 1;
+	s->inputPending = 0;
+
+	// is this a server socket, or does the service read by itself ?
+	if (s->getType() != NETSERVICE_CLIENT) {
+		// yes. let it handle the event itself
 		#ifdef _DEBUG_NETWORK
-		perror ("NETWORK::run(): select() ended unsuccessfully");
+		printf ("NETWORK::dispatch(): calling incoming() for server service 0x%p\n", s);
 		#endif // _DEBUG_NETWORK
-		return;
+		s->incoming();
+		return 1;
 	}
 
-	// if this is reached, we got a connection. browse the service list again
-	// to figure out who should get this event
-	for (i = 0; i < services->count(); i++) {
-		// fetch the service
-		service = (NETSERVICE*)services->elementAt (i);
+	// is the input buffered ?
+	s->budget = (budget > 0) ? budget : -1;
+	if (s->inputLimit > 0) {
+		// yes. read whatever we can into the buffer
+		if ((readable || pending) && s->fill() == 0)
+			// the connection was closed. drop it
+			return 0;
 
-		// fetch the file descriptor
-		fd = service->getFD();
+		// only bother the handler if there is something for it
+		if (s->inbuf->getLength() == 0) {
+			s->budget = -1;
+			return 1;
+		}
+	} else if (!s->peek()) {
+		// no data available. drop the connection
+		return 0;
+	}
+
+	// call the service's incoming() function. with automatic corking, hold
+	// back whatever it sends and write it all at once afterwards
+	#ifdef _DEBUG_NETWORK
+	printf ("NETWORK::dispatch(): calling incoming() for client service 0x%p\n", s);
+	#endif // _DEBUG_NETWORK
+	s->corked = s->autoCork;
+	s->incoming();
 
-		// do we have a valid file descriptor ?
-		if (fd != -1) {
-			// yes. did this service generate the event ?
-			if (FD_ISSET (fd, &fds)) {
-				// yes. is this a server socket ?
-				if (service->getType() == NETSERVICE_SERVER) {
-					// yes. handle the incoming connection
+	// did it have its share ? whatever is left waits until everyone else had
+	// a turn. the socket will still be readable, but the buffer or TLS may
+	// hold more which the socket no longer signals
+	if (s->budget == 0) {
+		counters[NETWORK_COUNT_BUDGET_HITS]++;
+		if (s->inbuf->getLength() > 0)
+			s->inputPending = 1;
+		#ifdef NET_TLS
+		if (s->tls != NULL && s->tls->pending() > 0)
+			s->inputPending = 1;
+		#endif // NET_TLS
+	}
+	s->budget = -1;
+	if (s->corked) {
+		s->corked = 0;
+		return s->flush();
+	}
+	return 1;
+}
+
+/*
+ * NETWORK::dispatchAll (int prio, fd_set* rfds, fd_set* wfds, long long start)
+ *
+ * This will handle the events of all services of priority [prio], as flagged
+ * in [rfds] and [wfds]. Services which must be dropped are buried. If there
+ * is a time slice, and handling services started at [start], it will return
+ * zero once the slice is used up, or non-zero if all services were handled.
+ * At least one service is always handled, so every priority makes progress.
+ *
+ */
+int
+NETWORK::dispatchAll (int prio, fd_set* rfds, fd_set* wfds, long long start) {
+	NETSERVICE* service;
+	NETSERVICE* subservice;
+	int i, j, k, pass, first = resume[prio], handled = 0;
+	int timed = (prio != NETSERVICE_PRIORITY_HIGH && slice > 0);
+
+	// start where we stopped last time, then go round to the beginning. [k]
+	// counts the services of this priority
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1 && first == 0)
+			break;
+		k = 0;
+		for (i = 0; i < services->count(); i++) {
+			// fetch the service
+			service = (NETSERVICE*)services->elementAt (i);
+
+			// is it our turn ?
+			if (service->priority == prio && (k++ >= first) == (pass == 0)) {
+				// yes. do we have time left ?
+				if (timed && handled > 0 && now() - start >= slice) {
+					// no. carry on from here next time
+					resume[prio] = k - 1;
+					return 0;
+				}
+
+				// handle it
+				handled++;
+				if (!dispatch (service, rfds, wfds)) {
+					// the connection is gone. drop it
 					#ifdef _DEBUG_NETWORK
-					printf ("NETWORK::run(): calling incoming() for server service 0x%p\n", service);
+					printf ("NETWORK::run(): dropping service 0x%p\n", service);
 					#endif // _DEBUG_NETWORK
-					service->incoming();
-				} else {
-					// no. is there actual data available ?
-					if (service->peek()) {
-						// yes. handle the incoming connection
-						#ifdef _DEBUG_NETWORK
-						printf ("NETWORK::run(): calling incoming() for client service 0x%p\n", service);
-						#endif // _DEBUG_NETWORK
-						service->incoming();
-					} else {
-						// no. drop the connection
-						#ifdef _DEBUG_NETWORK
-						printf ("NETWORK::run(): dropping service 0x%p\n", service);
-						#endif // _DEBUG_NETWORK
-
-						// mark the service as removed
-						service->setFD (-1);
-						services->removeElement (service);
-						service = NULL;
-					}
+
+					// mark the service as removed. it goes once we are done
+					service->setFD (-1);
+					bury (service, NETSERVICE_BURIED_DETACH);
+					continue;
 				}
 			}
 
-			// still have a service left ?
-			if (service) {
-				// yes. check for service's clients
-				for (j = 0; j < service->getClients()->count(); j++) {
-					// fetch the service
-					subservice = (NETSERVICE*)service->getClients()->elementAt (j);
-
-					// fetch the file descriptor
-					fd = subservice->getFD();
-
-					// valid descriptor ?
-					if (fd != -1) {
-						// yes. did this service generate the event ?
-						if (FD_ISSET (fd, &fds)) {
-							// yes. do we really have data available ?
-							if (subservice->peek()) {
-								// yes. call the service's incoming() function
-								#ifdef _DEBUG_NETWORK
-								printf ("NETWORK::run(): calling incoming() for client 0x%p for service 0x%p\n", subservice, service);
-								#endif // _DEBUG_NETWORK
-								subservice->incoming();
-							} else {
-								// no. drop the connection
-								#ifdef _DEBUG_NETWORK
-								printf ("NETWORK::run(): dropping connection for client 0x%p for service 0x%p\n", subservice, service);
-								#endif // _DEBUG_NETWORK
-								delete subservice;
-								service->getClients()->removeElement (subservice);
-
-								// ensure we don't skip the next client in the for loop
-								j--;
-							}
-						}
-					}
+			// check for service's clients
+			for (j = 0; j < service->getClients()->count(); j++) {
+				// fetch the service
+				subservice = (NETSERVICE*)service->getClients()->elementAt (j);
+
+				// is it our turn ?
+				if (subservice->priority != prio || (k++ >= first) != (pass == 0))
+					// no. skip it
+					continue;
+				if (timed && handled > 0 && now() - start >= slice) {
+					resume[prio] = k - 1;
+					return 0;
+				}
+
+				// handle it. when draining, clients go as soon as they are idle
+				handled++;
+				if (!dispatch (subservice, rfds, wfds) || (service->draining && subservice->isIdle())) {
+					// the connection is gone. drop it once we are done
+					#ifdef _DEBUG_NETWORK
+					printf ("NETWORK::run(): dropping connection for client 0x%p for service 0x%p\n", subservice, service);
+					#endif // _DEBUG_NETWORK
+					bury (subservice, NETSERVICE_BURIED_DELETE);
 				}
 			}
 		}
 	}
+
+	// everyone had a turn. start from the beginning next time
+	resume[prio] = 0;
+	return 1;
+}
+
+/*
+ * NETWORK::run()
+ *
+ * This will monitor the network.
+ *
+ */
+void
+NETWORK::run() {
+	fd_set rfds, wfds, r, w;
+	int		 i, j, fdmax, pending, n, prios, sliced;
+	struct timeval tv;
+	long long deadline, wait, start;
+	NETSERVICE* service;
+	NETSERVICE* subservice;
+
+	// construct the set of file descriptors to monitor, and see which
+	// priorities are in use
+	FD_ZERO (&rfds); FD_ZERO (&wfds); fdmax = -1; pending = 0; prios = 0;
+	for (i = 0; i < services->count(); i++) {
+		// fetch the service
+		service = (NETSERVICE*)services->elementAt (i);
+		pending |= collect (service, &rfds, &wfds, &fdmax);
+		prios |= 1 << service->priority;
+
+		// check for service's clients
+		for (j = 0; j < service->getClients()->count(); j++) {
+			// fetch the service
+			subservice = (NETSERVICE*)service->getClients()->elementAt (j);
+			pending |= collect (subservice, &rfds, &wfds, &fdmax);
+			prios |= 1 << subservice->priority;
+		}
+	}
+
+	// if a timer is due, don't wait at all
+	wait = -1;
+	if (numTimers > 0) {
+		wait = timers[0]->when - now();
+		if (wait <= 0)
+			pending = 1;
+	}
+
+	// if we are to busy poll, keep checking without blocking for a while
+	n = 0;
+	if (busyPoll > 0 && !pending) {
+		deadline = now() + ((wait > 0 && wait < busyPoll) ? wait : busyPoll);
+		do {
+			r = rfds; w = wfds;
+			tv.tv_sec = 0; tv.tv_usec = 0;
+			n = select (fdmax + 1, &r, &w, (fd_set*)NULL, &tv);
+			counters[NETWORK_COUNT_SPINS]++;
+		} while (n == 0 && now() < deadline);
+
+		// did this pay off ?
+		if (n > 0) {
+			// yes. use what we found
+			counters[NETWORK_COUNT_SPIN_HITS]++;
+			rfds = r; wfds = w;
+		}
+	}
+
+	// await a connection. if there is buffered input waiting to be handled,
+	// just check what else is going on without blocking, and don't wait
+	// beyond the first timer either
+	if (n == 0) {
+		if (!pending)
+			counters[NETWORK_COUNT_SLEEPS]++;
+		tv.tv_sec = 0; tv.tv_usec = 0;
+		if (!pending && wait > 0) {
+			tv.tv_sec = wait / 1000000; tv.tv_usec = wait % 1000000;
+		}
+
+		// with no descriptors to ask and work to do, don't ask at all
+		if (!pending || fdmax >= 0)
+			n = select (fdmax + 1, &rfds, &wfds, (fd_set*)NULL, (pending || wait > 0) ? &tv : (struct timeval*)NULL);
+	}
+	if (n < 0) {
+		// this failed. return
+		#ifdef _DEBUG_NETWORK
+		perror ("NETWORK::run(): select() ended unsuccessfully");
+		#endif // _DEBUG_NETWORK
+		return;
+	}
+
+	// if this is reached, we got a connection. browse the service list again
+	// to figure out who should get this event, most important ones first. the
+	// time slice only covers the others
+	running = 1; sliced = 0;
+	if (prios & (1 << NETSERVICE_PRIORITY_HIGH))
+		dispatchAll (NETSERVICE_PRIORITY_HIGH, &rfds, &wfds, 0);
+	start = now();
+	for (i = NETSERVICE_PRIORITY_HIGH + 1; i < NETSERVICE_PRIORITY_MAX; i++) {
+		// once out of time, every priority still gets a single service handled
+		if ((prios & (1 << i)) && !dispatchAll (i, &rfds, &wfds, start))
+			sliced = 1;
+	}
+	if (sliced)
+		counters[NETWORK_COUNT_SLICED]++;
+
+	// fire whatever timers are due
+	runTimers();
+
+	// now that nothing refers to them anymore, get rid of the services which
+	// are gone
+	running = 0;
+	reap();
 }
 
 /* vim:set ts=2 sw=2: */
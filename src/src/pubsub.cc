@@ -0,0 +1,500 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file pubsub.cc
+ * \brief Publish/subscribe channels, implements the PUBSUB class
+ *
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <network.h>
+#include <pubsub.h>
+
+/*
+ * PUBSUBTOPIC is a single topic. Subscriptions which are removed while the
+ * topic is being published to are only marked as such, by clearing their
+ * [service]; [dead] counts them, and they are freed once publishing is done.
+ */
+struct PUBSUBTOPIC {
+	PUBSUB*             owner;
+	char*               name;
+	uint32_t            hash;
+	struct PUBSUBTOPIC* next;
+	struct PUBSUBLINK*  head;
+	int                 count;
+	int                 busy;
+	int                 dead;
+};
+
+/*
+ * PUBSUBLINK is the subscription of a service to a topic. It is on two lists:
+ * the subscribers of the topic, and the subscriptions of the service.
+ */
+struct PUBSUBLINK {
+	struct PUBSUBTOPIC* topic;
+	NETSERVICE*         service;
+	struct PUBSUBLINK*  tprev;
+	struct PUBSUBLINK*  tnext;
+	struct PUBSUBLINK*  sprev;
+	struct PUBSUBLINK*  snext;
+};
+
+/*
+ * hashName (char* name)
+ *
+ * This will return the FNV-1a hash of [name].
+ *
+ */
+static uint32_t
+hashName (char* name) {
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h;
+}
+
+/*
+ * PUBSUB::PUBSUB (int size)
+ *
+ * This will construct an empty set of topics with [size] hash buckets.
+ *
+ */
+PUBSUB::PUBSUB (int size) {
+	// the bucket count must be a power of two
+	numBuckets = 1;
+	while (numBuckets < size)
+		numBuckets *= 2;
+	buckets = (struct PUBSUBTOPIC**)calloc (numBuckets, sizeof (struct PUBSUBTOPIC*));
+	numTopics = 0; slowPolicy = PUBSUB_SLOW_IGNORE; slowLimit = 0;
+	resetCounters();
+}
+
+/*
+ * PUBSUB::~PUBSUB()
+ *
+ * This is the destructor.
+ *
+ */
+PUBSUB::~PUBSUB() {
+	struct PUBSUBTOPIC* t;
+	struct PUBSUBLINK* l;
+
+	for (int i = 0; i < numBuckets; i++) {
+		while ((t = buckets[i]) != NULL) {
+			buckets[i] = t->next;
+
+			// take the subscriptions away from their services
+			while ((l = t->head) != NULL) {
+				t->head = l->tnext;
+				if (l->service != NULL)
+					detach (l);
+				free (l);
+			}
+			free (t);
+		}
+	}
+	free (buckets);
+}
+
+/*
+ * PUBSUB::find (char* name, uint32_t hash)
+ *
+ * This will return topic [name] with hash [hash], or NULL if there is no such
+ * topic.
+ *
+ */
+struct PUBSUBTOPIC*
+PUBSUB::find (char* name, uint32_t hash) {
+	struct PUBSUBTOPIC* t;
+
+	for (t = buckets[hash & (numBuckets - 1)]; t != NULL; t = t->next)
+		if (t->hash == hash && !strcmp (t->name, name))
+			return t;
+	return NULL;
+}
+
+/*
+ * PUBSUB::grow()
+ *
+ * This will double the number of hash buckets. It will return zero on
+ * failure or non-zero on success.
+ *
+ */
+int
+PUBSUB::grow() {
+	struct PUBSUBTOPIC** nb;
+	struct PUBSUBTOPIC* t;
+	int newsize = numBuckets * 2;
+
+	nb = (struct PUBSUBTOPIC**)calloc (newsize, sizeof (struct PUBSUBTOPIC*));
+	if (nb == NULL)
+		return 0;
+
+	// rehash all topics
+	for (int i = 0; i < numBuckets; i++) {
+		while ((t = buckets[i]) != NULL) {
+			buckets[i] = t->next;
+			t->next = nb[t->hash & (newsize - 1)];
+			nb[t->hash & (newsize - 1)] = t;
+		}
+	}
+	free (buckets);
+	buckets = nb; numBuckets = newsize;
+	return 1;
+}
+
+/*
+ * PUBSUB::subscribe (NETSERVICE* s, char* topic)
+ *
+ * This will subscribe service [s] to topic [topic]. It will return zero on
+ * failure or non-zero on success.
+ *
+ */
+int
+PUBSUB::subscribe (NETSERVICE* s, char* topic) {
+	uint32_t hash = hashName (topic);
+	struct PUBSUBTOPIC* t = find (topic, hash);
+	struct PUBSUBLINK* l;
+
+	// does the topic exist ?
+	if (t != NULL) {
+		// yes. are we already subscribed ? the service list is short, so look
+		// there rather than at the subscribers
+		for (l = s->subscriptions; l != NULL; l = l->snext)
+			if (l->topic == t)
+				return 1;
+	} else {
+		// no. create it
+		if (numTopics >= numBuckets)
+			grow();
+		t = (struct PUBSUBTOPIC*)malloc (sizeof (struct PUBSUBTOPIC) + strlen (topic) + 1);
+		if (t == NULL)
+			return 0;
+		t->owner = this; t->hash = hash; t->head = NULL;
+		t->count = 0; t->busy = 0; t->dead = 0;
+		t->name = (char*)(t + 1);
+		strcpy (t->name, topic);
+		t->next = buckets[hash & (numBuckets - 1)];
+		buckets[hash & (numBuckets - 1)] = t;
+		numTopics++;
+	}
+
+	l = (struct PUBSUBLINK*)malloc (sizeof (struct PUBSUBLINK));
+	if (l == NULL) {
+		if (t->count == 0 && t->dead == 0)
+			removeTopic (t);
+		return 0;
+	}
+	l->topic = t; l->service = s;
+
+	// hook it up to the topic
+	l->tprev = NULL; l->tnext = t->head;
+	if (t->head != NULL)
+		t->head->tprev = l;
+	t->head = l; t->count++;
+
+	// and to the service
+	l->sprev = NULL; l->snext = s->subscriptions;
+	if (s->subscriptions != NULL)
+		s->subscriptions->sprev = l;
+	s->subscriptions = l;
+	return 1;
+}
+
+/*
+ * PUBSUB::detach (struct PUBSUBLINK* l)
+ *
+ * This will remove subscription [l] from the list of its service.
+ *
+ */
+void
+PUBSUB::detach (struct PUBSUBLINK* l) {
+	if (l->sprev != NULL)
+		l->sprev->snext = l->snext;
+	else
+		l->service->subscriptions = l->snext;
+	if (l->snext != NULL)
+		l->snext->sprev = l->sprev;
+}
+
+/*
+ * PUBSUB::unlink (struct PUBSUBLINK* l)
+ *
+ * This will remove subscription [l]. The topic is freed along with its last
+ * subscription.
+ *
+ */
+void
+PUBSUB::unlink (struct PUBSUBLINK* l) {
+	struct PUBSUBTOPIC* t = l->topic;
+
+	detach (l);
+	t->count--;
+
+	// is the topic being published to ?
+	if (t->busy) {
+		// yes. leave the link for publish() to clean up
+		l->service = NULL; t->dead++;
+		return;
+	}
+
+	// remove it from the topic
+	if (l->tprev != NULL)
+		l->tprev->tnext = l->tnext;
+	else
+		t->head = l->tnext;
+	if (l->tnext != NULL)
+		l->tnext->tprev = l->tprev;
+	free (l);
+
+	// was this the last one ?
+	if (t->count == 0 && t->dead == 0)
+		// yes. get rid of the topic
+		t->owner->removeTopic (t);
+}
+
+/*
+ * PUBSUB::removeTopic (struct PUBSUBTOPIC* t)
+ *
+ * This will free topic [t], which must not have any subscriptions left.
+ *
+ */
+void
+PUBSUB::removeTopic (struct PUBSUBTOPIC* t) {
+	struct PUBSUBTOPIC** p;
+
+	for (p = &buckets[t->hash & (numBuckets - 1)]; *p != NULL; p = &(*p)->next)
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	free (t);
+	numTopics--;
+}
+
+/*
+ * PUBSUB::unsubscribe (NETSERVICE* s, char* topic)
+ *
+ * This will unsubscribe service [s] from topic [topic]. It will return zero
+ * if [s] was not subscribed, or non-zero if it was.
+ *
+ */
+int
+PUBSUB::unsubscribe (NETSERVICE* s, char* topic) {
+	struct PUBSUBTOPIC* t = find (topic, hashName (topic));
+	struct PUBSUBLINK* l;
+
+	if (t == NULL)
+		return 0;
+	for (l = s->subscriptions; l != NULL; l = l->snext)
+		if (l->topic == t) {
+			unlink (l);
+			return 1;
+		}
+	return 0;
+}
+
+/*
+ * PUBSUB::unsubscribeAll (NETSERVICE* s)
+ *
+ * This will unsubscribe service [s] from everything it is subscribed to.
+ *
+ */
+void
+PUBSUB::unsubscribeAll (NETSERVICE* s) {
+	while (s->subscriptions != NULL)
+		unlink (s->subscriptions);
+}
+
+/*
+ * PUBSUB::admit (NETSERVICE* s)
+ *
+ * This will apply the slow subscriber policy to [s]. It will return non-zero
+ * if [s] should get the message.
+ *
+ */
+int
+PUBSUB::admit (NETSERVICE* s) {
+	int slow;
+
+	// is the subscriber keeping up ?
+	if (slowLimit > 0)
+		slow = s->getOutputLength() >= slowLimit;
+	else
+		slow = s->isOutputFull();
+	if (!slow || slowPolicy == PUBSUB_SLOW_IGNORE)
+		// yes, or we don't care. send it
+		return 1;
+
+	// no. skip the message or get rid of the subscriber altogether
+	refuse (s);
+	return 0;
+}
+
+/*
+ * PUBSUB::refuse (NETSERVICE* s)
+ *
+ * This will account for a message [s] does not get because it is too slow,
+ * and drop [s] if that is the policy.
+ *
+ */
+void
+PUBSUB::refuse (NETSERVICE* s) {
+	if (slowPolicy == PUBSUB_SLOW_DROP) {
+		counters[PUBSUB_COUNT_DROPPED]++;
+		s->drop();
+	} else
+		counters[PUBSUB_COUNT_SKIPPED]++;
+}
+
+/*
+ * PUBSUB::publish (char* topic, char* buf, int len)
+ *
+ * This will send the [len] bytes at [buf] to all subscribers of [topic]. It
+ * will return the number of subscribers the message was sent or queued to.
+ *
+ */
+int
+PUBSUB::publish (char* topic, char* buf, int len) {
+	NETBLOCK* b;
+	int n;
+
+	// anyone listening ?
+	if (find (topic, hashName (topic)) == NULL) {
+		// no. don't bother copying the data
+		counters[PUBSUB_COUNT_PUBLISHED]++;
+		return 0;
+	}
+
+	b = NETBLOCK::create (buf, len);
+	if (b == NULL)
+		return 0;
+	n = publish (topic, b);
+	b->unref();
+	return n;
+}
+
+/*
+ * PUBSUB::publish (char* topic, NETBLOCK* b)
+ *
+ * This will send block [b] to all subscribers of [topic]. It will return the
+ * number of subscribers the block was sent or queued to.
+ *
+ */
+int
+PUBSUB::publish (char* topic, NETBLOCK* b) {
+	struct PUBSUBTOPIC* t = find (topic, hashName (topic));
+	struct PUBSUBLINK* l;
+	struct PUBSUBLINK* next;
+	int n = 0;
+
+	counters[PUBSUB_COUNT_PUBLISHED]++;
+	if (t == NULL)
+		return 0;
+
+	// callbacks may unsubscribe anyone while we are at it; keep the links
+	// around until we are done
+	t->busy++;
+	for (l = t->head; l != NULL; l = l->tnext) {
+		if (l->service == NULL || !admit (l->service))
+			continue;
+		// the subscriber may have no room left; we never wait for it
+		if (l->service->sendBlock (b) == b->getLength())
+			n++;
+		else if (l->service->getFD() != -1 && !l->service->isDropped())
+			refuse (l->service);
+	}
+	t->busy--;
+	counters[PUBSUB_COUNT_DELIVERED] += n;
+
+	// clean up whatever was unsubscribed in the meantime
+	if (t->busy == 0 && t->dead > 0) {
+		for (l = t->head; l != NULL; l = next) {
+			next = l->tnext;
+			if (l->service != NULL)
+				continue;
+			if (l->tprev != NULL)
+				l->tprev->tnext = l->tnext;
+			else
+				t->head = l->tnext;
+			if (l->tnext != NULL)
+				l->tnext->tprev = l->tprev;
+			free (l);
+		}
+		t->dead = 0;
+		if (t->count == 0)
+			removeTopic (t);
+	}
+	return n;
+}
+
+/*
+ * PUBSUB::getSubscribers (char* topic)
+ *
+ * This will return the number of subscribers of [topic].
+ *
+ */
+int
+PUBSUB::getSubscribers (char* topic) {
+	struct PUBSUBTOPIC* t = find (topic, hashName (topic));
+
+	return (t != NULL) ? t->count : 0;
+}
+
+/*
+ * PUBSUB::setSlowPolicy (int policy, int limit)
+ *
+ * This will handle subscribers which have [limit] bytes of output queued
+ * according to [policy]. If [limit] is zero, subscribers above their high
+ * watermark are considered slow.
+ *
+ */
+void
+PUBSUB::setSlowPolicy (int policy, int limit) {
+	slowPolicy = policy; slowLimit = limit;
+}
+
+/*
+ * PUBSUB::getCounter (int which)
+ *
+ * This will return counter [which], or zero if there is no such counter.
+ *
+ */
+int
+PUBSUB::getCounter (int which) {
+	if (which < 0 || which >= PUBSUB_COUNT_MAX)
+		return 0;
+	return counters[which];
+}
+
+/*
+ * PUBSUB::resetCounters()
+ *
+ * This will reset all counters to zero.
+ *
+ */
+void
+PUBSUB::resetCounters() {
+	for (int i = 0; i < PUBSUB_COUNT_MAX; i++)
+		counters[i] = 0;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,183 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file ratelimit.cc
+ * \brief Per-address rate limiting, implements the RATELIMIT class
+ *
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <network.h>
+#include <ratelimit.h>
+
+//! \brief RATELIMIT_PROBE is the number of slots searched for a bucket
+#define RATELIMIT_PROBE 8
+
+/*
+ * RATEBUCKET is a single token bucket. A bucket which has never been used has
+ * a [last] value of zero.
+ */
+struct RATEBUCKET {
+	uint32_t key;
+	double   tokens;
+	double   last;
+};
+
+/*
+ * now()
+ *
+ * This will return a monotonic timestamp in seconds.
+ *
+ */
+static double
+now() {
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * RATELIMIT::RATELIMIT (int size)
+ *
+ * This will construct a rate limiter with [size] buckets.
+ *
+ */
+RATELIMIT::RATELIMIT (int size) {
+	// never go below a single probe window
+	if (size < RATELIMIT_PROBE)
+		size = RATELIMIT_PROBE;
+
+	// ten connections per second with a burst of twenty is a sane default
+	numBuckets = size; rate = 10.0; burst = 20.0; prefix = 32;
+	buckets = (struct RATEBUCKET*)malloc (numBuckets * sizeof (struct RATEBUCKET));
+	if (buckets == NULL)
+		// without buckets, nothing is limited
+		numBuckets = 0;
+	clear();
+}
+
+/*
+ * RATELIMIT::~RATELIMIT()
+ *
+ * This is the destructor.
+ *
+ */
+RATELIMIT::~RATELIMIT() {
+	free (buckets);
+}
+
+/*
+ * RATELIMIT::setRate (double r, double b)
+ *
+ * This will allow [r] events per second, with bursts of up to [b] events.
+ *
+ */
+void
+RATELIMIT::setRate (double r, double b) {
+	rate = r; burst = b;
+}
+
+/*
+ * RATELIMIT::setPrefix (int p)
+ *
+ * This will cause all addresses sharing the first [p] bits to share a bucket.
+ *
+ */
+void
+RATELIMIT::setPrefix (int p) {
+	prefix = p;
+	clear();
+}
+
+/*
+ * RATELIMIT::clear()
+ *
+ * This will forget all buckets.
+ *
+ */
+void
+RATELIMIT::clear() {
+	if (buckets != NULL)
+		memset (buckets, 0, numBuckets * sizeof (struct RATEBUCKET));
+}
+
+/*
+ * RATELIMIT::check (IPV4KEY key)
+ *
+ * This will take a token from the bucket of [key]. It will return non-zero if
+ * this succeeded or zero if the bucket is empty.
+ *
+ */
+int
+RATELIMIT::check (IPV4KEY key) {
+	IPV4KEY k = key.mask (prefix);
+	struct RATEBUCKET* b = NULL;
+	struct RATEBUCKET* victim = NULL;
+	double t = now();
+	int i, slot;
+
+	// anything to keep track with ?
+	if (numBuckets == 0)
+		// no. let it through rather than refuse everyone
+		return 1;
+
+	// scan the probe window for our bucket. buckets are never removed, so an
+	// unused slot means there is no bucket for this key yet
+	slot = k.hash() % numBuckets;
+	for (i = 0; i < RATELIMIT_PROBE; i++, slot = (slot + 1) % numBuckets) {
+		b = &buckets[slot];
+		if (b->last == 0.0 || b->key == k.getValue())
+			break;
+
+		// remember the least recently used bucket, in case we need to recycle it
+		if (victim == NULL || b->last < victim->last)
+			victim = b;
+	}
+
+	// got a bucket ?
+	if (i == RATELIMIT_PROBE) {
+		// no. recycle the stalest one in the window
+		b = victim;
+		b->last = 0.0;
+	}
+
+	if (b->last == 0.0) {
+		// fresh bucket. fill it up
+		b->key = k.getValue(); b->tokens = burst;
+	} else {
+		// refill the bucket for the time passed
+		b->tokens += (t - b->last) * rate;
+		if (b->tokens > burst)
+			b->tokens = burst;
+	}
+	b->last = t;
+
+	// can we take a token ?
+	if (b->tokens < 1.0)
+		// no. drop it
+		return 0;
+
+	b->tokens -= 1.0;
+	return 1;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,358 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file relayservice.cc
+ * \brief Relaying of connections, implements the RELAYSERVICE and
+ *        RELAYSERVER classes
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <network.h>
+#include <relayservice.h>
+
+/*
+ * RELAYSERVICE::RELAYSERVICE()
+ *
+ * This is the constructor.
+ *
+ */
+RELAYSERVICE::RELAYSERVICE() {
+	peer = NULL; pipefd[0] = -1; pipefd[1] = -1;
+	queued = 0; eof = 0; shut = 0; relayed = 0;
+}
+
+/*
+ * RELAYSERVICE::~RELAYSERVICE()
+ *
+ * This is the destructor. The other end is dropped, as there is nobody left
+ * to relay to.
+ *
+ */
+RELAYSERVICE::~RELAYSERVICE() {
+	if (peer != NULL) {
+		peer->peer = NULL;
+		peer->drop();
+	}
+	if (pipefd[0] != -1) {
+		::close (pipefd[0]); ::close (pipefd[1]);
+	}
+}
+
+/*
+ * RELAYSERVICE::pair (RELAYSERVICE* p)
+ *
+ * This will relay between us and [p]. It will return zero on failure or
+ * non-zero on success.
+ *
+ */
+int
+RELAYSERVICE::pair (RELAYSERVICE* p) {
+	// are both of us free ?
+	if (p == this || peer != NULL || p->peer != NULL)
+		// no. refuse
+		return 0;
+
+	#ifdef OS_LINUX
+	// set up the pipes to splice through
+	if (pipefd[0] == -1 && pipe2 (pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		pipefd[0] = -1;
+		return 0;
+	}
+	if (p->pipefd[0] == -1 && pipe2 (p->pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		p->pipefd[0] = -1;
+		return 0;
+	}
+	#endif // OS_LINUX
+
+	peer = p; p->peer = this;
+	return 1;
+}
+
+/*
+ * RELAYSERVICE::connect (NETADDRESS* addr)
+ *
+ * This will start connecting to [addr]. It will return zero on failure or
+ * non-zero on success.
+ *
+ */
+int
+RELAYSERVICE::connect (NETADDRESS* addr) {
+	int lfd;
+
+	// create a socket
+	lfd = socket (AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0)
+		return 0;
+
+	// connect to the host, without waiting for it. if this fails later on, we
+	// find out when relaying
+	fcntl (lfd, F_SETFL, fcntl (lfd, F_GETFL, 0) | O_NONBLOCK);
+	if (::connect (lfd, addr->getInternalAddress(), addr->getInternalLength()) < 0 && errno != EINPROGRESS) {
+		// this failed. complain
+		#ifdef _DEBUG_NETWORK
+		perror ("RELAYSERVICE::connect(): connect() failed");
+		#endif // _DEBUG_NETWORK
+		::close (lfd);
+		return 0;
+	}
+
+	// set the close-on-exec flag. this is required in case exec..() is used,
+	// since clients can only exit if no processes occupy the sockets.
+	fcntl (lfd, F_SETFD, FD_CLOEXEC);
+
+	setFD (lfd);
+	return 1;
+}
+
+/*
+ * RELAYSERVICE::getPeer()
+ *
+ * This will return the other end, or NULL if there is none.
+ *
+ */
+RELAYSERVICE*
+RELAYSERVICE::getPeer() {
+	return peer;
+}
+
+/*
+ * RELAYSERVICE::getRelayed()
+ *
+ * This will return the number of bytes read from us and relayed to the other
+ * end.
+ *
+ */
+unsigned long
+RELAYSERVICE::getRelayed() {
+	return relayed;
+}
+
+/*
+ * RELAYSERVICE::getOutputLength()
+ *
+ * This will return the number of bytes on their way to us: whatever is
+ * queued, plus whatever the other end left in its pipe.
+ *
+ */
+int
+RELAYSERVICE::getOutputLength() {
+	return NETSERVICE::getOutputLength() + ((peer != NULL) ? peer->queued : 0);
+}
+
+/*
+ * RELAYSERVICE::flush()
+ *
+ * This will send whatever the other end has for us. Once everything is sent,
+ * reading from the other end is resumed, or we are shut down for writing if
+ * it reached end of file. It will return zero if the connection failed or
+ * non-zero otherwise.
+ *
+ */
+int
+RELAYSERVICE::flush() {
+	// send what was queued the usual way first
+	if (!NETSERVICE::flush())
+		return 0;
+
+	// anyone to relay from ?
+	if (peer == NULL || fd == -1)
+		// no. we are done
+		return 1;
+
+	if (!setNonBlocking())
+		return 0;
+
+	#ifdef OS_LINUX
+	int i;
+
+	// move whatever is in the pipe to the socket
+	while (peer->queued > 0) {
+		i = splice (peer->pipefd[0], NULL, fd, NULL, peer->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		countWrite (i);
+		if (i < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 1 : 0;
+		if (i == 0)
+			break;
+		peer->queued -= i;
+	}
+	#endif // OS_LINUX
+
+	// is everything delivered ?
+	if (getOutputLength() > 0)
+		// no. wait until we can write again
+		return 1;
+
+	// did the other end reach end of file ?
+	if (peer->eof) {
+		// yes. pass that on
+		if (!shut) {
+			::shutdown (fd, SHUT_WR);
+			shut = 1;
+		}
+		checkDone();
+	} else {
+		// no. we can take more
+		peer->resumeReading();
+	}
+	return 1;
+}
+
+/*
+ * RELAYSERVICE::incoming()
+ *
+ * This will read what is available and pass it on to the other end. If the
+ * other end cannot take everything, reading is paused until it can.
+ *
+ */
+void
+RELAYSERVICE::incoming() {
+	int i;
+
+	// anyone to relay to ?
+	if (peer == NULL) {
+		// no. this is pointless
+		drop();
+		return;
+	}
+
+	if (!setNonBlocking()) {
+		drop();
+		return;
+	}
+
+	#ifdef OS_LINUX
+	// move the data into the pipe, without looking at it
+	i = splice (fd, NULL, pipefd[1], NULL, RELAYSERVICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (i > 0)
+		queued += i;
+	countRead (i);
+	#else
+	char tmp[16384];
+
+	// no splice() here. copy it
+	i = ::recv (fd, tmp, sizeof (tmp), MSG_DONTWAIT);
+	countRead (i);
+	if (i > 0)
+		peer->send (tmp, i);
+	#endif // OS_LINUX
+
+	if (i < 0) {
+		// did the connection fail ?
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			// yes. give up on both ends
+			drop();
+		return;
+	}
+
+	if (i == 0) {
+		// end of file. nothing more to read
+		eof = 1;
+		pauseReading();
+	}
+	relayed += i;
+
+	// pass it on right away
+	if (!peer->flush()) {
+		peer->drop();
+		return;
+	}
+
+	// if the other end can't keep up, wait for it
+	if (peer->getOutputLength() > 0)
+		pauseReading();
+}
+
+/*
+ * RELAYSERVICE::checkDone()
+ *
+ * This will drop both ends if all data was delivered in both directions.
+ *
+ */
+void
+RELAYSERVICE::checkDone() {
+	if (peer != NULL && shut && peer->shut) {
+		drop(); peer->drop();
+	}
+}
+
+/*
+ * RELAYSERVER::RELAYSERVER()
+ *
+ * This is the constructor.
+ *
+ */
+RELAYSERVER::RELAYSERVER() {
+	hasTarget = 0;
+}
+
+/*
+ * RELAYSERVER::setTarget (IPV4ADDRESS* addr)
+ *
+ * This will relay new connections to [addr].
+ *
+ */
+void
+RELAYSERVER::setTarget (IPV4ADDRESS* addr) {
+	memcpy (target.getInternalAddress(), addr->getInternalAddress(), sizeof (struct sockaddr_in));
+	hasTarget = 1;
+}
+
+/*
+ * RELAYSERVER::incoming()
+ *
+ * This will accept a new connection, connect to the target and relay the
+ * two to each other.
+ *
+ */
+void
+RELAYSERVER::incoming() {
+	RELAYSERVICE* in;
+	RELAYSERVICE* out;
+
+	// got a target ?
+	if (!hasTarget) {
+		// no. refuse the connection
+		accept();
+		return;
+	}
+
+	// accept the connection. this gets rid of the client if it fails
+	in = new RELAYSERVICE();
+	if (!accept (in))
+		return;
+
+	// connect to the target, and relay
+	out = new RELAYSERVICE();
+	if (!out->connect (&target) || !in->pair (out)) {
+		delete out;
+		in->drop();
+		return;
+	}
+	out->setParent (this);
+	addClient (out);
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,419 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file rpcclient.cc
+ * \brief Pipelined requests over a single connection, implements the
+ *        RPCCLIENT class
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <network.h>
+#include <rpcclient.h>
+
+/*
+ * RPCCALL is a request in flight. A request whose handler is NULL was given
+ * up on, but its response is still expected; it keeps its place until then,
+ * so the responses after it are matched correctly. [next] links the free
+ * slots together.
+ */
+struct RPCCALL {
+	int           used;
+	unsigned int  id;
+	RPCHANDLER*   handler;
+	void*         arg;
+	long long     deadline;
+	int           next;
+};
+
+/*
+ * rpc_hash (unsigned int id)
+ *
+ * This will return the hash value of ID [id].
+ *
+ */
+static inline unsigned int
+rpc_hash (unsigned int id) {
+	return id * 2654435761U;
+}
+
+/*
+ * RPCCLIENT::RPCCLIENT (int m, int d)
+ *
+ * This is the constructor. Responses are matched according to [m], and at
+ * most [d] requests are in flight.
+ *
+ */
+RPCCLIENT::RPCCLIENT (int m, int d) {
+	matching = m; depth = (d > 0) ? d : 1;
+	inFlight = 0; orderHead = 0; nextDeadline = 0;
+	order = NULL; table = NULL; tableSize = 0;
+	input = new NETBUFFER();
+
+	// chain the slots together
+	calls = (RPCCALL*)malloc (depth * sizeof (RPCCALL));
+	for (int i = 0; i < depth; i++) {
+		calls[i].used = 0; calls[i].next = i + 1;
+	}
+	calls[depth - 1].next = -1;
+	freeSlot = 0;
+
+	if (matching == RPCCLIENT_TAGGED) {
+		// keep the hash table at most half full
+		tableSize = 16;
+		while (tableSize < depth * 2)
+			tableSize *= 2;
+		table = (int*)calloc (tableSize, sizeof (int));
+	} else
+		order = (int*)malloc (depth * sizeof (int));
+}
+
+/*
+ * RPCCLIENT::~RPCCLIENT()
+ *
+ * This is the destructor. Requests in flight fail.
+ *
+ */
+RPCCLIENT::~RPCCLIENT() {
+	cancel (RPCCLIENT_FAILED);
+	free (calls);
+	if (order != NULL)
+		free (order);
+	if (table != NULL)
+		free (table);
+	delete input;
+}
+
+/*
+ * RPCCLIENT::find (unsigned int id)
+ *
+ * This will look up the tagged request with ID [id]. It will return its
+ * position in the hash table, or -1 if it is not in flight.
+ *
+ */
+int
+RPCCLIENT::find (unsigned int id) {
+	int mask = tableSize - 1;
+	int i = rpc_hash (id) & mask;
+
+	while (table[i] != 0) {
+		if (calls[table[i] - 1].id == id)
+			return i;
+		i = (i + 1) & mask;
+	}
+	return -1;
+}
+
+/*
+ * RPCCLIENT::unhash (int i)
+ *
+ * This will remove entry [i] from the hash table. The entries following it
+ * are moved up where needed, so lookups never stop short of them.
+ *
+ */
+void
+RPCCLIENT::unhash (int i) {
+	int mask = tableSize - 1;
+	int j = i, k;
+
+	if (i < 0)
+		return;
+	table[i] = 0;
+	while (1) {
+		j = (j + 1) & mask;
+		if (table[j] == 0)
+			break;
+
+		// can the entry stay where it is ?
+		k = rpc_hash (calls[table[j] - 1].id) & mask;
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			// yes. leave it
+			continue;
+
+		// no. fill the hole with it
+		table[i] = table[j]; table[j] = 0; i = j;
+	}
+}
+
+/*
+ * RPCCLIENT::freeCall (int slot)
+ *
+ * This will free slot [slot].
+ *
+ */
+void
+RPCCLIENT::freeCall (int slot) {
+	calls[slot].used = 0; calls[slot].handler = NULL;
+	calls[slot].next = freeSlot; freeSlot = slot;
+	inFlight--;
+}
+
+/*
+ * RPCCLIENT::call (char* req, int len, RPCHANDLER* h, void* arg, int timeout,
+ *                  unsigned int id)
+ *
+ * This will send request [req] of [len] bytes. Once the response arrives, or
+ * after [timeout] milliseconds if non-zero, [h] is called with [arg]. If the
+ * responses are tagged, [id] identifies the request. It will return zero on
+ * failure or non-zero on success.
+ *
+ */
+int
+RPCCLIENT::call (char* req, int len, RPCHANDLER* h, void* arg, int timeout, unsigned int id) {
+	RPCCALL* c;
+	NETWORK* n;
+	int slot;
+
+	// can we send it ?
+	if (fd == -1 || isDropped() || h == NULL)
+		// no. complain
+		return 0;
+	if (inFlight >= depth) {
+		errno = EAGAIN;
+		return 0;
+	}
+	if (matching == RPCCLIENT_TAGGED && find (id) >= 0) {
+		errno = EEXIST;
+		return 0;
+	}
+
+	// send it. if only part of it went, the connection is of no use anymore
+	if (send (req, len) < len) {
+		cancel (RPCCLIENT_FAILED);
+		drop();
+		return 0;
+	}
+
+	// remember it
+	slot = freeSlot; c = &calls[slot]; freeSlot = c->next;
+	c->used = 1; c->id = id; c->handler = h; c->arg = arg; c->deadline = 0;
+	if (matching == RPCCLIENT_TAGGED) {
+		int i = rpc_hash (id) & (tableSize - 1);
+		while (table[i] != 0)
+			i = (i + 1) & (tableSize - 1);
+		table[i] = slot + 1;
+	} else
+		order[(orderHead + inFlight) % depth] = slot;
+	inFlight++;
+
+	// does it have a deadline before the one we are waiting for ?
+	if (timeout > 0) {
+		c->deadline = NETWORK::getTime() + (long long)timeout * 1000;
+		n = getNetwork();
+		if (n != NULL && (nextDeadline == 0 || c->deadline < nextDeadline)) {
+			// yes. wait for this one first
+			nextDeadline = c->deadline;
+			n->addTimer (this, timeout);
+		}
+	}
+	return 1;
+}
+
+/*
+ * RPCCLIENT::getInFlight()
+ *
+ * This will return the number of requests in flight.
+ *
+ */
+int
+RPCCLIENT::getInFlight() {
+	return inFlight;
+}
+
+/*
+ * RPCCLIENT::getDepth()
+ *
+ * This will return the maximum number of requests in flight.
+ *
+ */
+int
+RPCCLIENT::getDepth() {
+	return depth;
+}
+
+/*
+ * RPCCLIENT::handle (char* data, int len, unsigned int id)
+ *
+ * This will pass response [data] of [len] bytes, tagged [id], to the handler
+ * of its request. It will return zero if no request was sent for it, or
+ * non-zero otherwise.
+ *
+ */
+int
+RPCCLIENT::handle (char* data, int len, unsigned int id) {
+	RPCHANDLER* h;
+	void* arg;
+	int slot, i;
+
+	if (matching == RPCCLIENT_TAGGED) {
+		// a response to a request we gave up on is simply ignored
+		i = find (id);
+		if (i < 0)
+			return 1;
+		slot = table[i] - 1;
+		unhash (i);
+	} else {
+		// the response is for the oldest request
+		if (inFlight == 0)
+			return 0;
+		slot = order[orderHead];
+		orderHead = (orderHead + 1) % depth;
+	}
+
+	// free the slot before calling the handler, which may send another request
+	h = calls[slot].handler; arg = calls[slot].arg;
+	freeCall (slot);
+	if (h != NULL)
+		h->rpcDone (RPCCLIENT_OK, data, len, arg);
+	return 1;
+}
+
+/*
+ * RPCCLIENT::cancel (int status)
+ *
+ * This will call the handlers of all requests in flight with [status]. If
+ * the responses are ordered, the requests keep their place until their
+ * responses arrive.
+ *
+ */
+void
+RPCCLIENT::cancel (int status) {
+	RPCHANDLER* h;
+	void* arg;
+
+	for (int slot = 0; slot < depth; slot++) {
+		if (!calls[slot].used || calls[slot].handler == NULL)
+			continue;
+		h = calls[slot].handler; arg = calls[slot].arg;
+		calls[slot].handler = NULL;
+		if (matching == RPCCLIENT_TAGGED) {
+			unhash (find (calls[slot].id));
+			freeCall (slot);
+		}
+		h->rpcDone (status, NULL, 0, arg);
+	}
+}
+
+/*
+ * RPCCLIENT::schedule()
+ *
+ * This will set the timer for the earliest deadline of the requests in
+ * flight.
+ *
+ */
+void
+RPCCLIENT::schedule() {
+	NETWORK* n = getNetwork();
+	long long t;
+
+	nextDeadline = 0;
+	for (int slot = 0; slot < depth; slot++) {
+		if (!calls[slot].used || calls[slot].handler == NULL || calls[slot].deadline == 0)
+			continue;
+		if (nextDeadline == 0 || calls[slot].deadline < nextDeadline)
+			nextDeadline = calls[slot].deadline;
+	}
+	if (nextDeadline == 0 || n == NULL)
+		return;
+
+	// round up, so we don't wake up just before it
+	t = nextDeadline - NETWORK::getTime();
+	n->addTimer (this, (t > 0) ? (int)((t + 999) / 1000) : 0);
+}
+
+/*
+ * RPCCLIENT::expired()
+ *
+ * This will fail all requests which are past their deadline.
+ *
+ */
+void
+RPCCLIENT::expired() {
+	long long t = NETWORK::getTime();
+	RPCHANDLER* h;
+	void* arg;
+
+	for (int slot = 0; slot < depth; slot++) {
+		if (!calls[slot].used || calls[slot].handler == NULL || calls[slot].deadline == 0 || calls[slot].deadline > t)
+			continue;
+		h = calls[slot].handler; arg = calls[slot].arg;
+		calls[slot].handler = NULL;
+		if (matching == RPCCLIENT_TAGGED) {
+			unhash (find (calls[slot].id));
+			freeCall (slot);
+		}
+		h->rpcDone (RPCCLIENT_TIMEOUT, NULL, 0, arg);
+	}
+	schedule();
+}
+
+/*
+ * RPCCLIENT::incoming()
+ *
+ * This will read what is available, and hand every complete response to the
+ * handler of its request. If the connection is closed or the input makes no
+ * sense, all requests fail and the connection is dropped.
+ *
+ */
+void
+RPCCLIENT::incoming() {
+	unsigned int id;
+	char* p;
+	int i;
+
+	p = input->reserve (RPCCLIENT_CHUNK);
+	if (p == NULL)
+		i = 0;
+	else {
+		i = readRaw (p, RPCCLIENT_CHUNK, MSG_DONTWAIT);
+		countRead (i);
+	}
+	if (i < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		// nothing after all
+		return;
+	if (i <= 0) {
+		// the connection is gone. so are the responses
+		cancel (RPCCLIENT_FAILED);
+		drop();
+		return;
+	}
+	input->commit (i);
+
+	// handle all complete responses
+	while (input->getLength() > 0) {
+		id = 0;
+		i = parse (input->getData(), input->getLength(), &id);
+		if (i == 0)
+			// wait for the rest
+			break;
+		if (i < 0 || i > input->getLength() || !handle (input->getData(), i, id)) {
+			// we lost track. there's no telling what belongs to whom anymore
+			cancel (RPCCLIENT_FAILED);
+			drop();
+			return;
+		}
+		input->consume (i);
+	}
+}
+
+/* vim:set ts=2 sw=2: */
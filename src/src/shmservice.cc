@@ -0,0 +1,516 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file shmservice.cc
+ * \brief Shared memory transport between processes, implements the
+ *        SHMSERVICE class
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef OS_LINUX
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif // OS_LINUX
+#include <network.h>
+#include <shmservice.h>
+
+//! \brief SHMSERVICE_INPUT is the default input buffer size
+#define SHMSERVICE_INPUT 65536
+
+/*
+ * SHMRING is the header of a ring, which is directly followed by the data.
+ * [head] is only written by the producer and [tail] only by the consumer;
+ * both keep counting up and are masked to find the offset in the ring. They
+ * live on cache lines of their own, so the two sides don't fight over them.
+ *
+ * [readerWaiting] is set by the consumer if it found the ring empty, and
+ * [writerWaiting] by the producer if it found the ring full. The other side
+ * only wakes them up if they are set.
+ */
+struct SHMRING {
+	uint32_t head;
+	char     pad0[60];
+	uint32_t tail;
+	char     pad1[60];
+	uint32_t readerWaiting;
+	uint32_t writerWaiting;
+	uint32_t closed;
+	uint32_t size;
+	char     pad2[48];
+};
+
+/*
+ * SHMSERVICE::SHMSERVICE()
+ *
+ * This is the constructor.
+ *
+ */
+SHMSERVICE::SHMSERVICE() {
+	mem = NULL; memSize = 0; tx = NULL; rx = NULL; peerEvent = -1;
+}
+
+/*
+ * SHMSERVICE::~SHMSERVICE()
+ *
+ * This is the destructor.
+ *
+ */
+SHMSERVICE::~SHMSERVICE() {
+	close();
+	if (mem != NULL)
+		munmap (mem, memSize);
+	if (peerEvent != -1)
+		::close (peerEvent);
+}
+
+/*
+ * SHMSERVICE::map (int memfd, int creator)
+ *
+ * This will map the rings in shared memory [memfd]. If [creator] is non-zero,
+ * we write to the first ring, otherwise to the second. It will return zero
+ * on failure or non-zero on success.
+ *
+ */
+int
+SHMSERVICE::map (int memfd, int creator) {
+	struct SHMRING* r;
+	struct stat st;
+
+	if (fstat (memfd, &st) < 0 || st.st_size < (off_t)(2 * sizeof (struct SHMRING)))
+		return 0;
+	mem = (char*)mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (mem == (char*)MAP_FAILED) {
+		mem = NULL;
+		return 0;
+	}
+	memSize = st.st_size;
+
+	// the second ring directly follows the data of the first
+	r = (struct SHMRING*)mem;
+	if ((off_t)(2 * (sizeof (struct SHMRING) + r->size)) != st.st_size) {
+		munmap (mem, memSize); mem = NULL;
+		return 0;
+	}
+	tx = r; rx = (struct SHMRING*)(mem + sizeof (struct SHMRING) + r->size);
+	if (!creator) {
+		tx = rx; rx = r;
+	}
+	return 1;
+}
+
+/*
+ * SHMSERVICE::create (int sock, int size)
+ *
+ * This will set up two rings of [size] bytes and pass them to the process at
+ * the other end of Unix socket [sock]. It will return zero on failure or
+ * non-zero on success.
+ *
+ */
+int
+SHMSERVICE::create (int sock, int size) {
+	#ifdef OS_LINUX
+	struct SHMRING* r;
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE (3 * sizeof (int))];
+	int fds[3], n = 4096;
+	char c = 0;
+
+	if (fd != -1)
+		return 0;
+
+	// the ring size must be a power of two, so offsets can be masked
+	while (n < size)
+		n *= 2;
+
+	// set the memory and our eventfds up. we keep a copy of the eventfd of the
+	// other side, to wake it up
+	fds[0] = syscall (SYS_memfd_create, "libplusplus", 1 /* MFD_CLOEXEC */);
+	fds[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[2] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0 ||
+	    ftruncate (fds[0], 2 * (sizeof (struct SHMRING) + n)) < 0)
+		goto fail;
+	r = (struct SHMRING*)mmap (NULL, sizeof (struct SHMRING), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (r == (struct SHMRING*)MAP_FAILED)
+		goto fail;
+	r->size = n;
+	munmap (r, sizeof (struct SHMRING));
+	if (!map (fds[0], 1))
+		goto fail;
+	tx->size = n; rx->size = n;
+
+	// neither side has looked yet, so both wait for data
+	tx->readerWaiting = 1; rx->readerWaiting = 1;
+
+	// pass the memory and the eventfds along
+	memset (&msg, 0, sizeof (msg));
+	iov.iov_base = &c; iov.iov_len = 1;
+	msg.msg_iov = &iov; msg.msg_iovlen = 1;
+	msg.msg_control = cbuf; msg.msg_controllen = sizeof (cbuf);
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (3 * sizeof (int));
+	memcpy (CMSG_DATA (cmsg), fds, 3 * sizeof (int));
+	if (sendmsg (sock, &msg, 0) != 1)
+		goto fail;
+
+	// the first eventfd wakes the other side, the second one us
+	::close (fds[0]);
+	peerEvent = fds[1]; fd = fds[2];
+	setInputLimit (SHMSERVICE_INPUT);
+	return 1;
+
+fail:
+	if (mem != NULL) {
+		munmap (mem, memSize);
+		mem = NULL; tx = NULL; rx = NULL;
+	}
+	for (int i = 0; i < 3; i++)
+		if (fds[i] >= 0)
+			::close (fds[i]);
+	return 0;
+	#else
+	// not supported here
+	return 0;
+	#endif // OS_LINUX
+}
+
+/*
+ * SHMSERVICE::attach (int sock)
+ *
+ * This will attach to the rings passed by the process at the other end of
+ * Unix socket [sock]. It will return zero on failure or non-zero on success.
+ *
+ */
+int
+SHMSERVICE::attach (int sock) {
+	#ifdef OS_LINUX
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE (3 * sizeof (int))];
+	int fds[3];
+	char c;
+
+	if (fd != -1)
+		return 0;
+
+	// fetch the descriptors
+	memset (&msg, 0, sizeof (msg));
+	iov.iov_base = &c; iov.iov_len = 1;
+	msg.msg_iov = &iov; msg.msg_iovlen = 1;
+	msg.msg_control = cbuf; msg.msg_controllen = sizeof (cbuf);
+	if (recvmsg (sock, &msg, 0) != 1)
+		return 0;
+	cmsg = CMSG_FIRSTHDR (&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN (3 * sizeof (int)))
+		return 0;
+	memcpy (fds, CMSG_DATA (cmsg), 3 * sizeof (int));
+
+	// map the memory; the mapping stays after the descriptor is closed
+	if (!map (fds[0], 0)) {
+		for (int i = 0; i < 3; i++)
+			::close (fds[i]);
+		return 0;
+	}
+	::close (fds[0]);
+
+	// the first eventfd wakes us, the second one the other side
+	fd = fds[1]; peerEvent = fds[2];
+	setInputLimit (SHMSERVICE_INPUT);
+	return 1;
+	#else
+	// not supported here
+	return 0;
+	#endif // OS_LINUX
+}
+
+/*
+ * SHMSERVICE::notify()
+ *
+ * This will wake the other side up.
+ *
+ */
+void
+SHMSERVICE::notify() {
+	uint64_t one = 1;
+
+	write (peerEvent, &one, sizeof (one));
+}
+
+/*
+ * SHMSERVICE::wakeup()
+ *
+ * This will reset our eventfd after it woke us up.
+ *
+ */
+void
+SHMSERVICE::wakeup() {
+	uint64_t v;
+
+	read (fd, &v, sizeof (v));
+}
+
+/*
+ * SHMSERVICE::hasInput()
+ *
+ * This will return non-zero if there is data in the incoming ring.
+ *
+ */
+int
+SHMSERVICE::hasInput() {
+	if (rx == NULL)
+		return 0;
+	return (__atomic_load_n (&rx->head, __ATOMIC_ACQUIRE) != rx->tail) ? 1 : 0;
+}
+
+/*
+ * SHMSERVICE::readRaw (char* buf, int len, int flags)
+ *
+ * This will copy up to [len] bytes from the incoming ring to [buf]. If
+ * [flags] contains MSG_PEEK, the data is left in the ring. It will return
+ * what ::recv() would.
+ *
+ */
+int
+SHMSERVICE::readRaw (char* buf, int len, int flags) {
+	uint32_t head, tail, mask, off, n, first;
+	char* data;
+
+	if (rx == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	tail = rx->tail;
+	head = __atomic_load_n (&rx->head, __ATOMIC_ACQUIRE);
+
+	// anything there ?
+	if (head == tail) {
+		// no. ask to be woken up, then look again, so we can't miss anything
+		// written in the meantime
+		__atomic_store_n (&rx->readerWaiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence (__ATOMIC_SEQ_CST);
+		head = __atomic_load_n (&rx->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			// still nothing. if the other side is gone, this is the end
+			if (__atomic_load_n (&rx->closed, __ATOMIC_ACQUIRE) &&
+			    __atomic_load_n (&rx->head, __ATOMIC_ACQUIRE) == tail)
+				return 0;
+			errno = EAGAIN;
+			return -1;
+		}
+		__atomic_store_n (&rx->readerWaiting, 0, __ATOMIC_RELAXED);
+	}
+
+	// copy what we can, which may wrap around the end of the ring
+	n = head - tail;
+	if (n > (uint32_t)len)
+		n = len;
+	mask = rx->size - 1; off = tail & mask;
+	data = (char*)(rx + 1);
+	first = (n < rx->size - off) ? n : rx->size - off;
+	memcpy (buf, data + off, first);
+	memcpy (buf + first, data, n - first);
+	if (flags & MSG_PEEK)
+		return n;
+
+	// hand the room back, and wake the other side if it waits for it
+	__atomic_store_n (&rx->tail, tail + n, __ATOMIC_RELEASE);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&rx->writerWaiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n (&rx->writerWaiting, 0, __ATOMIC_RELAXED);
+		notify();
+	}
+
+	// if we emptied the ring, ask to be woken up for more. anything left
+	// behind is found by hasInput()
+	if (__atomic_load_n (&rx->head, __ATOMIC_ACQUIRE) == tail + n) {
+		__atomic_store_n (&rx->readerWaiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence (__ATOMIC_SEQ_CST);
+		if (__atomic_load_n (&rx->head, __ATOMIC_ACQUIRE) != tail + n)
+			__atomic_store_n (&rx->readerWaiting, 0, __ATOMIC_RELAXED);
+	}
+	return n;
+}
+
+/*
+ * SHMSERVICE::reserve (int* len)
+ *
+ * This will find room in the outgoing ring for up to [*len] bytes, lowering
+ * [*len] to what fits without wrapping around. It will return a pointer to
+ * the room, or NULL with errno set if the ring is full or the other side is
+ * gone.
+ *
+ */
+char*
+SHMSERVICE::reserve (int* len) {
+	uint32_t head, tail, room, off;
+
+	if (tx == NULL) {
+		errno = ENOTCONN;
+		return NULL;
+	}
+
+	// is anyone listening ?
+	if (__atomic_load_n (&rx->closed, __ATOMIC_ACQUIRE)) {
+		// no. behave like a socket would
+		errno = EPIPE;
+		return NULL;
+	}
+
+	head = tx->head;
+	tail = __atomic_load_n (&tx->tail, __ATOMIC_ACQUIRE);
+	room = tx->size - (head - tail);
+	if (room == 0) {
+		// full. ask to be woken up, then look again, so we can't miss anything
+		// read in the meantime
+		__atomic_store_n (&tx->writerWaiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence (__ATOMIC_SEQ_CST);
+		tail = __atomic_load_n (&tx->tail, __ATOMIC_ACQUIRE);
+		room = tx->size - (head - tail);
+		if (room == 0) {
+			errno = EAGAIN;
+			return NULL;
+		}
+		__atomic_store_n (&tx->writerWaiting, 0, __ATOMIC_RELAXED);
+	}
+
+	// don't go beyond the end of the ring
+	off = head & (tx->size - 1);
+	if (room > tx->size - off)
+		room = tx->size - off;
+	if ((uint32_t)*len > room)
+		*len = room;
+	return (char*)(tx + 1) + off;
+}
+
+/*
+ * SHMSERVICE::commit (int len)
+ *
+ * This will make [len] bytes written to the room returned by reserve()
+ * available to the other side, and wake it up if it waits for them.
+ *
+ */
+void
+SHMSERVICE::commit (int len) {
+	__atomic_store_n (&tx->head, tx->head + len, __ATOMIC_RELEASE);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&tx->readerWaiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n (&tx->readerWaiting, 0, __ATOMIC_RELAXED);
+		notify();
+	}
+}
+
+/*
+ * SHMSERVICE::writeRaw (char* buf, int len, int flags)
+ *
+ * This will copy up to [len] bytes from [buf] to the outgoing ring. It will
+ * return what ::send() would. The ring never blocks, so the flags are of no
+ * use.
+ *
+ */
+int
+SHMSERVICE::writeRaw (char* buf, int len, int) {
+	int done = 0, n;
+	char* p;
+
+	// this takes two rounds if we wrap around the end of the ring
+	while (done < len) {
+		n = len - done;
+		p = reserve (&n);
+		if (p == NULL)
+			break;
+		memcpy (p, buf + done, n);
+		commit (n);
+		done += n;
+	}
+	return (done == 0 && len > 0) ? -1 : done;
+}
+
+/*
+ * SHMSERVICE::writeVector (struct iovec* iov, int n, int flags)
+ *
+ * This will copy as much of the [n] buffers in [iov] as fits to the outgoing
+ * ring. It will return what ::send() would.
+ *
+ */
+int
+SHMSERVICE::writeVector (struct iovec* iov, int n, int flags) {
+	int done = 0, i;
+
+	for (int j = 0; j < n; j++) {
+		i = writeRaw ((char*)iov[j].iov_base, iov[j].iov_len, flags);
+		if (i < 0)
+			return (done > 0) ? done : -1;
+		done += i;
+		if (i < (int)iov[j].iov_len)
+			break;
+	}
+	return done;
+}
+
+/*
+ * SHMSERVICE::writeFile (int filefd, off_t* offset, int len)
+ *
+ * This will read up to [len] bytes of file [filefd] from [offset] onwards
+ * straight into the outgoing ring, and advance [offset] by the amount read.
+ * It will return what ::send() would.
+ *
+ */
+int
+SHMSERVICE::writeFile (int filefd, off_t* offset, int len) {
+	char* p = reserve (&len);
+	int i;
+
+	if (p == NULL)
+		return -1;
+	i = pread (filefd, p, len, *offset);
+	if (i > 0) {
+		commit (i);
+		*offset += i;
+	}
+	return i;
+}
+
+/*
+ * SHMSERVICE::closeRaw()
+ *
+ * This will tell the other side we are done.
+ *
+ */
+void
+SHMSERVICE::closeRaw() {
+	if (tx == NULL)
+		return;
+	__atomic_store_n (&tx->closed, 1, __ATOMIC_RELEASE);
+	notify();
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,252 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file sigservice.cc
+ * \brief Signal delivery through the network loop, implements the
+ *        SIGNALSERVICE class
+ *
+ */
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef OS_LINUX
+#include <sys/signalfd.h>
+#endif // OS_LINUX
+#include <network.h>
+#include <sigservice.h>
+
+#ifndef OS_LINUX
+/*
+ * sigPipe is the write end of the pipe signals are forwarded to. There is a
+ * single one, as signal handlers cannot tell services apart.
+ */
+static int sigPipe = -1;
+
+/*
+ * forward (int signo)
+ *
+ * This is the signal handler. It will write [signo] to the pipe, to be read
+ * by SIGNALSERVICE::incoming().
+ *
+ */
+static void
+forward (int signo) {
+	int saved = errno;
+	unsigned char c = signo;
+
+	// if the pipe is full, the signal is lost, just like a pending one would be
+	write (sigPipe, &c, 1);
+	errno = saved;
+}
+#endif // !OS_LINUX
+
+/*
+ * SIGNALSERVICE::SIGNALSERVICE()
+ *
+ * This is the constructor.
+ *
+ */
+SIGNALSERVICE::SIGNALSERVICE() {
+	for (int i = 0; i < NSIG; i++)
+		handlers[i] = NULL;
+	sigemptyset (&mask);
+	pipefd = -1;
+}
+
+/*
+ * SIGNALSERVICE::~SIGNALSERVICE()
+ *
+ * This is the destructor. It will restore the default behaviour of all
+ * signals we handle.
+ *
+ */
+SIGNALSERVICE::~SIGNALSERVICE() {
+	for (int i = 1; i < NSIG; i++)
+		if (sigismember (&mask, i) == 1)
+			remove (i);
+
+	#ifndef OS_LINUX
+	if (pipefd != -1) {
+		sigPipe = -1;
+		::close (pipefd);
+	}
+	#endif // !OS_LINUX
+}
+
+/*
+ * SIGNALSERVICE::setup()
+ *
+ * This will set the descriptor we wait on up to report the signals in our
+ * mask. It will return zero on failure or non-zero on success.
+ *
+ */
+int
+SIGNALSERVICE::setup() {
+	#ifdef OS_LINUX
+	int i;
+
+	// create the descriptor, or update the signals it reports
+	i = signalfd (fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (i < 0)
+		return 0;
+
+	// no stdio for this one; it isn't a socket
+	fd = i;
+	return 1;
+	#else
+	int p[2];
+
+	// already got a pipe ?
+	if (fd != -1)
+		// yes. nothing to do
+		return 1;
+
+	if (pipe (p) < 0)
+		return 0;
+	for (int i = 0; i < 2; i++) {
+		fcntl (p[i], F_SETFL, fcntl (p[i], F_GETFL, 0) | O_NONBLOCK);
+		fcntl (p[i], F_SETFD, FD_CLOEXEC);
+	}
+	fd = p[0]; pipefd = p[1]; sigPipe = p[1];
+	return 1;
+	#endif // OS_LINUX
+}
+
+/*
+ * SIGNALSERVICE::add (int signo, SIGNALHANDLER* h)
+ *
+ * This will have signal [signo] handled by [h] from within the network loop.
+ * It will return zero on failure or non-zero on success.
+ *
+ */
+int
+SIGNALSERVICE::add (int signo, SIGNALHANDLER* h) {
+	sigset_t set;
+
+	if (signo <= 0 || signo >= NSIG)
+		return 0;
+
+	handlers[signo] = h;
+	sigaddset (&mask, signo);
+	if (!setup()) {
+		sigdelset (&mask, signo);
+		return 0;
+	}
+
+	#ifdef OS_LINUX
+	// block the signal, so it is only reported by the descriptor
+	sigemptyset (&set);
+	sigaddset (&set, signo);
+	pthread_sigmask (SIG_BLOCK, &set, NULL);
+	#else
+	struct sigaction sa;
+
+	// forward the signal to the pipe
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = forward;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset (&sa.sa_mask);
+	sigaction (signo, &sa, NULL);
+
+	// it may have been blocked before
+	sigemptyset (&set);
+	sigaddset (&set, signo);
+	pthread_sigmask (SIG_UNBLOCK, &set, NULL);
+	#endif // OS_LINUX
+
+	#ifdef _DEBUG_NETWORK
+	printf ("SIGNALSERVICE::add(): handling signal %d\n", signo);
+	#endif // _DEBUG_NETWORK
+	return 1;
+}
+
+/*
+ * SIGNALSERVICE::remove (int signo)
+ *
+ * This will restore the default behaviour of signal [signo]. It will return
+ * zero on failure or non-zero on success.
+ *
+ */
+int
+SIGNALSERVICE::remove (int signo) {
+	if (signo <= 0 || signo >= NSIG || sigismember (&mask, signo) != 1)
+		return 0;
+
+	handlers[signo] = NULL;
+	sigdelset (&mask, signo);
+
+	#ifdef OS_LINUX
+	sigset_t set;
+
+	// stop reporting it, and let it through again
+	setup();
+	sigemptyset (&set);
+	sigaddset (&set, signo);
+	pthread_sigmask (SIG_UNBLOCK, &set, NULL);
+	#else
+	signal (signo, SIG_DFL);
+	#endif // OS_LINUX
+	return 1;
+}
+
+/*
+ * SIGNALSERVICE::handleSignal (int signo)
+ *
+ * This will call the handler of signal [signo], if any.
+ *
+ */
+void
+SIGNALSERVICE::handleSignal (int signo) {
+	if (signo > 0 && signo < NSIG && handlers[signo] != NULL)
+		handlers[signo]->handleSignal (signo);
+}
+
+/*
+ * SIGNALSERVICE::incoming()
+ *
+ * This will handle all pending signals.
+ *
+ */
+void
+SIGNALSERVICE::incoming() {
+	#ifdef OS_LINUX
+	struct signalfd_siginfo si[8];
+	int i;
+
+	// fetch signals until there are no more
+	while ((i = ::read (fd, si, sizeof (si))) > 0) {
+		for (int j = 0; j < i / (int)sizeof (struct signalfd_siginfo); j++)
+			handleSignal (si[j].ssi_signo);
+	}
+	#else
+	unsigned char buf[64];
+	int i;
+
+	while ((i = ::read (fd, buf, sizeof (buf))) > 0) {
+		for (int j = 0; j < i; j++)
+			handleSignal (buf[j]);
+	}
+	#endif // OS_LINUX
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,213 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file streamservice.cc
+ * \brief Streaming of files at a constant rate, implements the STREAMSERVICE
+ *        class
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <network.h>
+#include <streamservice.h>
+
+/*
+ * STREAMSERVICE::STREAMSERVICE()
+ *
+ * This is the constructor.
+ *
+ */
+STREAMSERVICE::STREAMSERVICE() {
+	file = -1; pos = 0; end = 0; advised = 0;
+	rate = 0; credit = 0; last = 0;
+}
+
+/*
+ * STREAMSERVICE::play (int filefd, int r, off_t offset, off_t len)
+ *
+ * This will start sending [len] bytes of file [filefd] from [offset] onwards
+ * at [r] bytes per second. If [len] is negative, the rest of the file is
+ * sent. It will return zero on failure or non-zero on success.
+ *
+ */
+int
+STREAMSERVICE::play (int filefd, int r, off_t offset, off_t len) {
+	struct stat st;
+	int i;
+
+	// can we stream at all ?
+	if (fd == -1 || r <= 0 || getNetwork() == NULL)
+		// no. complain
+		return 0;
+	stop();
+
+	// up to the end ?
+	if (len < 0) {
+		// yes. find out where that is
+		if (fstat (filefd, &st) < 0)
+			return 0;
+		len = st.st_size - offset;
+	}
+	file = filefd; pos = offset; end = offset + len; advised = offset;
+	rate = r;
+
+	#ifdef POSIX_FADV_SEQUENTIAL
+	// tell the kernel how the file is read, so it reads ahead further
+	posix_fadvise (file, offset, len, POSIX_FADV_SEQUENTIAL);
+	#endif // POSIX_FADV_SEQUENTIAL
+
+	#ifdef SO_MAX_PACING_RATE
+	// have the kernel spread the packets of a tick out, rather than sending
+	// them in a burst
+	i = rate;
+	setsockopt (fd, SOL_SOCKET, SO_MAX_PACING_RATE, &i, sizeof (i));
+	#endif // SO_MAX_PACING_RATE
+
+	// don't let more than a few ticks worth pile up in the socket
+	i = (int)((long long)rate * STREAMSERVICE_TICK * 4 / 1000);
+	if (i < STREAMSERVICE_MIN_BUFFER)
+		i = STREAMSERVICE_MIN_BUFFER;
+	setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &i, sizeof (i));
+
+	// start off with a tick's worth
+	credit = (long long)rate * STREAMSERVICE_TICK * 1000;
+	last = NETWORK::getTime();
+	expired();
+	return 1;
+}
+
+/*
+ * STREAMSERVICE::stop()
+ *
+ * This will stop streaming.
+ *
+ */
+void
+STREAMSERVICE::stop() {
+	NETWORK* n = getNetwork();
+
+	if (n != NULL)
+		n->removeTimer (this);
+	file = -1;
+}
+
+/*
+ * STREAMSERVICE::isPlaying()
+ *
+ * This will return non-zero while a file is streamed.
+ *
+ */
+int
+STREAMSERVICE::isPlaying() {
+	return (file != -1) ? 1 : 0;
+}
+
+/*
+ * STREAMSERVICE::getPosition()
+ *
+ * This will return the offset in the file of the next byte to send.
+ *
+ */
+off_t
+STREAMSERVICE::getPosition() {
+	return pos;
+}
+
+/*
+ * STREAMSERVICE::finished()
+ *
+ * This is called once the whole file is sent. It does nothing.
+ *
+ */
+void
+STREAMSERVICE::finished() {
+}
+
+/*
+ * STREAMSERVICE::expired()
+ *
+ * This will send whatever is due by now, and wait for the next tick.
+ *
+ */
+void
+STREAMSERVICE::expired() {
+	long long t = NETWORK::getTime();
+	long long limit;
+	off_t n;
+	int i;
+
+	// still streaming ?
+	if (file == -1 || fd == -1)
+		// no. nothing to do
+		return;
+
+	// earn credit for the time passed. a listener which can't keep up doesn't
+	// get a burst later on
+	credit += (t - last) * rate; last = t;
+	limit = (long long)rate * STREAMSERVICE_TICK * 2 * 1000;
+	if (credit > limit)
+		credit = limit;
+
+	#ifdef POSIX_FADV_WILLNEED
+	// halfway through what was read ahead ? then read the next part
+	if (advised < end && pos + (off_t)rate * STREAMSERVICE_READAHEAD / 2 >= advised) {
+		n = (off_t)rate * STREAMSERVICE_READAHEAD;
+		if (n > end - advised)
+			n = end - advised;
+		posix_fadvise (file, advised, n, POSIX_FADV_WILLNEED);
+		advised += n;
+	}
+	#endif // POSIX_FADV_WILLNEED
+
+	// send what we may, as long as the socket takes it
+	while (credit >= 1000000 && pos < end) {
+		n = credit / 1000000;
+		if (n > end - pos)
+			n = end - pos;
+		if (n > 65536)
+			n = 65536;
+		i = sendFile (file, &pos, n);
+		if (i < 0) {
+			// the connection failed. give up
+			stop();
+			drop();
+			return;
+		}
+		if (i == 0)
+			// the socket is full
+			break;
+		credit -= (long long)i * 1000000;
+	}
+
+	// done ?
+	if (pos >= end) {
+		// yes. tell whoever is interested
+		stop();
+		finished();
+		return;
+	}
+	if (getNetwork() != NULL)
+		getNetwork()->addTimer (this, STREAMSERVICE_TICK);
+}
+
+/* vim:set ts=2 sw=2: */
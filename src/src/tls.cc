@@ -0,0 +1,563 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file tls.cc
+ * \brief TLS support, implements the TLSCONTEXT and TLSSESSION classes
+ *
+ */
+#ifdef NET_TLS
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <network.h>
+#include <tls.h>
+
+/*
+ * TLSCACHED is the last session of a client context with server [host]. An
+ * empty [host] is used for servers without a name.
+ */
+struct TLSCACHED {
+	char*         host;
+	SSL_SESSION*  session;
+};
+
+/*
+ * newSession (SSL* ssl, SSL_SESSION* sess)
+ *
+ * This is called by OpenSSL whenever a client connection receives a session
+ * which may be resumed later. It is stored in the context, for the server
+ * the connection was made to.
+ *
+ */
+static int
+newSession (SSL* ssl, SSL_SESSION* sess) {
+	TLSCONTEXT* ctx = (TLSCONTEXT*)SSL_CTX_get_app_data (SSL_get_SSL_CTX (ssl));
+
+	// keep it; returning 1 means we took over the reference
+	ctx->setSession ((char*)SSL_get_app_data (ssl), sess);
+	return 1;
+}
+
+/*
+ * TLSCONTEXT::TLSCONTEXT()
+ *
+ * This is the constructor.
+ *
+ */
+TLSCONTEXT::TLSCONTEXT() {
+	#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	SSL_library_init();
+	SSL_load_error_strings();
+	#endif
+
+	ctx = NULL; sessions = NULL; nextSession = 0; ktls = 1;
+}
+
+/*
+ * TLSCONTEXT::~TLSCONTEXT()
+ *
+ * This is the destructor.
+ *
+ */
+TLSCONTEXT::~TLSCONTEXT() {
+	if (sessions != NULL) {
+		for (int i = 0; i < TLSCONTEXT_SESSIONS; i++) {
+			if (sessions[i].session)
+				SSL_SESSION_free (sessions[i].session);
+			if (sessions[i].host)
+				free (sessions[i].host);
+		}
+		free (sessions);
+	}
+	if (ctx)
+		SSL_CTX_free (ctx);
+}
+
+/*
+ * TLSCONTEXT::setup()
+ *
+ * This will apply the settings shared by clients and servers. It will return
+ * zero on failure or non-zero on success.
+ *
+ */
+int
+TLSCONTEXT::setup() {
+	if (ctx == NULL)
+		return 0;
+
+	// we may be handed a different pointer when retrying a partial write, and
+	// idle connections need not keep their buffers
+	SSL_CTX_set_mode (ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+	SSL_CTX_set_app_data (ctx, this);
+
+	// let the kernel do the encryption if it can
+	#ifdef SSL_OP_ENABLE_KTLS
+	if (ktls)
+		SSL_CTX_set_options (ctx, SSL_OP_ENABLE_KTLS);
+	#endif // SSL_OP_ENABLE_KTLS
+	return 1;
+}
+
+/*
+ * TLSCONTEXT::createServer (char* cert, char* key)
+ *
+ * This will set the context up for a server using certificate chain [cert]
+ * and private key [key]. It will return zero on failure or non-zero on
+ * success.
+ *
+ */
+int
+TLSCONTEXT::createServer (char* cert, char* key) {
+	static unsigned char sid[] = "libplusplus";
+
+	ctx = SSL_CTX_new (SSLv23_server_method());
+	if (!setup())
+		return 0;
+
+	// load the certificate and key
+	if (SSL_CTX_use_certificate_chain_file (ctx, cert) != 1 ||
+	    SSL_CTX_use_PrivateKey_file (ctx, key, SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key (ctx) != 1) {
+		#ifdef _DEBUG_NETWORK
+		ERR_print_errors_fp (stderr);
+		#endif // _DEBUG_NETWORK
+		SSL_CTX_free (ctx); ctx = NULL;
+		return 0;
+	}
+
+	// keep sessions around so clients can resume them
+	SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context (ctx, sid, sizeof (sid) - 1);
+	return 1;
+}
+
+/*
+ * TLSCONTEXT::createClient (char* ca)
+ *
+ * This will set the context up for a client which trusts the certificates in
+ * [ca]. If [ca] is NULL, the server is not verified. It will return zero on
+ * failure or non-zero on success.
+ *
+ */
+int
+TLSCONTEXT::createClient (char* ca) {
+	ctx = SSL_CTX_new (SSLv23_client_method());
+	if (!setup())
+		return 0;
+
+	// need to verify the server ?
+	if (ca != NULL) {
+		// yes. load the certificates we trust
+		if (SSL_CTX_load_verify_locations (ctx, ca, NULL) != 1) {
+			SSL_CTX_free (ctx); ctx = NULL;
+			return 0;
+		}
+		SSL_CTX_set_verify (ctx, SSL_VERIFY_PEER, NULL);
+	}
+
+	// we keep the session ourselves
+	SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb (ctx, newSession);
+	return 1;
+}
+
+/*
+ * TLSCONTEXT::isVerifying()
+ *
+ * This will return non-zero if servers are verified.
+ *
+ */
+int
+TLSCONTEXT::isVerifying() {
+	return (ctx != NULL && (SSL_CTX_get_verify_mode (ctx) & SSL_VERIFY_PEER)) ? 1 : 0;
+}
+
+/*
+ * TLSCONTEXT::setKernelTLS (int on)
+ *
+ * This will enable kernel TLS offload if [on] is non-zero. It must be called
+ * before the context is created.
+ *
+ */
+void
+TLSCONTEXT::setKernelTLS (int on) {
+	ktls = on;
+}
+
+/*
+ * TLSCONTEXT::getContext()
+ *
+ * This will return the OpenSSL context.
+ *
+ */
+SSL_CTX*
+TLSCONTEXT::getContext() {
+	return ctx;
+}
+
+/*
+ * TLSCONTEXT::getSession (char* host)
+ *
+ * This will return the session to offer to server [host], or NULL if there
+ * is none.
+ *
+ */
+SSL_SESSION*
+TLSCONTEXT::getSession (char* host) {
+	if (sessions == NULL)
+		return NULL;
+	if (host == NULL)
+		host = (char*)"";
+	for (int i = 0; i < TLSCONTEXT_SESSIONS; i++)
+		if (sessions[i].host != NULL && !strcmp (sessions[i].host, host))
+			return sessions[i].session;
+	return NULL;
+}
+
+/*
+ * TLSCONTEXT::setSession (char* host, SSL_SESSION* s)
+ *
+ * This will replace the session to offer to server [host] by [s]. The
+ * context takes over the reference to [s].
+ *
+ */
+void
+TLSCONTEXT::setSession (char* host, SSL_SESSION* s) {
+	TLSCACHED* c = NULL;
+	char* h;
+
+	if (host == NULL)
+		host = (char*)"";
+	if (sessions == NULL) {
+		sessions = (TLSCACHED*)calloc (TLSCONTEXT_SESSIONS, sizeof (TLSCACHED));
+		if (sessions == NULL) {
+			if (s)
+				SSL_SESSION_free (s);
+			return;
+		}
+	}
+
+	// do we have one for this server already ?
+	for (int i = 0; i < TLSCONTEXT_SESSIONS && c == NULL; i++)
+		if (sessions[i].host != NULL && !strcmp (sessions[i].host, host))
+			c = &sessions[i];
+	if (c == NULL) {
+		// no. if we have nothing to store, we are done
+		if (s == NULL)
+			return;
+
+		// take the next entry, forgetting whichever server had it
+		h = strdup (host);
+		if (h == NULL) {
+			SSL_SESSION_free (s);
+			return;
+		}
+		c = &sessions[nextSession];
+		nextSession = (nextSession + 1) % TLSCONTEXT_SESSIONS;
+		if (c->host)
+			free (c->host);
+		if (c->session)
+			SSL_SESSION_free (c->session);
+		c->host = h; c->session = NULL;
+	}
+
+	if (c->session)
+		SSL_SESSION_free (c->session);
+	c->session = s;
+}
+
+/*
+ * TLSSESSION::TLSSESSION (TLSCONTEXT* c, int fd, int server, char* h)
+ *
+ * This will set up TLS using context [c] on file descriptor [fd]. If [server]
+ * is non-zero, we will act as the server, otherwise as the client of the
+ * server named or addressed [h].
+ *
+ */
+TLSSESSION::TLSSESSION (TLSCONTEXT* c, int fd, int s, char* h) {
+	unsigned char addr[16];
+
+	ctx = c; server = s; established = 0; wantWrite = 0; kernelSend = 0;
+	host = NULL;
+
+	ssl = SSL_new (ctx->getContext());
+	if (ssl == NULL)
+		return;
+	SSL_set_fd (ssl, fd);
+	if (server) {
+		SSL_set_accept_state (ssl);
+	} else {
+		// a server we verify must be named, or any certificate of the CA will do
+		if (h == NULL && ctx->isVerifying())
+			goto fail;
+
+		// tell the server who we want, and make sure it is who we get. names
+		// are sent along; addresses can only be checked
+		if (h != NULL) {
+			host = strdup (h);
+			if (host == NULL)
+				goto fail;
+			SSL_set_app_data (ssl, host);
+			if (inet_pton (AF_INET, h, addr) != 1 && inet_pton (AF_INET6, h, addr) != 1) {
+				if (!SSL_set_tlsext_host_name (ssl, h))
+					goto fail;
+				if (ctx->isVerifying() && !SSL_set1_host (ssl, h))
+					goto fail;
+			} else if (ctx->isVerifying() && !X509_VERIFY_PARAM_set1_ip_asc (SSL_get0_param (ssl), h))
+				goto fail;
+		}
+
+		// offer the last session we got from this server, if any
+		if (ctx->getSession (host))
+			SSL_set_session (ssl, ctx->getSession (host));
+		SSL_set_connect_state (ssl);
+
+		// the client speaks first
+		wantWrite = 1;
+	}
+	return;
+
+fail:
+	SSL_free (ssl); ssl = NULL;
+}
+
+/*
+ * TLSSESSION::~TLSSESSION()
+ *
+ * This is the destructor.
+ *
+ */
+TLSSESSION::~TLSSESSION() {
+	if (ssl)
+		SSL_free (ssl);
+	if (host)
+		free (host);
+}
+
+/*
+ * TLSSESSION::isValid()
+ *
+ * This will return non-zero if the session was set up properly.
+ *
+ */
+int
+TLSSESSION::isValid() {
+	return (ssl != NULL) ? 1 : 0;
+}
+
+/*
+ * TLSSESSION::handshake()
+ *
+ * This will continue the handshake. It will return 1 once it is done, 0 if
+ * it failed or -1 if it must be continued when the socket is ready.
+ *
+ */
+int
+TLSSESSION::handshake() {
+	int i;
+
+	ERR_clear_error();
+	i = SSL_do_handshake (ssl);
+	if (i == 1) {
+		// victory
+		established = 1; wantWrite = 0;
+
+		// did the kernel take over ?
+		#if !defined(OPENSSL_NO_KTLS) && defined(BIO_get_ktls_send)
+		kernelSend = BIO_get_ktls_send (SSL_get_wbio (ssl)) ? 1 : 0;
+		#endif
+
+		#ifdef _DEBUG_NETWORK
+		printf ("TLSSESSION::handshake(): done, resumed %u, kernel send %u\n", isResumed(), kernelSend);
+		#endif // _DEBUG_NETWORK
+		return 1;
+	}
+
+	switch (SSL_get_error (ssl, i)) {
+		case SSL_ERROR_WANT_READ:
+			wantWrite = 0;
+			return -1;
+		case SSL_ERROR_WANT_WRITE:
+			wantWrite = 1;
+			return -1;
+	}
+
+	// this failed
+	#ifdef _DEBUG_NETWORK
+	ERR_print_errors_fp (stderr);
+	#endif // _DEBUG_NETWORK
+	return 0;
+}
+
+/*
+ * TLSSESSION::isEstablished()
+ *
+ * This will return non-zero once the handshake is done.
+ *
+ */
+int
+TLSSESSION::isEstablished() {
+	return established;
+}
+
+/*
+ * TLSSESSION::wantsWrite()
+ *
+ * This will return non-zero if the handshake waits for the socket to become
+ * writable.
+ *
+ */
+int
+TLSSESSION::wantsWrite() {
+	return wantWrite;
+}
+
+/*
+ * TLSSESSION::isKernelSend()
+ *
+ * This will return non-zero if outgoing data is encrypted by the kernel.
+ *
+ */
+int
+TLSSESSION::isKernelSend() {
+	return kernelSend;
+}
+
+/*
+ * TLSSESSION::result (int ret)
+ *
+ * This will translate OpenSSL return value [ret] into the recv()/send()
+ * conventions, setting errno as needed.
+ *
+ */
+int
+TLSSESSION::result (int ret) {
+	if (ret > 0)
+		return ret;
+
+	switch (SSL_get_error (ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			// try again later
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			// the peer closed the connection
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			// errno is already set, unless the peer just went away
+			if (ret == 0)
+				return 0;
+			return -1;
+	}
+
+	errno = EIO;
+	return -1;
+}
+
+/*
+ * TLSSESSION::read (char* buf, int len)
+ *
+ * This will read up to [len] decrypted bytes into [buf]. It will return the
+ * number of bytes read, zero on end of file or -1 on failure.
+ *
+ */
+int
+TLSSESSION::read (char* buf, int len) {
+	ERR_clear_error();
+	return result (SSL_read (ssl, buf, len));
+}
+
+/*
+ * TLSSESSION::write (char* buf, int len)
+ *
+ * This will write up to [len] bytes from [buf]. It will return the number of
+ * bytes written or -1 on failure.
+ *
+ */
+int
+TLSSESSION::write (char* buf, int len) {
+	int i;
+
+	// refuse to write anything until the handshake is done
+	if (!established) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	ERR_clear_error();
+	i = result (SSL_write (ssl, buf, len));
+
+	// SSL_write() never returns 0 for a non-empty buffer unless it failed
+	if (i == 0 && len > 0) {
+		errno = EPIPE;
+		return -1;
+	}
+	return i;
+}
+
+/*
+ * TLSSESSION::pending()
+ *
+ * This will return the number of decrypted bytes which can be read without
+ * reading from the socket.
+ *
+ */
+int
+TLSSESSION::pending() {
+	return SSL_pending (ssl);
+}
+
+/*
+ * TLSSESSION::isResumed()
+ *
+ * This will return non-zero if the handshake resumed a previous session.
+ *
+ */
+int
+TLSSESSION::isResumed() {
+	return SSL_session_reused (ssl) ? 1 : 0;
+}
+
+/*
+ * TLSSESSION::shutdown()
+ *
+ * This will send a close notification to the peer. We do not wait for the
+ * reply, as the connection is about to be closed anyway.
+ *
+ */
+void
+TLSSESSION::shutdown() {
+	if (established) {
+		ERR_clear_error();
+		SSL_shutdown (ssl);
+	}
+}
+
+#endif // NET_TLS
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,190 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file balancer.cc
+ * \brief Tests the ejection of failing servers by NETBALANCER
+ *
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <network.h>
+#include <balancer.h>
+
+//! \brief SERVERS is the number of servers
+#define SERVERS 3
+
+//! \brief FAILURES is the number of failures in a row which eject a server
+#define FAILURES 3
+
+//! \brief EJECT is the number of milliseconds a server is ejected the first time
+#define EJECT 50
+
+//! \brief The number of failed checks
+static int failures = 0;
+
+/*
+ * check (int ok, const char* what)
+ *
+ * This will complain about [what] if [ok] is zero.
+ *
+ */
+static void
+check (int ok, const char* what) {
+	if (!ok) {
+		fprintf (stderr, "balancer: %s\n", what);
+		failures++;
+	}
+}
+
+/*
+ * fail (NETBALANCER* b, int i, int n)
+ *
+ * This will have [n] requests to server [i] of [b] fail. It will return the
+ * time just before the last one failed.
+ *
+ */
+static long long
+fail (NETBALANCER* b, int i, int n) {
+	long long t = NETWORK::getTime();
+
+	while (n-- > 0) {
+		t = NETWORK::getTime();
+		b->done (i, 0, 0);
+	}
+	return t;
+}
+
+/*
+ * ejected (NETBALANCER* b, int i, long long since)
+ *
+ * This will wait for server [i] of [b] to come back. It will return the
+ * number of milliseconds it was out for since [since], or -1 if it did not
+ * come back within a second after it was expected.
+ *
+ */
+static int
+ejected (NETBALANCER* b, int i, long long since) {
+	while (b->isEjected (i)) {
+		if (NETWORK::getTime() - since > (EJECT * 8 + 1000) * 1000LL)
+			return -1;
+		usleep (1000);
+	}
+	return (int)((NETWORK::getTime() - since) / 1000);
+}
+
+/*
+ * testEjection()
+ *
+ * This will check a server is ejected after failing often enough in a row,
+ * and that no requests go there while it is out.
+ *
+ */
+static void
+testEjection() {
+	NETBALANCER b (NETBALANCER_LEAST_LOADED);
+	IPV4ADDRESS addr;
+	int counts[SERVERS] = { 0, 0, 0 };
+	int i, n;
+
+	addr.setAddr ((char*)"127.0.0.1");
+	for (i = 0; i < SERVERS; i++) {
+		addr.setPort (10000 + i);
+		check (b.add (&addr) == i, "cannot add server");
+	}
+	b.setEjection (FAILURES, 1000);
+
+	// a success in between starts the count over
+	fail (&b, 0, FAILURES - 1);
+	b.done (0, 1, 100);
+	fail (&b, 0, FAILURES - 1);
+	check (!b.isEjected (0), "server ejected before failing often enough");
+	fail (&b, 0, 1);
+	check (b.isEjected (0), "server not ejected");
+
+	for (n = 0; n < 1000; n++) {
+		i = b.pick();
+		check (i >= 0 && i < SERVERS, "no server picked");
+		if (i < 0 || i >= SERVERS)
+			break;
+		counts[i]++;
+		b.done (i, 1, 100);
+	}
+	check (counts[0] == 0, "ejected server picked");
+	check (counts[1] > 0 && counts[2] > 0, "servers left unused");
+
+	// if all are out, they are used anyway
+	fail (&b, 1, FAILURES);
+	fail (&b, 2, FAILURES);
+	i = b.pick();
+	check (i >= 0 && i < SERVERS, "no server picked while all are ejected");
+	b.done (i, 1, 100);
+}
+
+/*
+ * testBackoff()
+ *
+ * This will check a server which fails again once it is back stays out twice
+ * as long each time, and that a success makes it start over.
+ *
+ */
+static void
+testBackoff() {
+	NETBALANCER b;
+	IPV4ADDRESS addr;
+	long long t;
+	int i;
+
+	addr.setAddr ((char*)"127.0.0.1");
+	addr.setPort (10000);
+	b.add (&addr);
+	b.setEjection (FAILURES, EJECT);
+
+	t = fail (&b, 0, FAILURES);
+	i = ejected (&b, 0, t);
+	check (i >= 0, "server did not come back");
+	check (i < 0 || i >= EJECT, "server came back too soon");
+
+	// a single failure puts it out again, for twice as long
+	t = fail (&b, 0, 1);
+	check (b.isEjected (0), "server not ejected again");
+	i = ejected (&b, 0, t);
+	check (i >= 0, "server did not come back");
+	check (i < 0 || i >= EJECT * 2, "ejection did not grow");
+
+	t = fail (&b, 0, 1);
+	i = ejected (&b, 0, t);
+	check (i >= 0, "server did not come back");
+	check (i < 0 || i >= EJECT * 4, "ejection did not grow");
+
+	// a success forgives everything
+	b.done (0, 1, 100);
+	t = fail (&b, 0, FAILURES - 1);
+	check (!b.isEjected (0), "server ejected before failing often enough");
+	t = fail (&b, 0, 1);
+	i = ejected (&b, 0, t);
+	check (i >= EJECT && i < EJECT * 8, "ejection did not start over");
+}
+
+int
+main() {
+	testEjection();
+	testBackoff();
+	return failures ? 1 : 0;
+}
+
+/* vim:set ts=2 sw=2: */
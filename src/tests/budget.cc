@@ -0,0 +1,152 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file budget.cc
+ * \brief Tests the input budget of NETWORK
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <network.h>
+
+//! \brief BUDGET is the number of bytes a connection may read per dispatch
+#define BUDGET 100
+
+//! \brief SECOND is the longest a test may wait, in microseconds
+#define SECOND 1000000LL
+
+//! \brief The number of failed checks
+static int failures = 0;
+
+/*
+ * check (int ok, const char* what)
+ *
+ * This will complain about [what] if [ok] is zero.
+ *
+ */
+static void
+check (int ok, const char* what) {
+	if (!ok) {
+		fprintf (stderr, "budget: %s\n", what);
+		failures++;
+	}
+}
+
+/*! \class TESTCLIENT
+ *  \brief Connection which reads up to a number of bytes per call
+ */
+class TESTCLIENT : public NETCLIENT {
+public:
+	TESTCLIENT (int f, int n) {
+		setFD (f); setInputLimit (4096);
+		quota = n; length = calls = eof = refused = 0;
+	};
+
+	void incoming() {
+		char buf[10];
+		int i, n = 0;
+
+		calls++;
+		while (n < quota) {
+			i = recv (buf, sizeof (buf));
+			if (i == 0)
+				eof = 1;
+			if (i < 0 && errno == EAGAIN)
+				refused++;
+			if (i <= 0)
+				return;
+			length += i; n += i;
+		}
+	}
+
+	//! \brief The number of bytes handled per call
+	int quota;
+
+	//! \brief The number of bytes read, and the number of calls it took
+	int length, calls;
+
+	//! \brief Whether recv() claimed end of file, or refused to read
+	int eof, refused;
+};
+
+/*! \class TICK
+ *  \brief Timer which keeps NETWORK::run() from waiting for long
+ */
+class TICK : public NETTIMER {
+public:
+	void expired() { };
+};
+
+/*
+ * transfer (int len, int quota, TESTCLIENT** c)
+ *
+ * This will send [len] bytes to a connection which handles up to [quota]
+ * bytes per call, and run the network until they arrived, or a second passed. [c]
+ * receives the connection, which must be deleted.
+ *
+ */
+static void
+transfer (int len, int quota, TESTCLIENT** c) {
+	char buf[BUDGET * 10];
+	NETWORK net;
+	TICK tick;
+	long long t;
+	int sv[2];
+
+	check (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0, "cannot make socket pair");
+	*c = new TESTCLIENT (sv[0], quota);
+	net.setBudget (BUDGET);
+	net.addService (*c);
+
+	memset (buf, 'x', len);
+	check (write (sv[1], buf, len) == len, "cannot write");
+	t = NETWORK::getTime();
+	while ((*c)->length < len && NETWORK::getTime() - t < SECOND) {
+		net.addTimer (&tick, 10);
+		net.run();
+	}
+	net.removeService (*c);
+	::close (sv[1]);
+}
+
+int
+main() {
+	TESTCLIENT* c;
+
+	// a handler reading until it runs dry is stopped, but not told the
+	// connection is gone
+	transfer (BUDGET * 10, BUDGET * 10, &c);
+	check (c->length == BUDGET * 10, "data lost");
+	check (!c->eof, "used up budget looks like end of file");
+	check (c->refused > 0, "budget not enforced");
+	check (c->calls >= 10, "more read than the budget allows");
+	delete c;
+
+	// input left in the buffer once the budget is used up is handled, even
+	// if the socket has no more
+	transfer (BUDGET, BUDGET / 2, &c);
+	check (c->length == BUDGET, "buffered input forgotten");
+	delete c;
+	return failures ? 1 : 0;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,178 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file lines.cc
+ * \brief Tests NETBUFFER::getLines() against a byte at a time scan
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <buffer.h>
+
+//! \brief TEXT is the largest text split into lines
+#define TEXT 65536
+
+//! \brief MAXLINES is the largest number of lines asked for at once
+#define MAXLINES 100
+
+//! \brief The number of failed checks
+static int failures = 0;
+
+/*
+ * check (int ok, const char* what)
+ *
+ * This will complain about [what] if [ok] is zero.
+ *
+ */
+static void
+check (int ok, const char* what) {
+	if (!ok) {
+		fprintf (stderr, "lines: %s\n", what);
+		failures++;
+	}
+}
+
+/*
+ * split (char* text, int len, char delim, NETLINE* lines, int* rest)
+ *
+ * This will split the [len] bytes at [text] into lines ended by [delim] a
+ * byte at a time, the way getLines() is expected to. It will return the
+ * number of lines stored in [lines]; [rest] receives the offset of the
+ * partial line at the end.
+ *
+ */
+static int
+split (char* text, int len, char delim, struct NETLINE* lines, int* rest) {
+	int n = 0, pos = 0;
+
+	for (int i = 0; i < len; i++) {
+		if (text[i] != delim)
+			continue;
+		lines[n].data = text + pos; lines[n].len = i - pos;
+		if (delim == '\n' && i > pos && text[i - 1] == '\r')
+			lines[n].len--;
+		n++; pos = i + 1;
+	}
+	*rest = pos;
+	return n;
+}
+
+/*
+ * compare (char* text, int len, char delim, int seed)
+ *
+ * This will append the [len] bytes at [text] to a buffer in pieces of random
+ * size, take lines out of it in batches of random size, and check they are
+ * the ones split() finds.
+ *
+ */
+static void
+compare (char* text, int len, char delim, int seed) {
+	static struct NETLINE expect[TEXT + 1];
+	struct NETLINE got[MAXLINES];
+	NETBUFFER buf;
+	int total, rest, off = 0, n = 0;
+	int i, k, piece;
+
+	srand (seed);
+	total = split (text, len, delim, expect, &rest);
+	while (off < len) {
+		// mostly small pieces, so partial lines are picked up again often
+		piece = 1 + rand() % ((rand() % 4 == 0) ? 4096 : 40);
+		if (piece > len - off)
+			piece = len - off;
+		check (buf.append (text + off, piece), "cannot append");
+		off += piece;
+
+		do {
+			k = buf.getLines (got, 1 + rand() % MAXLINES, delim);
+			for (i = 0; i < k && n < total; i++, n++) {
+				if (got[i].len != expect[n].len || memcmp (got[i].data, expect[n].data, got[i].len)) {
+					check (0, "line differs");
+					return;
+				}
+			}
+			check (i == k, "too many lines");
+		} while (k > 0);
+	}
+	check (n == total, "lines missing");
+	check (buf.getLength() == len - rest && !memcmp (buf.getData(), text + rest, len - rest), "partial line lost");
+}
+
+/*
+ * testLengths()
+ *
+ * This will check lines of every length up to a few vectors, so delimiters
+ * fall on every position within and across vectors.
+ *
+ */
+static void
+testLengths() {
+	static char text[TEXT];
+	int len, i;
+
+	for (int l = 0; l < 100; l++) {
+		for (len = 0; len + l + 2 < TEXT / 4; ) {
+			for (i = 0; i < l; i++)
+				text[len++] = 'a' + i % 26;
+			// every other line ends in a carriage return as well
+			if (len % 2)
+				text[len++] = '\r';
+			text[len++] = '\n';
+		}
+		compare (text, len, '\n', l);
+	}
+}
+
+/*
+ * testRandom()
+ *
+ * This will check random text, with runs of delimiters and bytes with the
+ * high bit set, for a few delimiters.
+ *
+ */
+static void
+testRandom() {
+	static char text[TEXT];
+	char delims[] = { '\n', ';', '\0', (char)0xff };
+	int len, i;
+
+	srand (1);
+	for (int round = 0; round < 40; round++) {
+		char delim = delims[round % sizeof (delims)];
+		len = 1 + rand() % TEXT;
+		for (i = 0; i < len; i++) {
+			switch (rand() % 8) {
+				case 0: text[i] = delim; break;
+				case 1: text[i] = '\r'; break;
+				case 2: text[i] = (char)(0x80 + rand() % 128); break;
+				default: text[i] = 'a' + rand() % 26; break;
+			}
+		}
+		compare (text, len, delim, round);
+	}
+}
+
+int
+main() {
+	testLengths();
+	testRandom();
+	return failures ? 1 : 0;
+}
+
+/* vim:set ts=2 sw=2: */
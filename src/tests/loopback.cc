@@ -0,0 +1,232 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file loopback.cc
+ * \brief Tests the latency and chunking of LOOPBACK connections
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include <network.h>
+#include <loopback.h>
+
+//! \brief DATA is the number of bytes sent through a connection
+#define DATA 10000
+
+//! \brief SECOND is the longest a test may wait, in microseconds
+#define SECOND 1000000LL
+
+//! \brief The number of failed checks
+static int failures = 0;
+
+/*
+ * check (int ok, const char* what)
+ *
+ * This will complain about [what] if [ok] is zero.
+ *
+ */
+static void
+check (int ok, const char* what) {
+	if (!ok) {
+		fprintf (stderr, "loopback: %s\n", what);
+		failures++;
+	}
+}
+
+/*! \class TESTSIDE
+ *  \brief Side of a connection which records what it reads, and in which pieces
+ */
+class TESTSIDE : public NETCLIENT {
+public:
+	TESTSIDE() { length = reads = largest = eof = 0; arrived = 0; };
+
+	void incoming() {
+		int i = readRaw (data + length, DATA - length + 1, 0);
+
+		if (i == 0) {
+			check (!eof && length == DATA, "end of file before all data");
+			eof = 1;
+			return;
+		}
+		if (i < 0)
+			return;
+		if (length == 0)
+			arrived = NETWORK::getTime();
+		if (reads < DATA)
+			sizes[reads] = i;
+		reads++; length += i;
+		if (i > largest)
+			largest = i;
+	}
+
+	//! \brief Closes our side
+	void hangUp() { close(); };
+
+	// read by ourselves, so end of file is seen rather than dropping us
+	inline int getType () { return NETSERVICE_EVENT; };
+
+	//! \brief What was read
+	char data[DATA + 1];
+
+	//! \brief The number of bytes read, and the number of reads it took
+	int length, reads;
+
+	//! \brief The size of every read, and of the largest one
+	int sizes[DATA], largest;
+
+	//! \brief Whether end of file was seen
+	int eof;
+
+	//! \brief When the first data arrived
+	long long arrived;
+};
+
+/*! \class TICK
+ *  \brief Timer which keeps NETWORK::run() from waiting for long
+ */
+class TICK : public NETTIMER {
+public:
+	void expired() { };
+};
+
+/*
+ * run (NETWORK* net, TESTSIDE* s, int n)
+ *
+ * This will run [net] until [s] read [n] bytes and end of file if [n] is
+ * DATA, or a second passed.
+ *
+ */
+static void
+run (NETWORK* net, TESTSIDE* s, int n) {
+	long long t = NETWORK::getTime();
+	TICK tick;
+
+	while ((s->length < n || (n == DATA && !s->eof)) && NETWORK::getTime() - t < SECOND) {
+		net->addTimer (&tick, 10);
+		net->run();
+	}
+}
+
+/*
+ * fill (char* buf)
+ *
+ * This will fill [buf] with DATA bytes which are not all alike.
+ *
+ */
+static void
+fill (char* buf) {
+	for (int i = 0; i < DATA; i++)
+		buf[i] = 'a' + i % 23;
+}
+
+/*
+ * transfer (int latency, int chunk, unsigned int seed, TESTSIDE* b)
+ *
+ * This will send DATA bytes through a connection with latency [latency] and
+ * chunks of at most [chunk] bytes following [seed], and close it. [b] reads
+ * them. It will return the number of microseconds before the first data
+ * arrived.
+ *
+ */
+static long long
+transfer (int latency, int chunk, unsigned int seed, TESTSIDE* b) {
+	NETWORK net;
+	LOOPBACK lb (&net);
+	TESTSIDE a;
+	char buf[DATA];
+	long long t;
+
+	fill (buf);
+	check (lb.connect (&a, b), "cannot connect");
+	net.addService (&a);
+	net.addService (b);
+	lb.setLatency (latency);
+	lb.setChunk (chunk, seed);
+
+	// close right away; the data on its way must still arrive first
+	t = NETWORK::getTime();
+	check (a.send (buf, DATA) == DATA, "cannot send");
+	net.removeService (&a);
+	a.hangUp();
+
+	run (&net, b, DATA);
+	net.removeService (b);
+	check (b->length == DATA, "data lost");
+	check (b->eof, "no end of file");
+	check (!memcmp (b->data, buf, DATA), "data garbled");
+	return b->arrived - t;
+}
+
+/*
+ * testLatency()
+ *
+ * This will check data is held back for the latency, and no longer than
+ * that without one.
+ *
+ */
+static void
+testLatency() {
+	TESTSIDE* b = new TESTSIDE();
+
+	check (transfer (50000, 0, 0, b) >= 50000, "data arrived before the latency passed");
+	check (b->reads == 1, "data not handed out at once");
+	delete b;
+
+	b = new TESTSIDE();
+	check (transfer (0, 0, 0, b) < 50000, "data held back without latency");
+	delete b;
+}
+
+/*
+ * testChunks()
+ *
+ * This will check data is handed out in chunks no larger than the limit, of
+ * random sizes if seeded, and the same ones every time for the same seed.
+ *
+ */
+static void
+testChunks() {
+	TESTSIDE* a = new TESTSIDE();
+	TESTSIDE* b = new TESTSIDE();
+	int i;
+
+	// fixed chunks are all as large as allowed, except maybe the last
+	transfer (0, 7, 0, a);
+	check (a->largest == 7, "chunks too large");
+	for (i = 0; i < a->reads - 1; i++)
+		check (a->sizes[i] == 7, "chunk smaller than allowed");
+	delete a;
+
+	// random chunks vary, but are repeated exactly
+	a = new TESTSIDE();
+	transfer (1000, 13, 42, a);
+	transfer (1000, 13, 42, b);
+	check (a->largest <= 13, "chunks too large");
+	check (a->reads > DATA / 13, "chunks of one size only");
+	check (a->reads == b->reads && !memcmp (a->sizes, b->sizes, a->reads * sizeof (int)), "chunks not repeated");
+	delete a; delete b;
+}
+
+int
+main() {
+	testLatency();
+	testChunks();
+	return failures ? 1 : 0;
+}
+
+/* vim:set ts=2 sw=2: */
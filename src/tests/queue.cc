@@ -0,0 +1,174 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file queue.cc
+ * \brief Tests the output queue of NETSERVICE when the peer stops reading
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <network.h>
+#include <pubsub.h>
+
+//! \brief CHUNK is the number of bytes sent at once
+#define CHUNK 100000
+
+//! \brief CHUNKS is the number of chunks sent, well over NETSERVICE_QUEUE_LIMIT
+#define CHUNKS 50
+
+//! \brief The number of failed checks
+static int failures = 0;
+
+/*
+ * check (int ok, const char* what)
+ *
+ * This will complain about [what] if [ok] is zero.
+ *
+ */
+static void
+check (int ok, const char* what) {
+	if (!ok) {
+		fprintf (stderr, "queue: %s\n", what);
+		failures++;
+	}
+}
+
+/*! \class TESTCLIENT
+ *  \brief Connection over a descriptor we made ourselves
+ */
+class TESTCLIENT : public NETCLIENT {
+public:
+	void incoming() { };
+
+	//! \brief Takes over descriptor [f]
+	void attach (int f) { setFD (f); };
+
+	//! \brief Closes the connection
+	void hangUp() { close(); };
+};
+
+/*
+ * flood (int watermarks, long* sent, int* refused)
+ *
+ * This will send CHUNKS chunks to a peer which never reads, with or without
+ * [watermarks]. [sent] receives the number of bytes taken, and [refused] is
+ * set if a chunk was cut short with EAGAIN. It will return the number of
+ * microseconds it took.
+ *
+ */
+static long long
+flood (int watermarks, long* sent, int* refused) {
+	static char buf[CHUNK];
+	TESTCLIENT c;
+	long long t;
+	int sv[2], i, n;
+
+	check (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0, "cannot make socket pair");
+	c.attach (sv[0]);
+	if (watermarks)
+		c.setWatermarks (CHUNK * CHUNKS * 2, CHUNK);
+
+	memset (buf, 'x', sizeof (buf));
+	*sent = 0; *refused = 0;
+	t = NETWORK::getTime();
+	for (i = 0; i < CHUNKS; i++) {
+		errno = 0;
+		n = c.send (buf, CHUNK);
+		if (n < CHUNK && errno == EAGAIN)
+			*refused = 1;
+		*sent += n;
+	}
+	t = NETWORK::getTime() - t;
+
+	if (!watermarks)
+		check (c.getOutputLength() <= NETSERVICE_QUEUE_LIMIT, "queue grew beyond the limit");
+	// the peer goes first, or closing would wait for it to read everything
+	::close (sv[1]);
+	c.hangUp();
+	return t;
+}
+
+/*
+ * publish (int policy, long long* took, PUBSUB* ps)
+ *
+ * This will publish CHUNKS chunks through [ps] to a subscriber which never
+ * reads, under slow subscriber policy [policy]. [took] receives the number of microseconds
+ * it took. It will return the number of chunks the subscriber got.
+ *
+ */
+static int
+publish (int policy, long long* took, PUBSUB* ps) {
+	static char buf[CHUNK];
+	TESTCLIENT c;
+	int sv[2], i, n = 0;
+
+	check (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0, "cannot make socket pair");
+	c.attach (sv[0]);
+	ps->setSlowPolicy (policy);
+	check (ps->subscribe (&c, (char*)"news"), "cannot subscribe");
+
+	memset (buf, 'x', sizeof (buf));
+	*took = NETWORK::getTime();
+	for (i = 0; i < CHUNKS; i++)
+		n += ps->publish ((char*)"news", buf, CHUNK);
+	*took = NETWORK::getTime() - *took;
+
+	::close (sv[1]);
+	c.hangUp();
+	return n;
+}
+
+int
+main() {
+	PUBSUB ps;
+	long long took;
+	long sent;
+	int refused, n;
+
+	signal (SIGPIPE, SIG_IGN);
+
+	// without watermarks, a peer which stops reading gets a short count
+	check (flood (0, &sent, &refused) < 1000000, "send waited for the peer");
+	check (refused, "send not cut short");
+	check (sent < (long)CHUNK * CHUNKS, "more taken than fits");
+
+	// with them, everything is queued
+	flood (1, &sent, &refused);
+	check (!refused && sent == (long)CHUNK * CHUNKS, "send cut short despite watermarks");
+
+	// publishing skips a subscriber which has no room left, even if the
+	// policy is to ignore slowness
+	n = publish (PUBSUB_SLOW_IGNORE, &took, &ps);
+	check (took < 1000000, "publish waited for the subscriber");
+	check (n > 0 && n < CHUNKS, "subscriber not skipped");
+	check (ps.getCounter (PUBSUB_COUNT_SKIPPED) == CHUNKS - n, "skipped messages not counted");
+
+	// or drops it, if asked to
+	ps.resetCounters();
+	n = publish (PUBSUB_SLOW_DROP, &took, &ps);
+	check (n > 0 && n < CHUNKS, "subscriber not dropped");
+	check (ps.getCounter (PUBSUB_COUNT_DROPPED) == 1, "drop not counted");
+	return failures ? 1 : 0;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,93 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file ratelimit.cc
+ * \brief Tests the per network buckets of RATELIMIT
+ *
+ */
+#include <stdio.h>
+#include <network.h>
+#include <ratelimit.h>
+
+//! \brief BUCKETS is the number of buckets of the limiter
+#define BUCKETS 4096
+
+//! \brief NETWORKS is the number of networks seen, well below BUCKETS
+#define NETWORKS 1000
+
+//! \brief BURST is the number of events allowed at once
+#define BURST 3
+
+//! \brief The number of failed checks
+static int failures = 0;
+
+/*
+ * check (int ok, const char* what)
+ *
+ * This will complain about [what] if [ok] is zero.
+ *
+ */
+static void
+check (int ok, const char* what) {
+	if (!ok) {
+		fprintf (stderr, "ratelimit: %s\n", what);
+		failures++;
+	}
+}
+
+/*
+ * testPrefix (int prefix)
+ *
+ * This will use up the bursts of many networks of [prefix] bits, from
+ * different addresses within each of them, and check every network stays
+ * limited; a bucket which was recycled would start out full again.
+ *
+ */
+static void
+testPrefix (int prefix) {
+	RATELIMIT r (BUCKETS);
+	uint32_t net, host;
+	int i, j, allowed;
+
+	r.setRate (0.001, BURST);
+	r.setPrefix (prefix);
+
+	for (int round = 0; round < 2; round++) {
+		allowed = 0;
+		for (i = 0; i < NETWORKS; i++) {
+			// networks next to each other, as busy ones often are
+			net = (10U << 24) + ((uint32_t)i << (32 - prefix));
+			for (j = 0; j < BURST; j++) {
+				host = (prefix < 32) ? (uint32_t)(j * 7 + round) & (0xffffffffU >> prefix) : 0;
+				if (r.check (IPV4KEY (net | host)))
+					allowed++;
+			}
+		}
+		check (allowed == ((round == 0) ? NETWORKS * BURST : 0), (round == 0) ? "burst refused" : "bucket recycled while the table has room");
+	}
+}
+
+int
+main() {
+	testPrefix (32);
+	testPrefix (24);
+	testPrefix (16);
+	return failures ? 1 : 0;
+}
+
+/* vim:set ts=2 sw=2: */
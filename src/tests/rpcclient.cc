@@ -0,0 +1,240 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file rpcclient.cc
+ * \brief Tests the matching of tagged responses by RPCCLIENT
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <network.h>
+#include <loopback.h>
+#include <rpcclient.h>
+
+//! \brief DEPTH is the number of requests in flight, which sizes the hash table
+#define DEPTH 64
+
+//! \brief SECOND is the longest a test may wait, in microseconds
+#define SECOND 1000000LL
+
+//! \brief The number of failed checks
+static int failures = 0;
+
+/*
+ * check (int ok, const char* what)
+ *
+ * This will complain about [what] if [ok] is zero.
+ *
+ */
+static void
+check (int ok, const char* what) {
+	if (!ok) {
+		fprintf (stderr, "rpcclient: %s\n", what);
+		failures++;
+	}
+}
+
+/*! \class TESTCLIENT
+ *  \brief Client for a protocol of lines holding the ID of the request
+ */
+class TESTCLIENT : public RPCCLIENT {
+public:
+	TESTCLIENT() : RPCCLIENT (RPCCLIENT_TAGGED, DEPTH) { };
+
+	int parse (char* buf, int len, unsigned int* id) {
+		char* nl = (char*)memchr (buf, '\n', len);
+
+		if (nl == NULL)
+			return 0;
+		*id = strtoul (buf, NULL, 10);
+		return nl - buf + 1;
+	}
+};
+
+/*! \class TESTSERVER
+ *  \brief Other side of the connection, which answers when told to
+ */
+class TESTSERVER : public NETCLIENT {
+public:
+	TESTSERVER() { received = 0; };
+
+	//! \brief Counts the requests received
+	void incoming() {
+		char buf[1024];
+		int i = recv (buf, sizeof (buf));
+
+		for (int j = 0; j < i; j++)
+			if (buf[j] == '\n')
+				received++;
+	}
+
+	//! \brief Answers request [id]
+	void answer (unsigned int id) {
+		sendf ((char*)"%u\n", id);
+	}
+
+	//! \brief The number of requests received
+	int received;
+};
+
+/*! \class TESTHANDLER
+ *  \brief Checks every response belongs to the request it is handed to
+ */
+class TESTHANDLER : public RPCHANDLER {
+public:
+	TESTHANDLER() { ok = timedOut = 0; };
+
+	void rpcDone (int status, char* data, int, void* arg) {
+		if (status == RPCCLIENT_TIMEOUT) {
+			timedOut++;
+			return;
+		}
+		check (status == RPCCLIENT_OK, "request failed");
+		if (status != RPCCLIENT_OK)
+			return;
+		check (strtoul (data, NULL, 10) == (unsigned long)arg, "response handed to the wrong request");
+		ok++;
+	}
+
+	//! \brief The number of responses and timeouts
+	int ok, timedOut;
+};
+
+/*
+ * bucket (unsigned int id)
+ *
+ * This will return the hash table bucket of [id], hashed as RPCCLIENT does.
+ *
+ */
+static int
+bucket (unsigned int id) {
+	return (id * 2654435761U) & (DEPTH * 2 - 1);
+}
+
+/*
+ * pickIDs (unsigned int* ids, int n, unsigned int id)
+ *
+ * This will fill [ids] with [n] IDs from [id] on which hash to the last two
+ * buckets and the first one, so their probe sequences are long, overlap and
+ * wrap around the end of the table.
+ *
+ */
+static void
+pickIDs (unsigned int* ids, int n, unsigned int id) {
+	int b, i = 0;
+
+	while (i < n) {
+		b = bucket (id);
+		if (b == 0 || b >= DEPTH * 2 - 2)
+			ids[i++] = id;
+		id++;
+	}
+}
+
+/*! \class TICK
+ *  \brief Timer which keeps NETWORK::run() from waiting for long
+ */
+class TICK : public NETTIMER {
+public:
+	void expired() { };
+};
+
+/*
+ * run (NETWORK* net, int* what, int n)
+ *
+ * This will run [net] until [*what] reaches [n], or a second passed.
+ *
+ */
+static void
+run (NETWORK* net, int* what, int n) {
+	long long t = NETWORK::getTime();
+	TICK tick;
+
+	while (*what < n && NETWORK::getTime() - t < SECOND) {
+		net->addTimer (&tick, 10);
+		net->run();
+	}
+}
+
+/*
+ * testDelete()
+ *
+ * This will send requests whose IDs collide, answer them in random order and
+ * let a few time out, and check every response still finds its request.
+ *
+ */
+static void
+testDelete() {
+	NETWORK net;
+	LOOPBACK lb (&net);
+	TESTCLIENT client;
+	TESTSERVER server;
+	TESTHANDLER h;
+	unsigned int ids[DEPTH];
+	char buf[32];
+	int expect = 0;
+	int i, j, k, len;
+
+	check (lb.connect (&client, &server), "cannot connect");
+	net.addService (&client);
+	net.addService (&server);
+
+	srand (1);
+	for (int round = 0; round < 20; round++) {
+		// fill the client up with colliding requests; every seventh one times out
+		pickIDs (ids, DEPTH, round * 1000000 + 1);
+		for (i = 0; i < DEPTH; i++) {
+			len = sprintf (buf, "%u\n", ids[i]);
+			check (client.call (buf, len, &h, (void*)(unsigned long)ids[i], (i % 7 == 3) ? 1 : 0, ids[i]), "call refused");
+		}
+		expect += DEPTH;
+		run (&net, &server.received, expect);
+
+		// the ones with a deadline are taken out of the middle of the chains
+		run (&net, &h.timedOut, (round + 1) * 9);
+		check (h.timedOut == (round + 1) * 9, "requests did not time out");
+		check (client.getInFlight() == DEPTH - 9, "timed out requests still in flight");
+		len = sprintf (buf, "%u\n", ids[0]);
+		check (!client.call (buf, len, &h, NULL, 0, ids[0]) && errno == EEXIST, "duplicate ID accepted");
+
+		// answer the rest, in random order
+		for (i = DEPTH - 1; i > 0; i--) {
+			j = rand() % (i + 1);
+			k = ids[i]; ids[i] = ids[j]; ids[j] = k;
+		}
+		k = h.ok;
+		for (i = 0; i < DEPTH; i++)
+			server.answer (ids[i]);
+		run (&net, &h.ok, k + DEPTH - 9);
+		check (h.ok == k + DEPTH - 9, "responses lost");
+		check (client.getInFlight() == 0, "requests left in flight");
+	}
+
+	net.removeService (&client);
+	net.removeService (&server);
+}
+
+int
+main() {
+	testDelete();
+	return failures ? 1 : 0;
+}
+
+/* vim:set ts=2 sw=2: */
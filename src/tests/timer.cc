@@ -0,0 +1,207 @@
+/*
+ * libplusplus - A generic C++ library for networking, databases and more
+ * Copyright (C) 2002, 2003 Rink Springer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * \file timer.cc
+ * \brief Tests the timer heap of NETWORK
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <network.h>
+
+//! \brief TIMERS is the number of timers used
+#define TIMERS 500
+
+//! \brief SECOND is the longest a test may wait, in microseconds
+#define SECOND 1000000LL
+
+class TESTTIMER;
+
+//! \brief The timers, in the order they fired
+static TESTTIMER* fired[TIMERS * 2];
+static int numFired = 0;
+
+//! \brief The number of failed checks
+static int failures = 0;
+
+/*
+ * check (int ok, const char* what)
+ *
+ * This will complain about [what] if [ok] is zero.
+ *
+ */
+static void
+check (int ok, const char* what) {
+	if (!ok) {
+		fprintf (stderr, "timer: %s\n", what);
+		failures++;
+	}
+}
+
+/*! \class TESTTIMER
+ *  \brief Timer which records when it was due and when it fired
+ */
+class TESTTIMER : public NETTIMER {
+public:
+	TESTTIMER() { net = NULL; earliest = latest = 0; count = again = 0; }
+
+	/*! \brief Adds the timer, and records the window [when] must be in
+	 *  \param n The network
+	 *  \param msec The delay
+	 */
+	void add (NETWORK* n, int msec) {
+		net = n;
+		earliest = NETWORK::getTime() + (long long)msec * 1000;
+		check (n->addTimer (this, msec), "addTimer failed");
+		latest = NETWORK::getTime() + (long long)msec * 1000;
+	}
+
+	void expired() {
+		check (NETWORK::getTime() >= earliest, "timer fired early");
+		check (!isPending(), "timer pending while it fires");
+		if (numFired < TIMERS * 2)
+			fired[numFired++] = this;
+		count++;
+
+		// add ourselves again if asked to
+		if (again > 0) {
+			again--;
+			add (net, 1);
+		}
+	}
+
+	//! \brief The network the timer was added to
+	NETWORK* net;
+
+	//! \brief The earliest and latest time the timer can be due
+	long long earliest, latest;
+
+	//! \brief The number of times the timer fired
+	int count;
+
+	//! \brief The number of times to add the timer again once it fires
+	int again;
+};
+
+/*! \class TICK
+ *  \brief Timer which keeps NETWORK::run() from waiting for long
+ */
+class TICK : public NETTIMER {
+public:
+	void expired() { };
+};
+
+/*
+ * run (NETWORK* net, int n)
+ *
+ * This will run [net] until [n] timers fired, or a second passed.
+ *
+ */
+static void
+run (NETWORK* net, int n) {
+	long long t = NETWORK::getTime();
+	TICK tick;
+
+	while (numFired < n && NETWORK::getTime() - t < SECOND) {
+		net->addTimer (&tick, 10);
+		net->run();
+	}
+}
+
+/*
+ * testOrder()
+ *
+ * This will add timers in random order, cancel and move some of them, and
+ * check the others fire once each, in the order of their deadlines.
+ *
+ */
+static void
+testOrder() {
+	NETWORK net;
+	TESTTIMER* t = new TESTTIMER[TIMERS];
+	int expect = 0;
+	int i;
+
+	srand (1);
+	for (i = 0; i < TIMERS; i++)
+		t[i].add (&net, rand() % 100);
+
+	// cancel every third timer, and move every fifth one which is left
+	for (i = 0; i < TIMERS; i++) {
+		if (i % 3 == 0) {
+			net.removeTimer (&t[i]);
+			check (!t[i].isPending(), "cancelled timer still pending");
+		} else if (i % 5 == 0)
+			t[i].add (&net, rand() % 100);
+		else
+			check (t[i].isPending(), "timer not pending");
+	}
+
+	// cancelling twice does no harm
+	net.removeTimer (&t[0]);
+
+	for (i = 0; i < TIMERS; i++)
+		if (i % 3 != 0)
+			expect++;
+	run (&net, expect);
+	check (numFired == expect, "not all timers fired");
+
+	// no timer can come before one due earlier
+	for (i = 1; i < numFired; i++)
+		check (fired[i - 1]->earliest <= fired[i]->latest, "timers fired out of order");
+	for (i = 0; i < TIMERS; i++)
+		check (t[i].count == ((i % 3 == 0) ? 0 : 1), "timer fired the wrong number of times");
+
+	delete[] t;
+}
+
+/*
+ * testAgain()
+ *
+ * This will check timers can add themselves again from expired(), and that
+ * deleting a pending timer cancels it.
+ *
+ */
+static void
+testAgain() {
+	NETWORK net;
+	TESTTIMER a, b;
+	TESTTIMER* c = new TESTTIMER();
+
+	numFired = 0;
+	a.again = 3;
+	a.add (&net, 1);
+	b.add (&net, 20);
+	c->add (&net, 10);
+	delete c;
+
+	run (&net, 5);
+	check (a.count == 4, "timer did not add itself again");
+	check (b.count == 1, "timer did not fire");
+	check (numFired == 5, "deleted timer fired");
+	check (fired[numFired - 1] == &b, "timer added again fired out of order");
+}
+
+int
+main() {
+	testOrder();
+	testAgain();
+	return failures ? 1 : 0;
+}
+
+/* vim:set ts=2 sw=2: */